@@ -7,22 +7,102 @@
 #include <libgen.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "spsc_queue.h"
+#include "perf_counters.h"
+#include "file_source.h"
+#include "file_sink.h"
+#include "checkpoint.h"
+#include "checksum.h"
+#include "manifest.h"
+#include "delta.h"
+#include "dedup.h"
+#include "block_cache.h"
+#include "compression.h"
+#include "chunk_pool.h"
+#include "progress.h"
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
 
 #define MAX(A, B) (((A) > (B)) ? (A) : (B))
 #define MIN(A, B) (((A) < (B)) ? (A) : (B))
 #define GET_BYTE(X, N) (((X) & (0xFF << (N * 8))) >> (N * 8))
 
-#define NUM_FILE_SEND_RECEIVE_RETRIES 3
+#define DATA_PACKET_HEADER_SIZE 4
+#define MAX_CONTROL_PACKET_SIZE (1 + 2 * (2 + 255))	// two TLVs with one-byte lengths
+#define PROTOCOL_VERSION 2	// binary control packets with capabilities
+#define RECEIVE_QUEUE_SLOTS 256
+#define SEND_QUEUE_SLOTS 64
+#define COPY_PACKET_SIZE 8	// first block and number of blocks, 4 bytes each
+#define SKIP_PACKET_SIZE 8	// length of the run of zeros
+#define DELTA_SUFFIX ".delta"
+#define MESSAGE_PACKETS_PER_FRAME 4	// a flood of messages slows the file stream down but never stalls it
 
+/*
+ * Types of the TLVs of control packets. From version 2 on, numbers are
+ * big-endian binary of the TLV's length (version 1 had decimal strings).
+ */
 typedef enum {
-	PACKET_CTRL_TYPE_SIZE,
-	PACKET_CTRL_TYPE_NAME
+	PACKET_CTRL_TYPE_SIZE,		// 8 bytes
+	PACKET_CTRL_TYPE_NAME,
+	PACKET_CTRL_TYPE_OFFSET,	// 8 bytes, in ACCEPT
+	PACKET_CTRL_TYPE_CHECKSUM,	// 8 bytes, XXH64 of the whole file, in END
+	PACKET_CTRL_TYPE_FILES,		// 4 bytes, number of manifest entries, only in sessions
+	PACKET_CTRL_TYPE_VERSION,	// 1 byte, first TLV of every control packet
+	PACKET_CTRL_TYPE_BLOCK_SIZE,	// 4 bytes, in ACCEPT, signatures of blocks of this size follow
+	PACKET_CTRL_TYPE_BLOCKS,	// 4 bytes, in ACCEPT, how many
+	PACKET_CTRL_TYPE_CHUNKS,	// 4 bytes, in START, the sender can list this many chunks for the receiver's cache
+	PACKET_CTRL_TYPE_CODEC,		// 1 byte, in START, the codec the sender compresses with
+	PACKET_CTRL_TYPE_CAPABILITIES,	// 4 bytes, in START and ACCEPT, capability_t bits
+	PACKET_CTRL_TYPE_MTIME,		// 8 bytes, in START, nanoseconds since the epoch
+	PACKET_CTRL_TYPE_MODE,		// 4 bytes, in START, permission bits
+	PACKET_CTRL_TYPE_PACKET_SIZE	// 2 bytes, in ACCEPT, largest data packet the receiver's link takes
 } packet_ctrl_type_t;
 
+/*
+ * What each end can do with the file at hand. Both ends pick the transfer
+ * mode from the capabilities they share with select_transfer_mode.
+ */
+typedef enum {
+	CAPABILITY_CHECKSUM = 1 << 0,	// END carries the XXH64 of the file
+	CAPABILITY_RESUME = 1 << 1,	// the receiver has a checkpoint of the file
+	CAPABILITY_DELTA = 1 << 2,	// the receiver has an old copy of the file
+	CAPABILITY_DEDUP = 1 << 3,	// the sender lists chunks and the receiver has a block cache
+	CAPABILITY_COMPRESSION = 1 << 4,
+	CAPABILITY_METADATA = 1 << 5,	// modification time and permissions are restored
+	CAPABILITY_SPARSE = 1 << 6,	// holes and zero runs are sent as SKIP packets
+	CAPABILITY_REUSE = 1 << 7,	// the link stays up after END, for another START or a CLOSE
+	CAPABILITY_CHANNELS = 1 << 8,	// messages of other channels are interleaved with the data packets
+	CAPABILITY_BATCH = 1 << 9	// small packets share I frames
+} capability_t;
+
+typedef enum {
+	MODE_PLAIN,
+	MODE_RESUME,
+	MODE_DELTA,
+	MODE_DEDUP,
+	MODE_COMPRESSED
+} transfer_mode_t;
+
 typedef enum {
 	PACKET_CTRL_FIELD_DATA = 0,
 	PACKET_CTRL_FIELD_START = 1,
-	PACKET_CTRL_FIELD_END = 2
+	PACKET_CTRL_FIELD_END = 2,
+	PACKET_CTRL_FIELD_ACCEPT = 3,	// receiver's answer to START
+	PACKET_CTRL_FIELD_MANIFEST = 4,	// entries of a session, between START and ACCEPT
+	PACKET_CTRL_FIELD_SIGNATURES = 5,	// receiver's block signatures, after ACCEPT
+	PACKET_CTRL_FIELD_COPY = 6,	// data packet standing for a run of the receiver's blocks
+	PACKET_CTRL_FIELD_CHUNKS = 7,	// sender's chunk list, after ACCEPT
+	PACKET_CTRL_FIELD_WANTED = 8,	// receiver's bitmap of the chunks it lacks
+	PACKET_CTRL_FIELD_COMPRESSED = 9,	// piece of a compressed chunk
+	PACKET_CTRL_FIELD_COMPRESSED_END = 10,	// last piece of a compressed chunk
+	PACKET_CTRL_FIELD_SKIP = 11,	// data packet standing for a run of zeros
+	PACKET_CTRL_FIELD_CLOSE = 12,	// sender is done with a link kept up between transfers
+	PACKET_CTRL_FIELD_MESSAGE = 13,	// piece of a message, its channel where data packets have their number
+	PACKET_CTRL_FIELD_MESSAGE_END = 14	// last piece of a message
 } packet_ctrl_field_t;
 
 typedef struct {
@@ -40,430 +120,2170 @@ typedef struct {
 
 typedef struct {
 	packet_ctrl_field_t ctrl_field;
+	unsigned version;
 	unsigned num_params;
 	control_packet_param_t *params;
 } control_packet_t;
 
-int send_data_packet(datalink_t *datalink, const data_packet_t *data_packet);
+/*
+ * Message waiting in the sender's queue, sent in packets of up to packet_size bytes
+ */
+typedef struct queued_message {
+	struct queued_message *next;
+	unsigned channel;
+	size_t length;
+	size_t sent;
+	unsigned char data[];
+} queued_message_t;
+
+/*
+ * Receiver's pieces of the current message of a channel
+ */
+typedef struct message_assembly {
+	unsigned char *data;	// MAX_MESSAGE_SIZE bytes, allocated with the channel's first packet
+	size_t length;
+} message_assembly_t;
+
+/*
+ * Receiver's answer to START: its capabilities, where to resume, and what a delta is made of
+ */
+typedef struct {
+	unsigned capabilities;
+	uint64_t offset;
+	unsigned block_size;	// 0 unless block signatures for a delta follow
+	unsigned num_blocks;
+	unsigned packet_size;	// 0 if the receiver set no limit
+} accept_t;
+
+/*
+ * Slot of the receive queue: a validated data packet waiting to be written
+ */
+typedef struct {
+	uint16_t length;
+	char packet[];
+} received_packet_t;
+
+/*
+ * Writer stage. In a session the data stream is split back into the
+ * manifest's files, the sink holding the one currently being written.
+ */
+typedef struct {
+	spsc_queue_t queue;
+	file_sink_t sink;
+	atomic_int failed;
+	const manifest_t *manifest;	// NULL for a single file
+	const char *destination_folder;
+	transfer_open_sink_t open_sink;	// NULL for files in the destination folder
+	void *sink_context;
+	unsigned next_file;
+	int sink_open;
+	uint64_t file_left;
+	checksum_t checksum;	// of the whole session stream
+	file_source_t basis;	// previous version of the file, for COPY packets
+	int basis_open;
+	unsigned block_size;
+	unsigned num_blocks;
+	const dedup_list_t *dedup;	// NULL unless chunks come from the block cache
+	block_cache_t *cache;
+	unsigned next_chunk;
+	unsigned chunk_filled;
+	unsigned char *chunk_buffer;	// DEDUP_MAX_CHUNK bytes
+	chunk_pool_t *compression;	// NULL unless chunks are decompressed by a pool of workers
+	codec_t codec;
+	chunk_job_t *job;	// compressed chunk being received
+	int sparse;		// SKIP packets are punched as holes
+} file_writer_t;
+
+/*
+ * Slot of the read-ahead queue: one data packet worth of file contents,
+ * pointing either into the file mapping or at the slot's own buffer.
+ * A COPY chunk stands for file_length bytes the receiver already has.
+ */
+typedef struct {
+	packet_ctrl_field_t ctrl_field;
+	uint16_t length;
+	const unsigned char *data;
+	uint64_t file_length;
+	unsigned char buffer[];
+} file_chunk_t;
+
+/*
+ * Slot of the framing queue: a data packet, or a batch of small ones, already stuffed by llprepare
+ */
+typedef struct {
+	uint64_t data_length;
+	int batch;
+	unsigned length;
+	unsigned char frame[];
+} prepared_frame_t;
+
+/*
+ * Sender stages: file_reader_thread -> chunks -> packet_framer_thread -> frames -> link
+ * In a session the reader goes through the manifest's files, packing them back-to-back.
+ */
+typedef struct {
+	spsc_queue_t chunks;
+	spsc_queue_t frames;
+	file_source_t source;
+	checksum_t checksum;	// updated by the reader, read once it has been joined
+	atomic_int failed;
+	const manifest_t *manifest;	// NULL for a single file
+	unsigned next_file;
+	int source_open;
+	delta_scanner_t *scanner;	// NULL unless sending a delta of the mapped source
+	const dedup_list_t *dedup;	// NULL unless only sending the chunks the receiver wants
+	unsigned next_chunk;
+	uint64_t chunk_offset;	// of next_chunk in the file
+	unsigned chunk_sent;
+	chunk_pool_t *compression;	// NULL unless chunks are compressed by a pool of workers
+	codec_t codec;
+	uint64_t compressed_size;
+	int sparse;		// holes and zero runs of the mapped source are skipped
+	uint64_t skipped_size;
+	unsigned packet_size;
+	unsigned batch_length;	// 0 unless small packets share frames
+	int compression_level;
+} send_pipeline_t;
+
+int transfer_connect(transfer_t *transfer);
+void transfer_drop(transfer_t *transfer);
+int release_link(transfer_t *transfer);
+int send_file(transfer_t *transfer, file_source_t *source, const char *name);
+int send_session(transfer_t *transfer, char *const paths[], unsigned num_paths);
+int send_manifest(datalink_t *datalink, const manifest_t *manifest);
+int send_stream(transfer_t *transfer, send_pipeline_t *pipeline, uint64_t offset, uint64_t size);
+int send_messages(transfer_t *transfer, unsigned max_packets);
+int message_packet(const char *packet, int length);
+int receive_message(transfer_t *transfer, const char *packet, int length);
+void free_messages(transfer_t *transfer);
+int send_end_packet(datalink_t *datalink, const control_packet_param_t *params, unsigned num_params, const checksum_t *checksum);
+int receive_file(transfer_t *transfer, const char *destination_folder, transfer_open_sink_t open_sink, void *context);
+int receive_session(transfer_t *transfer, file_writer_t *writer, uint64_t size, unsigned num_files, unsigned sender_capabilities);
+int receive_stream(transfer_t *transfer, file_writer_t *writer, uint64_t offset, uint64_t size);
+int receive_end_packet(datalink_t *datalink, uint64_t digest);
+unsigned build_data_packet(const data_packet_t *data_packet, unsigned char *packet);
 int send_control_packet(datalink_t *datalink, const control_packet_t *control_packet);
 control_packet_param_t *get_param_by_type(const control_packet_t *control_packet, packet_ctrl_type_t type);
-void show_progress_bar(float progress);
-void print_usage(char *argv0);
-int cli();
-int baudrate = 0;
-int max_packet_size = MAX_PACKET_SIZE;
-int retransmission = DEFAULT_RETRANSMISSIONS;
-int timeout = DEFAULT_TIMEOUT;
+void set_number_param(control_packet_param_t *param, packet_ctrl_type_t type, uint64_t number, unsigned length, unsigned char *value);
+uint64_t get_number_param(const control_packet_t *control_packet, packet_ctrl_type_t type, uint64_t default_number);
+transfer_mode_t select_transfer_mode(unsigned capabilities);
+int restore_metadata(const char *path, uint64_t mtime, unsigned mode);
+int parse_control_packet(const char *packet, int size, control_packet_t *control_packet, control_packet_param_t *params);
+void free_control_packet(control_packet_t *control_packet);
+int receive_accept_packet(transfer_t *transfer, uint64_t size, accept_t *accept);
+int send_accept_packet(datalink_t *datalink, const accept_t *accept);
+int receive_signatures(datalink_t *datalink, delta_index_t *index);
+int send_signatures(datalink_t *datalink, const file_writer_t *writer);
+int open_basis(file_writer_t *writer, const char *file_path);
+int open_file_sink(file_writer_t *writer, const char *path, uint64_t size, uint64_t offset, const checksum_t *checksum);
+int read_delta_chunk(send_pipeline_t *pipeline, file_chunk_t *chunk);
+int send_chunk_list(datalink_t *datalink, dedup_list_t *list);
+int receive_chunk_list(datalink_t *datalink, dedup_list_t *list, unsigned num_chunks, block_cache_t *cache);
+int read_dedup_chunk(send_pipeline_t *pipeline, file_chunk_t *chunk);
+int copy_cached_chunks(file_writer_t *writer);
+int write_dedup_data(file_writer_t *writer, const unsigned char *data, unsigned length);
+void *file_writer_thread(void *arg);
+void *file_reader_thread(void *arg);
+void *packet_framer_thread(void *arg);
+int read_session_chunk(send_pipeline_t *pipeline, file_chunk_t *chunk);
+int compress_job(void *context, chunk_job_t *job);
+int read_compressed_chunk(send_pipeline_t *pipeline, file_chunk_t *chunk);
+int read_sparse_chunk(send_pipeline_t *pipeline, file_chunk_t *chunk);
+uint64_t get_skip_length(const unsigned char *data);
+int decompress_job(void *context, chunk_job_t *job);
+int write_compressed_data(file_writer_t *writer, const unsigned char *data, unsigned length, int last);
+int retire_decompressed_chunk(file_writer_t *writer);
+int open_session_file(file_writer_t *writer);
+int write_session_data(file_writer_t *writer, const unsigned char *data, unsigned length);
+int finish_session_files(file_writer_t *writer);
+void report_progress(progress_t *progress, const datalink_t *datalink, uint64_t done, int finished);
+void transfer_init(transfer_t *transfer, const char *port, int mode)
+{
+	transfer->port = port;
+	transfer->mode = mode;
+	transfer->baudrate = 0;
+	transfer->max_packet_size = MAX_PACKET_SIZE;
+	transfer->retransmissions = DEFAULT_RETRANSMISSIONS;
+	transfer->timeout = DEFAULT_TIMEOUT;
+	transfer->probe = 0;
+	transfer->delta = 0;
+	transfer->dedup = 0;
+	transfer->compression_level = 0;
+	transfer->cache_dir = NULL;
+	transfer->progress_mode = PROGRESS_OFF;
+	transfer->progress_interval = DEFAULT_PROGRESS_INTERVAL;
+	transfer->connected = 0;
+	transfer->reuse = 0;
+	transfer->packet_size = MAX_PACKET_SIZE;
+	transfer->keep_port = 0;
+	transfer->channels = 0;
+	pthread_mutex_init(&transfer->messages_lock, NULL);
+	transfer->messages = NULL;
+	transfer->on_message = NULL;
+	transfer->message_context = NULL;
+	transfer->assembly = NULL;
+	datalink_init(&transfer->datalink, mode);
+}
 
-int main(int argc, char *argv[]) // ./file_transfer <port> <send|receive> <filename>
+int transfer_connect(transfer_t *transfer)
 {
-	srand(time(NULL));
-	if (argc == 1) return cli();
-	if (argc != 4 && argc != 3)
+	if (transfer->connected) return 0;
+	datalink_t *datalink = &transfer->datalink;
+	// a kept port is still configured from the previous link
+	transport_t transport = datalink->transport;
+	datalink_init(datalink, transfer->mode);
+	datalink->transport = transport;
+	datalink->keep_port = transfer->keep_port;
+	datalink->listen = (transfer->mode == RECEIVER) && transfer->keep_port;
+	datalink->probe = (transfer->mode == SENDER) && transfer->probe;
+	datalink->baudrate = transfer->baudrate;
+	datalink->timeout = transfer->timeout;
+	datalink->max_retransmissions = transfer->retransmissions;
+	datalink->max_frame_length = MAX(transfer->max_packet_size + DATA_PACKET_HEADER_SIZE, MAX_CONTROL_PACKET_SIZE);
+	if (llopen(transfer->port, datalink))
 	{
-		print_usage(argv[0]);
+		llabort(datalink);
 		return 1;
 	}
-	datalink_t datalink;
-	if(strcmp(argv[2], "send") == 0) {
-		if (argc != 4)
-		{
-			print_usage(argv[0]);
-			return 1;
-		}
-		datalink_init(&datalink, SENDER);
-		unsigned tries = 0;
-		while (tries < NUM_FILE_SEND_RECEIVE_RETRIES)
-		{
-			if (send_file(argv[1], argv[3]))
-				tries++;
-			else
-				return 0;
-		}
-		printf("Couldn't send file. Terminating program.\n");
-	} else if(strcmp(argv[2], "receive") == 0) {
-		if (argc != 3)
-		{
-			print_usage(argv[0]);
-			return 1;
-		}
-		datalink_init(&datalink, RECEIVER);
-		unsigned tries = 0;
-		while (tries < NUM_FILE_SEND_RECEIVE_RETRIES)
-		{
-			if (receive_file(argv[1], argc == 4 ? argv[3] : ""))
-				tries++;
-			else
-				return 0;
-		}
-		printf("Couldn't receive file. Terminating program.\n");
+	transfer->connected = 1;
+	transfer->reuse = 0;
+	transfer->channels = 0;
+	if (transfer->assembly != NULL)
+	{
+		// pieces of messages cut short with the previous link are lost
+		unsigned channel;
+		for (channel = 0; channel <= MAX_CHANNEL; ++channel)
+			transfer->assembly[channel].length = 0;
+	}
+	transfer->packet_size = transfer->max_packet_size;
+	if (datalink->probe_results.frame_length > DATA_PACKET_HEADER_SIZE)
+	{
+		// the receiver has just parsed frames this long
+		transfer->packet_size = datalink->probe_results.frame_length - DATA_PACKET_HEADER_SIZE;
+		printf("Probe selected a packet size of %u bytes.\n", transfer->packet_size);
 	}
 	return 0;
 }
 
-void print_usage(char *argv0)
+void transfer_drop(transfer_t *transfer)
+{
+	// whatever was in flight is lost, the next transfer starts over on a new link
+	if (!transfer->connected) return;
+	transfer->connected = 0;
+	llabort(&transfer->datalink);
+}
+
+int release_link(transfer_t *transfer)
 {
-	printf("Usage:\n"
-			"\t%s <port> send <filename>\n"
-			"\t\tOR\n"
-			"\t%s <port> receive\n", argv0, argv0);
+	// kept up for the next transfer when both ends can
+	if (transfer->reuse) return 0;
+	transfer->connected = 0;
+	return llclose(&transfer->datalink);
 }
 
-int send_file(const char *port, const char *file_name)
+int transfer_close(transfer_t *transfer)
 {
-	// Read file
-	FILE *fp = fopen(file_name, "r");
-	if (fp == NULL)
+	int ret = 0;
+	if (transfer->connected)
 	{
-		perror("Error opening file");
-		return 1;
+		control_packet_t control_packet;
+		control_packet.ctrl_field = PACKET_CTRL_FIELD_CLOSE;
+		control_packet.num_params = 0;
+		control_packet.params = NULL;
+		if (transfer->mode == SENDER && send_control_packet(&transfer->datalink, &control_packet))
+		{
+			transfer_drop(transfer);
+			ret = 1;
+		}
+		else
+		{
+			transfer->connected = 0;
+			ret = llclose(&transfer->datalink);
+		}
 	}
-	fseek(fp, 0, SEEK_END);
-	unsigned long size = ftell(fp);
-	fseek(fp, 0, SEEK_SET);
-	char data[size];
-	fread(data, size, 1, fp);
-	fclose(fp);
-
-	// Establish connection
-	datalink_t datalink;
-	datalink_init(&datalink, SENDER);
-	datalink->baudrate = baudrate;
-	datalink->timeout = timeout;
-	datalink->max_retransmissions = retransmission;
-	if (llopen(port, &datalink)) return 1;
+	// a kept port is only closed here
+	transfer->datalink.keep_port = 0;
+	llabort(&transfer->datalink);
+	free_messages(transfer);
+	return ret;
+}
 
-	// Send start packet
-	control_packet_t control_packet;
-	control_packet.ctrl_field = PACKET_CTRL_FIELD_START;
-	control_packet.num_params = 2;
+int transfer_send(transfer_t *transfer, file_source_t *source, const char *name)
+{
+	if (send_file(transfer, source, name) == 0) return 0;
+	transfer_drop(transfer);
+	return 1;
+}
 
-	control_packet_param_t param_size;
-	param_size.type = PACKET_CTRL_TYPE_SIZE;
-	char str[(size == 0) ? (2) : ((int)((ceil(log10(size)) + 1) * sizeof(char)))];
-	if (sprintf(str, "%lu", size) < 0) return 1;
-	param_size.length = strlen(str) + 1;
-	param_size.value = str;
-	printf("Size:::: %s\n", str);
-
-	control_packet_param_t param_name;
-	param_name.type = PACKET_CTRL_TYPE_NAME;
-	char copy[strlen(file_name) + 1];
-	strcpy(copy, file_name);
-	char *base = basename(copy);
-	char file[strlen(base) + 1];
-	strcpy(file, base);
-	param_name.length = strlen(file);
-	param_name.value = file;
-
-	control_packet_param_t params[] = {param_size, param_name};
-	control_packet.params = params;
-	if (send_control_packet(&datalink, &control_packet)) return 1;
+int transfer_send_file(transfer_t *transfer, const char *path)
+{
+	// Open file (its contents are streamed by the read-ahead stage)
+	file_source_t source;
+	if (file_source_open(&source, path)) return 1;
+	char copy[strlen(path) + 1];
+	strcpy(copy, path);
+	int ret = transfer_send(transfer, &source, basename(copy));
+	file_source_close(&source);
+	return ret;
+}
 
-	// Send data packet
-	unsigned long i;
-	unsigned sn = 0;
-	for (i = 0; i < size; i += max_packet_size)
-	{
-		data_packet_t data_packet;
-		data_packet.ctrl_field = PACKET_CTRL_FIELD_DATA;
-		data_packet.sn = (char)(sn++ % (1 << 8));
-		data_packet.length = MIN(max_packet_size, size - i);
-		data_packet.data = &data[i];
-		if (send_data_packet(&datalink, &data_packet)) return 1;
-		show_progress_bar((float)i/size);
-	}
+int transfer_send_session(transfer_t *transfer, char *const paths[], unsigned num_paths)
+{
+	if (send_session(transfer, paths, num_paths) == 0) return 0;
+	transfer_drop(transfer);
+	return 1;
+}
 
-	// Send end packet
-	control_packet.ctrl_field = PACKET_CTRL_FIELD_END;
-	if (send_control_packet(&datalink, &control_packet)) return 1;
+int transfer_receive(transfer_t *transfer, const char *destination_folder)
+{
+	if (receive_file(transfer, destination_folder, NULL, NULL) == 0) return 0;
+	transfer_drop(transfer);
+	return 1;
+}
 
-	return llclose(&datalink);
+int transfer_receive_to(transfer_t *transfer, transfer_open_sink_t open_sink, void *context)
+{
+	if (receive_file(transfer, "", open_sink, context) == 0) return 0;
+	transfer_drop(transfer);
+	return 1;
 }
 
-int send_control_packet(datalink_t *datalink, const control_packet_t *control_packet)
+int transfer_post(transfer_t *transfer, unsigned channel, const void *data, size_t length)
 {
-	printf("Sending control packet...\n");
-	unsigned size = 1 + 2 * control_packet->num_params;
-	unsigned i;
-	for (i = 0; i < control_packet->num_params; ++i)
-	{
-		size += control_packet->params[i].length;
-	}
-	unsigned char packet[size];
-	packet[0] = control_packet->ctrl_field;
-	unsigned j;
-	for (i = 0, j = 1; i < control_packet->num_params; ++i)
+	if (channel == 0 || channel > MAX_CHANNEL || length > MAX_MESSAGE_SIZE)
 	{
-		packet[j++] = control_packet->params[i].type;
-		packet[j++] = control_packet->params[i].length;
-		memcpy(&packet[j], control_packet->params[i].value, control_packet->params[i].length);
-		j += control_packet->params[i].length;
+		printf("Error: invalid message of %zu bytes on channel %u.\n", length, channel);
+		return 1;
 	}
-
-	if (llwrite(datalink, packet, size))
+	queued_message_t *message = malloc(sizeof(queued_message_t) + length);
+	if (message == NULL)
 	{
-		printf("Error sending control packet.\n");
+		printf("Error: unable to queue a message of %zu bytes.\n", length);
 		return 1;
 	}
-	printf("Sent control packet with size %d.\n", size);
+	message->channel = channel;
+	message->length = length;
+	message->sent = 0;
+	memcpy(message->data, data, length);
+
+	// after every message of the same or a lower channel
+	pthread_mutex_lock(&transfer->messages_lock);
+	queued_message_t **link = &transfer->messages;
+	while (*link != NULL && (*link)->channel <= channel)
+		link = &(*link)->next;
+	message->next = *link;
+	*link = message;
+	pthread_mutex_unlock(&transfer->messages_lock);
 	return 0;
 }
 
-int send_data_packet(datalink_t *datalink, const data_packet_t *data_packet)
+int transfer_send_messages(transfer_t *transfer)
 {
-	printf("Sending data packet number %d ...\n", data_packet->sn);
-	unsigned size = data_packet->length + 4;
-	unsigned char packet[size];
-	packet[0] = data_packet->ctrl_field;
-	packet[1] = data_packet->sn;
-	packet[2] = (uint8_t)((data_packet->length & 0xFF00) >> 8);
-	packet[3] = (uint8_t)(data_packet->length & 0x00FF);
-	memcpy(&packet[4], data_packet->data, size);
-	if (llwrite(datalink, packet, size))
+	if (!transfer->connected || !transfer->channels)
 	{
-		printf("Error data control packet.\n");
+		printf("Error: the receiver did not take messages on this link.\n");
 		return 1;
 	}
-	return 0;
+	if (send_messages(transfer, UINT_MAX) == 0 && llflush(&transfer->datalink) == 0) return 0;
+	transfer_drop(transfer);
+	return 1;
 }
 
-int receive_file(const char *port, const char *destination_folder)
+int send_file(transfer_t *transfer, file_source_t *source, const char *name)
 {
-	// Establish connection
-	datalink_t datalink;
-	datalink_init(&datalink, RECEIVER);
-	datalink->baudrate = baudrate;
-	datalink->timeout = timeout;
-	datalink->max_retransmissions = retransmission;
-	if (llopen(port, &datalink)) return 1;
-	char buf[max_packet_size];
+	send_pipeline_t pipeline;
+	pipeline.manifest = NULL;
+	pipeline.scanner = NULL;
+	pipeline.dedup = NULL;
+	pipeline.compression = NULL;
+	pipeline.sparse = 0;
+	pipeline.source = *source;
+	uint64_t size = pipeline.source.size;
 
-	unsigned long size = llread(&datalink, buf);
-	if (size < 0)
+	// Chunks for the receiver's block cache are listed before connecting, this pass also hashes the file
+	dedup_list_t chunks;
+	checksum_t chunks_checksum;
+	dedup_list_init(&chunks);
+	checksum_init(&chunks_checksum);
+	if (transfer->dedup && pipeline.source.map != NULL && dedup_list_build(&chunks, pipeline.source.map, size, &chunks_checksum))
 	{
-		printf("Error: could not read data.\n");
+		dedup_list_free(&chunks);
+		return 1;
+	}
+
+	// Establish connection, unless the link is still up after the previous transfer
+	if (transfer_connect(transfer))
+	{
+		dedup_list_free(&chunks);
 		return 1;
 	}
+	datalink_t *datalink = &transfer->datalink;
+
+	// Send start packet, offering everything this end can do with the file
+	unsigned capabilities = CAPABILITY_CHECKSUM | CAPABILITY_REUSE;
+	// only a file has attributes, and only a source that can be rewound can be resumed
+	struct stat st;
+	if (pipeline.source.fd >= 0 && fstat(pipeline.source.fd, &st) == 0 && S_ISREG(st.st_mode))
+		capabilities |= CAPABILITY_METADATA;
+	if (pipeline.source.kind != SOURCE_CALLBACK)
+		capabilities |= CAPABILITY_RESUME;
+	// a delta is computed against the mapping, so streamed files are always sent in full
+	if (transfer->delta && pipeline.source.map != NULL)
+		capabilities |= CAPABILITY_DELTA;
+	if (chunks.num_chunks > 0)
+		capabilities |= CAPABILITY_DEDUP;
+	// workers compress straight from the mapping too
+	if (transfer->compression_level > 0 && pipeline.source.map != NULL)
+		capabilities |= CAPABILITY_COMPRESSION;
+	// holes are found with SEEK_DATA and zero runs in the mapping
+	if (pipeline.source.map != NULL)
+		capabilities |= CAPABILITY_SPARSE;
+	capabilities |= CAPABILITY_CHANNELS | CAPABILITY_BATCH;
 
-	// Read start packet
 	control_packet_t control_packet;
-	unsigned long i = 0;
-	control_packet.ctrl_field = buf[i++];
-	control_packet_param_t params[max_packet_size];
-	unsigned long j;
+	control_packet.ctrl_field = PACKET_CTRL_FIELD_START;
+	control_packet_param_t params[7];
+	unsigned char size_value[8], capabilities_value[4], mtime_value[8], mode_value[4], chunks_value[4], codec_value[1];
+	set_number_param(&params[0], PACKET_CTRL_TYPE_SIZE, size, sizeof(size_value), size_value);
+	printf("Size:::: %" PRIu64 "\n", size);
+
+	params[1].type = PACKET_CTRL_TYPE_NAME;
+	params[1].length = strlen(name);
+	params[1].value = (char *)name;
 
-	for (j = 0; i < size; ++j)
+	control_packet.num_params = 2;
+	set_number_param(&params[control_packet.num_params++], PACKET_CTRL_TYPE_CAPABILITIES, capabilities, sizeof(capabilities_value), capabilities_value);
+	if (capabilities & CAPABILITY_METADATA)
 	{
-		params[j].type = buf[i++];
-		params[j].length = buf[i++];
-		if ((params[j].value = malloc(params[j].length)) == NULL) return 1;
-		memcpy(params[j].value, &buf[i], params[j].length);
-		i += params[j].length;
+		set_number_param(&params[control_packet.num_params++], PACKET_CTRL_TYPE_MTIME,
+				(uint64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec, sizeof(mtime_value), mtime_value);
+		set_number_param(&params[control_packet.num_params++], PACKET_CTRL_TYPE_MODE, st.st_mode & 07777, sizeof(mode_value), mode_value);
 	}
-	control_packet.num_params = j;
+	if (capabilities & CAPABILITY_DEDUP)
+		set_number_param(&params[control_packet.num_params++], PACKET_CTRL_TYPE_CHUNKS, chunks.num_chunks, sizeof(chunks_value), chunks_value);
+	if (capabilities & CAPABILITY_COMPRESSION)
+		set_number_param(&params[control_packet.num_params++], PACKET_CTRL_TYPE_CODEC, CODEC_DEFLATE, sizeof(codec_value), codec_value);
 	control_packet.params = params;
 
-	control_packet_param_t *param_name = get_param_by_type(&control_packet, PACKET_CTRL_TYPE_NAME);
-	control_packet_param_t *param_size = get_param_by_type(&control_packet, PACKET_CTRL_TYPE_SIZE);
-
-	if (param_name == NULL || param_size == NULL)
+	// The receiver answers with its own capabilities, both ends then pick the same mode
+	accept_t accept;
+	if (send_control_packet(datalink, &control_packet) || receive_accept_packet(transfer, size, &accept))
 	{
-		printf("Error: could not read file header.\n");
+		dedup_list_free(&chunks);
 		return 1;
 	}
-
-	char file_name[param_name->length + 1];
-	memcpy(file_name, param_name->value, param_name->length);
-	file_name[param_name->length] = '\0';
-	char file_path[strlen(destination_folder) + strlen(file_name) + 1];
-	strcpy(file_path, destination_folder);
-	strcat(file_path, file_name);
-	FILE *fp = fopen(file_path,"wb");
-	if (fp == NULL)
+	transfer->reuse = (capabilities & accept.capabilities & CAPABILITY_REUSE) != 0;
+	transfer->channels = (capabilities & accept.capabilities & CAPABILITY_CHANNELS) != 0;
+	// a batch is bounded by the largest packet the receiver takes
+	datalink->max_batch_length = (capabilities & accept.capabilities & CAPABILITY_BATCH) ? transfer->packet_size + DATA_PACKET_HEADER_SIZE : 0;
+	transfer_mode_t mode = select_transfer_mode(capabilities & accept.capabilities);
+	uint64_t offset = (mode == MODE_RESUME) ? accept.offset : 0;
+	pipeline.sparse = (mode == MODE_PLAIN || mode == MODE_RESUME) && (capabilities & accept.capabilities & CAPABILITY_SPARSE);
+	pipeline.skipped_size = 0;
+	pipeline.packet_size = transfer->packet_size;
+	pipeline.batch_length = datalink->max_batch_length;
+	pipeline.compression_level = transfer->compression_level;
+	uint64_t stream_size = size;
+	checksum_init(&pipeline.checksum);
+	delta_index_t index;
+	delta_scanner_t scanner;
+	chunk_pool_t pool;
+	if (file_source_seek(&pipeline.source, offset))
 	{
-		perror("Error creating output file: ");
+		dedup_list_free(&chunks);
 		return 1;
 	}
-
-	// Read data
-	unsigned long bytes_read = 0;
-	unsigned char sn = 0;
-	unsigned long file_size = strtoul(param_size->value, NULL, 10);
-	printf("File size: %lu bytes.\n", file_size);
-	show_progress_bar(0);
-	while (bytes_read < file_size)
+	if (mode == MODE_DELTA)
 	{
-		data_packet_t data_packet;
-		if (llread(&datalink, buf) < 0) return 1;
-		data_packet.ctrl_field = buf[0];
-		data_packet.sn = buf[1];
-		data_packet.length = (((unsigned char)buf[2]) << 8) | ((unsigned char)buf[3]);
-		data_packet.data = &buf[4];
-		if (data_packet.ctrl_field != PACKET_CTRL_FIELD_DATA)
+		if (accept.block_size == 0 || delta_index_init(&index, accept.block_size, accept.num_blocks))
 		{
-			printf("Error receiving file. Received a control packet instead of a data packet.\n");
+			dedup_list_free(&chunks);
 			return 1;
 		}
-		if (data_packet.sn != sn)
+		if (receive_signatures(datalink, &index))
 		{
-			printf("Error receiving file. Expected packet number %d but received packet number %d instead.\n", sn, data_packet.sn);
+			delta_index_destroy(&index);
+			dedup_list_free(&chunks);
 			return 1;
 		}
-		sn = (unsigned char)(((unsigned)sn + 1) % (1 << 8));
-		unsigned num_written = fwrite(data_packet.data, sizeof(char), data_packet.length, fp);
-		if(num_written < data_packet.length)
+		printf("Sending a delta against %u blocks of %u bytes.\n", accept.num_blocks, accept.block_size);
+		delta_scanner_init(&scanner, &index, pipeline.source.map, size);
+		pipeline.scanner = &scanner;
+	}
+	else if (mode == MODE_DEDUP)
+	{
+		if (send_chunk_list(datalink, &chunks))
 		{
-			printf("Error writting to output file. Could only write %d out of %d bytes.\n", num_written, data_packet.length);
+			dedup_list_free(&chunks);
 			return 1;
 		}
-		bytes_read += data_packet.length;
-		show_progress_bar((float)bytes_read / file_size);
+		printf("Receiver lacks %" PRIu64 " of %" PRIu64 " bytes.\n", chunks.wanted_size, size);
+		// only the wanted chunks are streamed, the checksum still covers the whole file
+		pipeline.dedup = &chunks;
+		pipeline.next_chunk = 0;
+		pipeline.chunk_offset = 0;
+		pipeline.chunk_sent = 0;
+		pipeline.checksum = chunks_checksum;
+		stream_size = chunks.wanted_size;
 	}
-
-	// Read end packet
-	size = llread(&datalink, buf);
-	i = 0;
-	control_packet.ctrl_field = buf[i++];
-	if (control_packet.ctrl_field != PACKET_CTRL_FIELD_END)
+	else if (mode == MODE_COMPRESSED)
 	{
-		printf("Error receiving file. Was expecting an end packet but received a different one instead.\n");
-		return 1;
+		if (chunk_pool_init(&pool, chunk_pool_default_threads(), 2 * chunk_pool_default_threads(), 0,
+				compression_bound(CODEC_DEFLATE, COMPRESSION_CHUNK_SIZE), compress_job, &pipeline))
+		{
+			dedup_list_free(&chunks);
+			return 1;
+		}
+		printf("Compressing chunks of %d bytes with %s on %u threads.\n", COMPRESSION_CHUNK_SIZE, codec_name(CODEC_DEFLATE), pool.num_threads);
+		pipeline.compression = &pool;
+		pipeline.codec = CODEC_DEFLATE;
+		pipeline.next_chunk = 0;
+		pipeline.chunk_sent = 0;
+		pipeline.compressed_size = 0;
 	}
-
-	if (llclose(&datalink))
+	else if (offset > 0)
 	{
-		printf("Could not close connection properly.\n");
+		printf("Resuming transfer at byte %" PRIu64 ".\n", offset);
+		// the END checksum covers the whole file, including what the receiver already has
+		if (file_source_checksum(&pipeline.source, offset, &pipeline.checksum))
+		{
+			printf("Error reading file.\n");
+			dedup_list_free(&chunks);
+			return 1;
+		}
 	}
 
-	for (i = 0; i < control_packet.num_params; ++i)
+	int error = send_stream(transfer, &pipeline, offset, stream_size);
+	if (pipeline.scanner != NULL)
+		delta_index_destroy(&index);
+	if (pipeline.compression != NULL)
 	{
-		free(params[i].value);
+		// the mapping stays open until the workers are done with it
+		chunk_pool_destroy(&pool);
+		if (!error)
+			printf("Compressed %" PRIu64 " bytes to %" PRIu64 ".\n", size, pipeline.compressed_size);
 	}
+	if (pipeline.sparse && !error)
+		printf("Skipped %" PRIu64 " bytes of holes and zeros.\n", pipeline.skipped_size);
+	dedup_list_free(&chunks);
+	if (error) return 1;
 
-	return 0;
+	// Send end packet
+	if (send_end_packet(datalink, params, 2, &pipeline.checksum)) return 1;
+
+	return release_link(transfer);
 }
 
-void show_progress_bar(float progress)
+int send_session(transfer_t *transfer, char *const paths[], unsigned num_paths)
 {
-	unsigned width = 30;
+	// List every file up front, the receiver gets the whole manifest before any data
+	manifest_t manifest;
+	manifest_init(&manifest);
 	unsigned i;
-	printf("[");
-	for (i = 0; i < width; ++i)
+	for (i = 0; i < num_paths; ++i)
 	{
-		if (i < progress * width)
-			printf("=");
-		else
-			printf(" ");
+		if (manifest_add_path(&manifest, paths[i]))
+		{
+			manifest_free(&manifest);
+			return 1;
+		}
 	}
-	printf("] %.2f%%\n", progress * 100);
-}
+	printf("Sending %u files, %" PRIu64 " bytes.\n", manifest.num_entries, manifest.total_size);
 
-control_packet_param_t *get_param_by_type(const control_packet_t *control_packet, packet_ctrl_type_t type)
-{
-	unsigned i;
-	for (i = 0; i < control_packet->num_params; ++i)
+	// Establish connection, unless the link is still up after the previous transfer
+	if (transfer_connect(transfer))
 	{
-		if (control_packet->params[i].type == type) return &control_packet->params[i];
+		manifest_free(&manifest);
+		return 1;
 	}
-	return NULL;
-}
-
-int cli(){
+	datalink_t *datalink = &transfer->datalink;
 
-	char *mode,*fileName, *port;
-	int tries=3, valid=0;
-
-	mode=malloc(100);
-	fileName=malloc(100);
-	port=malloc(100);
+	// Send start packet, with the length of the whole data stream and the number of files
+	control_packet_t control_packet;
+	control_packet.ctrl_field = PACKET_CTRL_FIELD_START;
+	control_packet_param_t params[3];
+	unsigned char size_value[8], files_value[4], capabilities_value[4];
+	set_number_param(&params[0], PACKET_CTRL_TYPE_SIZE, manifest.total_size, sizeof(size_value), size_value);
+	set_number_param(&params[1], PACKET_CTRL_TYPE_FILES, manifest.num_entries, sizeof(files_value), files_value);
+	set_number_param(&params[2], PACKET_CTRL_TYPE_CAPABILITIES, CAPABILITY_CHECKSUM | CAPABILITY_REUSE | CAPABILITY_CHANNELS | CAPABILITY_BATCH, sizeof(capabilities_value), capabilities_value);
+	control_packet.num_params = 3;
+	control_packet.params = params;
+	accept_t accept;
+	if (send_control_packet(datalink, &control_packet) || send_manifest(datalink, &manifest) || receive_accept_packet(transfer, manifest.total_size, &accept))
+	{
+		manifest_free(&manifest);
+		return 1;
+	}
+	transfer->reuse = (accept.capabilities & CAPABILITY_REUSE) != 0;
+	transfer->channels = (accept.capabilities & CAPABILITY_CHANNELS) != 0;
+	datalink->max_batch_length = (accept.capabilities & CAPABILITY_BATCH) ? transfer->packet_size + DATA_PACKET_HEADER_SIZE : 0;
+	if (accept.offset != 0)
+	{
+		printf("Error: sessions cannot be resumed.\n");
+		manifest_free(&manifest);
+		return 1;
+	}
 
-	while(tries-- > 0){
+	// Send the contents of every file back-to-back
+	send_pipeline_t pipeline;
+	pipeline.manifest = &manifest;
+	pipeline.scanner = NULL;
+	pipeline.dedup = NULL;
+	pipeline.compression = NULL;
+	pipeline.sparse = 0;
+	pipeline.next_file = 0;
+	pipeline.source_open = 0;
+	pipeline.packet_size = transfer->packet_size;
+	pipeline.batch_length = datalink->max_batch_length;
+	pipeline.compression_level = 0;
+	checksum_init(&pipeline.checksum);
+	int error = send_stream(transfer, &pipeline, 0, manifest.total_size);
+	if (pipeline.source_open)
+		file_source_close(&pipeline.source);
+	manifest_free(&manifest);
+	if (error) return 1;
 
-		printf("Mode (send/receive)? ");
-		scanf("%s", mode);
+	// Send end packet
+	if (send_end_packet(datalink, params, 2, &pipeline.checksum)) return 1;
 
-		//verify mode entry
-		if (strcmp(mode,"send") == 0 || strcmp(mode,"receive") == 0){
-			valid=1;
+	return release_link(transfer);
+}
 
-			break;
-		}else{
-			printf("Invalid mode.\n");
-			continue;
+int send_manifest(datalink_t *datalink, const manifest_t *manifest)
+{
+	// as many entries per packet as the receiver is guaranteed to accept
+	unsigned char packet[MAX_CONTROL_PACKET_SIZE];
+	packet[0] = PACKET_CTRL_FIELD_MANIFEST;
+	unsigned next = 0;
+	while (next < manifest->num_entries)
+	{
+		unsigned length = manifest_encode(manifest, &next, &packet[1], sizeof(packet) - 1);
+		if (length == 0)
+		{
+			printf("Error: path %s is too long.\n", manifest->entries[next].path);
+			return 1;
 		}
+		if (llwrite(datalink, packet, length + 1))
+		{
+			printf("Error sending manifest.\n");
+			return 1;
+		}
+	}
+	return 0;
+}
 
-
+int send_stream(transfer_t *transfer, send_pipeline_t *pipeline, uint64_t offset, uint64_t size)
+{
+	// Start the read-ahead and framing stages
+	datalink_t *datalink = &transfer->datalink;
+	atomic_init(&pipeline->failed, 0);
+	if (spsc_queue_init(&pipeline->chunks, SEND_QUEUE_SLOTS, sizeof(file_chunk_t) + pipeline->packet_size)) return 1;
+	if (spsc_queue_init(&pipeline->frames, SEND_QUEUE_SLOTS, sizeof(prepared_frame_t) + LLPREPARE_MAX_LENGTH(pipeline->packet_size + DATA_PACKET_HEADER_SIZE)))
+	{
+		spsc_queue_destroy(&pipeline->chunks);
+		return 1;
+	}
+	pthread_t reader_thread, framer_thread;
+	if (pthread_create(&reader_thread, NULL, file_reader_thread, pipeline))
+	{
+		printf("Error starting file reader thread.\n");
+		spsc_queue_destroy(&pipeline->chunks);
+		spsc_queue_destroy(&pipeline->frames);
+		return 1;
+	}
+	if (pthread_create(&framer_thread, NULL, packet_framer_thread, pipeline))
+	{
+		printf("Error starting packet framer thread.\n");
+		spsc_queue_close(&pipeline->chunks);
+		pthread_join(reader_thread, NULL);
+		spsc_queue_destroy(&pipeline->chunks);
+		spsc_queue_destroy(&pipeline->frames);
+		return 1;
 	}
 
-	if (!valid){
-		printf("Invalid mode.\n");
-		return -1;
+	// Send data packets, the link stage only writes and waits for acks
+	uint64_t i = offset;
+	int error = 0;
+	progress_t progress;
+	progress_start(&progress, transfer->progress_mode, transfer->progress_interval, offset, size);
+	while (i < size)
+	{
+		prepared_frame_t *frame = spsc_queue_front_wait(&pipeline->frames);
+		if (frame == NULL)
+		{
+			printf("Error reading file.\n");
+			error = 1;
+			break;
+		}
+		// messages of other channels go first, a few at a time
+		if (transfer->channels && send_messages(transfer, MESSAGE_PACKETS_PER_FRAME))
+		{
+			error = 1;
+			break;
+		}
+		if (llwrite_prepared(datalink, frame->frame, frame->length, frame->batch))
+		{
+			printf("Error data control packet.\n");
+			error = 1;
+			break;
+		}
+		i += frame->data_length;
+		spsc_queue_release(&pipeline->frames);
+		report_progress(&progress, datalink, i, 0);
 	}
+	if (!error)
+		report_progress(&progress, datalink, i, 1);
 
-	tries=3;
-	valid=0;
+	spsc_queue_close(&pipeline->frames);
+	spsc_queue_close(&pipeline->chunks);
+	pthread_join(framer_thread, NULL);
+	pthread_join(reader_thread, NULL);
+	spsc_queue_destroy(&pipeline->chunks);
+	spsc_queue_destroy(&pipeline->frames);
+	return error || atomic_load(&pipeline->failed);
+}
 
-	if (strcmp(mode, "send") == 0)
-	{
-		while(tries-- > 0){
+int send_end_packet(datalink_t *datalink, const control_packet_param_t *params, unsigned num_params, const checksum_t *checksum)
+{
+	control_packet_param_t end_params[num_params + 1];
+	memcpy(end_params, params, num_params * sizeof(control_packet_param_t));
+	unsigned char digest[8];
+	set_number_param(&end_params[num_params], PACKET_CTRL_TYPE_CHECKSUM, checksum_digest(checksum), sizeof(digest), digest);
 
-			printf("File name? ");
-			scanf("%s", fileName);
+	control_packet_t control_packet;
+	control_packet.ctrl_field = PACKET_CTRL_FIELD_END;
+	control_packet.num_params = num_params + 1;
+	control_packet.params = end_params;
+	return send_control_packet(datalink, &control_packet);
+}
 
-			if(access(fileName,F_OK) == -1)
-				perror("File does not exist.\n");
-			else{
-				valid=1;
-				break;
-			}
-		}
-		if (!valid){
-			printf("Invalid input.\n");
-			return -1;
-		}
+int send_control_packet(datalink_t *datalink, const control_packet_t *control_packet)
+{
+	// every control packet opens with the version of its format
+	unsigned size = 1 + 3 + 2 * control_packet->num_params;
+	unsigned i;
+	for (i = 0; i < control_packet->num_params; ++i)
+	{
+		size += control_packet->params[i].length;
 	}
-	else
+	unsigned char packet[size];
+	packet[0] = control_packet->ctrl_field;
+	packet[1] = PACKET_CTRL_TYPE_VERSION;
+	packet[2] = 1;
+	packet[3] = PROTOCOL_VERSION;
+	unsigned j;
+	for (i = 0, j = 4; i < control_packet->num_params; ++i)
+	{
+		packet[j++] = control_packet->params[i].type;
+		packet[j++] = control_packet->params[i].length;
+		memcpy(&packet[j], control_packet->params[i].value, control_packet->params[i].length);
+		j += control_packet->params[i].length;
+	}
+
+	if (llwrite(datalink, packet, size))
 	{
-		printf("Destination folder? ");
-		scanf("%s", fileName);
+		printf("Error sending control packet.\n");
+		return 1;
 	}
-	printf("Port? ");
-	scanf("%s",port);
+	return 0;
+}
 
-	printf("Baudrate (0 to select default value)? ");
-	scanf("%d", &baudrate);
+unsigned build_data_packet(const data_packet_t *data_packet, unsigned char *packet)
+{
+	packet[0] = data_packet->ctrl_field;
+	packet[1] = data_packet->sn;
+	packet[2] = (uint8_t)((data_packet->length & 0xFF00) >> 8);
+	packet[3] = (uint8_t)(data_packet->length & 0x00FF);
+	memcpy(&packet[DATA_PACKET_HEADER_SIZE], data_packet->data, data_packet->length);
+	return data_packet->length + DATA_PACKET_HEADER_SIZE;
+}
 
-	tries = 3;
-	while(tries-- > 0) {
-		max_packet_size = -1;
-		printf("Max data packet size (0 to select default value, other values between 10 and 200)? ");
-		scanf("%d", &max_packet_size);
+int send_messages(transfer_t *transfer, unsigned max_packets)
+{
+	// the head of the queue is the next message of the lowest channel, even one just posted
+	unsigned i;
+	for (i = 0; i < max_packets; ++i)
+	{
+		pthread_mutex_lock(&transfer->messages_lock);
+		queued_message_t *message = transfer->messages;
+		pthread_mutex_unlock(&transfer->messages_lock);
+		if (message == NULL) return 0;
 
-		if(max_packet_size == 0) {
-			max_packet_size = MAX_PACKET_SIZE;
-			break;
+		data_packet_t data_packet;
+		data_packet.sn = message->channel;
+		data_packet.length = MIN(transfer->packet_size, message->length - message->sent);
+		data_packet.ctrl_field = (message->sent + data_packet.length == message->length) ? PACKET_CTRL_FIELD_MESSAGE_END : PACKET_CTRL_FIELD_MESSAGE;
+		data_packet.data = (char *)&message->data[message->sent];
+		unsigned char packet[data_packet.length + DATA_PACKET_HEADER_SIZE];
+		unsigned size = build_data_packet(&data_packet, packet);
+		if (llqueue(&transfer->datalink, packet, size))
+		{
+			printf("Error sending a message on channel %u.\n", message->channel);
+			return 1;
 		}
-
-		if(max_packet_size < 10 || max_packet_size > 200) {
-			printf("Invalid input!\n");
-			max_packet_size = MAX_PACKET_SIZE;
-			continue;
+		message->sent += data_packet.length;
+		if (data_packet.ctrl_field == PACKET_CTRL_FIELD_MESSAGE_END)
+		{
+			pthread_mutex_lock(&transfer->messages_lock);
+			queued_message_t **link = &transfer->messages;
+			while (*link != message)
+				link = &(*link)->next;
+			*link = message->next;
+			pthread_mutex_unlock(&transfer->messages_lock);
+			free(message);
 		}
 	}
+	return 0;
+}
 
-	printf("Timeout (0 to select default value)? ");
-	scanf("%d", &timeout);
-	if(timeout == 0)
-		timeout = DEFAULT_TIMEOUT;
-
-	printf("Max retransmissions (0 to select default value)? ");
-	scanf("%d", &retransmission);
-	if(retransmission == 0)
-		retransmission = DEFAULT_RETRANSMISSIONS;
+int message_packet(const char *packet, int length)
+{
+	return length >= DATA_PACKET_HEADER_SIZE
+			&& (packet[0] == PACKET_CTRL_FIELD_MESSAGE || packet[0] == PACKET_CTRL_FIELD_MESSAGE_END);
+}
 
-	if (strcmp(mode, "send") == 0)
-		return send_file(port, fileName);
-	else
-		return receive_file(port, fileName);
+int receive_message(transfer_t *transfer, const char *packet, int length)
+{
+	unsigned channel = (unsigned char)packet[1];
+	unsigned data_length = (((unsigned char)packet[2]) << 8) | ((unsigned char)packet[3]);
+	if (transfer->on_message == NULL || channel == 0 || data_length + DATA_PACKET_HEADER_SIZE != (unsigned)length)
+	{
+		printf("Error: received an invalid message packet.\n");
+		return 1;
+	}
+	if (transfer->assembly == NULL && (transfer->assembly = calloc(MAX_CHANNEL + 1, sizeof(message_assembly_t))) == NULL)
+	{
+		printf("Error: unable to allocate the message channels.\n");
+		return 1;
+	}
+	message_assembly_t *assembly = &transfer->assembly[channel];
+	if (assembly->data == NULL && (assembly->data = malloc(MAX_MESSAGE_SIZE)) == NULL)
+	{
+		printf("Error: unable to allocate a message of channel %u.\n", channel);
+		return 1;
+	}
+	if (assembly->length + data_length > MAX_MESSAGE_SIZE)
+	{
+		printf("Error: message on channel %u is longer than %d bytes.\n", channel, MAX_MESSAGE_SIZE);
+		assembly->length = 0;
+		return 1;
+	}
+	memcpy(&assembly->data[assembly->length], &packet[DATA_PACKET_HEADER_SIZE], data_length);
+	assembly->length += data_length;
+	if (packet[0] == PACKET_CTRL_FIELD_MESSAGE_END)
+	{
+		transfer->on_message(transfer->message_context, channel, assembly->data, assembly->length);
+		assembly->length = 0;
+	}
+	return 0;
+}
+
+void free_messages(transfer_t *transfer)
+{
+	pthread_mutex_lock(&transfer->messages_lock);
+	while (transfer->messages != NULL)
+	{
+		queued_message_t *message = transfer->messages;
+		transfer->messages = message->next;
+		free(message);
+	}
+	pthread_mutex_unlock(&transfer->messages_lock);
+	if (transfer->assembly != NULL)
+	{
+		unsigned channel;
+		for (channel = 0; channel <= MAX_CHANNEL; ++channel)
+			free(transfer->assembly[channel].data);
+		free(transfer->assembly);
+		transfer->assembly = NULL;
+	}
+}
+
+int receive_file(transfer_t *transfer, const char *destination_folder, transfer_open_sink_t open_sink, void *context)
+{
+	// Establish connection, unless the link is still up after the previous transfer
+	if (transfer_connect(transfer)) return 1;
+	datalink_t *datalink = &transfer->datalink;
+	char buf[datalink->max_frame_length];
+
+	// Read start packet, or the sender's goodbye on a link kept up between transfers.
+	// Messages sent in between are taken on the way.
+	int size;
+	while ((size = llread(datalink, buf)) >= 0 && message_packet(buf, size))
+	{
+		if (receive_message(transfer, buf, size)) return 1;
+	}
+	if (size < 0)
+	{
+		printf("Error: could not read data.\n");
+		return 1;
+	}
+
+	control_packet_t control_packet;
+	control_packet_param_t params[size / 2 + 1];
+	if (parse_control_packet(buf, size, &control_packet, params)
+			|| (control_packet.ctrl_field != PACKET_CTRL_FIELD_START && control_packet.ctrl_field != PACKET_CTRL_FIELD_CLOSE))
+	{
+		printf("Error: could not read file header.\n");
+		return 1;
+	}
+	if (control_packet.ctrl_field == PACKET_CTRL_FIELD_CLOSE)
+	{
+		free_control_packet(&control_packet);
+		transfer->connected = 0;
+		if (llclose(datalink))
+		{
+			printf("Could not close connection properly.\n");
+		}
+		return 0;
+	}
+
+	control_packet_param_t *param_name = get_param_by_type(&control_packet, PACKET_CTRL_TYPE_NAME);
+	control_packet_param_t *param_size = get_param_by_type(&control_packet, PACKET_CTRL_TYPE_SIZE);
+	control_packet_param_t *param_files = get_param_by_type(&control_packet, PACKET_CTRL_TYPE_FILES);
+	unsigned sender_capabilities = get_number_param(&control_packet, PACKET_CTRL_TYPE_CAPABILITIES, 0);
+
+	file_writer_t writer;
+	writer.manifest = NULL;
+	writer.sink_open = 0;
+	writer.basis_open = 0;
+	writer.chunk_buffer = NULL;
+	writer.dedup = NULL;
+	writer.compression = NULL;
+	writer.sparse = 0;
+	writer.destination_folder = destination_folder;
+	writer.open_sink = open_sink;
+	writer.sink_context = context;
+	if (param_size != NULL && param_files != NULL)
+	{
+		// a session of several files, listed in the manifest that follows
+		uint64_t stream_size = get_number_param(&control_packet, PACKET_CTRL_TYPE_SIZE, 0);
+		unsigned num_files = get_number_param(&control_packet, PACKET_CTRL_TYPE_FILES, 0);
+		free_control_packet(&control_packet);
+		return receive_session(transfer, &writer, stream_size, num_files, sender_capabilities);
+	}
+	if (param_name == NULL || param_size == NULL)
+	{
+		printf("Error: could not read file header.\n");
+		free_control_packet(&control_packet);
+		return 1;
+	}
+
+	char file_name[param_name->length + 1];
+	memcpy(file_name, param_name->value, param_name->length);
+	file_name[param_name->length] = '\0';
+	// the name ends up in a path, it must not lead out of the destination folder
+	if (strlen(file_name) != param_name->length || !manifest_safe_path(file_name))
+	{
+		printf("Error: refusing to create %s.\n", file_name);
+		free_control_packet(&control_packet);
+		return 1;
+	}
+	char file_path[strlen(destination_folder) + strlen(file_name) + 1];
+	strcpy(file_path, destination_folder);
+	strcat(file_path, file_name);
+	uint64_t file_size = get_number_param(&control_packet, PACKET_CTRL_TYPE_SIZE, 0);
+	printf("File size: %" PRIu64 " bytes.\n", file_size);
+	unsigned version = control_packet.version;
+	unsigned num_chunks = get_number_param(&control_packet, PACKET_CTRL_TYPE_CHUNKS, 0);
+	codec_t codec = get_number_param(&control_packet, PACKET_CTRL_TYPE_CODEC, CODEC_NONE);
+	uint64_t mtime = get_number_param(&control_packet, PACKET_CTRL_TYPE_MTIME, 0);
+	unsigned mode_bits = get_number_param(&control_packet, PACKET_CTRL_TYPE_MODE, 0644);
+	free_control_packet(&control_packet);
+
+	// What this end can do with the file, a checkpoint left by an interrupted transfer first
+	unsigned capabilities = CAPABILITY_CHECKSUM | CAPABILITY_SPARSE | CAPABILITY_REUSE | CAPABILITY_BATCH;
+	checkpoint_t checkpoint;
+	if (open_sink == NULL)
+	{
+		// only a file of our own can be resumed, patched or given its attributes
+		capabilities |= CAPABILITY_METADATA | CAPABILITY_DELTA;
+		if (checkpoint_load(file_path, file_size, &checkpoint) == 0 && checkpoint.offset > 0)
+			capabilities |= CAPABILITY_RESUME;
+	}
+	else if (open_sink(context, file_name, file_size, &writer.sink))
+	{
+		printf("Error: %s was refused.\n", file_name);
+		return 1;
+	}
+	else
+		writer.sink_open = 1;
+	if (num_chunks > 0 && transfer->cache_dir != NULL)
+		capabilities |= CAPABILITY_DEDUP;
+	if (codec > CODEC_NONE && codec < NUM_CODECS)
+		capabilities |= CAPABILITY_COMPRESSION;
+	if (transfer->on_message != NULL)
+		capabilities |= CAPABILITY_CHANNELS;
+	capabilities &= sender_capabilities;
+	transfer->reuse = version >= 2 && (capabilities & CAPABILITY_REUSE);
+	transfer->channels = (capabilities & CAPABILITY_CHANNELS) != 0;
+
+	// The fastest shared mode is used, falling back to the next one if it cannot be set up here
+	dedup_list_t chunks;
+	dedup_list_init(&chunks);
+	block_cache_t cache;
+	chunk_pool_t pool;
+	transfer_mode_t mode;
+	while (1)
+	{
+		mode = select_transfer_mode(capabilities);
+		// a complete old copy of the file is the basis of a delta
+		if (mode == MODE_DELTA && open_basis(&writer, file_path))
+			capabilities &= ~CAPABILITY_DELTA;
+		else if (mode == MODE_DEDUP && block_cache_open(&cache, transfer->cache_dir))
+			capabilities &= ~CAPABILITY_DEDUP;
+		// chunks are decompressed in any order, which only some sinks take
+		else if (mode == MODE_COMPRESSED && open_sink != NULL && !writer.sink.random_access)
+			capabilities &= ~CAPABILITY_COMPRESSION;
+		else
+			break;
+	}
+	accept_t accept;
+	memset(&accept, 0, sizeof(accept));
+	accept.capabilities = capabilities;
+	accept.packet_size = datalink->max_frame_length - DATA_PACKET_HEADER_SIZE;
+	uint64_t offset = (mode == MODE_RESUME) ? checkpoint.offset : 0;
+	accept.offset = offset;
+	uint64_t stream_size = file_size;
+	char delta_path[strlen(file_path) + sizeof(DELTA_SUFFIX)];
+	strcpy(delta_path, file_path);
+	strcat(delta_path, DELTA_SUFFIX);
+	// 0 once the file checks out, 1 if its data cannot be trusted, -1 if the transfer failed otherwise.
+	// Every failure goes through the cleanup after END, whatever was set up by then.
+	int ret = 0;
+	if (mode == MODE_DEDUP)
+	{
+		writer.dedup = &chunks;
+		writer.cache = &cache;
+	}
+	if (version < 2)
+	{
+		// senders from before ACCEPT go straight to the data
+		if (open_sink == NULL && open_file_sink(&writer, file_path, file_size, 0, NULL))
+			ret = -1;
+	}
+	else if (mode == MODE_DELTA)
+	{
+		// the new version is built next to the old one
+		printf("Receiving a delta against %u blocks of %u bytes.\n", writer.num_blocks, writer.block_size);
+		accept.block_size = writer.block_size;
+		accept.num_blocks = writer.num_blocks;
+		if (send_accept_packet(datalink, &accept) || send_signatures(datalink, &writer)
+				|| open_file_sink(&writer, delta_path, file_size, 0, NULL))
+			ret = -1;
+		writer.sink.resumable = 0;
+	}
+	else if (mode == MODE_DEDUP)
+	{
+		// Only the chunks missing from the cache are sent, the rest is read back from it
+		if ((writer.chunk_buffer = malloc(DEDUP_MAX_CHUNK)) == NULL || send_accept_packet(datalink, &accept)
+				|| receive_chunk_list(datalink, &chunks, num_chunks, &cache)
+				|| (open_sink == NULL && open_file_sink(&writer, file_path, file_size, 0, NULL)))
+		{
+			ret = -1;
+		}
+		else
+		{
+			printf("Block cache has %" PRIu64 " of %" PRIu64 " bytes.\n", file_size - chunks.wanted_size, file_size);
+			writer.next_chunk = 0;
+			writer.chunk_filled = 0;
+			stream_size = chunks.wanted_size;
+		}
+		// the stream is not the file, so a checkpoint offset would mean nothing
+		writer.sink.resumable = 0;
+	}
+	else if (mode == MODE_COMPRESSED)
+	{
+		// Chunks are decompressed in parallel and written wherever they belong, in any order
+		if ((open_sink == NULL && open_file_sink(&writer, file_path, file_size, 0, NULL))
+				|| chunk_pool_init(&pool, chunk_pool_default_threads(), 2 * chunk_pool_default_threads(), COMPRESSION_CHUNK_SIZE,
+				COMPRESSION_CHUNK_SIZE, decompress_job, &writer))
+		{
+			ret = -1;
+		}
+		else
+		{
+			writer.compression = &pool;
+			writer.codec = codec;
+			writer.job = NULL;
+			writer.next_chunk = 0;
+			if (send_accept_packet(datalink, &accept))
+				ret = -1;
+			else
+				printf("Decompressing %s on %u threads.\n", codec_name(codec), pool.num_threads);
+		}
+		writer.sink.resumable = 0;
+	}
+	else
+	{
+		if (offset > 0)
+			printf("Resuming transfer at byte %" PRIu64 ".\n", offset);
+		writer.sparse = (capabilities & CAPABILITY_SPARSE) != 0;
+		if (send_accept_packet(datalink, &accept)
+				|| (open_sink == NULL && open_file_sink(&writer, file_path, file_size, offset, offset > 0 ? &checkpoint.checksum : NULL)))
+			ret = -1;
+	}
+
+	if (ret == 0 && receive_stream(transfer, &writer, offset, stream_size))
+		ret = -1;
+	if (writer.dedup != NULL)
+	{
+		// chunks after the last wanted one only come from the cache
+		if (ret == 0 && (copy_cached_chunks(&writer) || writer.next_chunk != chunks.num_chunks))
+			ret = -1;
+		printf("Block cache: %lu chunks reused, %lu stored.\n", cache.num_hits, cache.num_stored);
+		free(writer.chunk_buffer);
+		dedup_list_free(&chunks);
+		block_cache_close(&cache);
+	}
+	if (writer.compression != NULL)
+		chunk_pool_destroy(&pool);
+
+	// Read end packet, every byte of the file is in the sink's checksum by now
+	if (ret == 0)
+		ret = receive_end_packet(datalink, checksum_digest(&writer.sink.checksum));
+	if (writer.basis_open)
+		file_source_close(&writer.basis);
+	if (ret == 0 && file_sink_finish(&writer.sink))
+		ret = -1;
+	else if (ret != 0 && writer.sink_open)
+		file_sink_close(&writer.sink);
+	if (ret == 0 && writer.basis_open && rename(delta_path, file_path) < 0)
+	{
+		perror("Error replacing the old version of the file");
+		ret = -1;
+	}
+	if (ret)
+	{
+		// what arrived stays on disk if its checkpoint can resume it, unless the checksum did not match
+		if (writer.sink_open && open_sink == NULL && !(writer.sink.resumable && ret < 0))
+		{
+			const char *partial_path = writer.basis_open ? delta_path : file_path;
+			checkpoint_remove(partial_path);
+			unlink(partial_path);
+		}
+		return 1;
+	}
+	if (capabilities & CAPABILITY_METADATA)
+		restore_metadata(file_path, mtime, mode_bits);
+
+	if (release_link(transfer))
+	{
+		printf("Could not close connection properly.\n");
+	}
+
+	return 0;
+}
+
+int receive_session(transfer_t *transfer, file_writer_t *writer, uint64_t size, unsigned num_files, unsigned sender_capabilities)
+{
+	// Read the manifest, which may span several packets
+	datalink_t *datalink = &transfer->datalink;
+	manifest_t manifest;
+	manifest_init(&manifest);
+	char buf[datalink->max_frame_length];
+	while (manifest.num_entries < num_files)
+	{
+		int length = llread(datalink, buf);
+		if (length <= 0 || buf[0] != PACKET_CTRL_FIELD_MANIFEST || manifest_decode(&manifest, (unsigned char *)&buf[1], length - 1))
+		{
+			printf("Error: could not read the session manifest.\n");
+			manifest_free(&manifest);
+			return 1;
+		}
+	}
+	if (manifest.num_entries != num_files || manifest.total_size != size)
+	{
+		printf("Error: the session manifest does not match its start packet.\n");
+		manifest_free(&manifest);
+		return 1;
+	}
+	printf("Receiving %u files, %" PRIu64 " bytes.\n", manifest.num_entries, manifest.total_size);
+	accept_t accept;
+	memset(&accept, 0, sizeof(accept));
+	accept.capabilities = CAPABILITY_CHECKSUM | (sender_capabilities & (CAPABILITY_REUSE | CAPABILITY_BATCH));
+	if (transfer->on_message != NULL)
+		accept.capabilities |= sender_capabilities & CAPABILITY_CHANNELS;
+	accept.packet_size = datalink->max_frame_length - DATA_PACKET_HEADER_SIZE;
+	transfer->reuse = (accept.capabilities & CAPABILITY_REUSE) != 0;
+	transfer->channels = (accept.capabilities & CAPABILITY_CHANNELS) != 0;
+	if (send_accept_packet(datalink, &accept))
+	{
+		manifest_free(&manifest);
+		return 1;
+	}
+
+	// The writer splits the data stream back into files
+	writer->manifest = &manifest;
+	writer->next_file = 0;
+	writer->sink_open = 0;
+	checksum_init(&writer->checksum);
+	int error = receive_stream(transfer, writer, 0, size) || finish_session_files(writer);
+	if (writer->sink_open)
+		file_sink_close(&writer->sink);
+	manifest_free(&manifest);
+	if (error || receive_end_packet(datalink, checksum_digest(&writer->checksum))) return 1;
+
+	if (release_link(transfer))
+	{
+		printf("Could not close connection properly.\n");
+	}
+
+	return 0;
+}
+
+int receive_stream(transfer_t *transfer, file_writer_t *writer, uint64_t offset, uint64_t size)
+{
+	// Start the writer stage, so that disk latency never delays an RR
+	datalink_t *datalink = &transfer->datalink;
+	atomic_init(&writer->failed, 0);
+	if (spsc_queue_init(&writer->queue, RECEIVE_QUEUE_SLOTS, sizeof(received_packet_t) + datalink->max_frame_length)) return 1;
+	pthread_t writer_thread;
+	if (pthread_create(&writer_thread, NULL, file_writer_thread, writer))
+	{
+		printf("Error starting file writer thread.\n");
+		spsc_queue_destroy(&writer->queue);
+		return 1;
+	}
+
+	// Read data
+	uint64_t bytes_read = offset;
+	uint64_t num_compressed = 0;
+	unsigned char sn = 0;
+	int error = 0;
+	progress_t progress;
+	progress_start(&progress, transfer->progress_mode, transfer->progress_interval, offset, size);
+	while (bytes_read < size)
+	{
+		received_packet_t *slot = spsc_queue_reserve_wait(&writer->queue);
+		if (slot == NULL || atomic_load(&writer->failed))
+		{
+			error = 1;
+			break;
+		}
+		int length = llread(datalink, slot->packet);
+		if (length < 0)
+		{
+			error = 1;
+			break;
+		}
+		if (message_packet(slot->packet, length))
+		{
+			// another channel's message, the file's next packet takes the same slot
+			if (receive_message(transfer, slot->packet, length))
+			{
+				error = 1;
+				break;
+			}
+			continue;
+		}
+		data_packet_t data_packet;
+		data_packet.ctrl_field = slot->packet[0];
+		data_packet.sn = slot->packet[1];
+		data_packet.length = (((unsigned char)slot->packet[2]) << 8) | ((unsigned char)slot->packet[3]);
+		uint64_t file_length = data_packet.length;
+		if (data_packet.ctrl_field == PACKET_CTRL_FIELD_COPY && writer->basis_open && data_packet.length == COPY_PACKET_SIZE)
+		{
+			const unsigned char *copy = (unsigned char *)&slot->packet[DATA_PACKET_HEADER_SIZE];
+			uint32_t first_block = ((uint32_t)copy[0] << 24) | (copy[1] << 16) | (copy[2] << 8) | copy[3];
+			uint32_t num_blocks = ((uint32_t)copy[4] << 24) | (copy[5] << 16) | (copy[6] << 8) | copy[7];
+			if (num_blocks == 0 || num_blocks > DELTA_MAX_RUN || first_block >= writer->num_blocks || num_blocks > writer->num_blocks - first_block)
+			{
+				printf("Error receiving file. Asked to copy blocks %u to %u of %u.\n", first_block, first_block + num_blocks, writer->num_blocks);
+				error = 1;
+				break;
+			}
+			file_length = (uint64_t)num_blocks * writer->block_size;
+			if (file_length > size - bytes_read)
+			{
+				printf("Error receiving file. Asked to copy %" PRIu64 " bytes with %" PRIu64 " left.\n", file_length, size - bytes_read);
+				error = 1;
+				break;
+			}
+		}
+		else if (data_packet.ctrl_field == PACKET_CTRL_FIELD_SKIP && writer->sparse && data_packet.length == SKIP_PACKET_SIZE)
+		{
+			file_length = get_skip_length((unsigned char *)&slot->packet[DATA_PACKET_HEADER_SIZE]);
+			if (file_length == 0 || file_length > size - bytes_read)
+			{
+				printf("Error receiving file. Asked to skip %" PRIu64 " bytes with %" PRIu64 " left.\n", file_length, size - bytes_read);
+				error = 1;
+				break;
+			}
+		}
+		else if ((data_packet.ctrl_field == PACKET_CTRL_FIELD_COMPRESSED || data_packet.ctrl_field == PACKET_CTRL_FIELD_COMPRESSED_END)
+				&& writer->compression != NULL)
+		{
+			// every chunk but the last one expands to COMPRESSION_CHUNK_SIZE bytes
+			file_length = 0;
+			if (data_packet.ctrl_field == PACKET_CTRL_FIELD_COMPRESSED_END)
+			{
+				file_length = MIN(COMPRESSION_CHUNK_SIZE, size - num_compressed * COMPRESSION_CHUNK_SIZE);
+				++num_compressed;
+			}
+		}
+		else if (data_packet.ctrl_field != PACKET_CTRL_FIELD_DATA)
+		{
+			printf("Error receiving file. Received a control packet instead of a data packet.\n");
+			error = 1;
+			break;
+		}
+		if (data_packet.sn != sn)
+		{
+			printf("Error receiving file. Expected packet number %d but received packet number %d instead.\n", sn, data_packet.sn);
+			error = 1;
+			break;
+		}
+		sn = (unsigned char)(((unsigned)sn + 1) % (1 << 8));
+		slot->length = data_packet.length;
+		spsc_queue_commit(&writer->queue);
+		bytes_read += file_length;
+		report_progress(&progress, datalink, bytes_read, 0);
+	}
+	if (!error)
+		report_progress(&progress, datalink, bytes_read, 1);
+
+	spsc_queue_close(&writer->queue);
+	pthread_join(writer_thread, NULL);
+	spsc_queue_destroy(&writer->queue);
+	return error || atomic_load(&writer->failed);
+}
+
+int receive_end_packet(datalink_t *datalink, uint64_t digest)
+{
+	char buf[datalink->max_frame_length];
+	int size = llread(datalink, buf);
+	control_packet_t control_packet;
+	control_packet_param_t params[size > 0 ? size / 2 + 1 : 1];
+	if (size <= 0 || parse_control_packet(buf, size, &control_packet, params) || control_packet.ctrl_field != PACKET_CTRL_FIELD_END)
+	{
+		printf("Error receiving file. Was expecting an end packet but received a different one instead.\n");
+		return -1;
+	}
+
+	int ret = 0;
+	if (get_param_by_type(&control_packet, PACKET_CTRL_TYPE_CHECKSUM) == NULL)
+	{
+		printf("Sender did not send a checksum, file could not be verified.\n");
+	}
+	else if (get_number_param(&control_packet, PACKET_CTRL_TYPE_CHECKSUM, 0) != digest)
+	{
+		printf("Error receiving file. Checksum mismatch: expected %016" PRIx64 " but computed %016" PRIx64 ".\n",
+				get_number_param(&control_packet, PACKET_CTRL_TYPE_CHECKSUM, 0), digest);
+		ret = 1;
+	}
+	else
+	{
+		printf("Checksum verified: %016" PRIx64 ".\n", digest);
+	}
+	free_control_packet(&control_packet);
+	return ret;
+}
+
+int send_accept_packet(datalink_t *datalink, const accept_t *accept)
+{
+	control_packet_param_t params[5];
+	unsigned num_params = 0;
+	unsigned char capabilities_value[4], offset_value[8], packet_size_value[2], block_size_value[4], blocks_value[4];
+	set_number_param(&params[num_params++], PACKET_CTRL_TYPE_CAPABILITIES, accept->capabilities, sizeof(capabilities_value), capabilities_value);
+	set_number_param(&params[num_params++], PACKET_CTRL_TYPE_OFFSET, accept->offset, sizeof(offset_value), offset_value);
+	set_number_param(&params[num_params++], PACKET_CTRL_TYPE_PACKET_SIZE, accept->packet_size, sizeof(packet_size_value), packet_size_value);
+	if (accept->block_size > 0)
+	{
+		set_number_param(&params[num_params++], PACKET_CTRL_TYPE_BLOCK_SIZE, accept->block_size, sizeof(block_size_value), block_size_value);
+		set_number_param(&params[num_params++], PACKET_CTRL_TYPE_BLOCKS, accept->num_blocks, sizeof(blocks_value), blocks_value);
+	}
+
+	control_packet_t control_packet;
+	control_packet.ctrl_field = PACKET_CTRL_FIELD_ACCEPT;
+	control_packet.num_params = num_params;
+	control_packet.params = params;
+	return send_control_packet(datalink, &control_packet);
+}
+
+int receive_accept_packet(transfer_t *transfer, uint64_t size, accept_t *accept)
+{
+	char buf[transfer->datalink.max_frame_length];
+	int length = llread(&transfer->datalink, buf);
+	if (length <= 0)
+	{
+		printf("Error: no answer to the start packet.\n");
+		return 1;
+	}
+
+	control_packet_t control_packet;
+	control_packet_param_t params[length / 2 + 1];
+	if (parse_control_packet(buf, length, &control_packet, params) || control_packet.ctrl_field != PACKET_CTRL_FIELD_ACCEPT)
+	{
+		printf("Error: invalid answer to the start packet.\n");
+		return 1;
+	}
+	accept->capabilities = get_number_param(&control_packet, PACKET_CTRL_TYPE_CAPABILITIES, 0);
+	accept->offset = get_number_param(&control_packet, PACKET_CTRL_TYPE_OFFSET, 0);
+	accept->packet_size = get_number_param(&control_packet, PACKET_CTRL_TYPE_PACKET_SIZE, 0);
+	// signatures only follow an ACCEPT that has both
+	accept->block_size = get_number_param(&control_packet, PACKET_CTRL_TYPE_BLOCKS, 0) == 0 ? 0 : get_number_param(&control_packet, PACKET_CTRL_TYPE_BLOCK_SIZE, 0);
+	accept->num_blocks = (accept->block_size == 0) ? 0 : get_number_param(&control_packet, PACKET_CTRL_TYPE_BLOCKS, 0);
+	free_control_packet(&control_packet);
+	if (accept->offset > size)
+	{
+		printf("Error: receiver asked to resume past the end of the file.\n");
+		return 1;
+	}
+	// larger packets would be dropped by the receiver's link as oversized
+	if (accept->packet_size > 0 && accept->packet_size < transfer->packet_size)
+	{
+		transfer->packet_size = accept->packet_size;
+		printf("Receiver limits packets to %u bytes.\n", transfer->packet_size);
+	}
+	return 0;
+}
+
+int send_chunk_list(datalink_t *datalink, dedup_list_t *list)
+{
+	unsigned char packet[MAX_CONTROL_PACKET_SIZE];
+	packet[0] = PACKET_CTRL_FIELD_CHUNKS;
+	unsigned next = 0;
+	while (next < list->num_chunks)
+	{
+		unsigned length = dedup_encode_chunks(list, &next, &packet[1], sizeof(packet) - 1);
+		if (llwrite(datalink, packet, length + 1))
+		{
+			printf("Error sending chunk list.\n");
+			return 1;
+		}
+	}
+
+	// the receiver answers with a bitmap of the chunks it lacks
+	char buf[datalink->max_frame_length];
+	next = 0;
+	while (next < list->num_chunks)
+	{
+		int length = llread(datalink, buf);
+		if (length <= 1 || buf[0] != PACKET_CTRL_FIELD_WANTED || dedup_decode_wanted(list, &next, (unsigned char *)&buf[1], length - 1))
+		{
+			printf("Error: could not read the chunks wanted by the receiver.\n");
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int receive_chunk_list(datalink_t *datalink, dedup_list_t *list, unsigned num_chunks, block_cache_t *cache)
+{
+	char buf[datalink->max_frame_length];
+	while (list->num_chunks < num_chunks)
+	{
+		int length = llread(datalink, buf);
+		if (length <= 1 || buf[0] != PACKET_CTRL_FIELD_CHUNKS || dedup_decode_chunks(list, (unsigned char *)&buf[1], length - 1))
+		{
+			printf("Error: could not read the sender's chunk list.\n");
+			return 1;
+		}
+	}
+	if (list->num_chunks != num_chunks)
+	{
+		printf("Error: the chunk list does not match its start packet.\n");
+		return 1;
+	}
+
+	unsigned i;
+	for (i = 0; i < list->num_chunks; ++i)
+	{
+		if (block_cache_has(cache, list->chunks[i].hash, list->chunks[i].length))
+		{
+			list->chunks[i].wanted = 0;
+			list->wanted_size -= list->chunks[i].length;
+		}
+	}
+
+	unsigned char packet[MAX_CONTROL_PACKET_SIZE];
+	packet[0] = PACKET_CTRL_FIELD_WANTED;
+	unsigned next = 0;
+	while (next < list->num_chunks)
+	{
+		unsigned length = dedup_encode_wanted(list, &next, &packet[1], sizeof(packet) - 1);
+		if (llwrite(datalink, packet, length + 1))
+		{
+			printf("Error sending wanted chunks.\n");
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int open_basis(file_writer_t *writer, const char *file_path)
+{
+	struct stat st;
+	if (stat(file_path, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size < DELTA_MIN_BLOCK_SIZE) return 1;
+	if (file_source_open(&writer->basis, file_path)) return 1;
+	if (writer->basis.map == NULL)
+	{
+		file_source_close(&writer->basis);
+		return 1;
+	}
+	writer->block_size = delta_block_size(writer->basis.size);
+	writer->num_blocks = writer->basis.size / writer->block_size;
+	writer->basis_open = 1;
+	return 0;
+}
+
+int open_file_sink(file_writer_t *writer, const char *path, uint64_t size, uint64_t offset, const checksum_t *checksum)
+{
+	if (file_sink_open(&writer->sink, path, size, offset, checksum)) return 1;
+	writer->sink_open = 1;
+	return 0;
+}
+
+int send_signatures(datalink_t *datalink, const file_writer_t *writer)
+{
+	// as many signatures per packet as the sender is guaranteed to accept
+	unsigned char packet[MAX_CONTROL_PACKET_SIZE];
+	packet[0] = PACKET_CTRL_FIELD_SIGNATURES;
+	unsigned next = 0;
+	while (next < writer->num_blocks)
+	{
+		unsigned length = delta_encode_signatures(writer->basis.map, writer->block_size, writer->num_blocks, &next, &packet[1], sizeof(packet) - 1);
+		if (llwrite(datalink, packet, length + 1))
+		{
+			printf("Error sending block signatures.\n");
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int receive_signatures(datalink_t *datalink, delta_index_t *index)
+{
+	char buf[datalink->max_frame_length];
+	while (index->num_signatures < index->num_blocks)
+	{
+		int length = llread(datalink, buf);
+		if (length <= 0 || buf[0] != PACKET_CTRL_FIELD_SIGNATURES || delta_index_add(index, (unsigned char *)&buf[1], length - 1))
+		{
+			printf("Error: could not read the receiver's block signatures.\n");
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int parse_control_packet(const char *packet, int size, control_packet_t *control_packet, control_packet_param_t *params)
+{
+	int i = 0;
+	unsigned j;
+	control_packet->ctrl_field = packet[i++];
+	for (j = 0; i + 2 <= size; ++j)
+	{
+		params[j].type = packet[i++];
+		params[j].length = packet[i++];
+		if (i + params[j].length > size || (params[j].value = malloc(params[j].length + 1)) == NULL)
+		{
+			control_packet->num_params = j;
+			control_packet->params = params;
+			free_control_packet(control_packet);
+			return 1;
+		}
+		memcpy(params[j].value, &packet[i], params[j].length);
+		params[j].value[params[j].length] = '\0';
+		i += params[j].length;
+	}
+	control_packet->num_params = j;
+	control_packet->params = params;
+	// packets without a version are from before the binary format
+	control_packet_param_t *param_version = get_param_by_type(control_packet, PACKET_CTRL_TYPE_VERSION);
+	control_packet->version = (param_version == NULL || param_version->length != 1) ? 1 : (unsigned char)param_version->value[0];
+	return 0;
+}
+
+void free_control_packet(control_packet_t *control_packet)
+{
+	unsigned i;
+	for (i = 0; i < control_packet->num_params; ++i)
+	{
+		free(control_packet->params[i].value);
+	}
+	control_packet->num_params = 0;
+}
+
+void *file_writer_thread(void *arg)
+{
+	file_writer_t *writer = arg;
+	received_packet_t *slot;
+	while ((slot = spsc_queue_front_wait(&writer->queue)) != NULL)
+	{
+		// coalesced into large aligned writes by the sink
+		const unsigned char *data = (unsigned char *)&slot->packet[DATA_PACKET_HEADER_SIZE];
+		int ret;
+		if (slot->packet[0] == PACKET_CTRL_FIELD_COPY)
+		{
+			// validated by the link stage, DELTA_MAX_RUN blocks of DELTA_MAX_BLOCK_SIZE bytes still fit a write
+			uint32_t first_block = ((uint32_t)data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+			uint32_t num_blocks = ((uint32_t)data[4] << 24) | (data[5] << 16) | (data[6] << 8) | data[7];
+			uint64_t length = (uint64_t)num_blocks * writer->block_size;
+			ret = file_sink_write(&writer->sink, writer->basis.map + (uint64_t)first_block * writer->block_size, length);
+		}
+		else if (slot->packet[0] == PACKET_CTRL_FIELD_SKIP)
+			ret = file_sink_skip(&writer->sink, get_skip_length(data));
+		else if (writer->dedup != NULL)
+			ret = write_dedup_data(writer, data, slot->length);
+		else if (writer->compression != NULL)
+			ret = write_compressed_data(writer, data, slot->length, slot->packet[0] == PACKET_CTRL_FIELD_COMPRESSED_END);
+		else if (writer->manifest == NULL)
+			ret = file_sink_write(&writer->sink, data, slot->length);
+		else
+			ret = write_session_data(writer, data, slot->length);
+		if (ret)
+		{
+			atomic_store(&writer->failed, 1);
+			spsc_queue_close(&writer->queue);
+			return NULL;
+		}
+		spsc_queue_release(&writer->queue);
+	}
+	// chunks still being decompressed are part of the file too
+	if (writer->compression != NULL)
+	{
+		int ret;
+		while ((ret = retire_decompressed_chunk(writer)) > 0)
+			;
+		if (ret < 0)
+			atomic_store(&writer->failed, 1);
+	}
+	return NULL;
+}
+
+void *file_reader_thread(void *arg)
+{
+	send_pipeline_t *pipeline = arg;
+	file_chunk_t *chunk;
+	while ((chunk = spsc_queue_reserve_wait(&pipeline->chunks)) != NULL)
+	{
+		int num_read;
+		if (pipeline->scanner != NULL)
+		{
+			num_read = read_delta_chunk(pipeline, chunk);
+		}
+		else if (pipeline->compression != NULL)
+		{
+			num_read = read_compressed_chunk(pipeline, chunk);
+		}
+		else if (pipeline->sparse)
+		{
+			num_read = read_sparse_chunk(pipeline, chunk);
+		}
+		else if (pipeline->dedup != NULL)
+		{
+			// the whole file was hashed along with the chunk list
+			num_read = read_dedup_chunk(pipeline, chunk);
+			chunk->ctrl_field = PACKET_CTRL_FIELD_DATA;
+			chunk->file_length = MAX(num_read, 0);
+		}
+		else
+		{
+			num_read = (pipeline->manifest == NULL)
+				? file_source_next(&pipeline->source, chunk->buffer, pipeline->packet_size, &chunk->data)
+				: read_session_chunk(pipeline, chunk);
+			// hashed in file order, whichever way the file is split into packets
+			if (num_read > 0)
+				checksum_update(&pipeline->checksum, chunk->data, num_read);
+			chunk->ctrl_field = PACKET_CTRL_FIELD_DATA;
+			chunk->file_length = num_read;
+		}
+		if (num_read <= 0)
+		{
+			if (num_read < 0)
+				atomic_store(&pipeline->failed, 1);
+			break;
+		}
+		chunk->length = num_read;
+		spsc_queue_commit(&pipeline->chunks);
+	}
+	spsc_queue_close(&pipeline->chunks);
+	return NULL;
+}
+
+void *packet_framer_thread(void *arg)
+{
+	send_pipeline_t *pipeline = arg;
+	unsigned char packet[pipeline->packet_size + DATA_PACKET_HEADER_SIZE];
+	unsigned sn = 0;
+	file_chunk_t *chunk;
+	unsigned char batch[pipeline->batch_length + 1];
+	while ((chunk = spsc_queue_front_wait(&pipeline->chunks)) != NULL)
+	{
+		prepared_frame_t *frame = spsc_queue_reserve_wait(&pipeline->frames);
+		if (frame == NULL)
+			break;
+		frame->data_length = 0;
+		frame->batch = 0;
+		unsigned batch_length = 0;
+		unsigned size = 0;
+		do
+		{
+			// packets already read share the frame while they fit, a lone one is sent as is
+			if (size > 0)
+			{
+				frame->batch = 1;
+				batch_length = llbatch_append(batch, batch_length, packet, size);
+			}
+			data_packet_t data_packet;
+			data_packet.ctrl_field = chunk->ctrl_field;
+			data_packet.sn = (char)(sn++ % (1 << 8));
+			data_packet.length = chunk->length;
+			data_packet.data = (char *)chunk->data;
+			perf_sample_t sample;
+			perf_phase_begin(&sample);
+			size = build_data_packet(&data_packet, packet);
+			perf_phase_end(PHASE_PACKETISING, &sample);
+			frame->data_length += chunk->file_length;
+			spsc_queue_release(&pipeline->chunks);
+		}
+		while ((chunk = spsc_queue_front(&pipeline->chunks)) != NULL
+				&& batch_length + LLBATCH_ENTRY_LENGTH(size) + LLBATCH_ENTRY_LENGTH(chunk->length + DATA_PACKET_HEADER_SIZE) <= pipeline->batch_length);
+		if (frame->batch)
+		{
+			batch_length = llbatch_append(batch, batch_length, packet, size);
+			frame->length = llprepare(batch, batch_length, frame->frame);
+		}
+		else
+			frame->length = llprepare(packet, size, frame->frame);
+		spsc_queue_commit(&pipeline->frames);
+	}
+	// unblock the reader if the link stage gave up
+	spsc_queue_close(&pipeline->chunks);
+	spsc_queue_close(&pipeline->frames);
+	return NULL;
+}
+
+int read_delta_chunk(send_pipeline_t *pipeline, file_chunk_t *chunk)
+{
+	delta_op_t op;
+	if (!delta_scanner_next(pipeline->scanner, pipeline->packet_size, &op)) return 0;
+	const unsigned char *file_data = pipeline->source.map + op.offset;
+	checksum_update(&pipeline->checksum, file_data, op.size);
+	chunk->file_length = op.size;
+	if (!op.copy)
+	{
+		chunk->ctrl_field = PACKET_CTRL_FIELD_DATA;
+		chunk->data = file_data;
+		return op.size;
+	}
+	chunk->ctrl_field = PACKET_CTRL_FIELD_COPY;
+	int i;
+	for (i = 0; i < 4; ++i)
+	{
+		chunk->buffer[i] = op.first_block >> (8 * (3 - i));
+		chunk->buffer[4 + i] = op.num_blocks >> (8 * (3 - i));
+	}
+	chunk->data = chunk->buffer;
+	return COPY_PACKET_SIZE;
+}
+
+int read_dedup_chunk(send_pipeline_t *pipeline, file_chunk_t *chunk)
+{
+	// wanted chunks are sent back-to-back, a packet never spans two of them
+	const dedup_list_t *list = pipeline->dedup;
+	while (pipeline->next_chunk < list->num_chunks && !list->chunks[pipeline->next_chunk].wanted)
+		pipeline->chunk_offset += list->chunks[pipeline->next_chunk++].length;
+	if (pipeline->next_chunk == list->num_chunks) return 0;
+	const dedup_chunk_t *next = &list->chunks[pipeline->next_chunk];
+	unsigned length = MIN(pipeline->packet_size, next->length - pipeline->chunk_sent);
+	chunk->data = pipeline->source.map + pipeline->chunk_offset + pipeline->chunk_sent;
+	pipeline->chunk_sent += length;
+	if (pipeline->chunk_sent == next->length)
+	{
+		pipeline->chunk_offset += next->length;
+		++pipeline->next_chunk;
+		pipeline->chunk_sent = 0;
+	}
+	return length;
+}
+
+int compress_job(void *context, chunk_job_t *job)
+{
+	const send_pipeline_t *pipeline = context;
+	unsigned length = compress_chunk(pipeline->codec, pipeline->compression_level, job->input, job->input_length, job->output_buffer);
+	if (length == 0) return 1;
+	// incompressible chunks go as they are, the receiver tells them apart by their length
+	if (length >= job->input_length)
+	{
+		job->result = job->input;
+		job->result_length = job->input_length;
+	}
+	else
+	{
+		job->result = job->output_buffer;
+		job->result_length = length;
+	}
+	return 0;
+}
+
+int read_compressed_chunk(send_pipeline_t *pipeline, file_chunk_t *chunk)
+{
+	// keep every worker busy with the chunks after the one being sent
+	chunk_job_t *job;
+	uint64_t size = pipeline->source.size;
+	while ((uint64_t)pipeline->next_chunk * COMPRESSION_CHUNK_SIZE < size && (job = chunk_pool_acquire(pipeline->compression)) != NULL)
+	{
+		uint64_t position = (uint64_t)pipeline->next_chunk * COMPRESSION_CHUNK_SIZE;
+		job->index = pipeline->next_chunk++;
+		job->input = pipeline->source.map + position;
+		job->input_length = MIN(COMPRESSION_CHUNK_SIZE, size - position);
+		chunk_pool_submit(pipeline->compression);
+	}
+	if ((job = chunk_pool_oldest(pipeline->compression)) == NULL) return 0;
+	if (job->status) return -1;
+
+	// copied, the job is reused as soon as its last piece is out
+	unsigned length = MIN(pipeline->packet_size, job->result_length - pipeline->chunk_sent);
+	memcpy(chunk->buffer, job->result + pipeline->chunk_sent, length);
+	chunk->data = chunk->buffer;
+	chunk->ctrl_field = PACKET_CTRL_FIELD_COMPRESSED;
+	chunk->file_length = 0;
+	pipeline->chunk_sent += length;
+	if (pipeline->chunk_sent == job->result_length)
+	{
+		checksum_update(&pipeline->checksum, job->input, job->input_length);
+		pipeline->compressed_size += job->result_length;
+		chunk->ctrl_field = PACKET_CTRL_FIELD_COMPRESSED_END;
+		chunk->file_length = job->input_length;
+		pipeline->chunk_sent = 0;
+		chunk_pool_retire(pipeline->compression);
+	}
+	return length;
+}
+
+int read_sparse_chunk(send_pipeline_t *pipeline, file_chunk_t *chunk)
+{
+	uint64_t zeros;
+	int num_read = file_source_next_data(&pipeline->source, pipeline->packet_size, &chunk->data, &zeros);
+	if (num_read != 0 || zeros == 0)
+	{
+		if (num_read > 0)
+			checksum_update(&pipeline->checksum, chunk->data, num_read);
+		chunk->ctrl_field = PACKET_CTRL_FIELD_DATA;
+		chunk->file_length = MAX(num_read, 0);
+		return num_read;
+	}
+	// a run of zeros goes as its length, however long
+	checksum_update_zeros(&pipeline->checksum, zeros);
+	pipeline->skipped_size += zeros;
+	int i;
+	for (i = 0; i < SKIP_PACKET_SIZE; ++i)
+	{
+		chunk->buffer[i] = zeros >> (8 * (SKIP_PACKET_SIZE - 1 - i));
+	}
+	chunk->ctrl_field = PACKET_CTRL_FIELD_SKIP;
+	chunk->data = chunk->buffer;
+	chunk->file_length = zeros;
+	return SKIP_PACKET_SIZE;
+}
+
+uint64_t get_skip_length(const unsigned char *data)
+{
+	uint64_t length = 0;
+	int i;
+	for (i = 0; i < SKIP_PACKET_SIZE; ++i)
+	{
+		length = (length << 8) | data[i];
+	}
+	return length;
+}
+
+int decompress_job(void *context, chunk_job_t *job)
+{
+	file_writer_t *writer = context;
+	uint64_t position = job->index * COMPRESSION_CHUNK_SIZE;
+	unsigned raw_length = MIN(COMPRESSION_CHUNK_SIZE, writer->sink.size - position);
+	if (job->input_length == raw_length)
+	{
+		job->result = job->input;
+	}
+	else
+	{
+		if (decompress_chunk(writer->codec, job->input, job->input_length, job->output_buffer, raw_length)) return 1;
+		job->result = job->output_buffer;
+	}
+	job->result_length = raw_length;
+	return file_sink_write_at(&writer->sink, job->result, raw_length, position);
+}
+
+int write_compressed_data(file_writer_t *writer, const unsigned char *data, unsigned length, int last)
+{
+	while (writer->job == NULL)
+	{
+		// every job is in flight, the oldest one has to be done before another chunk can start
+		if ((writer->job = chunk_pool_acquire(writer->compression)) == NULL)
+		{
+			if (retire_decompressed_chunk(writer) < 0) return 1;
+			continue;
+		}
+		writer->job->input = writer->job->input_buffer;
+		writer->job->input_length = 0;
+	}
+	chunk_job_t *job = writer->job;
+	if (job->input_length + length > COMPRESSION_CHUNK_SIZE)
+	{
+		printf("Error receiving file. Compressed chunk %u is larger than the chunk itself.\n", writer->next_chunk);
+		return 1;
+	}
+	memcpy(job->input_buffer + job->input_length, data, length);
+	job->input_length += length;
+	if (last)
+	{
+		job->index = writer->next_chunk++;
+		chunk_pool_submit(writer->compression);
+		writer->job = NULL;
+	}
+	return 0;
+}
+
+int retire_decompressed_chunk(file_writer_t *writer)
+{
+	chunk_job_t *job = chunk_pool_oldest(writer->compression);
+	if (job == NULL) return 0;
+	if (job->status) return -1;
+	// chunks finish in any order, but are hashed in file order
+	checksum_update(&writer->sink.checksum, job->result, job->result_length);
+	chunk_pool_retire(writer->compression);
+	return 1;
+}
+
+int copy_cached_chunks(file_writer_t *writer)
+{
+	const dedup_list_t *list = writer->dedup;
+	while (writer->next_chunk < list->num_chunks && !list->chunks[writer->next_chunk].wanted)
+	{
+		const dedup_chunk_t *chunk = &list->chunks[writer->next_chunk];
+		if (block_cache_get(writer->cache, chunk->hash, chunk->length, writer->chunk_buffer)
+				|| file_sink_write(&writer->sink, writer->chunk_buffer, chunk->length))
+			return 1;
+		++writer->next_chunk;
+	}
+	return 0;
+}
+
+int write_dedup_data(file_writer_t *writer, const unsigned char *data, unsigned length)
+{
+	const dedup_list_t *list = writer->dedup;
+	while (length > 0)
+	{
+		if (writer->chunk_filled == 0 && copy_cached_chunks(writer)) return 1;
+		if (writer->next_chunk == list->num_chunks)
+		{
+			printf("Error: received more data than the chunk list announced.\n");
+			return 1;
+		}
+		const dedup_chunk_t *chunk = &list->chunks[writer->next_chunk];
+		unsigned n = MIN(length, chunk->length - writer->chunk_filled);
+		memcpy(&writer->chunk_buffer[writer->chunk_filled], data, n);
+		writer->chunk_filled += n;
+		data += n;
+		length -= n;
+		if (writer->chunk_filled < chunk->length)
+			continue;
+
+		// checked before it can end up in the cache and in every later file made from it
+		if (checksum_buffer(writer->chunk_buffer, chunk->length) != chunk->hash)
+		{
+			printf("Error: chunk %u does not match its hash.\n", writer->next_chunk);
+			return 1;
+		}
+		if (file_sink_write(&writer->sink, writer->chunk_buffer, chunk->length)) return 1;
+		if (block_cache_put(writer->cache, chunk->hash, writer->chunk_buffer, chunk->length))
+			printf("Warning: could not store chunk %u in the block cache.\n", writer->next_chunk);
+		++writer->next_chunk;
+		writer->chunk_filled = 0;
+	}
+	return 0;
+}
+
+int read_session_chunk(send_pipeline_t *pipeline, file_chunk_t *chunk)
+{
+	// always copied, a file's mapping is gone by the time a packet that ended it gets framed
+	unsigned filled = 0;
+	while (filled < pipeline->packet_size)
+	{
+		if (!pipeline->source_open)
+		{
+			if (pipeline->next_file == pipeline->manifest->num_entries)
+				break;
+			const manifest_entry_t *entry = &pipeline->manifest->entries[pipeline->next_file++];
+			if (file_source_open(&pipeline->source, entry->source)) return -1;
+			pipeline->source_open = 1;
+			if (pipeline->source.size != entry->size)
+			{
+				printf("Error: %s changed size during the transfer.\n", entry->source);
+				return -1;
+			}
+		}
+		const unsigned char *data;
+		int num_read = file_source_next(&pipeline->source, &chunk->buffer[filled], pipeline->packet_size - filled, &data);
+		if (num_read < 0) return -1;
+		if (num_read == 0)
+		{
+			file_source_close(&pipeline->source);
+			pipeline->source_open = 0;
+			continue;
+		}
+		if (data != &chunk->buffer[filled])
+			memcpy(&chunk->buffer[filled], data, num_read);
+		filled += num_read;
+	}
+	chunk->data = chunk->buffer;
+	return filled;
+}
+
+int open_session_file(file_writer_t *writer)
+{
+	const manifest_entry_t *entry = &writer->manifest->entries[writer->next_file++];
+	if (writer->open_sink != NULL)
+	{
+		if (writer->open_sink(writer->sink_context, entry->path, entry->size, &writer->sink))
+		{
+			printf("Error: %s was refused.\n", entry->path);
+			return 1;
+		}
+	}
+	else
+	{
+		char path[strlen(writer->destination_folder) + strlen(entry->path) + 1];
+		strcpy(path, writer->destination_folder);
+		strcat(path, entry->path);
+		if (make_parent_directories(path) || file_sink_open(&writer->sink, path, entry->size, 0, NULL)) return 1;
+	}
+	// the session as a whole is verified by END, per-file checkpoints would only cost syncs
+	writer->sink.resumable = 0;
+	writer->sink_open = 1;
+	writer->file_left = entry->size;
+	return 0;
+}
+
+int write_session_data(file_writer_t *writer, const unsigned char *data, unsigned length)
+{
+	checksum_update(&writer->checksum, data, length);
+	while (length > 0)
+	{
+		if (!writer->sink_open)
+		{
+			if (writer->next_file == writer->manifest->num_entries)
+			{
+				printf("Error: received more data than the manifest announced.\n");
+				return 1;
+			}
+			if (open_session_file(writer)) return 1;
+		}
+		unsigned n = MIN(length, writer->file_left);
+		if (n > 0 && file_sink_write(&writer->sink, data, n)) return 1;
+		data += n;
+		length -= n;
+		writer->file_left -= n;
+		// empty files are created and finished here too, without any data of their own
+		if (writer->file_left == 0)
+		{
+			writer->sink_open = 0;
+			if (file_sink_finish(&writer->sink)) return 1;
+		}
+	}
+	return 0;
+}
+
+int finish_session_files(file_writer_t *writer)
+{
+	// only empty files can be left once the whole stream was written
+	while (writer->next_file < writer->manifest->num_entries)
+	{
+		if (open_session_file(writer)) return 1;
+		if (writer->file_left != 0)
+		{
+			printf("Error: the session ended before %s was received.\n", writer->manifest->entries[writer->next_file - 1].path);
+			return 1;
+		}
+		writer->sink_open = 0;
+		if (file_sink_finish(&writer->sink)) return 1;
+	}
+	return 0;
+}
+
+void report_progress(progress_t *progress, const datalink_t *datalink, uint64_t done, int finished)
+{
+	// the sender counts the frames it had to send again, the receiver the ones it asked for again
+	unsigned frames, retransmissions;
+	if (datalink->mode == SENDER)
+	{
+		frames = datalink->num_sent_data_frames;
+		retransmissions = datalink->num_timeouts + datalink->num_received_REJs;
+	}
+	else
+	{
+		frames = datalink->num_received_data_frames;
+		retransmissions = datalink->num_sent_REJs;
+	}
+	if (finished)
+		progress_finish(progress, done, frames, retransmissions);
+	else
+		progress_update(progress, done, frames, retransmissions);
+}
+
+control_packet_param_t *get_param_by_type(const control_packet_t *control_packet, packet_ctrl_type_t type)
+{
+	unsigned i;
+	for (i = 0; i < control_packet->num_params; ++i)
+	{
+		if (control_packet->params[i].type == type) return &control_packet->params[i];
+	}
+	return NULL;
+}
+
+void set_number_param(control_packet_param_t *param, packet_ctrl_type_t type, uint64_t number, unsigned length, unsigned char *value)
+{
+	unsigned i;
+	for (i = 0; i < length; ++i)
+	{
+		value[i] = number >> (8 * (length - 1 - i));
+	}
+	param->type = type;
+	param->length = length;
+	param->value = (char *)value;
+}
+
+uint64_t get_number_param(const control_packet_t *control_packet, packet_ctrl_type_t type, uint64_t default_number)
+{
+	control_packet_param_t *param = get_param_by_type(control_packet, type);
+	if (param == NULL) return default_number;
+	if (control_packet->version < 2) return strtoull(param->value, NULL, 10);
+	if (param->length > 8) return default_number;
+	uint64_t number = 0;
+	unsigned i;
+	for (i = 0; i < param->length; ++i)
+	{
+		number = (number << 8) | (unsigned char)param->value[i];
+	}
+	return number;
+}
+
+transfer_mode_t select_transfer_mode(unsigned capabilities)
+{
+	// whatever the receiver already has comes first, then whatever puts the fewest bytes on the link
+	if (capabilities & CAPABILITY_RESUME) return MODE_RESUME;
+	if (capabilities & CAPABILITY_DELTA) return MODE_DELTA;
+	if (capabilities & CAPABILITY_DEDUP) return MODE_DEDUP;
+	if (capabilities & CAPABILITY_COMPRESSION) return MODE_COMPRESSED;
+	return MODE_PLAIN;
+}
+
+int restore_metadata(const char *path, uint64_t mtime, unsigned mode)
+{
+	struct timespec times[2];
+	times[0].tv_sec = 0;
+	times[0].tv_nsec = UTIME_OMIT;
+	times[1].tv_sec = mtime / 1000000000;
+	times[1].tv_nsec = mtime % 1000000000;
+	// only the permission bits: a sender must not make the receiver's files setuid, setgid or sticky
+	if (chmod(path, mode & 0777) < 0 || utimensat(AT_FDCWD, path, times, 0) < 0)
+	{
+		perror("Error restoring file attributes");
+		return 1;
+	}
+	return 0;
 }
@@ -1,9 +1,116 @@
 #ifndef APPLICATION_H
 #define APPLICATION_H
 
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "datalink.h"
+#include "file_source.h"
+#include "file_sink.h"
+#include "progress.h"
+
 #define MAX_PACKET_SIZE	100
+#define MAX_CHANNEL	255		/* messages use channels 1 to MAX_CHANNEL, the file stream is channel 0 */
+#define MAX_MESSAGE_SIZE	65536
+
+/*
+ * Opens the sink an incoming file is written to, with one of the
+ * file_sink_open functions. name is the file's path as the sender listed it.
+ * Returns 0 if OK, 1 to refuse the file, which fails the transfer
+ */
+typedef int (*transfer_open_sink_t)(void *context, const char *name, uint64_t size, file_sink_t *sink);
+
+/*
+ * Takes a complete message of a channel on the receiver, in the order they were posted
+ */
+typedef void (*transfer_on_message_t)(void *context, unsigned channel, const unsigned char *data, size_t length);
+
+struct queued_message;
+struct message_assembly;
+
+/*
+ * One end of a link and the settings of its transfers. The link is brought
+ * up by the first transfer and, if the other end can, kept up for the next
+ * ones until transfer_close. A transfer that fails drops it, the next one
+ * connects again.
+ */
+typedef struct {
+	const char *port;
+	int mode;			/* SENDER or RECEIVER */
+	int baudrate;			/* 0 for the default */
+	int max_packet_size;
+	unsigned retransmissions;
+	unsigned timeout;
+	int probe;			/* sender: tune the link after connecting */
+	int delta;			/* sender: offer a delta against the receiver's copy */
+	int dedup;			/* sender: offer chunks for the receiver's block cache */
+	int compression_level;		/* sender: 0 for none, 1 (fastest) to 9 (smallest) */
+	const char *cache_dir;		/* receiver: block cache, NULL for none */
+	progress_mode_t progress_mode;
+	unsigned progress_interval;
+	datalink_t datalink;
+	int connected;
+	int reuse;			/* both ends keep the link up after END */
+	unsigned packet_size;		/* largest data packet of the current link */
+	int keep_port;			/* the port stays configured between links, a receiver listens for the next SET without timing out */
+	int channels;			/* the receiver takes messages on the current link */
+	pthread_mutex_t messages_lock;
+	struct queued_message *messages;	/* sender: by channel, then in the order they were posted */
+	transfer_on_message_t on_message;	/* receiver: NULL refuses messages */
+	void *message_context;
+	struct message_assembly *assembly;	/* receiver: message of each channel being received */
+} transfer_t;
+
+/*
+ * Default settings for one end of the link on port, nothing is opened yet.
+ * To run over a pipe, a socket or memory instead, open datalink.transport
+ * beforehand and set keep_port.
+ */
+void transfer_init(transfer_t *transfer, const char *port, int mode);
+
+/*
+ * Sends the whole of source under name. The source stays open and can be sent again.
+ * Returns 0 if OK, 1 otherwise
+ */
+int transfer_send(transfer_t *transfer, file_source_t *source, const char *name);
+int transfer_send_file(transfer_t *transfer, const char *path);
+
+/*
+ * Sends files and directory trees in a single transfer
+ * Returns 0 if OK, 1 otherwise
+ */
+int transfer_send_session(transfer_t *transfer, char *const paths[], unsigned num_paths);
+
+/*
+ * Receives the next transfer, into destination_folder (a prefix of the
+ * paths, "" for the current directory) or into sinks opened by open_sink.
+ * If the sender closed the link instead, transfer->connected is 0.
+ * Returns 0 if OK, 1 otherwise
+ */
+int transfer_receive(transfer_t *transfer, const char *destination_folder);
+int transfer_receive_to(transfer_t *transfer, transfer_open_sink_t open_sink, void *context);
+
+/*
+ * Queues a message of up to MAX_MESSAGE_SIZE bytes on channel 1 to MAX_CHANNEL.
+ * Safe to call from any thread, also while a transfer is running: queued messages
+ * are sent ahead of the file's data packets, a lower channel first, as soon as a
+ * transfer's receiver has taken channels. A long message of one channel can be
+ * overtaken by a message of a lower one.
+ * Returns 0 if OK, 1 otherwise
+ */
+int transfer_post(transfer_t *transfer, unsigned channel, const void *data, size_t length);
+
+/*
+ * Sends every queued message over a link kept up after a transfer that negotiated channels
+ * Returns 0 if OK, 1 otherwise
+ */
+int transfer_send_messages(transfer_t *transfer);
 
-int send_file(const char *port, const char *file_name);
-int receive_file(const char *port, const char *destination_folder);
+/*
+ * Takes the link down, if it is still up, and closes the port.
+ * Messages still queued are dropped.
+ * Returns 0 if OK, 1 otherwise
+ */
+int transfer_close(transfer_t *transfer);
 
 #endif
@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include "block_cache.h"
+#include "checksum.h"
+
+#define BLOCK_NAME_LENGTH 33	/* "/xx/" + 16 hex digits + "-" + 8 hex digits + ".tmp" */
+
+void block_path(const block_cache_t *cache, uint64_t hash, unsigned length, char *path);
+
+int block_cache_open(block_cache_t *cache, const char *dir) {
+	if(mkdir(dir, 0755) < 0 && errno != EEXIST) {
+		perror("Error creating block cache");
+		return 1;
+	}
+	if((cache->dir = strdup(dir)) == NULL) {
+		printf("ERROR (block_cache_open): unable to allocate memory\n");
+		return 1;
+	}
+	cache->num_hits = 0;
+	cache->num_stored = 0;
+	return 0;
+}
+
+void block_cache_close(block_cache_t *cache) {
+	free(cache->dir);
+	cache->dir = NULL;
+}
+
+void block_path(const block_cache_t *cache, uint64_t hash, unsigned length, char *path) {
+	sprintf(path, "%s/%02x/%016" PRIx64 "-%08x", cache->dir, (unsigned)(hash >> 56), hash, length);
+}
+
+int block_cache_has(const block_cache_t *cache, uint64_t hash, unsigned length) {
+	char path[strlen(cache->dir) + BLOCK_NAME_LENGTH + 1];
+	block_path(cache, hash, length, path);
+	struct stat st;
+	return stat(path, &st) == 0 && (uint64_t)st.st_size == length;
+}
+
+int block_cache_get(block_cache_t *cache, uint64_t hash, unsigned length, unsigned char *buffer) {
+	char path[strlen(cache->dir) + BLOCK_NAME_LENGTH + 1];
+	block_path(cache, hash, length, path);
+	int fd = open(path, O_RDONLY);
+	if(fd < 0) {
+		perror("Error opening cached block");
+		return 1;
+	}
+	unsigned total = 0;
+	while(total < length) {
+		ssize_t ret = read(fd, &buffer[total], length - total);
+		if(ret <= 0) {
+			if(ret < 0 && errno == EINTR)
+				continue;
+			break;
+		}
+		total += ret;
+	}
+	close(fd);
+	if(total != length || checksum_buffer(buffer, length) != hash) {
+		printf("ERROR (block_cache_get): cached block %s is corrupted, removing it\n", path);
+		unlink(path);
+		return 1;
+	}
+	++cache->num_hits;
+	return 0;
+}
+
+int block_cache_put(block_cache_t *cache, uint64_t hash, const unsigned char *data, unsigned length) {
+	char path[strlen(cache->dir) + BLOCK_NAME_LENGTH + 1];
+	char temp_path[sizeof(path)];
+	block_path(cache, hash, length, path);
+	sprintf(temp_path, "%s.tmp", path);
+
+	// fan-out directory, named by the first two hex digits
+	char *slash = strrchr(path, '/');
+	*slash = '\0';
+	if(mkdir(path, 0755) < 0 && errno != EEXIST) {
+		perror("Error creating block cache directory");
+		return 1;
+	}
+	*slash = '/';
+
+	int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0) {
+		perror("Error creating cached block");
+		return 1;
+	}
+	unsigned total = 0;
+	while(total < length) {
+		ssize_t ret = write(fd, &data[total], length - total);
+		if(ret < 0) {
+			if(errno == EINTR)
+				continue;
+			perror("Error writing cached block");
+			close(fd);
+			unlink(temp_path);
+			return 1;
+		}
+		total += ret;
+	}
+	close(fd);
+	if(rename(temp_path, path) < 0) {
+		perror("Error storing cached block");
+		unlink(temp_path);
+		return 1;
+	}
+	++cache->num_stored;
+	return 0;
+}
@@ -0,0 +1,41 @@
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include <stdint.h>
+
+/*
+ * Persistent content-addressed store of file chunks, one file per chunk
+ * named after its hash and length, fanned out over 256 subdirectories
+ */
+typedef struct {
+	char *dir;
+	unsigned long num_hits;
+	unsigned long num_stored;
+} block_cache_t;
+
+/*
+ * Opens the store at dir, creating it if needed
+ * Returns 0 if OK, 1 otherwise
+ */
+int block_cache_open(block_cache_t *cache, const char *dir);
+void block_cache_close(block_cache_t *cache);
+
+/*
+ * Returns 1 if the chunk is in the store, 0 otherwise
+ */
+int block_cache_has(const block_cache_t *cache, uint64_t hash, unsigned length);
+
+/*
+ * Reads a chunk into buffer, which must hold length bytes. A chunk that no
+ * longer matches its hash is removed from the store.
+ * Returns 0 if OK, 1 otherwise
+ */
+int block_cache_get(block_cache_t *cache, uint64_t hash, unsigned length, unsigned char *buffer);
+
+/*
+ * Adds a chunk, atomically so that readers never see part of it
+ * Returns 0 if OK, 1 otherwise
+ */
+int block_cache_put(block_cache_t *cache, uint64_t hash, const unsigned char *data, unsigned length);
+
+#endif
@@ -0,0 +1,425 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <inttypes.h>
+#include "bus.h"
+#include "file_source.h"
+#include "checksum.h"
+#include "manifest.h"
+
+#define MAX(A, B) (((A) > (B)) ? (A) : (B))
+#define MIN(A, B) (((A) < (B)) ? (A) : (B))
+
+#define BUS_MAX_RANGES ((BUS_CONTROL_SIZE - 1) / 8)
+#define BUS_MAX_NAME (BUS_CONTROL_SIZE - 20)
+
+typedef enum {
+	BUS_PACKET_FILE = 1,	// size (8), payload of a data packet (2), checksum (8) and name, to each node
+	BUS_PACKET_DATA = 2,	// index (4) and data, broadcast or resent to one node
+	BUS_PACKET_POLL = 3,	// master asks a node for the packets it lacks
+	BUS_PACKET_MISSING = 4,	// ranges of packets the node lacks, first (4) and count (4), none once its copy checks out
+	BUS_PACKET_CLOSE = 5	// the distribution is over
+} bus_packet_t;
+
+/*
+ * A secondary's copy of the file being distributed, written wherever its packets go
+ */
+typedef struct {
+	int fd;			// -1 until the file is announced
+	char *path;
+	uint64_t size;
+	unsigned payload;
+	uint32_t num_packets;
+	uint32_t num_missing;
+	unsigned char *have;	// bitmap of the packets received
+	uint64_t digest;
+	int verified;
+} bus_copy_t;
+
+void bus_link_init(datalink_t *datalink, const transfer_t *settings, unsigned node, int mode);
+void put_number(unsigned char *buffer, uint64_t number, unsigned length);
+uint64_t get_number(const unsigned char *buffer, unsigned length);
+int read_packet(file_source_t *source, unsigned payload, uint32_t index, unsigned char *packet);
+int announce_file(bus_node_t *node, const char *name, uint64_t size, unsigned payload, uint64_t digest);
+int repair_node(bus_node_t *node, file_source_t *source, unsigned payload, uint32_t num_packets);
+int open_copy(bus_copy_t *copy, const char *destination_folder, const unsigned char *packet, int length, unsigned max_length);
+int store_packet(bus_copy_t *copy, const unsigned char *packet, int length);
+int answer_poll(datalink_t *datalink, bus_copy_t *copy);
+void close_copy(bus_copy_t *copy);
+
+void bus_link_init(datalink_t *datalink, const transfer_t *settings, unsigned node, int mode) {
+	datalink_init(datalink, mode);
+	datalink->address = A_NODE(node);
+	datalink->baudrate = settings->baudrate;
+	datalink->timeout = settings->timeout;
+	datalink->max_retransmissions = settings->retransmissions;
+	datalink->max_frame_length = MAX(settings->max_packet_size + BUS_DATA_HEADER_SIZE, BUS_CONTROL_SIZE);
+	// every node's link shares the one port
+	datalink->keep_port = 1;
+}
+
+void put_number(unsigned char *buffer, uint64_t number, unsigned length) {
+	unsigned i;
+	for(i = 0; i < length; ++i)
+		buffer[i] = number >> (8 * (length - 1 - i));
+}
+
+uint64_t get_number(const unsigned char *buffer, unsigned length) {
+	uint64_t number = 0;
+	unsigned i;
+	for(i = 0; i < length; ++i)
+		number = (number << 8) | buffer[i];
+	return number;
+}
+
+int bus_distribute(const transfer_t *settings, const char *path, const unsigned nodes[], unsigned num_nodes) {
+	unsigned i;
+	for(i = 0; i < num_nodes; ++i) {
+		if(nodes[i] < 1 || nodes[i] > MAX_NODES) {
+			printf("ERROR (bus_distribute): nodes are numbered 1 to %d, not %u\n", MAX_NODES, nodes[i]);
+			return 1;
+		}
+	}
+	char copy[strlen(path) + 1];
+	strcpy(copy, path);
+	const char *name = basename(copy);
+	if(strlen(name) > BUS_MAX_NAME) {
+		printf("ERROR (bus_distribute): %s is too long a name\n", name);
+		return 1;
+	}
+
+	// The checksum each node checks its copy against
+	file_source_t source;
+	if(file_source_open(&source, path))
+		return 1;
+	checksum_t checksum;
+	checksum_init(&checksum);
+	if(file_source_checksum(&source, source.size, &checksum)) {
+		file_source_close(&source);
+		return 1;
+	}
+	uint64_t digest = checksum_digest(&checksum);
+	unsigned payload = settings->max_packet_size;
+	uint64_t num_packets = (source.size + payload - 1) / payload;
+	if(num_packets > UINT32_MAX) {
+		printf("ERROR (bus_distribute): %s takes more than %u packets\n", path, UINT32_MAX);
+		file_source_close(&source);
+		return 1;
+	}
+
+	bus_node_t *bus;
+	if((bus = calloc(num_nodes, sizeof(bus_node_t))) == NULL) {
+		printf("ERROR (bus_distribute): unable to allocate %u nodes\n", num_nodes);
+		file_source_close(&source);
+		return 1;
+	}
+	// the port may be open already, to run the bus over something else than a serial line
+	transport_t transport = settings->datalink.transport;
+	int own_port = (transport.ops == NULL);
+	if(own_port && transport_open(&transport, settings->port, settings->baudrate)) {
+		printf("ERROR (bus_distribute): unable to open %s\n", settings->port);
+		free(bus);
+		file_source_close(&source);
+		return 1;
+	}
+
+	// Each node is told what is coming over its own link, the ones that don't answer are left out
+	datalink_t *broadcast = NULL;
+	for(i = 0; i < num_nodes; ++i) {
+		bus_node_t *node = &bus[i];
+		node->node = nodes[i];
+		bus_link_init(&node->datalink, settings, node->node, SENDER);
+		node->datalink.transport = transport;
+		if(llopen(settings->port, &node->datalink) || announce_file(node, name, source.size, payload, digest)) {
+			printf("Node %u did not answer, leaving it out.\n", node->node);
+			llabort(&node->datalink);
+			continue;
+		}
+		node->connected = 1;
+		broadcast = &node->datalink;
+	}
+
+	// One broadcast pass, nobody answers
+	unsigned char packet[BUS_DATA_HEADER_SIZE + payload];
+	uint32_t index;
+	if(broadcast != NULL && file_source_seek(&source, 0) == 0) {
+		printf("Broadcasting %" PRIu64 " packets to every node.\n", num_packets);
+		for(index = 0; index < num_packets; ++index) {
+			int length = read_packet(&source, payload, index, packet);
+			if(length < 0 || llbroadcast(broadcast, packet, length))
+				break;
+		}
+	}
+
+	// Then each node in turn gets what it missed over its own link
+	unsigned num_failed = 0;
+	for(i = 0; i < num_nodes; ++i) {
+		bus_node_t *node = &bus[i];
+		if(node->connected && repair_node(node, &source, payload, num_packets) == 0) {
+			node->done = 1;
+			packet[0] = BUS_PACKET_CLOSE;
+			if(llwrite(&node->datalink, packet, 1) == 0) {
+				llclose(&node->datalink);
+				node->connected = 0;
+			}
+		}
+		if(node->connected)
+			llabort(&node->datalink);
+		if(node->done) {
+			printf("Node %u: done, %u packets repaired.\n", node->node, node->num_repaired);
+		} else {
+			printf("Node %u: failed.\n", node->node);
+			++num_failed;
+		}
+	}
+
+	if(own_port)
+		transport_close(&transport);
+	free(bus);
+	file_source_close(&source);
+	return num_failed > 0;
+}
+
+int read_packet(file_source_t *source, unsigned payload, uint32_t index, unsigned char *packet) {
+	// sequential reads need no seek, repairs jump to the packet they resend
+	uint64_t offset = (uint64_t)index * payload;
+	if(source->offset != offset && file_source_seek(source, offset))
+		return -1;
+	const unsigned char *data;
+	int length = file_source_next(source, &packet[BUS_DATA_HEADER_SIZE], MIN(payload, source->size - offset), &data);
+	if(length < 0 || (uint64_t)length != MIN(payload, source->size - offset)) {
+		printf("ERROR (read_packet): unable to read packet %u\n", index);
+		return -1;
+	}
+	packet[0] = BUS_PACKET_DATA;
+	put_number(&packet[1], index, 4);
+	if(data != &packet[BUS_DATA_HEADER_SIZE])
+		memcpy(&packet[BUS_DATA_HEADER_SIZE], data, length);
+	return BUS_DATA_HEADER_SIZE + length;
+}
+
+int announce_file(bus_node_t *node, const char *name, uint64_t size, unsigned payload, uint64_t digest) {
+	unsigned char packet[BUS_CONTROL_SIZE];
+	packet[0] = BUS_PACKET_FILE;
+	put_number(&packet[1], size, 8);
+	put_number(&packet[9], payload, 2);
+	put_number(&packet[11], digest, 8);
+	unsigned length = strlen(name);
+	memcpy(&packet[19], name, length);
+	return llwrite(&node->datalink, packet, 19 + length);
+}
+
+int repair_node(bus_node_t *node, file_source_t *source, unsigned payload, uint32_t num_packets) {
+	datalink_t *datalink = &node->datalink;
+	unsigned char packet[BUS_DATA_HEADER_SIZE + payload];
+	unsigned char answer[datalink->max_frame_length];
+	while(1) {
+		packet[0] = BUS_PACKET_POLL;
+		if(llwrite(datalink, packet, 1))
+			return 1;
+		int length = llread(datalink, (char *)answer);
+		if(length < 1 || answer[0] != BUS_PACKET_MISSING || (length - 1) % 8 != 0) {
+			printf("ERROR (repair_node): node %u did not say what it lacks\n", node->node);
+			return 1;
+		}
+		if(length == 1)
+			return 0;
+
+		int i;
+		for(i = 1; i < length; i += 8) {
+			uint32_t first = get_number(&answer[i], 4);
+			uint32_t count = get_number(&answer[i + 4], 4);
+			if(count == 0 || first >= num_packets || count > num_packets - first) {
+				printf("ERROR (repair_node): node %u asked for packets %u to %u of %u\n", node->node, first, first + count, num_packets);
+				return 1;
+			}
+			// a node whose copy keeps failing its checksum is given up on
+			if((uint64_t)node->num_repaired + count > 2 * (uint64_t)num_packets) {
+				printf("ERROR (repair_node): node %u keeps losing packets\n", node->node);
+				return 1;
+			}
+			node->num_repaired += count;
+			uint32_t index;
+			for(index = first; index < first + count; ++index) {
+				int packet_length = read_packet(source, payload, index, packet);
+				if(packet_length < 0 || llwrite(datalink, packet, packet_length))
+					return 1;
+			}
+		}
+	}
+}
+
+int bus_receive(transfer_t *transfer, unsigned node, const char *destination_folder) {
+	if(node < 1 || node > MAX_NODES) {
+		printf("ERROR (bus_receive): nodes are numbered 1 to %d, not %u\n", MAX_NODES, node);
+		return 1;
+	}
+	datalink_t *datalink = &transfer->datalink;
+	transport_t transport = datalink->transport;
+	bus_link_init(datalink, transfer, node, RECEIVER);
+	datalink->transport = transport;
+	datalink->keep_port = transfer->keep_port;
+	datalink->listen = 1;
+	if(llopen(transfer->port, datalink)) {
+		llabort(datalink);
+		return 1;
+	}
+
+	bus_copy_t copy;
+	memset(&copy, 0, sizeof(copy));
+	copy.fd = -1;
+	unsigned char packet[datalink->max_frame_length];
+	int error = 0;
+	while(!error) {
+		int length = llread(datalink, (char *)packet);
+		if(length < 1) {
+			error = 1;
+			break;
+		}
+		if(packet[0] == BUS_PACKET_CLOSE)
+			break;
+		switch(packet[0]) {
+		case BUS_PACKET_FILE:
+			error = open_copy(&copy, destination_folder, packet, length, datalink->max_frame_length);
+			break;
+		case BUS_PACKET_DATA:
+			error = store_packet(&copy, packet, length);
+			break;
+		case BUS_PACKET_POLL:
+			error = answer_poll(datalink, &copy);
+			break;
+		default:
+			printf("ERROR (bus_receive): unknown packet %d\n", packet[0]);
+			error = 1;
+		}
+	}
+
+	if(!error && !copy.verified) {
+		printf("ERROR (bus_receive): the master closed the link before %s was complete\n", copy.path != NULL ? copy.path : "the file");
+		error = 1;
+	}
+	if(!error)
+		printf("Received %s, %" PRIu64 " bytes.\n", copy.path, copy.size);
+	close_copy(&copy);
+	if(error) {
+		llabort(datalink);
+		return 1;
+	}
+	return llclose(datalink) != 0;
+}
+
+int open_copy(bus_copy_t *copy, const char *destination_folder, const unsigned char *packet, int length, unsigned max_length) {
+	if(length <= 19 || copy->fd >= 0) {
+		printf("ERROR (open_copy): invalid file announcement\n");
+		return 1;
+	}
+	char name[length - 19 + 1];
+	memcpy(name, &packet[19], length - 19);
+	name[length - 19] = '\0';
+	copy->size = get_number(&packet[1], 8);
+	copy->payload = get_number(&packet[9], 2);
+	copy->digest = get_number(&packet[11], 8);
+	if(!manifest_safe_path(name) || copy->payload == 0 || copy->payload + BUS_DATA_HEADER_SIZE > max_length) {
+		printf("ERROR (open_copy): refusing %s in packets of %u bytes\n", name, copy->payload);
+		return 1;
+	}
+	uint64_t num_packets = (copy->size + copy->payload - 1) / copy->payload;
+	if(num_packets > UINT32_MAX) {
+		printf("ERROR (open_copy): %s takes too many packets\n", name);
+		return 1;
+	}
+	copy->num_packets = num_packets;
+	copy->num_missing = num_packets;
+	if((copy->path = malloc(strlen(destination_folder) + strlen(name) + 1)) == NULL
+			|| (copy->have = calloc((num_packets + 7) / 8 + 1, 1)) == NULL) {
+		printf("ERROR (open_copy): unable to allocate the state of %s\n", name);
+		return 1;
+	}
+	sprintf(copy->path, "%s%s", destination_folder, name);
+	if((copy->fd = open(copy->path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror(copy->path);
+		return 1;
+	}
+	if(ftruncate(copy->fd, copy->size) < 0) {
+		perror(copy->path);
+		return 1;
+	}
+	printf("Receiving %s, %" PRIu64 " bytes.\n", copy->path, copy->size);
+	return 0;
+}
+
+int store_packet(bus_copy_t *copy, const unsigned char *packet, int length) {
+	// data broadcast before this node's link was opened is not its business
+	if(copy->fd < 0 || length < BUS_DATA_HEADER_SIZE)
+		return 0;
+	uint32_t index = get_number(&packet[1], 4);
+	uint64_t offset = (uint64_t)index * copy->payload;
+	if(index >= copy->num_packets || (uint64_t)(length - BUS_DATA_HEADER_SIZE) != MIN(copy->payload, copy->size - offset)) {
+		printf("ERROR (store_packet): invalid packet %u\n", index);
+		return 1;
+	}
+	if(copy->have[index / 8] & (1 << (index % 8)))
+		return 0;
+	if(pwrite(copy->fd, &packet[BUS_DATA_HEADER_SIZE], length - BUS_DATA_HEADER_SIZE, offset) != length - BUS_DATA_HEADER_SIZE) {
+		perror(copy->path);
+		return 1;
+	}
+	copy->have[index / 8] |= 1 << (index % 8);
+	--copy->num_missing;
+	return 0;
+}
+
+int answer_poll(datalink_t *datalink, bus_copy_t *copy) {
+	if(copy->fd < 0) {
+		printf("ERROR (answer_poll): polled before the file was announced\n");
+		return 1;
+	}
+	if(copy->num_missing == 0 && !copy->verified) {
+		// every packet is in, the copy must match the master's file before the master moves on
+		file_source_t source;
+		checksum_t checksum;
+		checksum_init(&checksum);
+		if(file_source_open(&source, copy->path))
+			return 1;
+		int error = file_source_checksum(&source, copy->size, &checksum);
+		file_source_close(&source);
+		if(error)
+			return 1;
+		if(checksum_digest(&checksum) == copy->digest) {
+			copy->verified = 1;
+		} else {
+			printf("Checksum mismatch on %s, asking for all of it again.\n", copy->path);
+			memset(copy->have, 0, (copy->num_packets + 7) / 8);
+			copy->num_missing = copy->num_packets;
+		}
+	}
+
+	// as many ranges as fit, the rest is asked for on the next poll
+	unsigned char answer[1 + 8 * BUS_MAX_RANGES];
+	answer[0] = BUS_PACKET_MISSING;
+	unsigned length = 1;
+	uint32_t index = 0;
+	while(index < copy->num_packets && length < sizeof(answer) && copy->num_missing > 0) {
+		if(copy->have[index / 8] & (1 << (index % 8))) {
+			++index;
+			continue;
+		}
+		uint32_t first = index;
+		while(index < copy->num_packets && !(copy->have[index / 8] & (1 << (index % 8))))
+			++index;
+		put_number(&answer[length], first, 4);
+		put_number(&answer[length + 4], index - first, 4);
+		length += 8;
+	}
+	return llwrite(datalink, answer, length);
+}
+
+void close_copy(bus_copy_t *copy) {
+	if(copy->fd >= 0)
+		close(copy->fd);
+	free(copy->path);
+	free(copy->have);
+}
@@ -0,0 +1,40 @@
+#ifndef BUS_H
+#define BUS_H
+
+#include "datalink.h"
+#include "application.h"
+
+#define BUS_DATA_HEADER_SIZE 5	/* packet type and 4-byte index */
+#define BUS_CONTROL_SIZE 256	/* longest packet other than data */
+
+/*
+ * A secondary of a multi-drop bus, as the master sees it
+ */
+typedef struct {
+	unsigned node;			/* 1 to MAX_NODES, its address is A_NODE(node) */
+	datalink_t datalink;		/* shares the master's port with every other node */
+	int connected;
+	int done;			/* its copy checked out */
+	unsigned num_repaired;		/* packets it missed in the broadcast */
+} bus_node_t;
+
+/*
+ * Master of an RS-485 style bus: sends the file at path to several secondaries
+ * sharing settings->port. The file is announced to every node over its own
+ * link, broadcast once to all of them, and each node is then polled for the
+ * packets it missed, which are resent over its link until its copy checks out.
+ * If settings->datalink.transport is open, the bus runs over it instead and
+ * it is left open.
+ * Returns 0 if every node got the file, 1 otherwise
+ */
+int bus_distribute(const transfer_t *settings, const char *path, const unsigned nodes[], unsigned num_nodes);
+
+/*
+ * Secondary: waits for the master to open the link of node and receives the
+ * next distribution into destination_folder ("" for the current directory).
+ * The port stays configured afterwards if transfer->keep_port is set.
+ * Returns 0 if OK, 1 otherwise
+ */
+int bus_receive(transfer_t *transfer, unsigned node, const char *destination_folder);
+
+#endif
@@ -0,0 +1,66 @@
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "checkpoint.h"
+
+void checkpoint_path(const char *file_path, const char *suffix, char *path);
+
+void checkpoint_path(const char *file_path, const char *suffix, char *path) {
+	strcpy(path, file_path);
+	strcat(path, CHECKPOINT_SUFFIX);
+	strcat(path, suffix);
+}
+
+int checkpoint_load(const char *file_path, uint64_t size, checkpoint_t *checkpoint) {
+	char path[strlen(file_path) + sizeof(CHECKPOINT_SUFFIX)];
+	checkpoint_path(file_path, "", path);
+	FILE *fp = fopen(path, "r");
+	if(fp == NULL)
+		return 1;
+	int ret = fscanf(fp, "%" SCNu64 " %" SCNu64, &checkpoint->size, &checkpoint->offset);
+	if(ret == 2)
+		ret = checksum_load(&checkpoint->checksum, fp) ? -1 : 3;
+	fclose(fp);
+	if(ret != 3 || checkpoint->size != size || checkpoint->offset > size || checkpoint->checksum.total_length != checkpoint->offset)
+		return 1;
+
+	// the data itself must still be there
+	struct stat st;
+	if(stat(file_path, &st) < 0 || (uint64_t)st.st_size < checkpoint->offset)
+		return 1;
+	return 0;
+}
+
+int checkpoint_save(const char *file_path, const checkpoint_t *checkpoint) {
+	char path[strlen(file_path) + sizeof(CHECKPOINT_SUFFIX)];
+	char temp_path[strlen(file_path) + sizeof(CHECKPOINT_SUFFIX) + 4];
+	checkpoint_path(file_path, "", path);
+	checkpoint_path(file_path, ".tmp", temp_path);
+
+	FILE *fp = fopen(temp_path, "w");
+	if(fp == NULL) {
+		perror("Error creating checkpoint");
+		return 1;
+	}
+	fprintf(fp, "%" PRIu64 " %" PRIu64 "\n", checkpoint->size, checkpoint->offset);
+	checksum_save(&checkpoint->checksum, fp);
+	if(fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+		perror("Error writing checkpoint");
+		fclose(fp);
+		return 1;
+	}
+	fclose(fp);
+	if(rename(temp_path, path) < 0) {
+		perror("Error replacing checkpoint");
+		return 1;
+	}
+	return 0;
+}
+
+void checkpoint_remove(const char *file_path) {
+	char path[strlen(file_path) + sizeof(CHECKPOINT_SUFFIX)];
+	checkpoint_path(file_path, "", path);
+	unlink(path);
+}
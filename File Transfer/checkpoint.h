@@ -0,0 +1,33 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdint.h>
+#include "checksum.h"
+
+#define CHECKPOINT_SUFFIX ".resume"
+
+/*
+ * Sidecar file kept next to a partially received file, recording how many
+ * bytes from its start are known to be on disk and their running checksum
+ */
+typedef struct {
+	uint64_t size;		/* announced size of the whole file */
+	uint64_t offset;	/* bytes verified and synced to disk */
+	checksum_t checksum;	/* state after hashing those offset bytes */
+} checkpoint_t;
+
+/*
+ * Reads the checkpoint of file_path, which is only valid for a transfer of the same size
+ * Returns 0 if a usable checkpoint was found, 1 otherwise
+ */
+int checkpoint_load(const char *file_path, uint64_t size, checkpoint_t *checkpoint);
+
+/*
+ * Atomically replaces the checkpoint of file_path
+ * Returns 0 if OK, 1 otherwise
+ */
+int checkpoint_save(const char *file_path, const checkpoint_t *checkpoint);
+
+void checkpoint_remove(const char *file_path);
+
+#endif
@@ -0,0 +1,178 @@
+#include <string.h>
+#include <inttypes.h>
+#include "checksum.h"
+
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+#define PRIME4 0x85EBCA77C2B2AE63ULL
+#define PRIME5 0x27D4EB2F165667C5ULL
+#define SEED 0
+
+static inline uint64_t rotl(uint64_t x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const unsigned char *p) {
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap64(v);
+#endif
+	return v;
+}
+
+static inline uint32_t read32(const unsigned char *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap32(v);
+#endif
+	return v;
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t input) {
+	acc += input * PRIME2;
+	acc = rotl(acc, 31);
+	return acc * PRIME1;
+}
+
+static inline uint64_t merge_round(uint64_t acc, uint64_t lane) {
+	acc ^= round64(0, lane);
+	return acc * PRIME1 + PRIME4;
+}
+
+void checksum_init(checksum_t *checksum) {
+	checksum->total_length = 0;
+	checksum->lanes[0] = SEED + PRIME1 + PRIME2;
+	checksum->lanes[1] = SEED + PRIME2;
+	checksum->lanes[2] = SEED;
+	checksum->lanes[3] = SEED - PRIME1;
+	checksum->num_pending = 0;
+}
+
+void checksum_update(checksum_t *checksum, const unsigned char *data, uint64_t length) {
+	checksum->total_length += length;
+
+	if(checksum->num_pending + length < 32) {
+		memcpy(&checksum->pending[checksum->num_pending], data, length);
+		checksum->num_pending += length;
+		return;
+	}
+
+	uint64_t *lanes = checksum->lanes;
+	if(checksum->num_pending > 0) {
+		unsigned fill = 32 - checksum->num_pending;
+		memcpy(&checksum->pending[checksum->num_pending], data, fill);
+		lanes[0] = round64(lanes[0], read64(&checksum->pending[0]));
+		lanes[1] = round64(lanes[1], read64(&checksum->pending[8]));
+		lanes[2] = round64(lanes[2], read64(&checksum->pending[16]));
+		lanes[3] = round64(lanes[3], read64(&checksum->pending[24]));
+		data += fill;
+		length -= fill;
+		checksum->num_pending = 0;
+	}
+
+	// four independent lanes keep the multipliers busy
+	uint64_t v1 = lanes[0], v2 = lanes[1], v3 = lanes[2], v4 = lanes[3];
+	while(length >= 32) {
+		v1 = round64(v1, read64(data));
+		v2 = round64(v2, read64(data + 8));
+		v3 = round64(v3, read64(data + 16));
+		v4 = round64(v4, read64(data + 24));
+		data += 32;
+		length -= 32;
+	}
+	lanes[0] = v1;
+	lanes[1] = v2;
+	lanes[2] = v3;
+	lanes[3] = v4;
+
+	memcpy(checksum->pending, data, length);
+	checksum->num_pending = length;
+}
+
+uint64_t checksum_digest(const checksum_t *checksum) {
+	const uint64_t *lanes = checksum->lanes;
+	uint64_t h;
+	if(checksum->total_length >= 32) {
+		h = rotl(lanes[0], 1) + rotl(lanes[1], 7) + rotl(lanes[2], 12) + rotl(lanes[3], 18);
+		h = merge_round(h, lanes[0]);
+		h = merge_round(h, lanes[1]);
+		h = merge_round(h, lanes[2]);
+		h = merge_round(h, lanes[3]);
+	} else {
+		h = lanes[2] + PRIME5;
+	}
+	h += checksum->total_length;
+
+	const unsigned char *p = checksum->pending;
+	unsigned left = checksum->num_pending;
+	while(left >= 8) {
+		h ^= round64(0, read64(p));
+		h = rotl(h, 27) * PRIME1 + PRIME4;
+		p += 8;
+		left -= 8;
+	}
+	if(left >= 4) {
+		h ^= (uint64_t)read32(p) * PRIME1;
+		h = rotl(h, 23) * PRIME2 + PRIME3;
+		p += 4;
+		left -= 4;
+	}
+	while(left > 0) {
+		h ^= (*p) * PRIME5;
+		h = rotl(h, 11) * PRIME1;
+		++p;
+		--left;
+	}
+
+	h ^= h >> 33;
+	h *= PRIME2;
+	h ^= h >> 29;
+	h *= PRIME3;
+	h ^= h >> 32;
+	return h;
+}
+
+void checksum_update_zeros(checksum_t *checksum, uint64_t length) {
+	static const unsigned char zeros[4096];
+	while(length > 0) {
+		unsigned n = length < sizeof(zeros) ? length : sizeof(zeros);
+		checksum_update(checksum, zeros, n);
+		length -= n;
+	}
+}
+
+uint64_t checksum_buffer(const unsigned char *data, uint64_t length) {
+	checksum_t checksum;
+	checksum_init(&checksum);
+	checksum_update(&checksum, data, length);
+	return checksum_digest(&checksum);
+}
+
+void checksum_save(const checksum_t *checksum, FILE *fp) {
+	unsigned i;
+	fprintf(fp, "%" PRIx64, checksum->total_length);
+	for(i = 0; i < 4; ++i)
+		fprintf(fp, " %" PRIx64, checksum->lanes[i]);
+	fprintf(fp, " ");
+	for(i = 0; i < checksum->num_pending; ++i)
+		fprintf(fp, "%02x", checksum->pending[i]);
+	fprintf(fp, "\n");
+}
+
+int checksum_load(checksum_t *checksum, FILE *fp) {
+	if(fscanf(fp, "%" SCNx64 " %" SCNx64 " %" SCNx64 " %" SCNx64 " %" SCNx64, &checksum->total_length,
+			&checksum->lanes[0], &checksum->lanes[1], &checksum->lanes[2], &checksum->lanes[3]) != 5)
+		return 1;
+	checksum->num_pending = checksum->total_length % 32;
+	unsigned i;
+	for(i = 0; i < checksum->num_pending; ++i) {
+		unsigned byte;
+		if(fscanf(fp, "%2x", &byte) != 1)
+			return 1;
+		checksum->pending[i] = byte;
+	}
+	return 0;
+}
@@ -0,0 +1,39 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Streaming XXH64 of a whole file. The state can be saved and restored, so a
+ * resumed transfer does not need to hash the bytes it already has again.
+ */
+typedef struct {
+	uint64_t total_length;
+	uint64_t lanes[4];
+	unsigned char pending[32];
+	unsigned num_pending;
+} checksum_t;
+
+void checksum_init(checksum_t *checksum);
+void checksum_update(checksum_t *checksum, const unsigned char *data, uint64_t length);
+uint64_t checksum_digest(const checksum_t *checksum);
+
+/*
+ * Same as checksum_update over length zero bytes
+ */
+void checksum_update_zeros(checksum_t *checksum, uint64_t length);
+
+/*
+ * Digest of a single buffer
+ */
+uint64_t checksum_buffer(const unsigned char *data, uint64_t length);
+
+/*
+ * Writes or reads the state as one line of text
+ * checksum_load returns 0 if OK, 1 otherwise
+ */
+void checksum_save(const checksum_t *checksum, FILE *fp);
+int checksum_load(checksum_t *checksum, FILE *fp);
+
+#endif
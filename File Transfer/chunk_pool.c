@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "chunk_pool.h"
+
+#define MAX_THREADS 8
+
+void *chunk_pool_worker(void *arg);
+
+void *chunk_pool_worker(void *arg) {
+	chunk_pool_t *pool = arg;
+	pthread_mutex_lock(&pool->lock);
+	while(1) {
+		while(!pool->stopping && pool->started == pool->submitted)
+			pthread_cond_wait(&pool->queued, &pool->lock);
+		if(pool->started == pool->submitted)
+			break;
+		chunk_job_t *job = &pool->jobs[pool->started++ % pool->num_jobs];
+		pthread_mutex_unlock(&pool->lock);
+
+		job->status = pool->process(pool->context, job);
+
+		pthread_mutex_lock(&pool->lock);
+		job->state = JOB_DONE;
+		pthread_cond_broadcast(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+int chunk_pool_init(chunk_pool_t *pool, unsigned num_threads, unsigned num_jobs, unsigned input_capacity, unsigned output_capacity, chunk_pool_process_t process, void *context) {
+	pool->num_jobs = num_jobs;
+	pool->submitted = 0;
+	pool->started = 0;
+	pool->retired = 0;
+	pool->num_threads = 0;
+	pool->stopping = 0;
+	pool->process = process;
+	pool->context = context;
+	pool->jobs = calloc(num_jobs, sizeof(chunk_job_t));
+	pool->threads = malloc(num_threads * sizeof(pthread_t));
+	if(pool->jobs == NULL || pool->threads == NULL) {
+		printf("ERROR (chunk_pool_init): unable to allocate memory\n");
+		free(pool->jobs);
+		free(pool->threads);
+		return 1;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->queued, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	unsigned i;
+	for(i = 0; i < num_jobs; ++i) {
+		chunk_job_t *job = &pool->jobs[i];
+		job->state = JOB_FREE;
+		job->input_buffer = input_capacity ? malloc(input_capacity) : NULL;
+		job->output_buffer = malloc(output_capacity);
+		if((input_capacity && job->input_buffer == NULL) || job->output_buffer == NULL) {
+			printf("ERROR (chunk_pool_init): unable to allocate job buffers\n");
+			chunk_pool_destroy(pool);
+			return 1;
+		}
+	}
+	for(i = 0; i < num_threads; ++i) {
+		if(pthread_create(&pool->threads[i], NULL, chunk_pool_worker, pool)) {
+			printf("ERROR (chunk_pool_init): unable to start worker thread\n");
+			chunk_pool_destroy(pool);
+			return 1;
+		}
+		++pool->num_threads;
+	}
+	return 0;
+}
+
+void chunk_pool_destroy(chunk_pool_t *pool) {
+	pthread_mutex_lock(&pool->lock);
+	pool->stopping = 1;
+	pthread_cond_broadcast(&pool->queued);
+	pthread_mutex_unlock(&pool->lock);
+	unsigned i;
+	for(i = 0; i < pool->num_threads; ++i)
+		pthread_join(pool->threads[i], NULL);
+	for(i = 0; i < pool->num_jobs; ++i) {
+		free(pool->jobs[i].input_buffer);
+		free(pool->jobs[i].output_buffer);
+	}
+	free(pool->jobs);
+	free(pool->threads);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->queued);
+	pthread_cond_destroy(&pool->done);
+}
+
+chunk_job_t *chunk_pool_acquire(chunk_pool_t *pool) {
+	pthread_mutex_lock(&pool->lock);
+	chunk_job_t *job = NULL;
+	if(pool->submitted - pool->retired < pool->num_jobs)
+		job = &pool->jobs[pool->submitted % pool->num_jobs];
+	pthread_mutex_unlock(&pool->lock);
+	return job;
+}
+
+void chunk_pool_submit(chunk_pool_t *pool) {
+	pthread_mutex_lock(&pool->lock);
+	pool->jobs[pool->submitted++ % pool->num_jobs].state = JOB_QUEUED;
+	pthread_cond_signal(&pool->queued);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+chunk_job_t *chunk_pool_oldest(chunk_pool_t *pool) {
+	pthread_mutex_lock(&pool->lock);
+	chunk_job_t *job = NULL;
+	if(pool->retired < pool->submitted) {
+		job = &pool->jobs[pool->retired % pool->num_jobs];
+		while(job->state != JOB_DONE)
+			pthread_cond_wait(&pool->done, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return job;
+}
+
+void chunk_pool_retire(chunk_pool_t *pool) {
+	pthread_mutex_lock(&pool->lock);
+	pool->jobs[pool->retired++ % pool->num_jobs].state = JOB_FREE;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+unsigned chunk_pool_default_threads() {
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if(cpus < 1)
+		return 1;
+	return cpus > MAX_THREADS ? MAX_THREADS : cpus;
+}
@@ -0,0 +1,82 @@
+#ifndef CHUNK_POOL_H
+#define CHUNK_POOL_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+typedef enum {
+	JOB_FREE,
+	JOB_QUEUED,
+	JOB_DONE
+} chunk_job_state_t;
+
+/*
+ * One chunk of work. Input either points at the caller's data or at the
+ * job's own input_buffer; process leaves its result in output_buffer or
+ * points result straight at the input when there was nothing to do.
+ */
+typedef struct {
+	chunk_job_state_t state;
+	uint64_t index;
+	const unsigned char *input;
+	unsigned input_length;
+	unsigned char *input_buffer;	/* NULL unless the pool was given an input capacity */
+	unsigned char *output_buffer;
+	const unsigned char *result;
+	unsigned result_length;
+	int status;			/* what process returned, 0 if OK */
+} chunk_job_t;
+
+typedef int (*chunk_pool_process_t)(void *context, chunk_job_t *job);
+
+/*
+ * Worker threads processing jobs in parallel, completing in any order,
+ * while the single thread that submits them retires them in order
+ */
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t queued;
+	pthread_cond_t done;
+	chunk_job_t *jobs;
+	unsigned num_jobs;
+	uint64_t submitted;
+	uint64_t started;
+	uint64_t retired;
+	pthread_t *threads;
+	unsigned num_threads;
+	int stopping;
+	chunk_pool_process_t process;
+	void *context;
+} chunk_pool_t;
+
+/*
+ * Starts num_threads workers sharing num_jobs jobs
+ * Returns 0 if OK, 1 otherwise
+ */
+int chunk_pool_init(chunk_pool_t *pool, unsigned num_threads, unsigned num_jobs, unsigned input_capacity, unsigned output_capacity, chunk_pool_process_t process, void *context);
+
+/*
+ * Finishes the queued jobs and stops the workers
+ */
+void chunk_pool_destroy(chunk_pool_t *pool);
+
+/*
+ * Returns the job to fill for the next submission, NULL if all jobs are in flight
+ * (the oldest one has to be retired first)
+ */
+chunk_job_t *chunk_pool_acquire(chunk_pool_t *pool);
+void chunk_pool_submit(chunk_pool_t *pool);
+
+/*
+ * Waits for the oldest job in flight to be processed
+ * Returns it, or NULL if none is in flight
+ */
+chunk_job_t *chunk_pool_oldest(chunk_pool_t *pool);
+void chunk_pool_retire(chunk_pool_t *pool);
+
+/*
+ * Number of workers worth starting on this machine
+ */
+unsigned chunk_pool_default_threads();
+
+#endif
@@ -0,0 +1,212 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "datalink.h"
+#include "frame_validator.h"
+#include "frame_parser.h"
+
+/*
+ * Microbenchmarks for the data link kernels, no serial port involved.
+ * Throughput is measured on the kernel's input (stuffed bytes for destuffing
+ * and the parser). Output is one line per case with fixed columns, so that
+ * runs from different commits can be diffed or joined directly.
+ */
+
+#define DEFAULT_BYTES_PER_CASE (32 << 20)
+#define NUM_FRAMES_PER_STREAM 64
+
+typedef enum {
+	CORPUS_RANDOM,
+	CORPUS_FLAGS,
+	CORPUS_TEXT,
+	CORPUS_ZEROS
+} corpus_t;
+
+typedef struct {
+	const char *name;
+	unsigned long long (*run)(const unsigned char *data, unsigned length, unsigned long iterations);
+} kernel_t;
+
+const char *corpus_names[] = {"random", "all-0x7E", "text", "zeros"};
+const unsigned frame_sizes[] = {16, 100, 1024, 16384};
+
+volatile unsigned long long sink;	// keeps results alive
+
+unsigned long long bench_stuffing(const unsigned char *data, unsigned length, unsigned long iterations);
+unsigned long long bench_destuffing(const unsigned char *data, unsigned length, unsigned long iterations);
+unsigned long long bench_bcc2(const unsigned char *data, unsigned length, unsigned long iterations);
+unsigned long long bench_parser(const unsigned char *data, unsigned length, unsigned long iterations);
+
+const kernel_t kernels[] = {
+	{"byte_stuffing", bench_stuffing},
+	{"byte_destuffing", bench_destuffing},
+	{"check_bcc2", bench_bcc2},
+	{"frame_parser", bench_parser}
+};
+
+static inline uint64_t read_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	return 0;
+#endif
+}
+
+double now_seconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void fill_corpus(corpus_t corpus, unsigned char *data, unsigned length) {
+	const char *text = "The quick brown fox jumps over the lazy dog. 0123456789\n";
+	unsigned i;
+	srand(42);	// same corpus on every run
+	for(i = 0; i < length; ++i) {
+		switch(corpus) {
+		case CORPUS_RANDOM:
+			data[i] = rand() & 0xFF;
+			break;
+		case CORPUS_FLAGS:
+			data[i] = FLAG;
+			break;
+		case CORPUS_TEXT:
+			data[i] = text[i % strlen(text)];
+			break;
+		case CORPUS_ZEROS:
+			data[i] = 0;
+			break;
+		}
+	}
+}
+
+unsigned long long bench_stuffing(const unsigned char *data, unsigned length, unsigned long iterations) {
+	unsigned char *dst = malloc(2 * length);
+	unsigned long long total = 0;
+	unsigned long i;
+	for(i = 0; i < iterations; ++i)
+		total += byte_stuffing(data, length, dst);
+	sink += total + dst[0];
+	free(dst);
+	return (unsigned long long)length * iterations;
+}
+
+unsigned long long bench_destuffing(const unsigned char *data, unsigned length, unsigned long iterations) {
+	unsigned char *stuffed = malloc(2 * length);
+	unsigned char *dst = malloc(2 * length);
+	unsigned stuffed_length = byte_stuffing(data, length, stuffed);
+	unsigned long long total = 0;
+	unsigned long i;
+	for(i = 0; i < iterations; ++i)
+		total += byte_destuffing(stuffed, stuffed_length, dst);
+	sink += total + dst[0];
+	free(stuffed);
+	free(dst);
+	return (unsigned long long)stuffed_length * iterations;
+}
+
+unsigned long long bench_bcc2(const unsigned char *data, unsigned length, unsigned long iterations) {
+	frame_t frame;
+	frame.buffer = (unsigned char *)data;
+	frame.length = length;
+	frame.bcc2 = 0;
+	unsigned long long total = 0;
+	unsigned long i;
+	for(i = 0; i < iterations; ++i)
+		total += check_bcc2(&frame);
+	sink += total;
+	return (unsigned long long)length * iterations;
+}
+
+int count_frame(void *context, const frame_t *frame) {
+	*(unsigned long long *)context += frame->length;
+	return 0;
+}
+
+unsigned long long bench_parser(const unsigned char *data, unsigned length, unsigned long iterations) {
+	// a stream of back-to-back data frames, fed the way get_frame feeds it
+	unsigned frame_length = 4 + LLPREPARE_MAX_LENGTH(length);
+	unsigned char *stream = malloc(NUM_FRAMES_PER_STREAM * frame_length);
+	unsigned stream_length = 0;
+	unsigned i;
+	for(i = 0; i < NUM_FRAMES_PER_STREAM; ++i) {
+		unsigned char ctrl = C_DATA(i % 2);
+		stream[stream_length++] = FLAG;
+		stream[stream_length++] = A_TRANSMITTER;
+		stream[stream_length++] = ctrl;
+		stream[stream_length++] = A_TRANSMITTER ^ ctrl;
+		stream_length += llprepare(data, length, &stream[stream_length]);
+	}
+
+	unsigned long long payload = 0;
+	frame_parser_t parser;
+	if(frame_parser_init(&parser, length, count_frame, NULL, &payload)) {
+		free(stream);
+		return 0;
+	}
+
+	unsigned long passes = (iterations + NUM_FRAMES_PER_STREAM - 1) / NUM_FRAMES_PER_STREAM;
+	unsigned long long total = 0;
+	unsigned long pass;
+	for(pass = 0; pass < passes; ++pass) {
+		unsigned offset;
+		for(offset = 0; offset < stream_length; offset += MAX_BUFFER_LENGTH) {
+			unsigned chunk = stream_length - offset < MAX_BUFFER_LENGTH ? stream_length - offset : MAX_BUFFER_LENGTH;
+			frame_parser_feed(&parser, &stream[offset], chunk);
+		}
+		total += stream_length;
+	}
+	sink += payload;
+	if(payload != (unsigned long long)length * NUM_FRAMES_PER_STREAM * passes)
+		printf("WARNING (bench_parser): parsed %llu payload bytes, expected %llu\n", payload, (unsigned long long)length * NUM_FRAMES_PER_STREAM * passes);
+	frame_parser_destroy(&parser);
+	free(stream);
+	return total;
+}
+
+int main(int argc, char *argv[]) // ./codec_bench [megabytes per case]
+{
+	unsigned long bytes_per_case = DEFAULT_BYTES_PER_CASE;
+	if(argc > 1)
+		bytes_per_case = strtoul(argv[1], NULL, 10) << 20;
+	if(bytes_per_case == 0) {
+		printf("Usage: %s [megabytes per case]\n", argv[0]);
+		return 1;
+	}
+
+	unsigned max_size = frame_sizes[sizeof(frame_sizes) / sizeof(frame_sizes[0]) - 1];
+	unsigned char *data = malloc(max_size);
+	if(data == NULL) {
+		printf("ERROR (main): unable to allocate %d bytes of memory\n", max_size);
+		return 1;
+	}
+
+	printf("%-16s %-10s %6s %12s %10s\n", "kernel", "corpus", "size", "MB/s", "cycles/B");
+	unsigned k, c, s;
+	for(k = 0; k < sizeof(kernels) / sizeof(kernels[0]); ++k) {
+		for(c = 0; c < sizeof(corpus_names) / sizeof(corpus_names[0]); ++c) {
+			for(s = 0; s < sizeof(frame_sizes) / sizeof(frame_sizes[0]); ++s) {
+				unsigned size = frame_sizes[s];
+				fill_corpus(c, data, size);
+				unsigned long iterations = bytes_per_case / size;
+				if(iterations == 0)
+					iterations = 1;
+
+				kernels[k].run(data, size, iterations / 16 + 1);	// warm up
+				double start = now_seconds();
+				uint64_t start_cycles = read_cycles();
+				unsigned long long bytes = kernels[k].run(data, size, iterations);
+				uint64_t cycles = read_cycles() - start_cycles;
+				double elapsed = now_seconds() - start;
+
+				printf("%-16s %-10s %6u %12.1f %10.3f\n", kernels[k].name, corpus_names[c], size,
+						bytes / elapsed / 1e6, bytes ? (double)cycles / bytes : 0.0);
+			}
+		}
+	}
+
+	free(data);
+	return 0;
+}
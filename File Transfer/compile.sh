@@ -1 +1,5 @@
-gcc -Wall serial.c datalink.c application.c -lm frame_validator.c -o file_transfer
+gcc -Wall -D_FILE_OFFSET_BITS=64 -c serial.c transport.c datalink.c application.c frame_validator.c frame_parser.c spsc_queue.c perf_counters.c file_source.c file_sink.c checkpoint.c checksum.c manifest.c delta.c dedup.c block_cache.c compression.c chunk_pool.c progress.c server.c bus.c sim.c
+ar rcs libfiletransfer.a serial.o transport.o datalink.o application.o frame_validator.o frame_parser.o spsc_queue.o perf_counters.o file_source.o file_sink.o checkpoint.o checksum.o manifest.o delta.o dedup.o block_cache.o compression.o chunk_pool.o progress.o server.o bus.o sim.o
+gcc -Wall -D_FILE_OFFSET_BITS=64 main.c libfiletransfer.a -lm -lz -pthread -o file_transfer
+gcc -Wall -O2 codec_bench.c transport.c datalink.c frame_validator.c frame_parser.c perf_counters.c serial.c -lm -pthread -o codec_bench
+gcc -Wall -O2 -DBCC1_ERR_PROB=0 -DBCC2_ERR_PROB=0 link_sim.c sim.c transport.c datalink.c frame_validator.c frame_parser.c perf_counters.c serial.c -lm -pthread -o link_sim
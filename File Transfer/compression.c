@@ -0,0 +1,53 @@
+#include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+#include "compression.h"
+
+const char *codec_names[NUM_CODECS] = {"none", "deflate"};
+
+const char *codec_name(codec_t codec) {
+	return codec_names[codec];
+}
+
+unsigned compression_bound(codec_t codec, unsigned length) {
+	switch(codec) {
+	case CODEC_DEFLATE:
+		return compressBound(length);
+	default:
+		return length;
+	}
+}
+
+unsigned compress_chunk(codec_t codec, int level, const unsigned char *input, unsigned length, unsigned char *output) {
+	switch(codec) {
+	case CODEC_DEFLATE: {
+		uLongf output_length = compressBound(length);
+		if(compress2(output, &output_length, input, length, level) != Z_OK) {
+			printf("ERROR (compress_chunk): deflate failed\n");
+			return 0;
+		}
+		return output_length;
+	}
+	default:
+		memcpy(output, input, length);
+		return length;
+	}
+}
+
+int decompress_chunk(codec_t codec, const unsigned char *input, unsigned length, unsigned char *output, unsigned raw_length) {
+	switch(codec) {
+	case CODEC_DEFLATE: {
+		uLongf output_length = raw_length;
+		if(uncompress(output, &output_length, input, length) != Z_OK || output_length != raw_length) {
+			printf("ERROR (decompress_chunk): corrupted deflate chunk\n");
+			return 1;
+		}
+		return 0;
+	}
+	default:
+		if(length != raw_length)
+			return 1;
+		memcpy(output, input, length);
+		return 0;
+	}
+}
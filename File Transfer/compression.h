@@ -0,0 +1,32 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#define COMPRESSION_CHUNK_SIZE (256 << 10)	/* every chunk of the file is compressed on its own */
+#define DEFAULT_COMPRESSION_LEVEL 1
+
+typedef enum {
+	CODEC_NONE,
+	CODEC_DEFLATE,
+	NUM_CODECS
+} codec_t;
+
+const char *codec_name(codec_t codec);
+
+/*
+ * Largest output of compress_chunk for length bytes of input
+ */
+unsigned compression_bound(codec_t codec, unsigned length);
+
+/*
+ * Compresses length bytes into output, which holds compression_bound bytes
+ * Returns the compressed length, 0 on error
+ */
+unsigned compress_chunk(codec_t codec, int level, const unsigned char *input, unsigned length, unsigned char *output);
+
+/*
+ * Decompresses a chunk that must expand to exactly raw_length bytes
+ * Returns 0 if OK, 1 otherwise
+ */
+int decompress_chunk(codec_t codec, const unsigned char *input, unsigned length, unsigned char *output, unsigned raw_length);
+
+#endif
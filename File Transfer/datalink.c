@@ -2,145 +2,167 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
-#include <signal.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <math.h>
+#include <time.h>
 #include "datalink.h"
-#include "serial.h"
 #include "frame_validator.h"
+#include "frame_parser.h"
+#include "perf_counters.h"
+#include "serial.h"
 
 #define INDUCE_ERROR 1
+// the simulator builds without induced errors, its channel makes its own
+#ifndef BCC1_ERR_PROB
 #define BCC1_ERR_PROB 10
+#endif
+#ifndef BCC2_ERR_PROB
 #define BCC2_ERR_PROB 10
-
-typedef struct {
-	datalink_t *datalink;
-	unsigned int tries_left;
-	unsigned int time_dif;
-	frame_t *frame;
-	unsigned int stop;
-} alarm_info_t;
+#endif
 
 int send_cmd_frame(datalink_t *datalink, const frame_t *frame);
 int send_data_frame(datalink_t *datalink, const frame_t *frame);
-int byte_stuffing(const unsigned char *src, unsigned length, unsigned char **dst, unsigned *new_length);
-int byte_destuffing(const unsigned char *src, unsigned length, unsigned char **dst, unsigned *new_length);
+int store_parsed_frame(void *context, const frame_t *frame);
 int get_frame(datalink_t *datalink, frame_t *frame);
-int byte_stuffing(const unsigned char *src, unsigned length, unsigned char **dst, unsigned *new_length);
-int write_timed_frame();
-void alarm_handler();
+int timer_start(datalink_t *datalink, const frame_t *frame, unsigned tries, unsigned interval_ms);
+void timer_arm(datalink_t *datalink, unsigned interval_ms);
+void timer_stop(datalink_t *datalink);
+int timer_resend(datalink_t *datalink);
+int timer_expired(datalink_t *datalink);
+int timer_wait_ms(const datalink_t *datalink);
 int send_frame(datalink_t *datalink, const frame_t *frame);
 void show_stats(datalink_t *datalink);
 int llopen_transmitter(datalink_t *datalink);
 int llopen_receiver(datalink_t *datalink);
 int llclose_transmitter(datalink_t *datalink);
 int llclose_receiver(datalink_t *datalink);
-unsigned acknowledge_frame(datalink_t *datalink);
 void inc_sequence_number(unsigned int *seq_num);
 int check_frame_order(datalink_t *datalink, frame_t *frame);
 int send_REJ(datalink_t *datalink);
 int send_RR(datalink_t *datalink);
 int send_UA(datalink_t *datalink);
+int llprobe(datalink_t *datalink);
+int probe_round_trip(datalink_t *datalink, const unsigned char *payload, unsigned length, unsigned char *stuffed, double *rtt);
+int echo_probe(datalink_t *datalink, const frame_t *probe);
 int probability(int value);
-
-alarm_info_t alrm_info;
-void alarm_handler() {
-	//printf("Alarm handler started.\n");
-	if(alrm_info.stop) {
-		alrm_info.tries_left = 0;
-		return;
+int write_information(datalink_t *datalink, const unsigned char *buffer, unsigned length, int batch);
+int check_batch(const unsigned char *batch, unsigned length);
+int next_batch_packet(datalink_t *datalink, char *buffer);
+void free_batches(datalink_t *datalink);
+
+int timer_start(datalink_t *datalink, const frame_t *frame, unsigned tries, unsigned interval_ms) {
+	if(frame == NULL || tries == 0 || interval_ms == 0) {
+		printf("ERROR (timer_start): invalid timer parameters.\n");
+		return 1;
 	}
-
-	if(alrm_info.datalink != NULL)
-		++alrm_info.datalink->num_timeouts;
-
-	if(alrm_info.frame == NULL) {
-		if(alrm_info.tries_left > 0)
-			--alrm_info.tries_left;
-		else {
-			/*printf("ERROR: Connection timed out\n");
-			if(kill(getpid(), SIGINT) != 0) {	// to return from blocking read in get_frame
-				printf("ERROR (alarm_handler): unable to send SIGINT signal.\n");
-				return;
-			}*/
-			return;
-		}
-		return;
+	if(send_frame(datalink, frame)) {
+		printf("ERROR (timer_start): send_frame failed.\n");
+		return 1;
 	}
+	timer_arm(datalink, interval_ms);
+	datalink->timer.frame = frame;
+	datalink->timer.tries_left = tries;
+	return 0;
+}
 
-	if(alrm_info.tries_left > 0) {
-		alrm_info.tries_left--;
-		if(send_frame(alrm_info.datalink, alrm_info.frame)) {
-			printf("ERROR (alarm_handler): unable to send requested frame\n");
-			return;
-		}
-		alarm(alrm_info.time_dif);
-	} else {
-		alrm_info.stop = 2;
-		/*printf("ERROR: Connection timed out\n");
-		if(kill(getpid(), SIGINT) != 0) {	// to return from blocking read in get_frame
-			printf("ERROR (alarm_handler): unable to send SIGINT signal.\n");
-			return;
-		}*/
-		return;
-	}
+void timer_arm(datalink_t *datalink, unsigned interval_ms) {
+	link_timer_t *timer = &datalink->timer;
+	timer->frame = NULL;
+	timer->tries_left = 0;
+	timer->interval_ms = interval_ms;
+	timer->deadline = interval_ms ? transport_now(&datalink->transport) + interval_ms / 1000.0 : 0;
 }
 
-int write_timed_frame() {
+void timer_stop(datalink_t *datalink) {
+	timer_arm(datalink, 0);
+}
 
-	if(alrm_info.frame == NULL || alrm_info.tries_left == 0 || alrm_info.time_dif == 0) {
-		printf("ERROR (write_timed_frame): invalid alarm info parameters.\n");
+int timer_resend(datalink_t *datalink) {
+	link_timer_t *timer = &datalink->timer;
+	if(timer->frame == NULL || timer->tries_left == 0)
 		return 1;
-	}
-
-	struct sigaction sa;
-	sigaction(SIGALRM, NULL, &sa);
-	sa.sa_handler = alarm_handler;
-	sigaction(SIGALRM, &sa, NULL);
+	--timer->tries_left;
+	if(send_frame(datalink, timer->frame))
+		printf("ERROR (timer_resend): unable to send requested frame\n");
+	// the next timeout counts from this copy
+	timer->deadline = transport_now(&datalink->transport) + timer->interval_ms / 1000.0;
+	return 0;
+}
 
-	//signal(SIGALRM, alarm_handler);
-	if(send_frame(alrm_info.datalink, alrm_info.frame)) {
-		printf("ERROR (write_timed_frame): send_frame failed.\n");
+int timer_expired(datalink_t *datalink) {
+	link_timer_t *timer = &datalink->timer;
+	if(timer->frame == NULL) {
+		timer->deadline = 0;
+		return 1;
+	}
+	++datalink->num_timeouts;
+	if(timer_resend(datalink)) {
+		timer_stop(datalink);
 		return 1;
 	}
-	alarm(alrm_info.time_dif);
-
 	return 0;
 }
 
-int read_byte(int fd, unsigned char *c)
-{
-	int res = read(fd,c,1);
-	/*if(res >= 1) {
-		printf("Read 0x%X", + *c);
-	}*/
-	return res;
+int timer_wait_ms(const datalink_t *datalink) {
+	if(datalink->timer.deadline == 0)
+		return -1;
+	double left = datalink->timer.deadline - transport_now(&datalink->transport);
+	return left > 0 ? (int)ceil(left * 1000) : 0;
 }
 
 void datalink_init(datalink_t *datalink, unsigned int mode) {
 	datalink->mode = mode;
-	datalink->curr_seq_number = 0;
+	datalink->tx_seq_number = 0;
+	datalink->rx_seq_number = 0;
 	datalink->repeat = 0;
 	datalink->frame_order = FIRST;
-	datalink->fd = -1;
+	transport_init(&datalink->transport);
 
 	datalink->num_sent_data_frames = 0;
 	datalink->num_received_data_frames = 0;
 	datalink->num_timeouts = 0;
 	datalink->num_sent_REJs = 0;
 	datalink->num_received_REJs = 0;
+	datalink->num_sent_batches = 0;
 	datalink->baudrate = 0;
 	datalink->max_retransmissions = DEFAULT_RETRANSMISSIONS;
 	datalink->timeout = DEFAULT_TIMEOUT;
+	datalink->max_frame_length = DEFAULT_MAX_FRAME_LENGTH;
+	datalink->probe = 0;
+	memset(&datalink->probe_results, 0, sizeof(datalink->probe_results));
+	datalink->keep_port = 0;
+	datalink->listen = 0;
+	datalink->address = A_TRANSMITTER;
+	datalink->parser = NULL;
+	timer_stop(datalink);
+	datalink->max_batch_length = 0;
+	datalink->tx_batch = NULL;
+	datalink->tx_batch_length = 0;
+	datalink->tx_batch_packets = 0;
+	datalink->rx_batch = NULL;
+	datalink->rx_batch_length = 0;
+	datalink->rx_batch_next = 0;
+	datalink->rx_start = 0;
+	datalink->rx_end = 0;
 }
 
 int llopen(const char *filename, datalink_t *datalink) {
-	int vtime = 0;
-	int vmin = 1;
-	int serial_fd = serial_initialize(filename, vmin, vtime, datalink->baudrate);
-	if (serial_fd < 0) {
-		printf("ERROR (llopen): serial_initialize failed.\n");
+	if ((datalink->parser = malloc(sizeof(frame_parser_t))) == NULL) {
+		printf("ERROR (llopen): unable to allocate frame parser.\n");
+		return 1;
+	}
+	if (frame_parser_init(datalink->parser, datalink->max_frame_length, store_parsed_frame, NULL, NULL)) {
+		free(datalink->parser);
+		datalink->parser = NULL;
+		return 1;
+	}
+	datalink->parser->multidrop = (datalink->address != A_TRANSMITTER);
+
+	if (datalink->transport.ops == NULL && transport_open(&datalink->transport, filename, datalink->baudrate)) {
+		printf("ERROR (llopen): unable to open %s.\n", filename);
 		return 1;
 	}
-	datalink->fd = serial_fd;
 
 	switch(datalink->mode) {
 	case SENDER:
@@ -148,6 +170,9 @@ int llopen(const char *filename, datalink_t *datalink) {
 			printf("ERROR (llopen): llopen_transmitter failed\n");
 			return 1;
 		}
+		if(datalink->probe && llprobe(datalink)) {
+			printf("ERROR (llopen): link probe failed, keeping configured parameters\n");
+		}
 		break;
 	case RECEIVER:
 		if(llopen_receiver(datalink)) {
@@ -166,6 +191,8 @@ int llopen(const char *filename, datalink_t *datalink) {
 int llclose(datalink_t *datalink) {
 	switch(datalink->mode) {
 	case SENDER:
+		if(llflush(datalink))
+			printf("ERROR (llclose): unable to send the queued packets\n");
 		if(llclose_transmitter(datalink)) {
 			printf("ERROR (llclose): llclose_transmitter failed\n");
 			//return 1;
@@ -183,8 +210,35 @@ int llclose(datalink_t *datalink) {
 	}
 
 	show_stats(datalink);
+	free_batches(datalink);
+
+	if (datalink->parser != NULL) {
+		frame_parser_destroy(datalink->parser);
+		free(datalink->parser);
+		datalink->parser = NULL;
+	}
 
-	return serial_terminate(datalink->fd);
+	if (datalink->keep_port)
+		return 0;
+	return transport_close(&datalink->transport);
+}
+
+void llabort(datalink_t *datalink) {
+	timer_stop(datalink);
+	free_batches(datalink);
+	if (datalink->parser != NULL) {
+		frame_parser_destroy(datalink->parser);
+		free(datalink->parser);
+		datalink->parser = NULL;
+	}
+	if (datalink->transport.ops == NULL)
+		return;
+	if (datalink->keep_port) {
+		// whatever the failed link left in flight must not reach the next one
+		transport_discard(&datalink->transport);
+		return;
+	}
+	transport_close(&datalink->transport);
 }
 
 void show_stats(datalink_t *datalink)
@@ -195,6 +249,20 @@ void show_stats(datalink_t *datalink)
 	printf("Number of received data frames: %d\n", datalink->num_received_data_frames);
 	printf("Number of timeouts: %d\n", datalink->num_timeouts);
 	printf("Number of received REJs: %d\n", datalink->num_received_REJs);
+	if (datalink->num_sent_batches > 0)
+		printf("Number of sent batches: %d\n", datalink->num_sent_batches);
+	if (datalink->parser != NULL) {
+		printf("Number of rejected frame headers: %d\n", datalink->parser->num_bad_headers);
+		printf("Number of bad escapes: %d\n", datalink->parser->num_bad_escapes);
+		printf("Number of oversized frames: %d\n", datalink->parser->num_oversized_frames);
+	}
+	if (datalink->probe_results.frame_length > 0) {
+		link_probe_t *probe = &datalink->probe_results;
+		printf("Probe: %u/%u echoes, RTT min %.2f ms avg %.2f ms, %.0f bytes/s, best frame %u bytes\n",
+				probe->num_sent - probe->num_lost, probe->num_sent, probe->min_rtt * 1000, probe->avg_rtt * 1000,
+				probe->byte_rate, probe->frame_length);
+	}
+	perf_counters_show();
 	printf("----------------------------------\n");
 	printf("\n");
 }
@@ -204,56 +272,31 @@ int llopen_transmitter(datalink_t *datalink) {
 	frame.sequence_number = 0;
 	frame.control_field = C_SET;
 	frame.type = CMD_FRAME;
-	frame.address_field = A_TRANSMITTER;
-
-	alrm_info.datalink = datalink;
-	alrm_info.tries_left = datalink->max_retransmissions;
-	alrm_info.time_dif = datalink->timeout;
-	alrm_info.frame = &frame;
-	alrm_info.stop = 0;
+	frame.address_field = datalink->address;
 
-	write_timed_frame();
-	while(alrm_info.tries_left > 0) {
-		frame_t answer;
-		int ret = get_frame(datalink, &answer);
-		if(ret == READ_ERROR) {
-			printf("ERROR (llopen_transmitter): get_frame failed\n");
-			return 1;
-		} else if(ret == READ_RETURN_ALARM) {
-			continue;
-		}
-
-		if(alrm_info.stop == 2) {
-			printf("ERROR (llopen_transmitter): transmission failed (number of attempts to get UA exceeded)\n");
-			return 1;
-		}
-		if(invalid_frame(&answer) || answer.control_field != C_UA) {
-			printf("ERROR (llopen_transmitter): received invalid frame. Expected valid UA command frame\n");
-			return 1;
-		}
-		alrm_info.stop = 1;
-		alrm_info.tries_left = 0;
-		alrm_info.frame = NULL;
-	}
-
-	if(alrm_info.frame != NULL) {
+	if(timer_start(datalink, &frame, datalink->max_retransmissions, datalink->timeout * 1000))
+		return 1;
+	frame_t answer;
+	int ret = get_frame(datalink, &answer);
+	timer_stop(datalink);
+	if(ret == READ_ERROR) {
+		printf("ERROR (llopen_transmitter): get_frame failed\n");
+		return 1;
+	} else if(ret == READ_RETURN_ALARM) {
 		printf("ERROR: Connection timed out.\n");
 		return 1;
 	}
+	if(invalid_frame(&answer) || answer.control_field != C_UA) {
+		printf("ERROR (llopen_transmitter): received invalid frame. Expected valid UA command frame\n");
+		return 1;
+	}
 
 	return 0;
 }
 
 int llopen_receiver(datalink_t *datalink) {
 
-	alrm_info.frame = NULL;
-	alrm_info.tries_left = 0;
-	alrm_info.stop = 0;
-	struct sigaction sa;
-	sigaction(SIGALRM, NULL, &sa);
-	sa.sa_handler = alarm_handler;
-	sigaction(SIGALRM, &sa, NULL);
-	alarm(datalink->timeout);
+	timer_arm(datalink, datalink->listen ? 0 : datalink->timeout * 1000);
 
 	int attempts = datalink->max_retransmissions;
 
@@ -269,6 +312,9 @@ int llopen_receiver(datalink_t *datalink) {
 		}
 
 		if(invalid_frame(&frame) || frame.control_field != C_SET) {
+			// a listening receiver skips the leftovers of the previous link
+			if(datalink->listen)
+				continue;
 			printf("ERROR (llopen_receiver): received invalid frame. Expected valid SET command frame\n");
 			//return 1;
 		} else {
@@ -276,6 +322,7 @@ int llopen_receiver(datalink_t *datalink) {
 		}
 		--attempts;
 	}
+	timer_stop(datalink);
 	if(attempts <= 0) {
 		printf("ERROR (llopen_receiver): transmission failed (number of attempts to receiver SET exceeded\n");
 		return 1;
@@ -285,14 +332,13 @@ int llopen_receiver(datalink_t *datalink) {
 	answer.sequence_number = 0;
 	answer.control_field = C_UA;
 	answer.type = CMD_FRAME;
-	answer.address_field = A_TRANSMITTER;
+	answer.address_field = datalink->address;
 
 	if(send_frame(datalink, &answer)) {
 		printf("ERROR (llopen_receiver): unable to answer sender's SET.\n");
 		return 1;
 	}
 
-	alrm_info.stop = 1;
 	return 0;
 }
 
@@ -301,42 +347,30 @@ int llclose_transmitter(datalink_t *datalink) {
 	frame.sequence_number = 0;
 	frame.control_field = C_DISC;
 	frame.type = CMD_FRAME;
-	frame.address_field = A_TRANSMITTER;
+	frame.address_field = datalink->address;
 
-	alrm_info.datalink = datalink;
-	alrm_info.tries_left = datalink->max_retransmissions;
-	alrm_info.time_dif = datalink->timeout;
-	alrm_info.frame = &frame;
-	alrm_info.stop = 0;
-
-	write_timed_frame();
-
-	while(alrm_info.tries_left > 0) {
-		frame_t answer;
-		int ret = get_frame(datalink, &answer);
-		if(ret == READ_ERROR) {
-			printf("ERROR (llclose_transmitter): get_frame failed\n");
-			return 1;
-		} else if (ret == READ_RETURN_ALARM) {
-			continue;
-		}
-
-		if(alrm_info.stop == 2) {
-			printf("ERROR (llclose_transmitter)\n");
-			return 1;
-		}
-		if(invalid_frame(&answer) || answer.control_field != C_DISC) {
-			printf("ERROR (llclose_transmitter): received invalid frame. Expected valid DISC command frame.\n");
-			return 1;
-		}
-		alrm_info.stop = 1;
+	if(timer_start(datalink, &frame, datalink->max_retransmissions, datalink->timeout * 1000))
+		return 1;
+	frame_t answer;
+	int ret = get_frame(datalink, &answer);
+	timer_stop(datalink);
+	if(ret == READ_ERROR) {
+		printf("ERROR (llclose_transmitter): get_frame failed\n");
+		return 1;
+	} else if (ret == READ_RETURN_ALARM) {
+		printf("ERROR: Disconnection timed out.\n");
+		return 1;
+	}
+	if(invalid_frame(&answer) || answer.control_field != C_DISC) {
+		printf("ERROR (llclose_transmitter): received invalid frame. Expected valid DISC command frame.\n");
+		return 1;
 	}
 
 	frame_t final_ua;
 	final_ua.sequence_number = 0;
 	final_ua.control_field = C_UA;
 	final_ua.type = CMD_FRAME;
-	final_ua.address_field = A_TRANSMITTER;
+	final_ua.address_field = datalink->address;
 
 	if(send_frame(datalink, &final_ua)) {
 		printf("ERROR (llclose_transmitter): unable to answer receiver's DISC.\n");
@@ -348,10 +382,8 @@ int llclose_transmitter(datalink_t *datalink) {
 
 int llclose_receiver(datalink_t *datalink) {
 
-	alrm_info.tries_left = 0;
-	alrm_info.stop = 1;
 	int attempts = datalink->max_retransmissions;
-	alarm(datalink->timeout);
+	timer_arm(datalink, datalink->timeout * 1000);
 
 	while (attempts > 0) {
 		frame_t frame;
@@ -365,10 +397,10 @@ int llclose_receiver(datalink_t *datalink) {
 		}
 
 		if(frame.type == DATA_FRAME) {
-			int temp = datalink->curr_seq_number;
-			datalink->curr_seq_number = ((frame.control_field >> 5) + 1)%2;
+			int temp = datalink->rx_seq_number;
+			datalink->rx_seq_number = ((frame.control_field >> 5) + 1)%2;
 			send_RR(datalink);
-			datalink->curr_seq_number = temp;
+			datalink->rx_seq_number = temp;
 		}
 
 		if(invalid_frame(&frame) || frame.control_field != C_DISC) {
@@ -379,6 +411,7 @@ int llclose_receiver(datalink_t *datalink) {
 		}
 		--attempts;
 	}
+	timer_stop(datalink);
 	if(attempts <= 0) {
 		printf("ERROR (llclose_receiver): transmission failed (attemts to get DISC exceeded)\n");
 		return 1;
@@ -388,7 +421,7 @@ int llclose_receiver(datalink_t *datalink) {
 	answer.sequence_number = 0;
 	answer.control_field = C_DISC;
 	answer.type = CMD_FRAME;
-	answer.address_field = A_TRANSMITTER;
+	answer.address_field = datalink->address;
 
 	if(send_frame(datalink, &answer)) {
 		printf("ERROR (llclose_receiver): unable to answer sender's SET.\n");
@@ -399,107 +432,176 @@ int llclose_receiver(datalink_t *datalink) {
 }
 
 int llwrite(datalink_t *datalink, const unsigned char *buffer, int length) {
-	unsigned attempts = datalink->max_retransmissions;
-	frame_t frame;
-	frame.sequence_number = datalink->curr_seq_number;
-	if ((frame.buffer = malloc(length)) == NULL) {
-		printf("ERROR (llwrite): unable to allocate %d bytes of memory\n", length);
+	if(llflush(datalink))
+		return 1;
+	return write_information(datalink, buffer, length, 0);
+}
+
+int write_information(datalink_t *datalink, const unsigned char *buffer, unsigned length, int batch) {
+	unsigned char *stuffed;
+	if ((stuffed = malloc(LLPREPARE_MAX_LENGTH(length))) == NULL) {
+		printf("ERROR (llwrite): unable to allocate %d bytes of memory\n", LLPREPARE_MAX_LENGTH(length));
 		return 1;
 	}
-	memcpy(frame.buffer, buffer, length);
-	frame.length = length;
-	frame.control_field = C_DATA(frame.sequence_number);
-	frame.type = DATA_FRAME;
-	frame.address_field = A_TRANSMITTER;
+	unsigned stuffed_length = llprepare(buffer, length, stuffed);
+	int ret = llwrite_prepared(datalink, stuffed, stuffed_length, batch);
+	free(stuffed);
+	return ret;
+}
 
-	alrm_info.datalink = datalink;
-	alrm_info.tries_left = datalink->max_retransmissions;
-	alrm_info.time_dif = datalink->timeout;
-	alrm_info.frame = &frame;
-	alrm_info.stop = 0;
+unsigned llbatch_append(unsigned char *batch, unsigned batch_length, const unsigned char *packet, unsigned length) {
+	batch[batch_length] = (unsigned char)(length >> 8);
+	batch[batch_length + 1] = (unsigned char)length;
+	memcpy(&batch[batch_length + 2], packet, length);
+	return batch_length + LLBATCH_ENTRY_LENGTH(length);
+}
 
-	if(write_timed_frame()) {
-		printf("ERROR (llwrite): unable to start alarms\n");
+int llqueue(datalink_t *datalink, const unsigned char *buffer, int length) {
+	unsigned max_length = datalink->max_batch_length;
+	if(max_length > datalink->max_frame_length)
+		max_length = datalink->max_frame_length;
+	if(LLBATCH_ENTRY_LENGTH(length) > max_length)
+		return llwrite(datalink, buffer, length);
+	if(datalink->tx_batch_length + LLBATCH_ENTRY_LENGTH(length) > max_length && llflush(datalink))
+		return 1;
+	if(datalink->tx_batch == NULL && (datalink->tx_batch = malloc(datalink->max_frame_length)) == NULL) {
+		printf("ERROR (llqueue): unable to allocate %d bytes of memory\n", datalink->max_frame_length);
 		return 1;
 	}
+	datalink->tx_batch_length = llbatch_append(datalink->tx_batch, datalink->tx_batch_length, buffer, length);
+	++datalink->tx_batch_packets;
+	return 0;
+}
+
+int llflush(datalink_t *datalink) {
+	unsigned length = datalink->tx_batch_length;
+	unsigned num_packets = datalink->tx_batch_packets;
+	datalink->tx_batch_length = 0;
+	datalink->tx_batch_packets = 0;
+	if(num_packets == 0)
+		return 0;
+	// a lone packet goes in an I frame of its own, without the batch framing
+	if(num_packets == 1)
+		return write_information(datalink, &datalink->tx_batch[2], length - 2, 0);
+	return write_information(datalink, datalink->tx_batch, length, 1);
+}
 
-	while(attempts-- > 0) {
+unsigned llprepare(const unsigned char *buffer, int length, unsigned char *stuffed) {
+	perf_sample_t sample;
+	perf_phase_begin(&sample);
+	unsigned char bcc2 = 0;
+	int i;
+	for (i = 0; i < length; ++i)
+		bcc2 ^= buffer[i];
+	perf_phase_end(PHASE_BCC, &sample);
+
+	perf_phase_begin(&sample);
+	unsigned stuffed_length = byte_stuffing(buffer, length, stuffed);
+	stuffed_length += byte_stuffing(&bcc2, sizeof(bcc2), &stuffed[stuffed_length]);
+	stuffed[stuffed_length++] = FLAG;
+	perf_phase_end(PHASE_STUFFING, &sample);
+	return stuffed_length;
+}
+
+int llwrite_prepared(datalink_t *datalink, const unsigned char *stuffed, unsigned stuffed_length, int batch) {
+	if(llflush(datalink))
+		return 1;
+
+	// answers that are neither RR nor REJ, retransmissions are bounded by the timer
+	unsigned attempts = datalink->max_retransmissions;
+	frame_t frame;
+	frame.sequence_number = datalink->tx_seq_number;
+	frame.buffer = (unsigned char *)stuffed;
+	frame.length = stuffed_length;
+	frame.control_field = batch ? C_BATCH(frame.sequence_number) : C_DATA(frame.sequence_number);
+	frame.type = DATA_FRAME;
+	frame.address_field = datalink->address;
+
+	if(timer_start(datalink, &frame, datalink->max_retransmissions, datalink->timeout * 1000)) {
+		printf("ERROR (llwrite): unable to start the retransmission timer\n");
+		return 1;
+	}
+
+	while(attempts > 0) {
 		frame_t answer;
 		int ret = get_frame(datalink, &answer);
 		if(ret == READ_ERROR) {
 			printf("ERROR (llwrite): get_frame failed\n");
-			continue;
+			timer_stop(datalink);
+			return 1;
 		} else if(ret == READ_RETURN_ALARM) {
-			if(alrm_info.tries_left <= 0) {
-				printf("ERROR: Connection timed out\n");
-				return 1;
-			}
-			continue;
+			printf("ERROR: Connection timed out\n");
+			return 1;
 		}
 
-		if(alrm_info.stop == 2) {
-			printf("ERROR (llwrite): transmission failed (number of attempts to get RR exceeded)\n");
+		if(answer.control_field == C_PROBE)
+			continue;	// late echo from llprobe
+
+		if(answer.type == DATA_FRAME && answer.sequence_number == (datalink->rx_seq_number + 1) % 2) {
+			// the peer missed our RR for its last I frame and sent it again
+			send_RR(datalink);
 			continue;
 		}
 
-		if(answer.type != CMD_FRAME && ret != READ_RETURN_ALARM) {
+		if(answer.type != CMD_FRAME) {
 			printf("Invalid RR or REJ received\n");
+			--attempts;
 			continue;
 		}
 
 		if(check_bcc1(&answer)) {
 			printf("Invalid bcc1 in frame received\n");
+			--attempts;
 			continue;
 		}
 
-		if(answer.control_field == C_REJ(datalink->curr_seq_number) {
+		if(answer.control_field == C_REJ(datalink->tx_seq_number)) {
 			printf("Got REJ, resending\n");
-			send_frame(datalink, &frame);
 			++datalink->num_received_REJs;
+			if(timer_resend(datalink)) {
+				printf("ERROR: Connection timed out\n");
+				timer_stop(datalink);
+				return 1;
+			}
 			continue;
 		}
 
-		if(answer.control_field != C_RR((datalink->curr_seq_number + 1)%2)) {
-			printf("Invalid RR value received");
+		if(answer.control_field != C_RR((datalink->tx_seq_number + 1)%2)) {
+			printf("Invalid RR value received\n");
 			send_frame(datalink, &frame);
+			--attempts;
 			continue;
 		}
 
-		/*if(invalid_frame(&answer) || frame.control_field != C_RR(datalink->curr_seq_number)) {
-			printf("ERROR (llwrite): received invalid frame. Expected valid RR command frame\n");
-			continue;
-		}*/
-
-		alrm_info.stop = 1;
-		break;
+		timer_stop(datalink);
+		inc_sequence_number(&datalink->tx_seq_number);
+		if(batch)
+			++datalink->num_sent_batches;
+		return 0;
 	}
-	free(frame.buffer);
 
-	if(attempts == 0) {
-		printf("ERROR (llwrite): communication failed. Attempts to send frame exceeded limit(%d)", LLWRITE_ANSWER_TRIES);
-		return 1;
-	}
-	inc_sequence_number(&datalink->curr_seq_number);
-	return 0;
+	timer_stop(datalink);
+	printf("ERROR (llwrite): communication failed. Attempts to send frame exceeded limit(%d)\n", datalink->max_retransmissions);
+	return 1;
 }
 
 int send_REJ(datalink_t *datalink) {
 	++datalink->num_sent_REJs;
 	frame_t frame;
-	frame.sequence_number = datalink->curr_seq_number;
-	frame.control_field = C_REJ(datalink->curr_seq_number);
+	frame.sequence_number = datalink->rx_seq_number;
+	frame.control_field = C_REJ(datalink->rx_seq_number);
 	frame.type = CMD_FRAME;
-	frame.address_field = A_TRANSMITTER;
+	frame.address_field = datalink->address;
 
 	return send_frame(datalink, &frame);
 }
 
 int send_RR(datalink_t *datalink) {
 	frame_t frame;
-	frame.sequence_number = datalink->curr_seq_number;
+	frame.sequence_number = datalink->rx_seq_number;
 	frame.control_field = C_RR(frame.sequence_number);
 	frame.type = CMD_FRAME;
-	frame.address_field = A_TRANSMITTER;
+	frame.address_field = datalink->address;
 
 	return send_frame(datalink, &frame);
 }
@@ -509,31 +611,67 @@ int send_UA(datalink_t *datalink) {
 	frame.sequence_number = 0;
 	frame.control_field = C_UA;
 	frame.type = CMD_FRAME;
-	frame.address_field = A_TRANSMITTER;
+	frame.address_field = datalink->address;
 
 	return send_frame(datalink, &frame);
 }
 
 int llread(datalink_t *datalink, char * buffer) {
-	alrm_info.frame = NULL;
-	alrm_info.tries_left = 0;
-	alrm_info.stop = 0;
-	struct sigaction sa;
-	sigaction(SIGALRM, NULL, &sa);
-	sa.sa_handler = alarm_handler;
-	sigaction(SIGALRM, &sa, NULL);
-	alarm(15);
+	if(datalink->rx_batch_next < datalink->rx_batch_length)
+		return next_batch_packet(datalink, buffer);
+	// the peer won't answer packets still waiting in our own queue
+	if(llflush(datalink))
+		return -1;
+
+	// a dropped frame is only resent after timeout, so wait for all of the peer's
+	// retransmissions, but never less than LLREAD_TIMEOUT for it to prepare an answer
+	unsigned idle_ms = datalink->timeout * (datalink->max_retransmissions + 1) * 1000;
+	if(idle_ms < LLREAD_TIMEOUT * 1000)
+		idle_ms = LLREAD_TIMEOUT * 1000;
+	timer_arm(datalink, idle_ms);
 
 	frame_t frame;
-	int tries = datalink->max_retransmissions;
-	while(tries-- > 0) {
+	while(1) {
 		int ret = get_frame(datalink, &frame);
 		if(ret == READ_ERROR) {
 			printf("ERROR (llread): unable to get frame\n");
 			return -1;
 		} else if(ret == READ_RETURN_ALARM) {
 			printf("ERROR: Connection timed out\n");
-			return 1;
+			return -1;
+		}
+
+		if(frame.address_field == A_BROADCAST) {
+			// nobody answers a broadcast, whatever is lost here is repaired later
+			if(frame.type != DATA_FRAME || frame.control_field == C_PROBE || check_bcc1(&frame) || check_bcc2(&frame))
+				continue;
+			timer_arm(datalink, idle_ms);
+			memcpy(buffer, frame.buffer, frame.length);
+			return frame.length;
+		}
+
+		if(frame.type == CMD_FRAME) {
+			// a stale RR, REJ or UA is not answered, that would start an RR ping-pong
+			if(frame.control_field != C_SET || check_bcc1(&frame))
+				continue;
+			if(datalink->num_received_data_frames > 0) {
+				printf("ERROR (llread): the peer opened a new link\n");
+				timer_stop(datalink);
+				return -1;
+			}
+			// our UA was lost and the peer is still opening the link
+			if(send_UA(datalink))
+				printf("Got SET but unable to answer UA\n");
+			continue;
+		}
+		// the peer is still sending, the timeout counts from its last frame
+		timer_arm(datalink, idle_ms);
+
+		if(frame.control_field == C_PROBE) {
+			// link characterisation by the transmitter
+			if(!check_bcc2(&frame))
+				echo_probe(datalink, &frame);
+			continue;
 		}
 
 		int probability_check = 2;
@@ -545,20 +683,14 @@ int llread(datalink_t *datalink, char * buffer) {
 				break;
 			}
 
-			if(frame.type == CMD_FRAME) {
-				if(frame.control_field == C_SET) {
-					if(send_UA(datalink)) {
-						printf("Got SET but unable to answer UA\n");
-						continue_outter = 1;
-						break;
-					}
-				}
-			}
-
 			++datalink->num_received_data_frames;
 
-			if(check_bcc2(&frame)) {
-				if(ORDER_BIT(datalink->curr_seq_number) == frame.control_field) {
+			perf_sample_t sample;
+			perf_phase_begin(&sample);
+			int bcc2_error = check_bcc2(&frame);
+			perf_phase_end(PHASE_BCC, &sample);
+			if(bcc2_error) {
+				if(frame.sequence_number == datalink->rx_seq_number) {
 					printf("REJ\n");
 					send_REJ(datalink);
 					++datalink->num_sent_REJs;
@@ -566,7 +698,7 @@ int llread(datalink_t *datalink, char * buffer) {
 					break;
 				} else {
 					printf("BCC2 failed.\n");
-					printf("RR%d\n", datalink->curr_seq_number);
+					printf("RR%d\n", datalink->rx_seq_number);
 					send_RR(datalink);
 					continue_outter = 1;
 					break;
@@ -574,58 +706,100 @@ int llread(datalink_t *datalink, char * buffer) {
 			}
 
 			if(probability(BCC1_ERR_PROB)) {
-				frame->bcc1 += 13;	// INDUCE BCC1 ERROR
+				frame.bcc1 += 13;	// INDUCE BCC1 ERROR
 			}
 
 			if(probability(BCC2_ERR_PROB)) {
-				frame->bcc2 += 13;	// INDUCE BCC2 ERROR
+				frame.bcc2 += 13;	// INDUCE BCC2 ERROR
 			}
 		}
 		if(continue_outter)
 			continue;
 
 
-		if(ORDER_BIT(datalink->curr_seq_number) != frame.control_field) {
+		if(frame.sequence_number != datalink->rx_seq_number) {
 			printf("BCC2 failed.\n");
-			printf("RR%d\n", datalink->curr_seq_number);
+			printf("RR%d\n", datalink->rx_seq_number);
 			send_RR(datalink);
 			continue;
 		}
 
-		alrm_info.stop = 1;
-		inc_sequence_number(&datalink->curr_seq_number);
+		int batch = frame.control_field == C_BATCH(frame.sequence_number);
+		if(batch && check_batch(frame.buffer, frame.length)) {
+			printf("ERROR (llread): received a malformed batch\n");
+			timer_stop(datalink);
+			return -1;
+		}
+		if(batch && datalink->rx_batch == NULL && (datalink->rx_batch = malloc(datalink->max_frame_length)) == NULL) {
+			printf("ERROR (llread): unable to allocate %d bytes of memory\n", datalink->max_frame_length);
+			timer_stop(datalink);
+			return -1;
+		}
+
+		timer_stop(datalink);
+		inc_sequence_number(&datalink->rx_seq_number);
 		send_RR(datalink);
+		if(batch) {
+			memcpy(datalink->rx_batch, frame.buffer, frame.length);
+			datalink->rx_batch_length = frame.length;
+			datalink->rx_batch_next = 0;
+			return next_batch_packet(datalink, buffer);
+		}
 		memcpy(buffer, frame.buffer, frame.length);
 		return frame.length;
 	}
-
-	alrm_info.stop = 1;
-	printf("ERROR (llread): attempts exceeded\n");
-	return -1;
 }
 
-unsigned acknowledge_frame(datalink_t *datalink) {
-	if(!datalink->repeat) {
-		inc_sequence_number(&datalink->curr_seq_number);
+int llbroadcast(datalink_t *datalink, const unsigned char *buffer, int length) {
+	if(llflush(datalink))
+		return 1;
+	unsigned char *stuffed;
+	if ((stuffed = malloc(LLPREPARE_MAX_LENGTH(length))) == NULL) {
+		printf("ERROR (llbroadcast): unable to allocate %d bytes of memory\n", LLPREPARE_MAX_LENGTH(length));
+		return 1;
 	}
-
 	frame_t frame;
-	frame.sequence_number = datalink->curr_seq_number;
-	frame.control_field = C_RR(frame.sequence_number);
-	frame.type = CMD_FRAME;
-	frame.address_field = A_TRANSMITTER;
+	frame.sequence_number = 0;
+	frame.buffer = stuffed;
+	frame.length = llprepare(buffer, length, stuffed);
+	frame.control_field = C_DATA(0);
+	frame.type = DATA_FRAME;
+	frame.address_field = A_BROADCAST;
+	int ret = send_frame(datalink, &frame);
+	free(stuffed);
+	return ret;
+}
 
-	alrm_info.datalink = datalink;
-	alrm_info.tries_left = LLREAD_ANSWER_TRIES;
-	alrm_info.time_dif = LLREAD_ANSWER_RESEND_TIME;
-	alrm_info.frame = &frame;
-	alrm_info.stop = 0;
+int check_batch(const unsigned char *batch, unsigned length) {
+	// the entries must cover the information field exactly
+	unsigned next = 0;
+	while(next + 2 <= length)
+		next += LLBATCH_ENTRY_LENGTH((batch[next] << 8) | batch[next + 1]);
+	return next != length || length == 0;
+}
+
+int next_batch_packet(datalink_t *datalink, char *buffer) {
+	const unsigned char *entry = &datalink->rx_batch[datalink->rx_batch_next];
+	unsigned length = (entry[0] << 8) | entry[1];
+	memcpy(buffer, &entry[2], length);
+	datalink->rx_batch_next += LLBATCH_ENTRY_LENGTH(length);
+	return length;
+}
 
-	return write_timed_frame();
+void free_batches(datalink_t *datalink) {
+	free(datalink->tx_batch);
+	free(datalink->rx_batch);
+	datalink->tx_batch = NULL;
+	datalink->tx_batch_length = 0;
+	datalink->tx_batch_packets = 0;
+	datalink->rx_batch = NULL;
+	datalink->rx_batch_length = 0;
+	datalink->rx_batch_next = 0;
 }
 
+
 int check_frame_order(datalink_t *datalink, frame_t *frame) {
-	if((ORDER_BIT(datalink->curr_seq_number) & ORDER_BIT(1)) ^ frame->control_field) {
+	if((ORDER_BIT(datalink->rx_seq_number) & ORDER_BIT(1)) ^ frame->control_field) {
 		return 0;
 	} else {
 		return 1;
@@ -651,7 +825,12 @@ int send_cmd_frame(datalink_t *datalink, const frame_t *frame)
 			frame->control_field,
 			frame->address_field ^ frame->control_field,
 			FLAG};
-	if (write(datalink->fd, msg, sizeof(msg)) != sizeof(msg)) {
+	struct iovec iov = { msg, sizeof(msg) };
+	perf_sample_t sample;
+	perf_phase_begin(&sample);
+	int written = transport_write(&datalink->transport, &iov, 1);
+	perf_phase_end(PHASE_WRITE, &sample);
+	if (written != sizeof(msg)) {
 		printf("ERROR (send_cmd_frame): write failed\n");
 		return 1;
 	}
@@ -661,203 +840,267 @@ int send_cmd_frame(datalink_t *datalink, const frame_t *frame)
 
 int send_data_frame(datalink_t *datalink, const frame_t *frame)
 {
-	printf("Sending data frame...\n");
-	unsigned char ctrl = frame->sequence_number << 5;
+	unsigned char ctrl = frame->control_field;
 	unsigned char fh[] = {FLAG,
-			A_TRANSMITTER,
+			frame->address_field,
 			ctrl,
-			A_TRANSMITTER ^ ctrl
+			frame->address_field ^ ctrl
+	};
+
+	// the information field is already stuffed and closed (see llprepare)
+	struct iovec iov[] = {
+			{ fh, sizeof(fh) },
+			{ frame->buffer, frame->length }
 	};
+	perf_sample_t sample;
+	perf_phase_begin(&sample);
+	int written = transport_write(&datalink->transport, iov, 2);
+	perf_phase_end(PHASE_WRITE, &sample);
+	if (written != sizeof(fh) + frame->length) {
+		printf("ERROR (send_data_frame): write failed\n");
+		return 1;
+	}
+	if (ctrl != C_PROBE)
+		++datalink->num_sent_data_frames;
+	return 0;
+}
 
-	unsigned char *data;
-	unsigned length;
-	if (byte_stuffing(frame->buffer, frame->length, &data, &length)) return 1;
+int llprobe(datalink_t *datalink) {
+	link_probe_t *probe = &datalink->probe_results;
+	unsigned max_length = datalink->max_frame_length;
+	unsigned char *payload = malloc(max_length);
+	unsigned char *stuffed = malloc(LLPREPARE_MAX_LENGTH(max_length));
+	if(payload == NULL || stuffed == NULL) {
+		printf("ERROR (llprobe): unable to allocate %d bytes of memory\n", max_length);
+		free(payload);
+		free(stuffed);
+		return 1;
+	}
 
-	int i;
-	unsigned char bcc2;
-	if (frame->length > 0)
-	{
-		bcc2 = frame->buffer[0];
-		for (i = 1; i < frame->length; ++i)
-		{
-			bcc2 ^= frame->buffer[i];
+	memset(probe, 0, sizeof(*probe));
+	double rtt_sum = 0, max_rtt = 0, best_goodput = 0;
+	unsigned long long line_bytes = 0;
+	unsigned index = 0;
+	unsigned length = PROBE_MIN_LENGTH;
+	while(1) {
+		if(length > max_length)
+			length = max_length;
+
+		unsigned received = 0, lost = 0;
+		double length_rtt = 0;
+		unsigned k;
+		for(k = 0; k < PROBE_BURST; ++k, ++index) {
+			unsigned i;
+			payload[0] = index >> 8;
+			payload[1] = index & 0xFF;
+			for(i = 2; i < length; ++i)
+				payload[i] = (index + i) * 31;	// sweeps through FLAG and ESC as well
+
+			double rtt;
+			if(probe_round_trip(datalink, payload, length, stuffed, &rtt)) {
+				++lost;
+				continue;
+			}
+			++received;
+			length_rtt += rtt;
+			line_bytes += 2 * (length + 6);
+			if(probe->min_rtt == 0 || rtt < probe->min_rtt)
+				probe->min_rtt = rtt;
+			if(rtt > max_rtt)
+				max_rtt = rtt;
 		}
+
+		// the receiver takes no frames this long: a limit rather than losses, and longer ones fare no better
+		if(received == 0)
+			break;
+		probe->num_sent += PROBE_BURST;
+		probe->num_lost += lost;
+
+		// payload delivered per second of stop-and-wait, discounted by the losses
+		double goodput = length * ((double)received / PROBE_BURST) / (length_rtt / received);
+		if(goodput > best_goodput) {
+			best_goodput = goodput;
+			probe->frame_length = length;
+		}
+		rtt_sum += length_rtt;
+
+		if(length == max_length)
+			break;
+		length *= 4;
 	}
-	else bcc2 = 0;
-	unsigned char *bcc2_stuffed;
-	unsigned length2;
-	if (byte_stuffing(&bcc2, sizeof(bcc2), &bcc2_stuffed, &length2)) {
-		printf("ERROR (send_data_frame): byte_stuffing failed\n");
+	free(payload);
+	free(stuffed);
+
+	unsigned num_received = probe->num_sent - probe->num_lost;
+	if(num_received == 0) {
+		printf("ERROR (llprobe): no probe frame was echoed\n");
 		return 1;
 	}
-
-	unsigned char ft[] = {FLAG };
-	if (write(datalink->fd, fh, sizeof(fh)) != sizeof(fh)) return 1;
-	if (write(datalink->fd, data, length) != length) return 1;
-	if (write(datalink->fd, bcc2_stuffed, length2) != length2) return 1;
-	if (write(datalink->fd, ft, sizeof(ft)) != sizeof(ft)) return 1;
-	++datalink->num_sent_data_frames;
-	free(data);
-	free(bcc2_stuffed);
+	probe->avg_rtt = rtt_sum / num_received;
+	probe->byte_rate = line_bytes / rtt_sum;
+
+	// link timeouts are whole seconds
+	datalink->timeout = (unsigned)ceil(PROBE_TIMEOUT_FACTOR * max_rtt);
+	if(datalink->timeout == 0)
+		datalink->timeout = 1;
+	if(probe->num_lost > 0) {
+		// enough tries for a frame to get through with PROBE_TARGET_FAILURE probability of giving up
+		double loss = (double)probe->num_lost / probe->num_sent;
+		unsigned tries = (unsigned)ceil(log(PROBE_TARGET_FAILURE) / log(loss));
+		if(tries > datalink->max_retransmissions)
+			datalink->max_retransmissions = tries;
+	}
 	return 0;
 }
 
+int probe_round_trip(datalink_t *datalink, const unsigned char *payload, unsigned length, unsigned char *stuffed, double *rtt) {
+	frame_t frame;
+	frame.sequence_number = 0;
+	frame.control_field = C_PROBE;
+	frame.type = DATA_FRAME;
+	frame.address_field = datalink->address;
+	frame.buffer = stuffed;
+	frame.length = llprepare(payload, length, stuffed);
+
+	// the probe and its echo cross the line at 10 bits a byte, however long they are
+	unsigned line_ms = (unsigned)ceil(2 * (frame.length + 6) * 10 * 1000.0 / serial_bits_per_second(datalink->baudrate));
+
+	double start = transport_now(&datalink->transport);
+	if(send_frame(datalink, &frame))
+		return 1;
+	// only bounds get_frame, nothing is resent or counted as a timeout
+	timer_arm(datalink, line_ms + PROBE_TIMEOUT_MARGIN_MS);
+
+	while(1) {
+		frame_t answer;
+		if(get_frame(datalink, &answer) != 0) {
+			timer_stop(datalink);
+			return 1;	// timed out, or the port failed
+		}
+		// late echoes of earlier probes carry a different index
+		if(answer.control_field != C_PROBE || answer.length != length || check_bcc2(&answer)
+				|| memcmp(answer.buffer, payload, length) != 0)
+			continue;
+		*rtt = transport_now(&datalink->transport) - start;
+		timer_stop(datalink);
+		return 0;
+	}
+}
+
+int echo_probe(datalink_t *datalink, const frame_t *probe) {
+	unsigned char *stuffed;
+	if ((stuffed = malloc(LLPREPARE_MAX_LENGTH(probe->length))) == NULL) {
+		printf("ERROR (echo_probe): unable to allocate %d bytes of memory\n", LLPREPARE_MAX_LENGTH(probe->length));
+		return 1;
+	}
+	frame_t frame;
+	frame.sequence_number = 0;
+	frame.control_field = C_PROBE;
+	frame.type = DATA_FRAME;
+	frame.address_field = datalink->address;
+	frame.buffer = stuffed;
+	frame.length = llprepare(probe->buffer, probe->length, stuffed);
+	int ret = send_frame(datalink, &frame);
+	free(stuffed);
+	return ret;
+}
+
 void inc_sequence_number(unsigned int *seq_num) {
 	*seq_num = (*seq_num + 1)%2;
 }
 
-int byte_stuffing(const unsigned char *src, unsigned length, unsigned char **dst, unsigned *new_length)
+unsigned byte_stuffing(const unsigned char *src, unsigned length, unsigned char *dst)
 {
-	unsigned char stuffed[2 * length]; // 2 * length is the size in the worst case
 	unsigned i;
 	unsigned j;
 	for (i = 0, j = 0; i < length; ++i, ++j)
 	{
 		if (src[i] == FLAG)
 		{
-			stuffed[j] = ESC;
-			stuffed[++j] = FLAG ^ ESC_XOR;
+			dst[j] = ESC;
+			dst[++j] = FLAG ^ ESC_XOR;
 		}
 		else if (src[i] == ESC)
 		{
-			stuffed[j] = ESC;
-			stuffed[++j] = ESC ^ ESC_XOR;
+			dst[j] = ESC;
+			dst[++j] = ESC ^ ESC_XOR;
 		}
 		else
-			stuffed[j] = src[i];
+			dst[j] = src[i];
 	}
-	*new_length = j;
-	if ((*dst = malloc(*new_length)) == NULL) {
-		printf("ERROR (byte_stuffing): unable to allocate %d bytes of memory\n", *new_length);
-		return 1;
-	}
-	memcpy(*dst, stuffed, *new_length);
-	return 0;
+	return j;
 }
 
-int byte_destuffing(const unsigned char *src, unsigned length, unsigned char **dst, unsigned *new_length)
+unsigned byte_destuffing(const unsigned char *src, unsigned length, unsigned char *dst)
 {
-	unsigned char destuffed[length];
 	unsigned i;
 	unsigned j;
 	for (i = 0, j = 0; i < length; ++i, ++j)
 	{
-		if(src[i] == ESC)
+		if(src[i] == ESC && i + 1 < length)
 		{
-			destuffed[j] = src[++i] ^ ESC_XOR;
+			dst[j] = src[++i] ^ ESC_XOR;
 		}
 		else
-			destuffed[j] = src[i];
+			dst[j] = src[i];
 	}
+	return j;
+}
 
-	*new_length = j;
-	if ((*dst = malloc(*new_length)) == NULL) {
-		printf("ERROR (byte_destuffing): unable to allocate %d bytes of memory\n", *new_length);
-		return 1;
-	}
-	memcpy(*dst, destuffed, *new_length);
-	return 0;
+int store_parsed_frame(void *context, const frame_t *frame) {
+	frame_t **out = context;
+	**out = *frame;
+	*out = NULL;	// tells get_frame that a frame arrived
+	return 1;
 }
 
 int get_frame(datalink_t *datalink, frame_t *frame) {
-	state_t state = START;
-	unsigned char byte;
-	if ((frame->buffer = malloc(sizeof(char) * 50000)) == NULL) {
-		printf("ERROR (get_frame): unable to allocate %d bytes of memory\n", 50000);
-		return 1;
-	}
-	unsigned char *buf = malloc(sizeof(char) * 50000);
-	if(buf == NULL) {
-		printf("ERROR (get_frame): unable to allocate %d bytes of memory\n", 50000);
-		return 1;
-	}
-	unsigned buf_length = 0;
-	frame->type = DATA_FRAME;
-	frame->bcc2 = 0;
-	/*char *test[] = {
-			"START",
-			"FLAG_RCV",
-			"A_RCV",
-			"C_RCV",
-			"BCC1_RCV",
-			"STOP"
-	};*/
-
-	while(state != STOP) {
-		//printf("PREV_STATE: %s\t", test[(int)state]);
-		int ret = read_byte(datalink->fd, &byte);
-		if(ret == 0) {
-			return READ_ERROR;
-		} else if(ret == -1) {
-			return READ_RETURN_ALARM;
-		}
-
-		switch(state) {
-		case START:
-			if(byte == FLAG) {
-				state = FLAG_RCV;
+	frame_t *out = frame;
+	datalink->parser->context = &out;
+	perf_sample_t sample;
+	while(out != NULL) {
+		if(datalink->rx_start == datalink->rx_end) {
+			// waits for the port and the link's timer at once, no signals involved
+			int ready = transport_poll(&datalink->transport, timer_wait_ms(datalink));
+			if(ready < 0) {
+				if(errno == EINTR)
+					continue;
+				return READ_ERROR;
+			} else if(ready == 0) {
+				// a transport may return early, e.g. on taking a connection: only the deadline counts
+				if(datalink->timer.deadline == 0 || transport_now(&datalink->transport) < datalink->timer.deadline)
+					continue;
+				if(timer_expired(datalink))
+					return READ_RETURN_ALARM;
+				continue;
 			}
-			break;
-		case FLAG_RCV:
-			if(byte == A_TRANSMITTER || byte == A_RECEIVER) {
-				state = A_RCV;
-				frame->address_field = byte;
-			} else if(byte != FLAG) {
-				state = START;
-			}
-			break;
-		case A_RCV:
-			if(byte == FLAG) {
-				state = FLAG_RCV;
-			} else if(byte == C_SET || byte == C_UA || byte == C_DISC || byte == C_REJ(0) || byte == C_REJ(1) || byte == C_RR(0) || byte == C_RR(1)) {
-				frame->type = CMD_FRAME;
-				frame->control_field = byte;
-				state = C_RCV;
-			} else if(byte == C_DATA(0) || byte == C_DATA(1)) {
-				frame->type = DATA_FRAME;
-				frame->control_field = byte;
-				state = C_RCV;
-			} else {
-				state = START;
-			}
-			break;
-		case C_RCV:
-		{
-			state = BCC1_RCV;
-			frame->bcc1 = byte;
-			break;
-		}
-		case BCC1_RCV:
-			if(byte == FLAG) {
-				state = STOP;
-			} else {
-				buf[buf_length++] = byte;
+
+			perf_phase_begin(&sample);
+			int ret = transport_read(&datalink->transport, datalink->rx_buffer, MAX_BUFFER_LENGTH);
+			perf_phase_end(PHASE_READ, &sample);
+			if(ret == 0) {
+				return READ_ERROR;
+			} else if(ret == -1) {
+				if(errno == EINTR || errno == EAGAIN)
+					continue;
+				return READ_ERROR;
 			}
-			break;
-		case STOP:
-			break;
+			datalink->rx_start = 0;
+			datalink->rx_end = ret;
 		}
-		//printf("\tNEXT_STATE: %s\t\n", test[(int)state]);
-	}
 
-	//printf("\n\tLEAVING State Machine\n\n");
+		perf_phase_begin(&sample);
+		datalink->rx_start += frame_parser_feed(datalink->parser, &datalink->rx_buffer[datalink->rx_start], datalink->rx_end - datalink->rx_start);
+		perf_phase_end(PHASE_PARSING, &sample);
 
-	unsigned char *temp; unsigned int temp_len;
-
-	if(frame->type == DATA_FRAME) {
-		if(byte_destuffing(buf, buf_length, &temp, &temp_len)) {
-			printf("ERROR (get_frame): failed to perform destuffing on DATA frame received\n");
-			return 1;
+		if(out == NULL && frame->address_field != datalink->address && frame->address_field != A_BROADCAST) {
+			// another secondary's frame on the bus: the master is alive, so is an idle wait
+			if(datalink->timer.frame == NULL && datalink->timer.deadline != 0)
+				timer_arm(datalink, datalink->timer.interval_ms);
+			out = frame;
 		}
-
-		frame->length = temp_len - 1;
-		memcpy(frame->buffer, temp, temp_len - 1);
-		frame->bcc2 = temp[temp_len-1];
-		free(temp);
 	}
 
-	//printf("\n\tLEFT State Machine\n\n");
-
 	return 0;
 }
 
@@ -866,16 +1109,3 @@ int probability(int value) {
 	return num < value;
 }
 
-/*
-int read_byte(int fd, unsigned char *c)
-{
-	int res = read(fd,c,1);
-	if (res != 1)
-	{
-		printf("Error reading from the serial port.\n");
-		return 1;
-	}
-	printf("Read 0x%X\n", + *c);
-	return 0;
-}
- */
@@ -1,134 +1,276 @@
-#ifndef __DATALINK_H
-#define __DATALINK_H
-
-#include <stdlib.h>
-
-#define BIT(n) (1 << n)
-
-#define ORDER_BIT(n) (n << 5)
-
-/*
- * Describe function return values
- */
-#define OK 0
-#define ERROR -1
-
-#define FLAG 126
-#define ESC 0x7D
-#define ESC_XOR 0x20
-#define A_TRANSMITTER 0x03
-#define A_RECEIVER 0x01
-#define C_DATA(S) ((S) << 5)
-#define C_SET 0x07
-#define C_DISC 0x0B
-#define C_UA 0x03
-#define C_RR(R) (((R) << 5) | 1)
-#define C_REJ(R) (((R) << 5) | 5)
-
-#define SET 0
-#define UA 1
-#define DATA 2
-
-#define MAX_BUFFER_LENGTH 256
-
-typedef enum {
-	CMD_FRAME,
-	DATA_FRAME
-} frame_type_t;
-
-typedef struct {
-	unsigned char sequence_number;
-	unsigned char address_field;
-	unsigned char control_field;
-	unsigned char bcc1;
-	unsigned length;
-	unsigned char *buffer;
-	unsigned char bcc2;
-	frame_type_t type;
-} frame_t;
-
-/*
- * Describes the receiver state-machine states
- */
-typedef enum {START,
-	FLAG_RCV,
-	A_RCV,
-	C_RCV,
-	BCC1_RCV,
-	STOP
-} state_t;
-
-/*
- * Define the program mode (either reader or writer)
- */
-#define SENDER 0
-#define RECEIVER 1
-
-#define INIT_CONNECTION_TRIES 15
-#define INIT_CONNECTION_RESEND_TIME 1
-#define FINAL_DISCONNECTION_TRIES 15
-#define FINAL_DISCONNECTION_RESEND_TIME 1
-#define LLREAD_ANSWER_TRIES 15
+#ifndef __DATALINK_H
+#define __DATALINK_H
+
+#include <stdlib.h>
+#include <termios.h>
+#include "transport.h"
+
+#define BIT(n) (1 << n)
+
+#define ORDER_BIT(n) (n << 5)
+
+/*
+ * Describe function return values
+ */
+#define OK 0
+#define ERROR -1
+
+#define FLAG 126
+#define ESC 0x7D
+#define ESC_XOR 0x20
+#define A_TRANSMITTER 0x03
+#define A_RECEIVER 0x01
+#define A_NODE(N) (0x0F + (N))	/* secondaries of a multi-drop bus, 1 to MAX_NODES */
+#define MAX_NODES 48
+#define A_BROADCAST 0xFF	/* every secondary takes it, none answers */
+#define C_DATA(S) ((S) << 5)
+#define C_SET 0x07
+#define C_DISC 0x0B
+#define C_UA 0x03
+#define C_RR(R) (((R) << 5) | 1)
+#define C_REJ(R) (((R) << 5) | 5)
+#define C_PROBE 0x0D
+#define C_BATCH(S) (((S) << 5) | 0x10)
+
+#define SET 0
+#define UA 1
+#define DATA 2
+
+#define MAX_BUFFER_LENGTH 256
+
+typedef enum {
+	CMD_FRAME,
+	DATA_FRAME
+} frame_type_t;
+
+typedef struct {
+	unsigned char sequence_number;
+	unsigned char address_field;
+	unsigned char control_field;
+	unsigned char bcc1;
+	unsigned length;
+	unsigned char *buffer;
+	unsigned char bcc2;
+	frame_type_t type;
+} frame_t;
+
+/*
+ * Describes the receiver state-machine states
+ */
+typedef enum {START,
+	FLAG_RCV,
+	A_RCV,
+	C_RCV,
+	BCC1_RCV,
+	STOP
+} state_t;
+
+/*
+ * Define the program mode (either reader or writer)
+ */
+#define SENDER 0
+#define RECEIVER 1
+
+#define INIT_CONNECTION_TRIES 15
+#define INIT_CONNECTION_RESEND_TIME 1
+#define FINAL_DISCONNECTION_TRIES 15
+#define FINAL_DISCONNECTION_RESEND_TIME 1
+#define LLREAD_ANSWER_TRIES 15
 #define LLREAD_ANSWER_RESEND_TIME 1
-#define LLREAD_VALIDMSG_TRIES 15
-#define LLWRITE_ANSWER_TRIES 5
-#define LLWRITE_ANSWER_TIMEOUT 5
-#define READ_ERROR 1
+#define LLREAD_VALIDMSG_TRIES 15
+#define LLREAD_TIMEOUT 15
+#define LLWRITE_ANSWER_TRIES 5
+#define LLWRITE_ANSWER_TIMEOUT 5
+#define READ_ERROR 1
 #define READ_RETURN_ALARM 2
-
-typedef enum {
-	FIRST,
-	MIDDLE,
-	LAST
-} frame_order_t;
-
-#define DEFAULT_RETRANSMISSIONS 3
-#define DEFAULT_TIMEOUT 15
-
-typedef struct {
-	int fd;
-	int mode;
-	unsigned int curr_seq_number;
-	unsigned int repeat;
-	frame_order_t frame_order;
-	unsigned num_sent_data_frames;
-	unsigned num_received_data_frames;
-	unsigned num_timeouts;
-	unsigned num_sent_REJs;
-	unsigned num_received_REJs;
-	int baudrate;
-	unsigned max_retransmissions;
-	unsigned timeout;
-} datalink_t;
-
-/*
- * Initializes all datalink parameters except fd(set to -1)
- */
-void datalink_init(datalink_t *datalink, unsigned int mode);
-
-/*
- * Starts the connection via serial-port, allowing for it to be either reader or writer
- * Returns 0 if OK, > 0 otherwise
- */
+
+typedef enum {
+	FIRST,
+	MIDDLE,
+	LAST
+} frame_order_t;
+
+#define DEFAULT_RETRANSMISSIONS 3
+#define DEFAULT_TIMEOUT 15
+#define DEFAULT_MAX_FRAME_LENGTH 1024
+
+#define PROBE_BURST 4
+#define PROBE_MIN_LENGTH 16
+#define PROBE_TIMEOUT_MARGIN_MS 500	/* on top of the time a probe and its echo take on the line */
+#define PROBE_TIMEOUT_FACTOR 4
+#define PROBE_TARGET_FAILURE 1e-6
+
+/*
+ * Results of the optional link characterisation done by llopen
+ */
+typedef struct {
+	unsigned num_sent;	/* of the lengths the receiver echoed at all, longer ones are left out */
+	unsigned num_lost;
+	double min_rtt;		/* seconds */
+	double avg_rtt;
+	double byte_rate;	/* line bytes per second, both directions */
+	unsigned frame_length;	/* information field length with the best goodput, 0 if not probed */
+} link_probe_t;
+
+struct frame_parser;
+
+/*
+ * Retransmission timer of one link, checked by get_frame while it waits for the port
+ */
+typedef struct {
+	const frame_t *frame;	/* resent on every timeout, NULL to only time out */
+	unsigned tries_left;
+	unsigned interval_ms;
+	double deadline;	/* monotonic seconds, 0 when stopped */
+} link_timer_t;
+
+/*
+ * State of one link. Links share nothing, each may run on its own thread.
+ */
+typedef struct {
+	transport_t transport;		/* the port, closed while its ops are NULL */
+	int mode;
+	unsigned int tx_seq_number;	/* next I frame sent by llwrite */
+	unsigned int rx_seq_number;	/* next I frame expected by llread */
+	unsigned int repeat;
+	frame_order_t frame_order;
+	unsigned num_sent_data_frames;
+	unsigned num_received_data_frames;
+	unsigned num_timeouts;
+	unsigned num_sent_REJs;
+	unsigned num_received_REJs;
+	unsigned num_sent_batches;	/* I frames that carried several packets */
+	int baudrate;
+	unsigned max_retransmissions;
+	unsigned timeout;
+	unsigned max_frame_length;
+	unsigned probe;
+	link_probe_t probe_results;
+	int keep_port;			/* llclose and llabort leave the port open and configured for the next llopen */
+	int listen;			/* receiver: llopen waits for a SET however long it takes */
+	unsigned char address;		/* of every frame of the link, A_NODE(n) on a multi-drop bus */
+	struct frame_parser *parser;
+	link_timer_t timer;
+	unsigned max_batch_length;	/* largest batch the peer takes, at most max_frame_length, 0 for none */
+	unsigned char *tx_batch;	/* packets queued by llqueue */
+	unsigned tx_batch_length;
+	unsigned tx_batch_packets;
+	unsigned char *rx_batch;	/* last batch received, llread hands out its packets one at a time */
+	unsigned rx_batch_length;
+	unsigned rx_batch_next;
+	unsigned char rx_buffer[MAX_BUFFER_LENGTH];
+	unsigned rx_start;
+	unsigned rx_end;
+} datalink_t;
+
+/*
+ * Initializes all datalink parameters, the transport is closed
+ */
+void datalink_init(datalink_t *datalink, unsigned int mode);
+
+/*
+ * Starts the connection via serial-port, allowing for it to be either reader or writer.
+ * The port is only opened (see transport_open) if datalink->transport is closed,
+ * otherwise the open one is reused: a kept port, or a pipe, socket or memory transport.
+ * If datalink->probe is set, the writer then measures the link with echo frames and
+ * seeds timeout, max_retransmissions and probe_results.frame_length from the results.
+ * Returns 0 if OK, > 0 otherwise
+ */
 int llopen(const char *filename, datalink_t *datalink);
-
-/*
- * Writes length bytes from buffer to fd
- * Return number of bytes written on success, -1 if error
- */
-int llwrite(datalink_t *datalink, const unsigned char *buffer, int length);
-
-/*
- * Reads from fd to buffer
- * Returns buffer size if ok, -1 if error
- */
-int llread(datalink_t *datalink, char * buffer);
-
-/*
- * Closes fd data link
- * Returns 0 if success, <0 on error
- */
-int llclose(datalink_t *datalink);
-
-
-#endif
+
+/*
+ * Writes length bytes from buffer to the link
+ * Return number of bytes written on success, -1 if error
+ */
+int llwrite(datalink_t *datalink, const unsigned char *buffer, int length);
+
+/*
+ * Escapes every FLAG and ESC byte of src into dst, which must hold 2 * length bytes
+ * Returns the stuffed length
+ */
+unsigned byte_stuffing(const unsigned char *src, unsigned length, unsigned char *dst);
+
+/*
+ * Reverses byte_stuffing, dst must hold length bytes
+ * Returns the destuffed length
+ */
+unsigned byte_destuffing(const unsigned char *src, unsigned length, unsigned char *dst);
+
+/*
+ * Worst-case size of a prepared information field of length bytes:
+ * every byte and the BCC2 stuffed, plus the closing FLAG
+ */
+#define LLPREPARE_MAX_LENGTH(length) (2 * (length) + 3)
+
+/*
+ * Builds the information field of a data frame (stuffed data and BCC2 followed
+ * by the closing FLAG) into stuffed, which must hold LLPREPARE_MAX_LENGTH(length) bytes.
+ * Does not touch the link, so it may run on a different thread than llwrite_prepared.
+ * Returns the number of bytes written to stuffed
+ */
+unsigned llprepare(const unsigned char *buffer, int length, unsigned char *stuffed);
+
+/*
+ * Same as llwrite, but for an information field already built by llprepare,
+ * sent as a batch if batch is set
+ * Return 0 on success, 1 if error
+ */
+int llwrite_prepared(datalink_t *datalink, const unsigned char *stuffed, unsigned stuffed_length, int batch);
+
+/*
+ * A batch packs several small packets into one information field, each as its
+ * length (2 bytes, big endian) followed by the packet, and is sent in a C_BATCH
+ * frame. The whole batch takes a single RR.
+ */
+#define LLBATCH_ENTRY_LENGTH(length) ((length) + 2)
+
+/*
+ * Appends packet to the batch_length bytes of a batch being built in batch, which must
+ * have LLBATCH_ENTRY_LENGTH(length) more bytes. Does not touch the link.
+ * Returns the new length of the batch
+ */
+unsigned llbatch_append(unsigned char *batch, unsigned batch_length, const unsigned char *packet, unsigned length);
+
+/*
+ * Queues a packet to share an I frame with the packets queued after it, while the
+ * batch fits in max_batch_length. The queue is sent once the next packet doesn't fit,
+ * by llflush, and ahead of any other llwrite, llread or llclose.
+ * Without max_batch_length, it is the same as llwrite.
+ * Return 0 on success, 1 if error
+ */
+int llqueue(datalink_t *datalink, const unsigned char *buffer, int length);
+
+/*
+ * Sends the packets queued by llqueue, if any
+ * Return 0 on success, 1 if error
+ */
+int llflush(datalink_t *datalink);
+
+/*
+ * Sends length bytes to every secondary of a multi-drop bus at once. Nobody
+ * acknowledges a broadcast, what a secondary misses is left for the caller to repair.
+ * Return 0 on success, 1 if error
+ */
+int llbroadcast(datalink_t *datalink, const unsigned char *buffer, int length);
+
+/*
+ * Reads from the link to buffer, which must hold max_frame_length bytes.
+ * The packets of a batch are returned by successive calls, and a
+ * secondary of a multi-drop bus also gets the master's broadcasts.
+ * Returns buffer size if ok, -1 if error
+ */
+int llread(datalink_t *datalink, char * buffer);
+
+/*
+ * Closes the data link, the port itself stays open if datalink->keep_port is set
+ * Returns 0 if success, <0 on error
+ */
+int llclose(datalink_t *datalink);
+
+/*
+ * Closes the port without the DISC handshake, once the link has failed
+ */
+void llabort(datalink_t *datalink);
+
+
+#endif
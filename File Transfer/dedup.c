@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "dedup.h"
+
+/* normalized chunking: boundaries are harder to find before the average size and easier after it */
+#define MASK_SMALL 0x0003590703530000ULL	/* 15 bits set */
+#define MASK_LARGE 0x0000D90003530000ULL	/* 11 bits set */
+
+uint64_t gear[256];
+pthread_once_t gear_once = PTHREAD_ONCE_INIT;	/* lists may be built on several threads at once */
+
+void init_gear();
+uint64_t cut_point(const unsigned char *data, uint64_t size);
+int add_chunk(dedup_list_t *list, uint64_t hash, uint32_t length);
+
+void init_gear() {
+	// splitmix64 from a fixed seed, chunk boundaries must never change between versions
+	uint64_t state = 0x5245434F4D2D3031ULL;
+	int i;
+	for(i = 0; i < 256; ++i) {
+		uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+		gear[i] = z ^ (z >> 31);
+	}
+}
+
+uint64_t cut_point(const unsigned char *data, uint64_t size) {
+	if(size <= DEDUP_MIN_CHUNK)
+		return size;
+	uint64_t end = (size < DEDUP_MAX_CHUNK) ? size : DEDUP_MAX_CHUNK;
+	uint64_t middle = (end < DEDUP_AVG_CHUNK) ? end : DEDUP_AVG_CHUNK;
+	uint64_t hash = 0;
+	uint64_t i;
+	for(i = DEDUP_MIN_CHUNK; i < middle; ++i) {
+		hash = (hash << 1) + gear[data[i]];
+		if(!(hash & MASK_SMALL))
+			return i + 1;
+	}
+	for(; i < end; ++i) {
+		hash = (hash << 1) + gear[data[i]];
+		if(!(hash & MASK_LARGE))
+			return i + 1;
+	}
+	return end;
+}
+
+void dedup_list_init(dedup_list_t *list) {
+	list->chunks = NULL;
+	list->num_chunks = 0;
+	list->capacity = 0;
+	list->wanted_size = 0;
+}
+
+void dedup_list_free(dedup_list_t *list) {
+	free(list->chunks);
+	dedup_list_init(list);
+}
+
+int add_chunk(dedup_list_t *list, uint64_t hash, uint32_t length) {
+	if(list->num_chunks == list->capacity) {
+		unsigned capacity = list->capacity ? 2 * list->capacity : 256;
+		dedup_chunk_t *chunks = realloc(list->chunks, capacity * sizeof(dedup_chunk_t));
+		if(chunks == NULL) {
+			printf("ERROR (add_chunk): unable to allocate memory\n");
+			return 1;
+		}
+		list->chunks = chunks;
+		list->capacity = capacity;
+	}
+	dedup_chunk_t *chunk = &list->chunks[list->num_chunks++];
+	chunk->hash = hash;
+	chunk->length = length;
+	chunk->wanted = 1;
+	list->wanted_size += length;
+	return 0;
+}
+
+int dedup_list_build(dedup_list_t *list, const unsigned char *data, uint64_t size, checksum_t *checksum) {
+	pthread_once(&gear_once, init_gear);
+	uint64_t offset = 0;
+	while(offset < size) {
+		uint64_t length = cut_point(&data[offset], size - offset);
+		if(add_chunk(list, checksum_buffer(&data[offset], length), length))
+			return 1;
+		checksum_update(checksum, &data[offset], length);
+		offset += length;
+	}
+	return 0;
+}
+
+unsigned dedup_encode_chunks(const dedup_list_t *list, unsigned *next, unsigned char *buffer, unsigned max) {
+	unsigned length = 0;
+	while(*next < list->num_chunks && length + DEDUP_ENTRY_SIZE <= max) {
+		const dedup_chunk_t *chunk = &list->chunks[*next];
+		int i;
+		for(i = 0; i < 8; ++i)
+			buffer[length++] = chunk->hash >> (8 * (7 - i));
+		for(i = 0; i < 4; ++i)
+			buffer[length++] = chunk->length >> (8 * (3 - i));
+		++*next;
+	}
+	return length;
+}
+
+int dedup_decode_chunks(dedup_list_t *list, const unsigned char *buffer, unsigned length) {
+	if(length % DEDUP_ENTRY_SIZE != 0) {
+		printf("ERROR (dedup_decode_chunks): truncated chunk list\n");
+		return 1;
+	}
+	unsigned i;
+	for(i = 0; i < length; i += DEDUP_ENTRY_SIZE) {
+		uint64_t hash = 0;
+		uint32_t chunk_length = 0;
+		int j;
+		for(j = 0; j < 8; ++j)
+			hash = (hash << 8) | buffer[i + j];
+		for(j = 8; j < DEDUP_ENTRY_SIZE; ++j)
+			chunk_length = (chunk_length << 8) | buffer[i + j];
+		if(chunk_length == 0 || chunk_length > DEDUP_MAX_CHUNK) {
+			printf("ERROR (dedup_decode_chunks): invalid chunk length %u\n", chunk_length);
+			return 1;
+		}
+		if(add_chunk(list, hash, chunk_length))
+			return 1;
+	}
+	return 0;
+}
+
+unsigned dedup_encode_wanted(const dedup_list_t *list, unsigned *next, unsigned char *buffer, unsigned max) {
+	unsigned length = 0;
+	while(*next < list->num_chunks && length < max) {
+		unsigned char byte = 0;
+		int bit;
+		for(bit = 0; bit < 8 && *next < list->num_chunks; ++bit, ++*next) {
+			if(list->chunks[*next].wanted)
+				byte |= 1 << bit;
+		}
+		buffer[length++] = byte;
+	}
+	return length;
+}
+
+int dedup_decode_wanted(dedup_list_t *list, unsigned *next, const unsigned char *buffer, unsigned length) {
+	unsigned i;
+	for(i = 0; i < length; ++i) {
+		int bit;
+		for(bit = 0; bit < 8 && *next < list->num_chunks; ++bit, ++*next) {
+			dedup_chunk_t *chunk = &list->chunks[*next];
+			int wanted = (buffer[i] >> bit) & 1;
+			if(chunk->wanted && !wanted)
+				list->wanted_size -= chunk->length;
+			chunk->wanted = wanted;
+		}
+	}
+	return 0;
+}
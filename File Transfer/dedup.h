@@ -0,0 +1,63 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdint.h>
+#include "checksum.h"
+
+#define DEDUP_MIN_CHUNK (2 << 10)
+#define DEDUP_AVG_CHUNK (8 << 10)
+#define DEDUP_MAX_CHUNK (64 << 10)
+#define DEDUP_ENTRY_SIZE 12	/* 8-byte hash and 4-byte length, both big-endian */
+
+/*
+ * Content-defined chunk of a file: boundaries depend only on the bytes
+ * around them, so the same data yields the same chunks in any file
+ */
+typedef struct {
+	uint64_t hash;
+	uint32_t length;
+	int wanted;	/* the receiver does not have it */
+} dedup_chunk_t;
+
+typedef struct {
+	dedup_chunk_t *chunks;
+	unsigned num_chunks;
+	unsigned capacity;
+	uint64_t wanted_size;	/* total length of the wanted chunks */
+} dedup_list_t;
+
+void dedup_list_init(dedup_list_t *list);
+void dedup_list_free(dedup_list_t *list);
+
+/*
+ * Splits size bytes of data into chunks, every one of them wanted, and
+ * hashes the whole of data into checksum on the way
+ * Returns 0 if OK, 1 otherwise
+ */
+int dedup_list_build(dedup_list_t *list, const unsigned char *data, uint64_t size, checksum_t *checksum);
+
+/*
+ * Serializes the chunks from *next on, as many as fit in max bytes
+ * Returns the number of bytes written
+ */
+unsigned dedup_encode_chunks(const dedup_list_t *list, unsigned *next, unsigned char *buffer, unsigned max);
+
+/*
+ * Appends the chunks serialized in buffer
+ * Returns 0 if OK, 1 otherwise
+ */
+int dedup_decode_chunks(dedup_list_t *list, const unsigned char *buffer, unsigned length);
+
+/*
+ * Serializes the wanted flags from chunk *next on as a bitmap, eight chunks per byte
+ * Returns the number of bytes written
+ */
+unsigned dedup_encode_wanted(const dedup_list_t *list, unsigned *next, unsigned char *buffer, unsigned max);
+
+/*
+ * Reads the wanted flags from chunk *next on, updating wanted_size
+ * Returns 0 if OK, 1 otherwise
+ */
+int dedup_decode_wanted(dedup_list_t *list, unsigned *next, const unsigned char *buffer, unsigned length);
+
+#endif
@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "delta.h"
+#include "checksum.h"
+
+unsigned bucket_of(const delta_index_t *index, uint32_t weak);
+void build_buckets(delta_index_t *index);
+void emit_literal(delta_scanner_t *scanner, uint64_t end, unsigned max_literal, delta_op_t *op);
+
+unsigned delta_block_size(uint64_t size) {
+	uint64_t block_size = (uint64_t)sqrt((double)size) & ~63ULL;
+	if(block_size < DELTA_MIN_BLOCK_SIZE)
+		return DELTA_MIN_BLOCK_SIZE;
+	if(block_size > DELTA_MAX_BLOCK_SIZE)
+		return DELTA_MAX_BLOCK_SIZE;
+	return block_size;
+}
+
+uint32_t rolling_checksum(const unsigned char *data, unsigned length) {
+	uint32_t a = 0, b = 0;
+	unsigned i;
+	for(i = 0; i < length; ++i) {
+		a += data[i];
+		b += (length - i) * data[i];
+	}
+	return (a & 0xFFFF) | (b << 16);
+}
+
+unsigned delta_encode_signatures(const unsigned char *basis, unsigned block_size, unsigned num_blocks, unsigned *next, unsigned char *buffer, unsigned max) {
+	unsigned length = 0;
+	while(*next < num_blocks && length + DELTA_SIGNATURE_SIZE <= max) {
+		const unsigned char *block = basis + (uint64_t)*next * block_size;
+		uint32_t weak = rolling_checksum(block, block_size);
+		uint64_t strong = checksum_buffer(block, block_size);
+		int i;
+		for(i = 0; i < 4; ++i)
+			buffer[length++] = weak >> (8 * (3 - i));
+		for(i = 0; i < 8; ++i)
+			buffer[length++] = strong >> (8 * (7 - i));
+		++*next;
+	}
+	return length;
+}
+
+int delta_index_init(delta_index_t *index, unsigned block_size, unsigned num_blocks) {
+	index->block_size = block_size;
+	index->num_blocks = num_blocks;
+	index->num_signatures = 0;
+	index->num_buckets = 1;
+	while(index->num_buckets < 2 * num_blocks)
+		index->num_buckets <<= 1;
+	index->weak = malloc(num_blocks * sizeof(uint32_t) + 1);
+	index->strong = malloc(num_blocks * sizeof(uint64_t) + 1);
+	index->next = malloc(num_blocks * sizeof(unsigned) + 1);
+	index->buckets = calloc(index->num_buckets, sizeof(unsigned));
+	if(index->weak == NULL || index->strong == NULL || index->next == NULL || index->buckets == NULL) {
+		printf("ERROR (delta_index_init): unable to allocate an index of %u blocks\n", num_blocks);
+		delta_index_destroy(index);
+		return 1;
+	}
+	return 0;
+}
+
+void delta_index_destroy(delta_index_t *index) {
+	free(index->weak);
+	free(index->strong);
+	free(index->next);
+	free(index->buckets);
+	index->weak = NULL;
+	index->strong = NULL;
+	index->next = NULL;
+	index->buckets = NULL;
+}
+
+unsigned bucket_of(const delta_index_t *index, uint32_t weak) {
+	return ((weak ^ (weak >> 15)) * 2654435761U) & (index->num_buckets - 1);
+}
+
+void build_buckets(delta_index_t *index) {
+	// inserted backwards so every chain is in block order, which keeps runs of copied blocks long
+	unsigned i = index->num_blocks;
+	while(i-- > 0) {
+		unsigned bucket = bucket_of(index, index->weak[i]);
+		index->next[i] = index->buckets[bucket];
+		index->buckets[bucket] = i + 1;
+	}
+}
+
+int delta_index_add(delta_index_t *index, const unsigned char *buffer, unsigned length) {
+	if(length % DELTA_SIGNATURE_SIZE != 0 || index->num_signatures + length / DELTA_SIGNATURE_SIZE > index->num_blocks) {
+		printf("ERROR (delta_index_add): unexpected signatures\n");
+		return 1;
+	}
+	unsigned i;
+	for(i = 0; i < length; i += DELTA_SIGNATURE_SIZE) {
+		uint32_t weak = 0;
+		uint64_t strong = 0;
+		int j;
+		for(j = 0; j < 4; ++j)
+			weak = (weak << 8) | buffer[i + j];
+		for(j = 4; j < DELTA_SIGNATURE_SIZE; ++j)
+			strong = (strong << 8) | buffer[i + j];
+		index->weak[index->num_signatures] = weak;
+		index->strong[index->num_signatures] = strong;
+		++index->num_signatures;
+	}
+	if(index->num_signatures == index->num_blocks)
+		build_buckets(index);
+	return 0;
+}
+
+int delta_index_find(const delta_index_t *index, uint32_t weak, const unsigned char *data) {
+	unsigned entry = index->buckets[bucket_of(index, weak)];
+	int hashed = 0;
+	uint64_t strong = 0;
+	for(; entry != 0; entry = index->next[entry - 1]) {
+		if(index->weak[entry - 1] != weak)
+			continue;
+		// the strong hash is only worth computing once the cheap one matched
+		if(!hashed) {
+			strong = checksum_buffer(data, index->block_size);
+			hashed = 1;
+		}
+		if(index->strong[entry - 1] == strong)
+			return entry - 1;
+	}
+	return -1;
+}
+
+void delta_scanner_init(delta_scanner_t *scanner, const delta_index_t *index, const unsigned char *data, uint64_t size) {
+	scanner->index = index;
+	scanner->data = data;
+	scanner->size = size;
+	scanner->position = 0;
+	scanner->literal = 0;
+	scanner->rolling = 0;
+}
+
+void emit_literal(delta_scanner_t *scanner, uint64_t end, unsigned max_literal, delta_op_t *op) {
+	op->copy = 0;
+	op->offset = scanner->literal;
+	op->size = end - scanner->literal;
+	if(op->size > max_literal)
+		op->size = max_literal;
+	scanner->literal += op->size;
+}
+
+int delta_scanner_next(delta_scanner_t *scanner, unsigned max_literal, delta_op_t *op) {
+	const delta_index_t *index = scanner->index;
+	unsigned block_size = index->block_size;
+	const unsigned char *data = scanner->data;
+	while(1) {
+		// too little left for a whole block, the rest is sent as it is
+		if(index->num_blocks == 0 || scanner->position + block_size > scanner->size) {
+			if(scanner->literal == scanner->size)
+				return 0;
+			emit_literal(scanner, scanner->size, max_literal, op);
+			return 1;
+		}
+		if(scanner->position - scanner->literal >= max_literal) {
+			emit_literal(scanner, scanner->position, max_literal, op);
+			return 1;
+		}
+
+		if(!scanner->rolling) {
+			uint32_t weak = rolling_checksum(&data[scanner->position], block_size);
+			scanner->a = weak & 0xFFFF;
+			scanner->b = weak >> 16;
+			scanner->rolling = 1;
+		}
+		uint32_t weak = (scanner->a & 0xFFFF) | (scanner->b << 16);
+		int block = delta_index_find(index, weak, &data[scanner->position]);
+		if(block >= 0) {
+			// whatever precedes the match goes first
+			if(scanner->literal < scanner->position) {
+				emit_literal(scanner, scanner->position, max_literal, op);
+				return 1;
+			}
+			unsigned num_blocks = 1;
+			while(num_blocks < DELTA_MAX_RUN && block + num_blocks < index->num_blocks
+					&& scanner->position + (uint64_t)(num_blocks + 1) * block_size <= scanner->size) {
+				const unsigned char *next = &data[scanner->position + (uint64_t)num_blocks * block_size];
+				if(rolling_checksum(next, block_size) != index->weak[block + num_blocks]
+						|| checksum_buffer(next, block_size) != index->strong[block + num_blocks])
+					break;
+				++num_blocks;
+			}
+			op->copy = 1;
+			op->offset = scanner->position;
+			op->size = (uint64_t)num_blocks * block_size;
+			op->first_block = block;
+			op->num_blocks = num_blocks;
+			scanner->position += op->size;
+			scanner->literal = scanner->position;
+			scanner->rolling = 0;
+			return 1;
+		}
+
+		// slide the window by one byte
+		if(scanner->position + block_size < scanner->size) {
+			uint32_t out = data[scanner->position];
+			uint32_t in = data[scanner->position + block_size];
+			scanner->a += in - out;
+			scanner->b += scanner->a - block_size * out;
+		}
+		++scanner->position;
+	}
+}
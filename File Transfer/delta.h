@@ -0,0 +1,89 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stdint.h>
+
+#define DELTA_SIGNATURE_SIZE 12		/* 4-byte rolling checksum and 8-byte strong hash, both big-endian */
+#define DELTA_MIN_BLOCK_SIZE 512
+#define DELTA_MAX_BLOCK_SIZE (64 << 10)
+#define DELTA_MAX_RUN 0xFFFF		/* blocks per copy instruction */
+
+/*
+ * Signatures of the fixed-size blocks of the receiver's copy of a file,
+ * looked up by rolling checksum first and confirmed by strong hash
+ */
+typedef struct {
+	unsigned block_size;
+	unsigned num_blocks;
+	unsigned num_signatures;	/* received so far */
+	uint32_t *weak;
+	uint64_t *strong;
+	unsigned *buckets;		/* first block + 1 of each hash chain, 0 if empty */
+	unsigned *next;			/* next block + 1 in the same chain */
+	unsigned num_buckets;		/* always a power of two */
+} delta_index_t;
+
+/*
+ * One instruction of the delta, either size bytes at offset of the new file
+ * to be sent as they are, or num_blocks of the receiver's blocks from first_block on
+ */
+typedef struct {
+	int copy;
+	uint64_t offset;
+	uint64_t size;
+	unsigned first_block;
+	unsigned num_blocks;
+} delta_op_t;
+
+/*
+ * Walks the new file, looking for the receiver's blocks at every byte offset
+ */
+typedef struct {
+	const delta_index_t *index;
+	const unsigned char *data;
+	uint64_t size;
+	uint64_t position;	/* start of the window being matched */
+	uint64_t literal;	/* start of the bytes not yet handed out */
+	uint32_t a, b;		/* rolling checksum of the window */
+	int rolling;		/* 0 when a, b must be recomputed */
+} delta_scanner_t;
+
+/*
+ * Block size for a basis file of size bytes, about its square root
+ */
+unsigned delta_block_size(uint64_t size);
+
+uint32_t rolling_checksum(const unsigned char *data, unsigned length);
+
+/*
+ * Serializes the signatures of the blocks of basis from *next on, as many as fit in max bytes
+ * Returns the number of bytes written
+ */
+unsigned delta_encode_signatures(const unsigned char *basis, unsigned block_size, unsigned num_blocks, unsigned *next, unsigned char *buffer, unsigned max);
+
+/*
+ * Returns 0 if OK, 1 otherwise
+ */
+int delta_index_init(delta_index_t *index, unsigned block_size, unsigned num_blocks);
+void delta_index_destroy(delta_index_t *index);
+
+/*
+ * Appends the signatures serialized in buffer, the index can be searched once all arrived
+ * Returns 0 if OK, 1 otherwise
+ */
+int delta_index_add(delta_index_t *index, const unsigned char *buffer, unsigned length);
+
+/*
+ * Returns the index of a block with the same contents as data, -1 if there is none
+ */
+int delta_index_find(const delta_index_t *index, uint32_t weak, const unsigned char *data);
+
+void delta_scanner_init(delta_scanner_t *scanner, const delta_index_t *index, const unsigned char *data, uint64_t size);
+
+/*
+ * Hands out the next instruction, literal runs being at most max_literal bytes long
+ * Returns 1 if an instruction was stored in op, 0 at the end of the file
+ */
+int delta_scanner_next(delta_scanner_t *scanner, unsigned max_literal, delta_op_t *op);
+
+#endif
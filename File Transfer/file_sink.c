@@ -0,0 +1,260 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "file_sink.h"
+#include "checkpoint.h"
+
+int file_sink_checkpoint(file_sink_t *sink);
+int init_sink(file_sink_t *sink, file_sink_kind_t kind, uint64_t size, int buffered);
+int write_fully(file_sink_t *sink, const unsigned char *data, unsigned length, uint64_t position);
+int write_zeros(file_sink_t *sink, uint64_t length);
+
+int init_sink(file_sink_t *sink, file_sink_kind_t kind, uint64_t size, int buffered) {
+	sink->kind = kind;
+	sink->path = NULL;
+	sink->fd = -1;
+	sink->base = 0;
+	sink->memory = NULL;
+	sink->write = NULL;
+	sink->context = NULL;
+	sink->random_access = 0;
+	sink->size = size;
+	sink->offset = 0;
+	sink->buffer = NULL;
+	sink->buffered = 0;
+	sink->resumable = 0;
+	checksum_init(&sink->checksum);
+	if(buffered && posix_memalign((void **)&sink->buffer, SINK_ALIGNMENT, SINK_BATCH_SIZE)) {
+		printf("ERROR (file_sink_open): unable to allocate %d bytes of memory\n", SINK_BATCH_SIZE);
+		sink->buffer = NULL;
+		return 1;
+	}
+	return 0;
+}
+
+int file_sink_open(file_sink_t *sink, const char *path, uint64_t size, uint64_t offset, const checksum_t *checksum) {
+	if(init_sink(sink, SINK_FILE, size, 1))
+		return 1;
+	if((sink->fd = open(path, O_WRONLY | O_CREAT | (offset == 0 ? O_TRUNC : 0), 0644)) < 0) {
+		perror("Error creating output file");
+		free(sink->buffer);
+		return 1;
+	}
+	// bytes past the checkpoint were never confirmed to be on disk
+	if(offset > 0 && ftruncate(sink->fd, offset) < 0) {
+		perror("Error truncating output file");
+		free(sink->buffer);
+		close(sink->fd);
+		return 1;
+	}
+	if((sink->path = strdup(path)) == NULL) {
+		printf("ERROR (file_sink_open): unable to allocate memory\n");
+		free(sink->buffer);
+		close(sink->fd);
+		return 1;
+	}
+	sink->offset = offset;
+	sink->resumable = 1;
+	sink->random_access = 1;
+	if(checksum != NULL)
+		sink->checksum = *checksum;
+
+	// reserve the blocks without changing the size, so an interrupted transfer is not mistaken for a complete one
+	if(size > offset && fallocate(sink->fd, FALLOC_FL_KEEP_SIZE, offset, size - offset) < 0 && errno != EOPNOTSUPP && errno != ENOSYS) {
+		perror("Error preallocating output file");
+		free(sink->path);
+		free(sink->buffer);
+		close(sink->fd);
+		return 1;
+	}
+	return 0;
+}
+
+int file_sink_open_fd(file_sink_t *sink, int fd, uint64_t size) {
+	struct stat st;
+	if(fstat(fd, &st) < 0) {
+		perror("Error reading output file attributes");
+		return 1;
+	}
+	if(init_sink(sink, SINK_FD, size, 1))
+		return 1;
+	sink->fd = fd;
+	if(S_ISREG(st.st_mode)) {
+		off_t position = lseek(fd, 0, SEEK_CUR);
+		sink->random_access = (position >= 0);
+		sink->base = (position >= 0) ? (uint64_t)position : 0;
+	}
+	return 0;
+}
+
+void file_sink_open_memory(file_sink_t *sink, unsigned char *memory, uint64_t size) {
+	// copied straight into place, nothing to coalesce
+	init_sink(sink, SINK_MEMORY, size, 0);
+	sink->memory = memory;
+	sink->random_access = 1;
+}
+
+int file_sink_open_callback(file_sink_t *sink, uint64_t size, file_sink_callback_t write, void *context) {
+	if(init_sink(sink, SINK_CALLBACK, size, 1))
+		return 1;
+	sink->write = write;
+	sink->context = context;
+	return 0;
+}
+
+int file_sink_write(file_sink_t *sink, const unsigned char *data, unsigned length) {
+	if(sink->kind == SINK_MEMORY) {
+		checksum_update(&sink->checksum, data, length);
+		if(write_fully(sink, data, length, sink->offset))
+			return 1;
+		sink->offset += length;
+		return 0;
+	}
+	while(length > 0) {
+		// a resumed file starts mid-batch, so batches end at multiples of SINK_BATCH_SIZE
+		unsigned room = SINK_BATCH_SIZE - sink->offset % SINK_BATCH_SIZE - sink->buffered;
+		unsigned n = length < room ? length : room;
+		memcpy(&sink->buffer[sink->buffered], data, n);
+		// hashed before a flush can happen, so the checkpoint's state covers exactly its offset
+		checksum_update(&sink->checksum, data, n);
+		sink->buffered += n;
+		data += n;
+		length -= n;
+		if(n == room && file_sink_flush(sink))
+			return 1;
+	}
+	return 0;
+}
+
+int write_fully(file_sink_t *sink, const unsigned char *data, unsigned length, uint64_t position) {
+	if(sink->kind == SINK_MEMORY) {
+		if(position > sink->size || length > sink->size - position) {
+			printf("ERROR (file_sink): more data than the %llu bytes announced\n", (unsigned long long)sink->size);
+			return 1;
+		}
+		if(length > 0)
+			memcpy(&sink->memory[position], data, length);
+		return 0;
+	}
+	if(sink->kind == SINK_CALLBACK)
+		return length > 0 && sink->write(sink->context, data, length);
+
+	unsigned written = 0;
+	while(written < length) {
+		ssize_t ret = sink->random_access
+			? pwrite(sink->fd, &data[written], length - written, sink->base + position + written)
+			: write(sink->fd, &data[written], length - written);
+		if(ret < 0) {
+			if(errno == EINTR)
+				continue;
+			perror("Error writing to output file");
+			return 1;
+		}
+		written += ret;
+	}
+	return 0;
+}
+
+int write_zeros(file_sink_t *sink, uint64_t length) {
+	if(sink->kind == SINK_MEMORY) {
+		if(sink->offset > sink->size || length > sink->size - sink->offset) {
+			printf("ERROR (file_sink): more data than the %llu bytes announced\n", (unsigned long long)sink->size);
+			return 1;
+		}
+		memset(&sink->memory[sink->offset], 0, length);
+		return 0;
+	}
+	// the buffer is empty after a flush
+	memset(sink->buffer, 0, length < SINK_BATCH_SIZE ? length : SINK_BATCH_SIZE);
+	uint64_t done = 0;
+	while(done < length) {
+		unsigned n = (length - done < SINK_BATCH_SIZE) ? length - done : SINK_BATCH_SIZE;
+		if(write_fully(sink, sink->buffer, n, sink->offset + done))
+			return 1;
+		done += n;
+	}
+	return 0;
+}
+
+int file_sink_write_at(file_sink_t *sink, const unsigned char *data, unsigned length, uint64_t position) {
+	if(!sink->random_access) {
+		printf("ERROR (file_sink_write_at): the sink can only be written in order\n");
+		return 1;
+	}
+	return write_fully(sink, data, length, position);
+}
+
+int file_sink_skip(file_sink_t *sink, uint64_t length) {
+	if(file_sink_flush(sink))
+		return 1;
+	if(sink->kind != SINK_FILE) {
+		// only a file of our own can be extended and punched without touching anything of the caller's
+		if(write_zeros(sink, length))
+			return 1;
+	} else {
+		// extended over the run first, holes are not punched past the end of a file
+		if(ftruncate(sink->fd, sink->offset + length) < 0) {
+			perror("Error extending output file");
+			return 1;
+		}
+		// the file was truncated at the offset when opened, so the run already reads back as zeros
+		if(fallocate(sink->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, sink->offset, length) < 0 && errno != EOPNOTSUPP && errno != ENOSYS) {
+			perror("Error punching a hole in output file");
+			return 1;
+		}
+	}
+	checksum_update_zeros(&sink->checksum, length);
+	sink->offset += length;
+	return file_sink_checkpoint(sink);
+}
+
+int file_sink_flush(file_sink_t *sink) {
+	if(write_fully(sink, sink->buffer, sink->buffered, sink->offset))
+		return 1;
+	sink->offset += sink->buffered;
+	sink->buffered = 0;
+	return file_sink_checkpoint(sink);
+}
+
+int file_sink_checkpoint(file_sink_t *sink) {
+	if(!sink->resumable)
+		return 0;
+	if(fdatasync(sink->fd) < 0) {
+		perror("Error syncing output file");
+		return 1;
+	}
+	checkpoint_t checkpoint;
+	checkpoint.size = sink->size;
+	checkpoint.offset = sink->offset;
+	checkpoint.checksum = sink->checksum;
+	return checkpoint_save(sink->path, &checkpoint);
+}
+
+int file_sink_close(file_sink_t *sink) {
+	int ret = file_sink_flush(sink);
+	free(sink->buffer);
+	sink->buffer = NULL;
+	if(sink->kind == SINK_FILE && close(sink->fd) < 0) {
+		perror("Error closing output file");
+		ret = 1;
+	}
+	free(sink->path);
+	sink->path = NULL;
+	return ret;
+}
+
+int file_sink_finish(file_sink_t *sink) {
+	if(!sink->resumable)
+		return file_sink_close(sink);
+	char path[strlen(sink->path) + 1];
+	strcpy(path, sink->path);
+	if(file_sink_close(sink))
+		return 1;
+	checkpoint_remove(path);
+	return 0;
+}
@@ -0,0 +1,114 @@
+#ifndef FILE_SINK_H
+#define FILE_SINK_H
+
+#include <stdint.h>
+#include "checksum.h"
+
+#define SINK_BATCH_SIZE (1 << 20)
+#define SINK_ALIGNMENT 4096
+
+typedef enum {
+	SINK_FILE,		/* created at path, closed with the sink */
+	SINK_FD,		/* descriptor owned by the caller */
+	SINK_MEMORY,		/* caller's buffer of the file's size */
+	SINK_CALLBACK		/* handed to a write callback in file order */
+} file_sink_kind_t;
+
+/*
+ * Consumes the next length bytes of the file
+ * Returns 0 if OK, 1 otherwise
+ */
+typedef int (*file_sink_callback_t)(void *context, const unsigned char *data, unsigned length);
+
+/*
+ * Sequential writer for a file of known size. The whole size is reserved up
+ * front so the file does not fragment, and small packets are coalesced into
+ * SINK_BATCH_SIZE writes at aligned offsets. After every batch the data is
+ * synced and a checkpoint records how far the file is complete. Everything
+ * written is also hashed while it is still in cache.
+ * Only sinks created at a path are resumable; the others can stand in for
+ * them anywhere else.
+ */
+typedef struct {
+	file_sink_kind_t kind;
+	char *path;		/* NULL unless created at a path */
+	int fd;			/* -1 for memory and callback sinks */
+	uint64_t base;		/* position of the file's first byte in fd */
+	unsigned char *memory;
+	file_sink_callback_t write;
+	void *context;
+	int random_access;	/* file_sink_write_at can be used */
+	uint64_t size;		/* size announced by the sender */
+	uint64_t offset;	/* file offset of the first buffered byte */
+	unsigned char *buffer;
+	unsigned buffered;
+	checksum_t checksum;	/* of every byte written so far, buffered or not */
+	int resumable;		/* set to 0 after opening to skip the syncs and checkpoints */
+} file_sink_t;
+
+/*
+ * Opens path for writing from offset on (anything past it is discarded),
+ * creating it if needed, and reserves size bytes for it. checksum is the
+ * state of the bytes before offset, NULL when starting from scratch.
+ * Returns 0 if OK, 1 otherwise
+ */
+int file_sink_open(file_sink_t *sink, const char *path, uint64_t size, uint64_t offset, const checksum_t *checksum);
+
+/*
+ * Writes size bytes to fd from its current position on. Regular files can
+ * be written at random, anything else is written to in order.
+ * Returns 0 if OK, 1 otherwise
+ */
+int file_sink_open_fd(file_sink_t *sink, int fd, uint64_t size);
+
+/*
+ * Writes size bytes into memory, which must hold them
+ */
+void file_sink_open_memory(file_sink_t *sink, unsigned char *memory, uint64_t size);
+
+/*
+ * Hands size bytes to write, in order
+ * Returns 0 if OK, 1 otherwise
+ */
+int file_sink_open_callback(file_sink_t *sink, uint64_t size, file_sink_callback_t write, void *context);
+
+/*
+ * Appends length bytes
+ * Returns 0 if OK, 1 otherwise
+ */
+int file_sink_write(file_sink_t *sink, const unsigned char *data, unsigned length);
+
+/*
+ * Appends length zero bytes, as a hole releasing the blocks reserved for them
+ * in a file created at a path
+ * Returns 0 if OK, 1 otherwise
+ */
+int file_sink_skip(file_sink_t *sink, uint64_t length);
+
+/*
+ * Writes length bytes at position, bypassing the buffer and the checksum.
+ * Safe to call from several threads at once, as long as nothing is buffered.
+ * Only for sinks with random_access set.
+ * Returns 0 if OK, 1 otherwise
+ */
+int file_sink_write_at(file_sink_t *sink, const unsigned char *data, unsigned length, uint64_t position);
+
+/*
+ * Writes out whatever is still buffered
+ * Returns 0 if OK, 1 otherwise
+ */
+int file_sink_flush(file_sink_t *sink);
+
+/*
+ * Flushes and closes the file, keeping the checkpoint so the transfer can be resumed
+ * Returns 0 if OK, 1 otherwise
+ */
+int file_sink_close(file_sink_t *sink);
+
+/*
+ * Same as file_sink_close for a file received in full, whose checkpoint is removed
+ * Returns 0 if OK, 1 otherwise
+ */
+int file_sink_finish(file_sink_t *sink);
+
+#endif
@@ -0,0 +1,255 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "file_source.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define MIN(A, B) (((A) < (B)) ? (A) : (B))
+
+void init_source(file_source_t *source, file_source_kind_t kind, uint64_t size);
+void advise_windows(file_source_t *source);
+void locate_data(file_source_t *source, uint64_t position);
+int all_zero(const unsigned char *data, unsigned length);
+uint64_t zero_run(file_source_t *source, uint64_t position);
+
+int file_source_open(file_source_t *source, const char *file_name) {
+	int fd = open(file_name, O_RDONLY);
+	if(fd < 0) {
+		perror("Error opening file");
+		return 1;
+	}
+	if(file_source_open_fd(source, fd)) {
+		close(fd);
+		return 1;
+	}
+	source->kind = SOURCE_FILE;
+	return 0;
+}
+
+int file_source_open_fd(file_source_t *source, int fd) {
+	struct stat st;
+	if(fstat(fd, &st) < 0) {
+		perror("Error reading file size");
+		return 1;
+	}
+	init_source(source, SOURCE_FD, st.st_size);
+	source->fd = fd;
+
+	if(S_ISREG(st.st_mode) && source->size > 0) {
+		void *map = mmap(NULL, source->size, PROT_READ, MAP_PRIVATE, source->fd, 0);
+		if(map != MAP_FAILED) {
+			source->map = map;
+			madvise(map, source->size, MADV_SEQUENTIAL);
+		}
+	}
+	if(source->map == NULL)
+		posix_fadvise(source->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	return 0;
+}
+
+void file_source_open_memory(file_source_t *source, const unsigned char *data, uint64_t size) {
+	init_source(source, SOURCE_MEMORY, size);
+	source->map = data;
+}
+
+void file_source_open_callback(file_source_t *source, uint64_t size, file_source_callback_t read, void *context) {
+	init_source(source, SOURCE_CALLBACK, size);
+	source->read = read;
+	source->context = context;
+}
+
+void init_source(file_source_t *source, file_source_kind_t kind, uint64_t size) {
+	source->kind = kind;
+	source->fd = -1;
+	source->read = NULL;
+	source->context = NULL;
+	source->size = size;
+	source->offset = 0;
+	source->next_window = 0;
+	source->map = NULL;
+	source->data_start = 0;
+	source->data_end = 0;
+	source->run_start = UINT64_MAX;
+}
+
+void file_source_close(file_source_t *source) {
+	if(source->map != NULL && source->kind != SOURCE_MEMORY)
+		munmap((void *)source->map, source->size);
+	source->map = NULL;
+	if(source->kind == SOURCE_FILE)
+		close(source->fd);
+}
+
+int file_source_seek(file_source_t *source, uint64_t offset) {
+	if(offset > source->size) {
+		printf("ERROR (file_source_seek): offset past the end of the file\n");
+		return 1;
+	}
+	if(source->kind == SOURCE_CALLBACK && offset != source->offset) {
+		printf("ERROR (file_source_seek): a callback source cannot be rewound or skipped\n");
+		return 1;
+	}
+	if(source->map == NULL && source->fd >= 0 && lseek(source->fd, offset, SEEK_SET) < 0) {
+		perror("Error seeking in file");
+		return 1;
+	}
+	source->offset = offset;
+	source->next_window = offset - offset % SOURCE_WINDOW_SIZE;
+	source->data_end = 0;
+	return 0;
+}
+
+void advise_windows(file_source_t *source) {
+	uint64_t window = source->next_window;
+	source->next_window += SOURCE_WINDOW_SIZE;
+	// the caller's memory has no file behind it, dropped pages would be lost
+	if(source->kind == SOURCE_MEMORY)
+		return;
+	uint64_t ahead = MIN(SOURCE_WINDOW_SIZE, source->size - window);
+	madvise((void *)(source->map + window), ahead, MADV_WILLNEED);
+	if(window >= 2 * SOURCE_WINDOW_SIZE) {
+		// well behind anything still queued for framing, pages are re-read from the file if ever needed
+		madvise((void *)(source->map + window - 2 * SOURCE_WINDOW_SIZE), SOURCE_WINDOW_SIZE, MADV_DONTNEED);
+	}
+}
+
+int file_source_next(file_source_t *source, unsigned char *buffer, unsigned max, const unsigned char **data) {
+	if(source->kind == SOURCE_CALLBACK) {
+		if(source->offset >= source->size)
+			return 0;
+		int num_read = source->read(source->context, buffer, MIN(max, source->size - source->offset));
+		if(num_read < 0) {
+			printf("ERROR (file_source_next): read callback failed\n");
+			return -1;
+		}
+		source->offset += num_read;
+		*data = buffer;
+		return num_read;
+	}
+	if(source->map == NULL) {
+		int num_read = read(source->fd, buffer, max);
+		if(num_read < 0) {
+			perror("Error reading file");
+			return -1;
+		}
+		source->offset += num_read;
+		*data = buffer;
+		return num_read;
+	}
+
+	if(source->offset >= source->size)
+		return 0;
+	if(source->offset >= source->next_window)
+		advise_windows(source);
+	unsigned length = MIN(max, source->size - source->offset);
+	*data = source->map + source->offset;
+	source->offset += length;
+	return length;
+}
+
+void locate_data(file_source_t *source, uint64_t position) {
+	off_t data = lseek(source->fd, position, SEEK_DATA);
+	if(data < 0) {
+		// ENXIO is a hole up to the end, anything else means the file system cannot tell
+		source->data_start = (errno == ENXIO) ? source->size : position;
+		source->data_end = source->size;
+		return;
+	}
+	off_t hole = lseek(source->fd, data, SEEK_HOLE);
+	source->data_start = data;
+	source->data_end = (hole < 0) ? source->size : (uint64_t)hole;
+}
+
+int all_zero(const unsigned char *data, unsigned length) {
+	unsigned i = 0;
+#if defined(__SSE2__)
+	// 64 bytes ORed together per step, then a single compare against zero
+	const __m128i zero = _mm_setzero_si128();
+	for(; i + 64 <= length; i += 64) {
+		__m128i v = _mm_or_si128(
+				_mm_or_si128(_mm_loadu_si128((const __m128i *)&data[i]), _mm_loadu_si128((const __m128i *)&data[i + 16])),
+				_mm_or_si128(_mm_loadu_si128((const __m128i *)&data[i + 32]), _mm_loadu_si128((const __m128i *)&data[i + 48])));
+		if(_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xFFFF)
+			return 0;
+	}
+#endif
+	for(; i < length; ++i) {
+		if(data[i])
+			return 0;
+	}
+	return 1;
+}
+
+uint64_t zero_run(file_source_t *source, uint64_t position) {
+	if(position == source->run_start)
+		return source->run_length;
+	uint64_t end = position;
+	while(end < source->size) {
+		if(end >= source->data_end)
+			locate_data(source, end);
+		if(end < source->data_start) {
+			// a hole, skipped without touching its pages
+			end = source->data_start;
+			continue;
+		}
+		// only whole blocks of zeros, or the tail of the file
+		if(end % SPARSE_BLOCK_SIZE != 0)
+			break;
+		unsigned length = MIN(SPARSE_BLOCK_SIZE, source->size - end);
+		if(!all_zero(source->map + end, length))
+			break;
+		end += length;
+	}
+	source->run_start = position;
+	source->run_length = end - position;
+	return source->run_length;
+}
+
+int file_source_next_data(file_source_t *source, unsigned max, const unsigned char **data, uint64_t *zeros) {
+	*zeros = 0;
+	if(source->offset >= source->size)
+		return 0;
+	if((*zeros = zero_run(source, source->offset)) > 0) {
+		source->offset += *zeros;
+		source->next_window = source->offset - source->offset % SOURCE_WINDOW_SIZE;
+		return 0;
+	}
+	if(source->offset >= source->next_window)
+		advise_windows(source);
+	unsigned length = MIN(max, source->size - source->offset);
+	// a run starting inside this piece is left for the next call
+	uint64_t boundary = source->offset - source->offset % SPARSE_BLOCK_SIZE + SPARSE_BLOCK_SIZE;
+	if(boundary < source->offset + length && zero_run(source, boundary) > 0)
+		length = boundary - source->offset;
+	*data = source->map + source->offset;
+	source->offset += length;
+	return length;
+}
+
+int file_source_checksum(file_source_t *source, uint64_t length, checksum_t *checksum) {
+	if(file_source_seek(source, 0))
+		return 1;
+	unsigned char *buffer = NULL;
+	if(source->map == NULL && (buffer = malloc(SOURCE_WINDOW_SIZE)) == NULL) {
+		printf("ERROR (file_source_checksum): unable to allocate %d bytes of memory\n", SOURCE_WINDOW_SIZE);
+		return 1;
+	}
+	while(source->offset < length) {
+		const unsigned char *data;
+		int n = file_source_next(source, buffer, MIN(SOURCE_WINDOW_SIZE, length - source->offset), &data);
+		if(n <= 0) {
+			free(buffer);
+			return 1;
+		}
+		checksum_update(checksum, data, n);
+	}
+	free(buffer);
+	return 0;
+}
@@ -0,0 +1,93 @@
+#ifndef FILE_SOURCE_H
+#define FILE_SOURCE_H
+
+#include <stdint.h>
+#include "checksum.h"
+
+#define SOURCE_WINDOW_SIZE (1 << 20)
+#define SPARSE_BLOCK_SIZE 4096	/* smallest run of zeros worth skipping */
+
+typedef enum {
+	SOURCE_FILE,		/* opened by path, closed with the source */
+	SOURCE_FD,		/* descriptor owned by the caller */
+	SOURCE_MEMORY,		/* caller's buffer, read in place as if it were a mapping */
+	SOURCE_CALLBACK		/* streamed from a read callback */
+} file_source_kind_t;
+
+/*
+ * Fills buffer with the next (up to) max bytes of the source
+ * Returns the number of bytes, -1 on error
+ */
+typedef int (*file_source_callback_t)(void *context, unsigned char *buffer, unsigned max);
+
+/*
+ * Sequential reader of a file of any size. Regular files are mapped and read
+ * in place, with the kernel told to fetch the next window ahead of the cursor
+ * and to drop the ones already sent, so memory use stays constant. Anything
+ * that cannot be mapped is streamed with read() instead.
+ */
+typedef struct {
+	file_source_kind_t kind;
+	int fd;			/* -1 for memory and callback sources */
+	file_source_callback_t read;
+	void *context;
+	uint64_t size;
+	uint64_t offset;
+	const unsigned char *map;	/* NULL when streaming */
+	uint64_t next_window;
+	uint64_t data_start;	/* data region around the cursor, from SEEK_DATA and SEEK_HOLE */
+	uint64_t data_end;
+	uint64_t run_start;	/* last zero run measured */
+	uint64_t run_length;
+} file_source_t;
+
+/*
+ * Returns 0 if OK, 1 otherwise
+ */
+int file_source_open(file_source_t *source, const char *file_name);
+
+/*
+ * Reads the file behind fd, which stays open after file_source_close
+ * Returns 0 if OK, 1 otherwise
+ */
+int file_source_open_fd(file_source_t *source, int fd);
+
+/*
+ * Reads size bytes of data, which must outlive the source
+ */
+void file_source_open_memory(file_source_t *source, const unsigned char *data, uint64_t size);
+
+/*
+ * Reads size bytes from read. Such a source can only be read from start to end.
+ */
+void file_source_open_callback(file_source_t *source, uint64_t size, file_source_callback_t read, void *context);
+void file_source_close(file_source_t *source);
+
+/*
+ * Moves the cursor to offset
+ * Returns 0 if OK, 1 otherwise
+ */
+int file_source_seek(file_source_t *source, uint64_t offset);
+
+/*
+ * Hands out the next (up to) max bytes: *data points either into the mapping
+ * or into buffer, which must hold max bytes.
+ * Returns the number of bytes, 0 at the end of the file, -1 on error
+ */
+int file_source_next(file_source_t *source, unsigned char *buffer, unsigned max, const unsigned char **data);
+
+/*
+ * Same as file_source_next for a mapped file, but stops short of holes and
+ * of runs of zero blocks. At one of them nothing is handed out: the cursor
+ * moves past the run and *zeros is set to its length.
+ * Returns the number of bytes, 0 at the end of the file or of a run, -1 on error
+ */
+int file_source_next_data(file_source_t *source, unsigned max, const unsigned char **data, uint64_t *zeros);
+
+/*
+ * Hashes the first length bytes into checksum, leaving the cursor at length
+ * Returns 0 if OK, 1 otherwise
+ */
+int file_source_checksum(file_source_t *source, uint64_t length, checksum_t *checksum);
+
+#endif
@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "frame_parser.h"
+
+int valid_control_field(unsigned char byte, frame_type_t *type);
+void parser_error(frame_parser_t *parser, frame_parser_error_t error);
+
+int frame_parser_init(frame_parser_t *parser, unsigned max_length, frame_parser_callback_t on_frame, frame_parser_error_callback_t on_error, void *context) {
+	// one extra byte for the BCC2, which travels at the end of the information field
+	if((parser->buffer = malloc(max_length + 1)) == NULL) {
+		printf("ERROR (frame_parser_init): unable to allocate %d bytes of memory\n", max_length + 1);
+		return 1;
+	}
+	parser->max_length = max_length;
+	parser->on_frame = on_frame;
+	parser->on_error = on_error;
+	parser->context = context;
+	parser->num_bad_headers = 0;
+	parser->num_bad_escapes = 0;
+	parser->num_oversized_frames = 0;
+	parser->multidrop = 0;
+	frame_parser_reset(parser);
+	return 0;
+}
+
+void frame_parser_destroy(frame_parser_t *parser) {
+	free(parser->buffer);
+	parser->buffer = NULL;
+}
+
+void frame_parser_reset(frame_parser_t *parser) {
+	parser->state = START;
+	parser->escaped = 0;
+	parser->length = 0;
+}
+
+int valid_control_field(unsigned char byte, frame_type_t *type) {
+	if(byte == C_SET || byte == C_UA || byte == C_DISC || byte == C_REJ(0) || byte == C_REJ(1) || byte == C_RR(0) || byte == C_RR(1)) {
+		*type = CMD_FRAME;
+		return 1;
+	}
+	if(byte == C_DATA(0) || byte == C_DATA(1) || byte == C_BATCH(0) || byte == C_BATCH(1) || byte == C_PROBE) {
+		*type = DATA_FRAME;
+		return 1;
+	}
+	return 0;
+}
+
+void parser_error(frame_parser_t *parser, frame_parser_error_t error) {
+	switch(error) {
+	case PARSER_BAD_HEADER:
+		++parser->num_bad_headers;
+		break;
+	case PARSER_BAD_ESCAPE:
+		++parser->num_bad_escapes;
+		break;
+	case PARSER_OVERSIZED:
+		++parser->num_oversized_frames;
+		break;
+	}
+	if(parser->on_error != NULL)
+		parser->on_error(parser->context, error);
+}
+
+size_t frame_parser_feed(frame_parser_t *parser, const unsigned char *bytes, size_t length) {
+	frame_t *frame = &parser->frame;
+	size_t i;
+	for(i = 0; i < length; ++i) {
+		unsigned char byte = bytes[i];
+
+		switch(parser->state) {
+		case START:
+			if(byte == FLAG)
+				parser->state = FLAG_RCV;
+			break;
+		case FLAG_RCV:
+			if(byte == A_TRANSMITTER || byte == A_RECEIVER || (parser->multidrop && byte != FLAG)) {
+				frame->address_field = byte;
+				parser->state = A_RCV;
+			} else if(byte != FLAG) {
+				parser->state = START;
+			}
+			break;
+		case A_RCV:
+			if(byte == FLAG) {
+				parser->state = FLAG_RCV;
+			} else if(valid_control_field(byte, &frame->type)) {
+				frame->control_field = byte;
+				parser->state = C_RCV;
+			} else {
+				parser_error(parser, PARSER_BAD_HEADER);
+				parser->state = START;
+			}
+			break;
+		case C_RCV:
+			if(byte == (frame->address_field ^ frame->control_field)) {
+				frame->bcc1 = byte;
+				parser->length = 0;
+				parser->escaped = 0;
+				parser->state = BCC1_RCV;
+			} else {
+				// a corrupted header must not swallow the next frame's opening FLAG
+				parser_error(parser, PARSER_BAD_HEADER);
+				parser->state = (byte == FLAG) ? FLAG_RCV : START;
+			}
+			break;
+		case BCC1_RCV:
+			if(byte == FLAG) {
+				if(parser->escaped) {
+					parser_error(parser, PARSER_BAD_ESCAPE);
+					parser->state = FLAG_RCV;
+					break;
+				}
+				if(frame->type == DATA_FRAME) {
+					if(parser->length == 0) {
+						// no room for the BCC2, so this FLAG can only open a new frame
+						parser->state = FLAG_RCV;
+						break;
+					}
+					frame->length = parser->length - 1;
+					frame->bcc2 = parser->buffer[parser->length - 1];
+				} else {
+					frame->length = 0;
+					frame->bcc2 = 0;
+				}
+				frame->buffer = parser->buffer;
+				frame->sequence_number = frame->control_field >> 5;
+				parser->state = START;
+				if(parser->on_frame(parser->context, frame))
+					return i + 1;
+				break;
+			}
+			if(byte == ESC) {
+				parser->escaped = 1;
+				break;
+			}
+			if(parser->length > parser->max_length) {
+				parser_error(parser, PARSER_OVERSIZED);
+				parser->state = START;
+				break;
+			}
+			parser->buffer[parser->length++] = parser->escaped ? byte ^ ESC_XOR : byte;
+			parser->escaped = 0;
+			break;
+		case STOP:
+			parser->state = START;
+			break;
+		}
+	}
+	return length;
+}
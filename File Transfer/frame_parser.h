@@ -0,0 +1,60 @@
+#ifndef __FRAME_PARSER_H
+#define __FRAME_PARSER_H
+
+#include <stddef.h>
+#include "datalink.h"
+
+typedef enum {
+	PARSER_BAD_HEADER,	/* address, control or BCC1 did not match */
+	PARSER_BAD_ESCAPE,	/* ESC immediately followed by FLAG */
+	PARSER_OVERSIZED	/* information field exceeded max_length */
+} frame_parser_error_t;
+
+/*
+ * Called for every complete frame. The frame's buffer belongs to the parser
+ * and is only valid until the next call to frame_parser_feed.
+ * Returning non-zero makes frame_parser_feed return right after this frame.
+ */
+typedef int (*frame_parser_callback_t)(void *context, const frame_t *frame);
+typedef void (*frame_parser_error_callback_t)(void *context, frame_parser_error_t error);
+
+/*
+ * Push-style frame parser: bytes can be fed in chunks of any size (down to a
+ * single byte) and it resumes exactly where the previous chunk ended
+ */
+typedef struct frame_parser {
+	state_t state;
+	int escaped;
+	unsigned max_length;
+	int multidrop;		/* any address is taken, the link keeps the frames of its own */
+	unsigned length;
+	unsigned char *buffer;
+	frame_t frame;
+	frame_parser_callback_t on_frame;
+	frame_parser_error_callback_t on_error;
+	void *context;
+	unsigned num_bad_headers;
+	unsigned num_bad_escapes;
+	unsigned num_oversized_frames;
+} frame_parser_t;
+
+/*
+ * Prepares a parser for information fields of at most max_length bytes
+ * (not counting BCC2). on_error may be NULL.
+ * Returns 0 if OK, 1 otherwise
+ */
+int frame_parser_init(frame_parser_t *parser, unsigned max_length, frame_parser_callback_t on_frame, frame_parser_error_callback_t on_error, void *context);
+void frame_parser_destroy(frame_parser_t *parser);
+
+/*
+ * Drops any partially received frame
+ */
+void frame_parser_reset(frame_parser_t *parser);
+
+/*
+ * Feeds length bytes to the parser
+ * Returns the number of bytes consumed, which is less than length only if on_frame asked to stop
+ */
+size_t frame_parser_feed(frame_parser_t *parser, const unsigned char *bytes, size_t length);
+
+#endif //__FRAME_PARSER_H
@@ -0,0 +1,268 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include "datalink.h"
+#include "sim.h"
+
+/*
+ * Runs the data link against itself over a simulated channel on a virtual
+ * clock (see sim.h): every scenario sends packets of a frame size from one
+ * end to the other, from llopen to llclose, with its own seed. Output is one
+ * line per combination of frame size and timeout with fixed columns, so that
+ * policies can be compared over thousands of lossy runs in seconds.
+ */
+
+#define MAX_CHOICES 16
+#define DEFAULT_NUM_SCENARIOS 100
+#define DEFAULT_NUM_PACKETS 100
+#define DEFAULT_SIM_BAUDRATE 38400
+#define DEFAULT_BIT_ERROR_RATE 1e-4
+
+/*
+ * One run and what each end saw of it
+ */
+typedef struct {
+	unsigned frame_size;
+	unsigned timeout;
+	unsigned retransmissions;
+	unsigned num_packets;
+	uint64_t seed;
+	unsigned num_timeouts;		/* sender */
+	unsigned num_sent_frames;
+	unsigned num_REJs;		/* receiver */
+	unsigned num_delivered;
+	unsigned num_corrupted;		/* delivered, but not what was sent */
+} scenario_t;
+
+/*
+ * Totals of every scenario of one combination
+ */
+typedef struct {
+	unsigned num_runs;
+	unsigned num_ok;
+	unsigned num_deadlocks;
+	double duration;
+	double payload_bits;
+	double line_bits;
+	unsigned long num_timeouts;
+	unsigned long num_REJs;
+	unsigned long num_sent_frames;
+	unsigned long num_corrupted;
+} totals_t;
+
+int run_sender(void *context, transport_t *transport);
+int run_receiver(void *context, transport_t *transport);
+void setup_link(datalink_t *datalink, const scenario_t *scenario, transport_t *transport, int mode);
+void fill_packet(const scenario_t *scenario, unsigned index, unsigned char *packet);
+unsigned parse_list(const char *list, unsigned *values);
+void print_usage(const char *argv0);
+
+void setup_link(datalink_t *datalink, const scenario_t *scenario, transport_t *transport, int mode) {
+	datalink_init(datalink, mode);
+	datalink->transport = *transport;
+	datalink->timeout = scenario->timeout;
+	datalink->max_retransmissions = scenario->retransmissions;
+	datalink->max_frame_length = scenario->frame_size;
+}
+
+void fill_packet(const scenario_t *scenario, unsigned index, unsigned char *packet) {
+	// every packet differs, so that a delivered one can be checked against what was sent
+	uint64_t x = scenario->seed * 0x9E3779B97F4A7C15ULL + index + 1;
+	unsigned i;
+	for(i = 0; i < scenario->frame_size; ++i) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		packet[i] = x;
+	}
+}
+
+int run_sender(void *context, transport_t *transport) {
+	scenario_t *scenario = context;
+	datalink_t *datalink;
+	if((datalink = malloc(sizeof(datalink_t))) == NULL)
+		return 1;
+	setup_link(datalink, scenario, transport, SENDER);
+	unsigned char packet[scenario->frame_size];
+	int ret = llopen("sim", datalink);
+	unsigned i;
+	for(i = 0; ret == 0 && i < scenario->num_packets; ++i) {
+		fill_packet(scenario, i, packet);
+		ret = llwrite(datalink, packet, scenario->frame_size);
+	}
+	if(ret == 0)
+		ret = llclose(datalink) != 0;
+	else
+		llabort(datalink);
+	scenario->num_timeouts = datalink->num_timeouts;
+	scenario->num_sent_frames = datalink->num_sent_data_frames;
+	free(datalink);
+	return ret;
+}
+
+int run_receiver(void *context, transport_t *transport) {
+	scenario_t *scenario = context;
+	datalink_t *datalink;
+	if((datalink = malloc(sizeof(datalink_t))) == NULL)
+		return 1;
+	setup_link(datalink, scenario, transport, RECEIVER);
+	unsigned char expected[scenario->frame_size];
+	char buffer[scenario->frame_size];
+	int ret = llopen("sim", datalink);
+	while(ret == 0 && scenario->num_delivered < scenario->num_packets) {
+		int length = llread(datalink, buffer);
+		if(length < 0) {
+			ret = 1;
+			break;
+		}
+		fill_packet(scenario, scenario->num_delivered++, expected);
+		if(length != scenario->frame_size || memcmp(buffer, expected, length) != 0)
+			++scenario->num_corrupted;
+	}
+	if(ret == 0)
+		ret = llclose(datalink) != 0;
+	else
+		llabort(datalink);
+	scenario->num_REJs = datalink->num_sent_REJs;
+	free(datalink);
+	return ret;
+}
+
+unsigned parse_list(const char *list, unsigned *values) {
+	unsigned num_values = 0;
+	char *end;
+	while(num_values < MAX_CHOICES) {
+		values[num_values] = strtoul(list, &end, 10);
+		if(end == list || values[num_values] == 0)
+			return 0;
+		++num_values;
+		if(*end != ',')
+			break;
+		list = end + 1;
+	}
+	return *end == '\0' ? num_values : 0;
+}
+
+void print_usage(const char *argv0) {
+	printf("Usage: %s [-n scenarios] [-s first seed] [-p packets] [-b baud rate] [-d delay ms] [-e bit error rate] [-r retransmissions] [-f frame sizes] [-t timeouts]\n"
+			"\tframe sizes and timeouts (seconds) are comma-separated lists, every combination is run\n", argv0);
+}
+
+int main(int argc, char *argv[]) // ./link_sim [-n scenarios] [-s seed] [-p packets] [-b baud] [-d ms] [-e ber] [-r retx] [-f sizes] [-t timeouts]
+{
+	unsigned num_scenarios = DEFAULT_NUM_SCENARIOS;
+	uint64_t first_seed = 1;
+	unsigned num_packets = DEFAULT_NUM_PACKETS;
+	unsigned retransmissions = DEFAULT_RETRANSMISSIONS;
+	sim_channel_t channel = { DEFAULT_SIM_BAUDRATE, 0, DEFAULT_BIT_ERROR_RATE, 0 };
+	unsigned frame_sizes[MAX_CHOICES] = {16, 64, 256, 1024};
+	unsigned num_frame_sizes = 4;
+	unsigned timeouts[MAX_CHOICES] = {1, 3};
+	unsigned num_timeouts = 2;
+
+	int opt;
+	while((opt = getopt(argc, argv, "n:s:p:b:d:e:r:f:t:")) != -1) {
+		switch(opt) {
+		case 'n':
+			num_scenarios = atoi(optarg);
+			break;
+		case 's':
+			first_seed = strtoull(optarg, NULL, 10);
+			break;
+		case 'p':
+			num_packets = atoi(optarg);
+			break;
+		case 'b':
+			channel.baudrate = atoi(optarg);
+			break;
+		case 'd':
+			channel.delay = atof(optarg) / 1000;
+			break;
+		case 'e':
+			channel.bit_error_rate = atof(optarg);
+			break;
+		case 'r':
+			retransmissions = atoi(optarg);
+			break;
+		case 'f':
+			num_frame_sizes = parse_list(optarg, frame_sizes);
+			break;
+		case 't':
+			num_timeouts = parse_list(optarg, timeouts);
+			break;
+		default:
+			print_usage(argv[0]);
+			return 1;
+		}
+	}
+	if(optind != argc || num_scenarios == 0 || channel.baudrate == 0 || num_frame_sizes == 0 || num_timeouts == 0
+			|| channel.bit_error_rate < 0 || channel.bit_error_rate >= 1) {
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	// the data link reports every frame on stdout, only the table goes there
+	fflush(stdout);
+	int table = dup(STDOUT_FILENO);
+	int null = open("/dev/null", O_WRONLY);
+	if(table < 0 || null < 0) {
+		perror("link_sim");
+		return 1;
+	}
+	FILE *out = fdopen(table, "w");
+	setvbuf(out, NULL, _IOLBF, 0);
+	dup2(null, STDOUT_FILENO);
+
+	fprintf(out, "%d scenarios of %u packets, %u baud, %.1f ms delay, bit error rate %g, %u retransmissions\n",
+			num_scenarios, num_packets, channel.baudrate, channel.delay * 1000, channel.bit_error_rate, retransmissions);
+	fprintf(out, "%6s %7s %8s %9s %10s %9s %9s %9s %9s %9s\n", "size", "timeout", "ok", "deadlock", "seconds", "goodput", "frames", "timeouts", "REJs", "corrupt");
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	unsigned long num_runs = 0;
+	unsigned f, t, i;
+	for(f = 0; f < num_frame_sizes; ++f) {
+		for(t = 0; t < num_timeouts; ++t) {
+			totals_t totals;
+			memset(&totals, 0, sizeof(totals));
+			for(i = 0; i < num_scenarios; ++i) {
+				scenario_t scenario;
+				memset(&scenario, 0, sizeof(scenario));
+				scenario.frame_size = frame_sizes[f];
+				scenario.timeout = timeouts[t];
+				scenario.retransmissions = retransmissions;
+				scenario.num_packets = num_packets;
+				scenario.seed = first_seed + i;
+				channel.seed = scenario.seed;
+
+				scenario_t receiver = scenario;
+				sim_results_t results;
+				int ret = sim_run(&channel, run_sender, &scenario, run_receiver, &receiver, &results);
+				++totals.num_runs;
+				totals.num_ok += (ret == 0);
+				totals.num_deadlocks += results.deadlock;
+				totals.duration += results.duration;
+				totals.payload_bits += 8.0 * receiver.num_delivered * scenario.frame_size;
+				totals.line_bits += results.duration * channel.baudrate;
+				totals.num_timeouts += scenario.num_timeouts;
+				totals.num_sent_frames += scenario.num_sent_frames;
+				totals.num_REJs += receiver.num_REJs;
+				totals.num_corrupted += receiver.num_corrupted;
+				++num_runs;
+			}
+			// goodput is the share of the line's bit time that carried delivered payload
+			fprintf(out, "%6u %7u %8u %9u %10.2f %8.1f%% %9.1f %9.1f %9.1f %9lu\n", frame_sizes[f], timeouts[t],
+					totals.num_ok, totals.num_deadlocks, totals.duration / totals.num_runs,
+					totals.line_bits > 0 ? 100 * totals.payload_bits / totals.line_bits : 0.0,
+					(double)totals.num_sent_frames / totals.num_runs, (double)totals.num_timeouts / totals.num_runs,
+					(double)totals.num_REJs / totals.num_runs, totals.num_corrupted);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	fprintf(out, "%lu runs in %.2f s\n", num_runs, (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+	fclose(out);
+	return 0;
+}
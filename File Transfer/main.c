@@ -0,0 +1,405 @@
+#include "application.h"
+#include "datalink.h"
+#include "perf_counters.h"
+#include "manifest.h"
+#include "server.h"
+#include "bus.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <signal.h>
+#include <pthread.h>
+
+#define NUM_FILE_SEND_RECEIVE_RETRIES 3
+
+int send_paths(transfer_t *transfer, char *const paths[], unsigned num_paths);
+int receive_all(transfer_t *transfer, const char *destination_folder);
+int serve_spool(transfer_t *transfer, const char *spool_folder);
+int serve_ports(transfer_t *settings, const char *spool_folder, char *const ports[], unsigned num_ports);
+int distribute(transfer_t *settings, const char *path, char *const nodes[], unsigned num_nodes);
+int serve_node(transfer_t *transfer, unsigned node, const char *destination_folder);
+void print_message(void *context, unsigned channel, const unsigned char *data, size_t length);
+void print_usage(char *argv0);
+int cli();
+
+int main(int argc, char *argv[]) // ./file_transfer [-p] [-P] [-d] [-D] [-c dir] [-z level] [-q|-m] [-i ms] [-M message] <port> <send <path>...|receive [folder]|daemon <spool folder>|distribute <file> <node>...|node <node> [folder]> | server <spool folder> <port>...
+{
+	srand(time(NULL));
+	if (argc == 1) return cli();
+
+	transfer_t transfer;
+	transfer_init(&transfer, NULL, SENDER);
+	transfer.progress_mode = PROGRESS_BAR;
+	transfer.on_message = print_message;
+	const char *message = NULL;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "pPdDc:z:qmi:M:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'p':
+			perf_counters_enable();
+			break;
+		case 'P':
+			transfer.probe = 1;
+			break;
+		case 'd':
+			transfer.delta = 1;
+			break;
+		case 'D':
+			transfer.dedup = 1;
+			break;
+		case 'c':
+			transfer.cache_dir = optarg;
+			break;
+		case 'z':
+			transfer.compression_level = atoi(optarg);
+			if (transfer.compression_level < 1 || transfer.compression_level > 9)
+			{
+				print_usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'q':
+			transfer.progress_mode = PROGRESS_OFF;
+			break;
+		case 'm':
+			transfer.progress_mode = PROGRESS_LINES;
+			break;
+		case 'i':
+			transfer.progress_interval = atoi(optarg);
+			break;
+		case 'M':
+			message = optarg;
+			break;
+		default:
+			print_usage(argv[0]);
+			return 1;
+		}
+	}
+	argv += optind - 1;
+	argc -= optind - 1;
+
+	if (argc < 3)
+	{
+		print_usage(argv[0]);
+		return 1;
+	}
+	if(strcmp(argv[1], "server") == 0) {
+		if (argc < 4)
+		{
+			print_usage(argv[0]);
+			return 1;
+		}
+		return serve_ports(&transfer, argv[2], &argv[3], argc - 3);
+	}
+	transfer.port = argv[1];
+	if(strcmp(argv[2], "send") == 0) {
+		if (argc < 4)
+		{
+			print_usage(argv[0]);
+			return 1;
+		}
+		if (message != NULL && transfer_post(&transfer, 1, message, strlen(message)))
+			return 1;
+		return send_paths(&transfer, &argv[3], argc - 3);
+	} else if(strcmp(argv[2], "receive") == 0) {
+		if (argc != 3 && argc != 4)
+		{
+			print_usage(argv[0]);
+			return 1;
+		}
+		transfer.mode = RECEIVER;
+		return receive_all(&transfer, argc == 4 ? argv[3] : "");
+	} else if(strcmp(argv[2], "daemon") == 0) {
+		if (argc != 4)
+		{
+			print_usage(argv[0]);
+			return 1;
+		}
+		transfer.mode = RECEIVER;
+		return serve_spool(&transfer, argv[3]);
+	} else if(strcmp(argv[2], "distribute") == 0) {
+		if (argc < 5)
+		{
+			print_usage(argv[0]);
+			return 1;
+		}
+		return distribute(&transfer, argv[3], &argv[4], argc - 4);
+	} else if(strcmp(argv[2], "node") == 0) {
+		if (argc != 4 && argc != 5)
+		{
+			print_usage(argv[0]);
+			return 1;
+		}
+		transfer.mode = RECEIVER;
+		return serve_node(&transfer, atoi(argv[3]), argc == 5 ? argv[4] : "");
+	}
+	return 0;
+}
+
+void print_usage(char *argv0)
+{
+	printf("Usage:\n"
+			"\t%s [options] <port> send <file or directory>...\n"
+			"\t\tOR\n"
+			"\t%s [options] <port> receive [destination folder]\n"
+			"\t\tOR\n"
+			"\t%s [options] <port> daemon <spool folder>\n"
+			"\t\tOR\n"
+			"\t%s [options] server <spool folder> <port>...\t(SIGUSR1 prints the totals of every port)\n"
+			"\t\tOR\n"
+			"\t%s [options] <port> distribute <file> <node>...\t(master of a multi-drop bus, nodes 1 to %d)\n"
+			"\t\tOR\n"
+			"\t%s [options] <port> node <node> [destination folder]\n"
+			"A port is a serial port, or tcp:<host>:<port> to connect and tcp::<port> to wait for the peer over TCP\n"
+			"Options:\n"
+			"\t-p\tprofile the data link phases with hardware counters\n"
+			"\t-P\tprobe the link after connecting and tune timeout, retries and packet size\n"
+			"\t-d\tonly send what differs from the receiver's copy of the file\n"
+			"\t-D\tonly send the chunks missing from the receiver's block cache\n"
+			"\t-c dir\tblock cache of the receiver\n"
+			"\t-z level\tcompress the file in parallel chunks, from 1 (fastest) to 9 (smallest)\n"
+			"\t-q\tno progress report\n"
+			"\t-m\tprogress as machine-readable lines\n"
+			"\t-i ms\tinterval between progress reports (default %d)\n"
+			"\t-M message\tsend a message on channel 1 alongside the files\n", argv0, argv0, argv0, argv0, argv0, MAX_NODES, argv0, DEFAULT_PROGRESS_INTERVAL);
+}
+
+void print_message(void *context, unsigned channel, const unsigned char *data, size_t length)
+{
+	printf("Message on channel %u: %.*s\n", channel, (int)length, (const char *)data);
+}
+
+int send_paths(transfer_t *transfer, char *const paths[], unsigned num_paths)
+{
+	// a single regular file keeps the resumable protocol, anything else is a session
+	struct stat st;
+	int session = num_paths > 1 || stat(paths[0], &st) < 0 || !S_ISREG(st.st_mode);
+	unsigned tries = 0;
+	while (tries < NUM_FILE_SEND_RECEIVE_RETRIES)
+	{
+		if (session ? transfer_send_session(transfer, paths, num_paths) : transfer_send_file(transfer, paths[0]))
+			tries++;
+		else
+		{
+			// messages the files' data packets didn't leave room for
+			if (transfer->connected && transfer->channels)
+				transfer_send_messages(transfer);
+			return transfer_close(transfer);
+		}
+	}
+	printf("Couldn't send file. Terminating program.\n");
+	return 0;
+}
+
+int receive_all(transfer_t *transfer, const char *destination_folder)
+{
+	// whatever the sender has for this link, until it closes it
+	unsigned tries = 0;
+	while (tries < NUM_FILE_SEND_RECEIVE_RETRIES)
+	{
+		if (transfer_receive(transfer, destination_folder))
+			tries++;
+		else if (!transfer->connected)
+			return 0;
+	}
+	printf("Couldn't receive file. Terminating program.\n");
+	return 0;
+}
+
+int serve_spool(transfer_t *transfer, const char *spool_folder)
+{
+	// the port is configured once and a SET is answered as soon as it arrives, until the process is killed
+	char folder[strlen(spool_folder) + 2];
+	strcpy(folder, spool_folder);
+	if (*folder != '\0' && folder[strlen(folder) - 1] != '/')
+		strcat(folder, "/");
+	if (make_parent_directories(folder))
+		return 1;
+	transfer->keep_port = 1;
+	printf("Waiting for transfers into %s.\n", *folder != '\0' ? folder : "./");
+	while (1)
+	{
+		if (transfer_receive(transfer, folder))
+		{
+			printf("Transfer failed, waiting for the next one.\n");
+			// don't spin on a port that keeps failing
+			if (transfer->datalink.transport.ops == NULL)
+				sleep(1);
+		}
+		else if (!transfer->connected)
+			printf("Waiting for the next transfer.\n");
+	}
+}
+
+int serve_ports(transfer_t *settings, const char *spool_folder, char *const ports[], unsigned num_ports)
+{
+	// blocked before the port threads start so that they inherit it, only sigwait below takes these
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	// the bars of several ports would overwrite each other
+	if (settings->progress_mode == PROGRESS_BAR)
+		settings->progress_mode = PROGRESS_OFF;
+	server_t server;
+	if (server_start(&server, settings, ports, num_ports, spool_folder))
+		return 1;
+	printf("Serving %u ports.\n", num_ports);
+	while (1)
+	{
+		int received;
+		if (sigwait(&signals, &received))
+			continue;
+		server_show_stats(&server);
+		if (received != SIGUSR1)
+			return 0;
+	}
+}
+
+int distribute(transfer_t *settings, const char *path, char *const nodes[], unsigned num_nodes)
+{
+	unsigned numbers[num_nodes];
+	unsigned i;
+	for (i = 0; i < num_nodes; i++)
+		numbers[i] = atoi(nodes[i]);
+	return bus_distribute(settings, path, numbers, num_nodes);
+}
+
+int serve_node(transfer_t *transfer, unsigned node, const char *destination_folder)
+{
+	// the node keeps its port configured and takes every distribution addressed to it, until the process is killed
+	char folder[strlen(destination_folder) + 2];
+	strcpy(folder, destination_folder);
+	if (*folder != '\0' && folder[strlen(folder) - 1] != '/')
+		strcat(folder, "/");
+	if (make_parent_directories(folder))
+		return 1;
+	if (node < 1 || node > MAX_NODES)
+	{
+		printf("Error: nodes are numbered 1 to %d.\n", MAX_NODES);
+		return 1;
+	}
+	transfer->keep_port = 1;
+	printf("Node %u waiting for distributions into %s.\n", node, *folder != '\0' ? folder : "./");
+	while (1)
+	{
+		if (bus_receive(transfer, node, folder))
+		{
+			printf("Distribution failed, waiting for the next one.\n");
+			if (transfer->datalink.transport.ops == NULL)
+				sleep(1);
+		}
+	}
+}
+
+int cli(){
+
+	char *mode,*fileName, *port;
+	int tries=3, valid=0;
+
+	mode=malloc(100);
+	fileName=malloc(100);
+	port=malloc(100);
+
+	while(tries-- > 0){
+
+		printf("Mode (send/receive)? ");
+		scanf("%s", mode);
+
+		//verify mode entry
+		if (strcmp(mode,"send") == 0 || strcmp(mode,"receive") == 0){
+			valid=1;
+
+			break;
+		}else{
+			printf("Invalid mode.\n");
+			continue;
+		}
+
+
+	}
+
+	if (!valid){
+		printf("Invalid mode.\n");
+		return -1;
+	}
+
+	tries=3;
+	valid=0;
+
+	if (strcmp(mode, "send") == 0)
+	{
+		while(tries-- > 0){
+
+			printf("File name? ");
+			scanf("%s", fileName);
+
+			if(access(fileName,F_OK) == -1)
+				perror("File does not exist.\n");
+			else{
+				valid=1;
+				break;
+			}
+		}
+		if (!valid){
+			printf("Invalid input.\n");
+			return -1;
+		}
+	}
+	else
+	{
+		printf("Destination folder? ");
+		scanf("%s", fileName);
+	}
+	printf("Port? ");
+	scanf("%s",port);
+
+	transfer_t transfer;
+	transfer_init(&transfer, port, strcmp(mode, "send") == 0 ? SENDER : RECEIVER);
+	transfer.progress_mode = PROGRESS_BAR;
+
+	printf("Baudrate (0 to select default value)? ");
+	scanf("%d", &transfer.baudrate);
+
+	tries = 3;
+	while(tries-- > 0) {
+		transfer.max_packet_size = -1;
+		printf("Max data packet size (0 to select default value, other values between 10 and 200)? ");
+		scanf("%d", &transfer.max_packet_size);
+
+		if(transfer.max_packet_size == 0) {
+			transfer.max_packet_size = MAX_PACKET_SIZE;
+			break;
+		}
+
+		if(transfer.max_packet_size < 10 || transfer.max_packet_size > 200) {
+			printf("Invalid input!\n");
+			transfer.max_packet_size = MAX_PACKET_SIZE;
+			continue;
+		}
+	}
+
+	printf("Timeout (0 to select default value)? ");
+	scanf("%u", &transfer.timeout);
+	if(transfer.timeout == 0)
+		transfer.timeout = DEFAULT_TIMEOUT;
+
+	printf("Max retransmissions (0 to select default value)? ");
+	scanf("%u", &transfer.retransmissions);
+	if(transfer.retransmissions == 0)
+		transfer.retransmissions = DEFAULT_RETRANSMISSIONS;
+
+	if (strcmp(mode, "send") == 0)
+		return send_paths(&transfer, &fileName, 1);
+	else
+		return receive_all(&transfer, fileName);
+}
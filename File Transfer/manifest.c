@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <sys/stat.h>
+#include "manifest.h"
+
+int add_directory(manifest_t *manifest, const char *path, const char *source);
+
+void manifest_init(manifest_t *manifest) {
+	manifest->entries = NULL;
+	manifest->num_entries = 0;
+	manifest->capacity = 0;
+	manifest->total_size = 0;
+}
+
+void manifest_free(manifest_t *manifest) {
+	unsigned i;
+	for(i = 0; i < manifest->num_entries; ++i) {
+		free(manifest->entries[i].path);
+		free(manifest->entries[i].source);
+	}
+	free(manifest->entries);
+	manifest_init(manifest);
+}
+
+int manifest_add(manifest_t *manifest, const char *path, const char *source, uint64_t size) {
+	if(manifest->num_entries == manifest->capacity) {
+		unsigned capacity = manifest->capacity ? 2 * manifest->capacity : 64;
+		manifest_entry_t *entries = realloc(manifest->entries, capacity * sizeof(manifest_entry_t));
+		if(entries == NULL) {
+			printf("ERROR (manifest_add): unable to allocate memory\n");
+			return 1;
+		}
+		manifest->entries = entries;
+		manifest->capacity = capacity;
+	}
+	manifest_entry_t *entry = &manifest->entries[manifest->num_entries];
+	entry->size = size;
+	entry->path = strdup(path);
+	entry->source = (source == NULL) ? NULL : strdup(source);
+	if(entry->path == NULL || (source != NULL && entry->source == NULL)) {
+		printf("ERROR (manifest_add): unable to allocate memory\n");
+		free(entry->path);
+		free(entry->source);
+		return 1;
+	}
+	++manifest->num_entries;
+	manifest->total_size += size;
+	return 0;
+}
+
+int add_directory(manifest_t *manifest, const char *path, const char *source) {
+	DIR *dir = opendir(source);
+	if(dir == NULL) {
+		perror(source);
+		return 1;
+	}
+	struct dirent *dirent;
+	while((dirent = readdir(dir)) != NULL) {
+		if(strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0)
+			continue;
+		char child_source[strlen(source) + strlen(dirent->d_name) + 2];
+		char child_path[strlen(path) + strlen(dirent->d_name) + 2];
+		sprintf(child_source, "%s/%s", source, dirent->d_name);
+		sprintf(child_path, "%s%s%s", path, *path ? "/" : "", dirent->d_name);
+
+		// symbolic links and special files are not transferred
+		struct stat st;
+		if(lstat(child_source, &st) < 0) {
+			perror(child_source);
+			closedir(dir);
+			return 1;
+		}
+		int ret = 0;
+		if(S_ISDIR(st.st_mode))
+			ret = add_directory(manifest, child_path, child_source);
+		else if(S_ISREG(st.st_mode))
+			ret = manifest_add(manifest, child_path, child_source, st.st_size);
+		if(ret) {
+			closedir(dir);
+			return 1;
+		}
+	}
+	closedir(dir);
+	return 0;
+}
+
+int manifest_add_path(manifest_t *manifest, const char *source) {
+	struct stat st;
+	if(stat(source, &st) < 0) {
+		perror(source);
+		return 1;
+	}
+	char copy[strlen(source) + 1];
+	strcpy(copy, source);
+	const char *base = basename(copy);
+	if(S_ISREG(st.st_mode))
+		return manifest_add(manifest, base, source, st.st_size);
+	if(S_ISDIR(st.st_mode)) {
+		// "." or "/" have no name of their own, their contents go straight into the destination
+		int unnamed = strcmp(base, ".") == 0 || strcmp(base, "..") == 0 || strcmp(base, "/") == 0;
+		return add_directory(manifest, unnamed ? "" : base, source);
+	}
+	printf("ERROR (manifest_add_path): %s is neither a regular file nor a directory\n", source);
+	return 1;
+}
+
+unsigned manifest_encode(const manifest_t *manifest, unsigned *next, unsigned char *buffer, unsigned max) {
+	unsigned length = 0;
+	while(*next < manifest->num_entries) {
+		const manifest_entry_t *entry = &manifest->entries[*next];
+		unsigned path_length = strlen(entry->path);
+		if(length + MANIFEST_ENTRY_HEADER_SIZE + path_length > max || path_length > 0xFFFF)
+			break;
+		int i;
+		for(i = 0; i < 8; ++i)
+			buffer[length++] = entry->size >> (8 * (7 - i));
+		buffer[length++] = path_length >> 8;
+		buffer[length++] = path_length & 0xFF;
+		memcpy(&buffer[length], entry->path, path_length);
+		length += path_length;
+		++*next;
+	}
+	return length;
+}
+
+int manifest_decode(manifest_t *manifest, const unsigned char *buffer, unsigned length) {
+	unsigned i = 0;
+	while(i < length) {
+		if(i + MANIFEST_ENTRY_HEADER_SIZE > length) {
+			printf("ERROR (manifest_decode): truncated entry\n");
+			return 1;
+		}
+		uint64_t size = 0;
+		int j;
+		for(j = 0; j < 8; ++j)
+			size = (size << 8) | buffer[i++];
+		unsigned path_length = (buffer[i] << 8) | buffer[i + 1];
+		i += 2;
+		if(i + path_length > length) {
+			printf("ERROR (manifest_decode): truncated entry\n");
+			return 1;
+		}
+		char path[path_length + 1];
+		memcpy(path, &buffer[i], path_length);
+		path[path_length] = '\0';
+		i += path_length;
+		if(strlen(path) != path_length || !manifest_safe_path(path)) {
+			printf("ERROR (manifest_decode): refusing to create %s\n", path);
+			return 1;
+		}
+		if(manifest_add(manifest, path, NULL, size))
+			return 1;
+	}
+	return 0;
+}
+
+int manifest_safe_path(const char *path) {
+	if(*path == '\0' || *path == '/')
+		return 0;
+	const char *component = path;
+	while(1) {
+		const char *end = strchr(component, '/');
+		size_t length = (end == NULL) ? strlen(component) : (size_t)(end - component);
+		if(length == 0 || (length == 1 && component[0] == '.') || (length == 2 && strncmp(component, "..", 2) == 0))
+			return 0;
+		if(end == NULL)
+			return 1;
+		component = end + 1;
+	}
+}
+
+int make_parent_directories(const char *path) {
+	char copy[strlen(path) + 1];
+	strcpy(copy, path);
+	char *slash;
+	if(*copy == '\0')
+		return 0;
+	for(slash = strchr(copy + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+		*slash = '\0';
+		if(mkdir(copy, 0755) < 0 && errno != EEXIST) {
+			perror(copy);
+			return 1;
+		}
+		*slash = '/';
+	}
+	return 0;
+}
@@ -0,0 +1,68 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stdint.h>
+
+#define MANIFEST_ENTRY_HEADER_SIZE 10	/* 8-byte size and 2-byte path length, both big-endian */
+
+/*
+ * One file of a session. Its contents follow the previous file's in the
+ * session's data stream.
+ */
+typedef struct {
+	char *path;	/* relative, '/' separated, as created by the receiver */
+	char *source;	/* where the sender reads it from, NULL on the receiver */
+	uint64_t size;
+} manifest_entry_t;
+
+/*
+ * Ordered list of the files of a session
+ */
+typedef struct {
+	manifest_entry_t *entries;
+	unsigned num_entries;
+	unsigned capacity;
+	uint64_t total_size;
+} manifest_t;
+
+void manifest_init(manifest_t *manifest);
+void manifest_free(manifest_t *manifest);
+
+/*
+ * Appends one entry, source may be NULL
+ * Returns 0 if OK, 1 otherwise
+ */
+int manifest_add(manifest_t *manifest, const char *path, const char *source, uint64_t size);
+
+/*
+ * Appends a regular file, or every regular file below a directory, named
+ * relative to the directory that contains source
+ * Returns 0 if OK, 1 otherwise
+ */
+int manifest_add_path(manifest_t *manifest, const char *source);
+
+/*
+ * Serializes as many entries as fit in max bytes, starting with entry *next,
+ * and advances *next past them
+ * Returns the number of bytes written, 0 if entry *next does not fit at all
+ */
+unsigned manifest_encode(const manifest_t *manifest, unsigned *next, unsigned char *buffer, unsigned max);
+
+/*
+ * Appends the entries serialized in buffer, rejecting unsafe paths
+ * Returns 0 if OK, 1 otherwise
+ */
+int manifest_decode(manifest_t *manifest, const unsigned char *buffer, unsigned length);
+
+/*
+ * Returns 1 if path is relative and stays below the directory it is created in, 0 otherwise
+ */
+int manifest_safe_path(const char *path);
+
+/*
+ * Creates every missing directory leading to the file path
+ * Returns 0 if OK, 1 otherwise
+ */
+int make_parent_directories(const char *path);
+
+#endif
@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "perf_counters.h"
+
+#define COUNTERS_NOT_OPENED -2
+
+typedef struct {
+	atomic_ullong counters[NUM_COUNTERS];
+	atomic_ullong nanoseconds;
+	atomic_ullong calls;
+} phase_stats_t;
+
+const char *phase_names[NUM_PHASES] = {
+	"stuffing",
+	"bcc",
+	"parsing",
+	"read",
+	"write",
+	"packetising"
+};
+
+const uint64_t counter_configs[NUM_COUNTERS] = {
+	PERF_COUNT_HW_CPU_CYCLES,
+	PERF_COUNT_HW_INSTRUCTIONS,
+	PERF_COUNT_HW_CACHE_MISSES
+};
+
+atomic_int perf_enabled = 0;
+atomic_int perf_hardware = 0;
+phase_stats_t phase_stats[NUM_PHASES];
+
+/* counter group of the calling thread, the first fd is the group leader */
+__thread int thread_counters[NUM_COUNTERS] = {COUNTERS_NOT_OPENED};
+/* only there to close the group when its thread exits */
+pthread_key_t thread_counters_key;
+pthread_once_t thread_counters_once = PTHREAD_ONCE_INIT;
+
+int open_counter(uint64_t config, int group_fd, int exclude_kernel);
+void create_thread_counters_key();
+void close_thread_counters(void *group);
+int open_thread_counters();
+int read_thread_counters(uint64_t *counters);
+uint64_t monotonic_nanoseconds();
+
+int open_counter(uint64_t config, int group_fd, int exclude_kernel) {
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = config;
+	attr.read_format = PERF_FORMAT_GROUP;
+	attr.disabled = (group_fd == -1);
+	attr.exclude_kernel = exclude_kernel;	// syscall phases are only complete with kernel time
+	attr.exclude_hv = 1;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+void create_thread_counters_key() {
+	pthread_key_create(&thread_counters_key, close_thread_counters);
+}
+
+void close_thread_counters(void *group) {
+	int i;
+	for(i = 0; i < NUM_COUNTERS; ++i)
+		close(thread_counters[i]);
+	thread_counters[0] = COUNTERS_NOT_OPENED;
+}
+
+int open_thread_counters() {
+	int exclude_kernel;
+	for(exclude_kernel = 0; exclude_kernel <= 1; ++exclude_kernel) {
+		int i;
+		thread_counters[0] = -1;
+		for(i = 0; i < NUM_COUNTERS; ++i) {
+			thread_counters[i] = open_counter(counter_configs[i], i == 0 ? -1 : thread_counters[0], exclude_kernel);
+			if(thread_counters[i] < 0)
+				break;
+		}
+		if(i == NUM_COUNTERS) {
+			ioctl(thread_counters[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+			ioctl(thread_counters[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+			// pipeline stages come and go with every transfer, their groups must not outlive them
+			pthread_once(&thread_counters_once, create_thread_counters_key);
+			pthread_setspecific(thread_counters_key, thread_counters);
+			return 0;
+		}
+		while(i-- > 0)
+			close(thread_counters[i]);
+	}
+	thread_counters[0] = -1;
+	return 1;
+}
+
+int read_thread_counters(uint64_t *counters) {
+	if(thread_counters[0] == COUNTERS_NOT_OPENED)
+		open_thread_counters();
+	if(thread_counters[0] < 0)
+		return 1;
+
+	uint64_t group[1 + NUM_COUNTERS];
+	if(read(thread_counters[0], group, sizeof(group)) != sizeof(group))
+		return 1;
+	memcpy(counters, &group[1], sizeof(uint64_t) * NUM_COUNTERS);
+	return 0;
+}
+
+uint64_t monotonic_nanoseconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int perf_counters_enable() {
+	atomic_store(&perf_enabled, 1);
+	uint64_t counters[NUM_COUNTERS];
+	if(read_thread_counters(counters)) {
+		printf("perf_event_open unavailable, only timing the data link phases.\n");
+		return 1;
+	}
+	atomic_store(&perf_hardware, 1);
+	return 0;
+}
+
+int perf_counters_enabled() {
+	return atomic_load_explicit(&perf_enabled, memory_order_relaxed);
+}
+
+void perf_phase_begin(perf_sample_t *sample) {
+	if(!perf_counters_enabled())
+		return;
+	if(read_thread_counters(sample->counters))
+		memset(sample->counters, 0, sizeof(sample->counters));
+	sample->nanoseconds = monotonic_nanoseconds();
+}
+
+void perf_phase_end(perf_phase_t phase, const perf_sample_t *sample) {
+	if(!perf_counters_enabled())
+		return;
+	uint64_t nanoseconds = monotonic_nanoseconds();
+	uint64_t counters[NUM_COUNTERS];
+	int i;
+	if(read_thread_counters(counters) == 0) {
+		for(i = 0; i < NUM_COUNTERS; ++i)
+			atomic_fetch_add_explicit(&phase_stats[phase].counters[i], counters[i] - sample->counters[i], memory_order_relaxed);
+	}
+	atomic_fetch_add_explicit(&phase_stats[phase].nanoseconds, nanoseconds - sample->nanoseconds, memory_order_relaxed);
+	atomic_fetch_add_explicit(&phase_stats[phase].calls, 1, memory_order_relaxed);
+}
+
+void perf_counters_show() {
+	if(!perf_counters_enabled())
+		return;
+
+	printf("%-12s %10s %12s %14s %14s %12s %6s\n", "phase", "calls", "time (ms)", "cycles", "instructions", "cache-misses", "IPC");
+	int i;
+	for(i = 0; i < NUM_PHASES; ++i) {
+		unsigned long long cycles = atomic_load(&phase_stats[i].counters[COUNTER_CYCLES]);
+		unsigned long long instructions = atomic_load(&phase_stats[i].counters[COUNTER_INSTRUCTIONS]);
+		if(atomic_load(&perf_hardware)) {
+			printf("%-12s %10llu %12.3f %14llu %14llu %12llu %6.2f\n", phase_names[i],
+					atomic_load(&phase_stats[i].calls),
+					atomic_load(&phase_stats[i].nanoseconds) / 1e6,
+					cycles, instructions,
+					atomic_load(&phase_stats[i].counters[COUNTER_CACHE_MISSES]),
+					cycles ? (double)instructions / cycles : 0.0);
+		} else {
+			printf("%-12s %10llu %12.3f %14s %14s %12s %6s\n", phase_names[i],
+					atomic_load(&phase_stats[i].calls),
+					atomic_load(&phase_stats[i].nanoseconds) / 1e6,
+					"-", "-", "-", "-");
+		}
+	}
+}
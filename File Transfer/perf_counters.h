@@ -0,0 +1,52 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <stdint.h>
+
+/*
+ * Hot-path phases of a transfer. Hardware counters (perf_event_open) and
+ * elapsed time are accumulated per phase over the whole process.
+ */
+typedef enum {
+	PHASE_STUFFING,
+	PHASE_BCC,
+	PHASE_PARSING,
+	PHASE_READ,
+	PHASE_WRITE,
+	PHASE_PACKETISING,
+	NUM_PHASES
+} perf_phase_t;
+
+typedef enum {
+	COUNTER_CYCLES,
+	COUNTER_INSTRUCTIONS,
+	COUNTER_CACHE_MISSES,
+	NUM_COUNTERS
+} perf_counter_t;
+
+typedef struct {
+	uint64_t counters[NUM_COUNTERS];
+	uint64_t nanoseconds;
+} perf_sample_t;
+
+/*
+ * Turns the instrumentation on. Counters are opened lazily on every thread
+ * that enters a phase and closed when it exits; without perf_event_open
+ * support only time is measured.
+ * Returns 0 if hardware counters are available, 1 otherwise
+ */
+int perf_counters_enable();
+int perf_counters_enabled();
+
+/*
+ * Brackets one execution of a phase. Both are no-ops unless enabled.
+ */
+void perf_phase_begin(perf_sample_t *sample);
+void perf_phase_end(perf_phase_t phase, const perf_sample_t *sample);
+
+/*
+ * Prints the per-phase table (nothing if disabled)
+ */
+void perf_counters_show();
+
+#endif
@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include "progress.h"
+
+#define BAR_WIDTH 30
+
+uint64_t progress_clock();
+void progress_report(progress_t *progress, uint64_t done, unsigned frames, unsigned retransmissions, uint64_t now, int last);
+void format_rate(double bytes_per_second, char *str, unsigned size);
+
+uint64_t progress_clock() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void progress_start(progress_t *progress, progress_mode_t mode, unsigned interval_ms, uint64_t done, uint64_t total) {
+	progress->mode = mode;
+	progress->interval_ms = interval_ms;
+	progress->tty = isatty(STDOUT_FILENO);
+	progress->total = total;
+	progress->start_done = done;
+	progress->last_done = done;
+	progress->start_ns = progress_clock();
+	progress->last_ns = progress->start_ns;
+	progress->next_ns = progress->start_ns + interval_ms * 1000000ULL;
+}
+
+void progress_update(progress_t *progress, uint64_t done, unsigned frames, unsigned retransmissions) {
+	if(progress->mode == PROGRESS_OFF)
+		return;
+	uint64_t now = progress_clock();
+	if(now < progress->next_ns)
+		return;
+	progress_report(progress, done, frames, retransmissions, now, 0);
+	progress->next_ns = now + progress->interval_ms * 1000000ULL;
+}
+
+void progress_finish(progress_t *progress, uint64_t done, unsigned frames, unsigned retransmissions) {
+	if(progress->mode == PROGRESS_OFF)
+		return;
+	progress_report(progress, done, frames, retransmissions, progress_clock(), 1);
+}
+
+void format_rate(double bytes_per_second, char *str, unsigned size) {
+	if(bytes_per_second >= 1e6)
+		snprintf(str, size, "%.2f MB/s", bytes_per_second / 1e6);
+	else if(bytes_per_second >= 1e3)
+		snprintf(str, size, "%.1f kB/s", bytes_per_second / 1e3);
+	else
+		snprintf(str, size, "%.0f B/s", bytes_per_second);
+}
+
+void progress_report(progress_t *progress, uint64_t done, unsigned frames, unsigned retransmissions, uint64_t now, int last) {
+	double elapsed = (now - progress->start_ns) / 1e9;
+	double interval = (now - progress->last_ns) / 1e9;
+	double rate = interval > 0 ? (done - progress->last_done) / interval : 0;
+	double average = elapsed > 0 ? (done - progress->start_done) / elapsed : 0;
+	double fraction = progress->total > 0 ? (double)done / progress->total : 1;
+	// the average is steadier than the last interval, and a stalled link has no ETA
+	double eta = average > 0 ? (progress->total - done) / average : -1;
+	double retransmission_rate = frames > 0 ? (double)retransmissions / frames : 0;
+	progress->last_done = done;
+	progress->last_ns = now;
+
+	if(progress->mode == PROGRESS_LINES) {
+		printf("progress bytes=%llu total=%llu percent=%.2f rate=%.0f avg_rate=%.0f eta=%.1f retransmissions=%u frames=%u elapsed=%.3f%s\n",
+				(unsigned long long)done, (unsigned long long)progress->total, fraction * 100, rate, average,
+				eta, retransmissions, frames, elapsed, last ? " done=1" : "");
+		fflush(stdout);
+		return;
+	}
+
+	char bar[BAR_WIDTH + 1];
+	unsigned i;
+	for(i = 0; i < BAR_WIDTH; ++i)
+		bar[i] = (i < fraction * BAR_WIDTH) ? '=' : ' ';
+	bar[BAR_WIDTH] = '\0';
+	char rate_str[16], average_str[16], eta_str[16];
+	format_rate(last ? average : rate, rate_str, sizeof(rate_str));
+	format_rate(average, average_str, sizeof(average_str));
+	if(last)
+		snprintf(eta_str, sizeof(eta_str), "%.1fs", elapsed);
+	else if(eta < 0)
+		snprintf(eta_str, sizeof(eta_str), "--:--");
+	else
+		snprintf(eta_str, sizeof(eta_str), "%u:%02u", (unsigned)eta / 60, (unsigned)eta % 60);
+	// on a terminal the bar is redrawn in place, logs get one line per report
+	printf("%s[%s] %6.2f%% %11s (avg %s) %s %s retx %.1f%%%s", progress->tty ? "\r" : "", bar, fraction * 100,
+			rate_str, average_str, last ? "in" : "ETA", eta_str, retransmission_rate * 100,
+			(progress->tty && !last) ? "\033[K" : "\n");
+	fflush(stdout);
+}
@@ -0,0 +1,44 @@
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include <stdint.h>
+
+#define DEFAULT_PROGRESS_INTERVAL 500	/* ms */
+
+typedef enum {
+	PROGRESS_BAR,		/* redrawn in place on a terminal, one line per update otherwise */
+	PROGRESS_LINES,		/* key=value lines starting with "progress", for monitoring */
+	PROGRESS_OFF
+} progress_mode_t;
+
+/*
+ * Transfer progress, reported at most once per interval however often it is
+ * updated. Rates only count the bytes moved since progress_start, so a
+ * resumed transfer does not look faster than the link.
+ */
+typedef struct {
+	progress_mode_t mode;
+	unsigned interval_ms;
+	int tty;
+	uint64_t total;
+	uint64_t start_done;
+	uint64_t start_ns;
+	uint64_t last_done;
+	uint64_t last_ns;
+	uint64_t next_ns;	/* nothing is reported before this */
+} progress_t;
+
+void progress_start(progress_t *progress, progress_mode_t mode, unsigned interval_ms, uint64_t done, uint64_t total);
+
+/*
+ * done bytes out of total so far, after frames data frames of which
+ * retransmissions were sent again. Cheap unless a report is due.
+ */
+void progress_update(progress_t *progress, uint64_t done, unsigned frames, unsigned retransmissions);
+
+/*
+ * Reports the final state whatever the interval
+ */
+void progress_finish(progress_t *progress, uint64_t done, unsigned frames, unsigned retransmissions);
+
+#endif
@@ -1,8 +1,6 @@
 #include "serial.h"
 
-struct termios oldtio;	// TO ALLOW serial_terminate TO WORK
-
-int serial_initialize(const char *serial_port, int vmin, int vtime, int baudrate) {
+int serial_initialize(const char *serial_port, int vmin, int vtime, int baudrate, struct termios *oldtio) {
 	struct termios newtio;
 	int fd = open(serial_port, O_RDWR | O_NOCTTY);
 	if (fd <0) {
@@ -10,8 +8,9 @@ int serial_initialize(const char *serial_port, int vmin, int vtime, int baudrate
 		return -1;
 	}
 
-	if ( tcgetattr(fd,&oldtio) == -1) { /* save current port settings */
+	if ( tcgetattr(fd,oldtio) == -1) { /* save current port settings */
 		perror("tcgetattr");
+		close(fd);
 		return -1;
 	}
 
@@ -38,6 +37,7 @@ int serial_initialize(const char *serial_port, int vmin, int vtime, int baudrate
 
 	if ( tcsetattr(fd,TCSANOW,&newtio) == -1) {
 		perror("tcsetattr");
+		close(fd);
 		return -1;
 	}
 
@@ -46,10 +46,28 @@ int serial_initialize(const char *serial_port, int vmin, int vtime, int baudrate
 	return fd;
 }
 
-int serial_terminate(int fd) {
-	if ( tcsetattr(fd,TCSANOW,&oldtio) == -1) {
+int serial_terminate(int fd, const struct termios *oldtio) {
+	if ( tcsetattr(fd,TCSANOW,oldtio) == -1) {
 		perror("tcsetattr");
+		close(fd);
 		return 1;
 	}
-	return 0;
+	return close(fd) < 0;
+}
+
+int serial_bits_per_second(int baudrate) {
+	switch(baudrate == 0 ? BAUDRATE : baudrate) {
+	case B1200:	return 1200;
+	case B2400:	return 2400;
+	case B4800:	return 4800;
+	case B9600:	return 9600;
+	case B19200:	return 19200;
+	case B38400:	return 38400;
+	case B57600:	return 57600;
+	case B115200:	return 115200;
+	case B230400:	return 230400;
+	case B460800:	return 460800;
+	case B921600:	return 921600;
+	default:	return 38400;	// unknown codes are timed as the default line
+	}
 }
@@ -24,7 +24,12 @@
  Open serial port device for reading and writing and not as controlling tty
  because we don't want to get killed if linenoise sends CTRL-C.
  */
-int serial_initialize(const char *serial_port, int vmin, int vtime, int baudrate);
-int serial_terminate(int fd);
+int serial_initialize(const char *serial_port, int vmin, int vtime, int baudrate, struct termios *oldtio);
+int serial_terminate(int fd, const struct termios *oldtio);
+
+/*
+ Bits per second of a baudrate as serial_initialize takes it (a Bxxx constant, 0 for BAUDRATE)
+ */
+int serial_bits_per_second(int baudrate);
 
 #endif
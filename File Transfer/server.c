@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "server.h"
+#include "manifest.h"
+
+void *server_port_thread(void *arg);
+int wait_for_start(server_t *server);
+void set_start_state(server_t *server, int state);
+void free_ports(server_t *server, unsigned num_ports);
+void add_link_stats(port_stats_t *stats, const datalink_t *datalink);
+void show_port_stats(const char *name, const port_stats_t *stats);
+
+void *server_port_thread(void *arg) {
+	server_port_t *port = arg;
+	transfer_t *transfer = &port->transfer;
+	// no port opens its line before every thread is up
+	if(wait_for_start(port->server) < 0)
+		return NULL;
+	while(1) {
+		int ret = transfer_receive(transfer, port->folder);
+		if(ret) {
+			atomic_fetch_add(&port->stats.num_failures, 1);
+			printf("%s: transfer failed, waiting for the next one.\n", transfer->port);
+		}
+		if(transfer->connected)
+			continue;	// kept up for the sender's next transfer
+
+		// the link is down, its counters start over with the next one
+		if(!ret)
+			atomic_fetch_add(&port->stats.num_links, 1);
+		add_link_stats(&port->stats, &transfer->datalink);
+		if(transfer->datalink.transport.ops == NULL)
+			sleep(1);	// the port itself failed, don't spin on it
+	}
+	return NULL;
+}
+
+int wait_for_start(server_t *server) {
+	pthread_mutex_lock(&server->start_lock);
+	while(server->start_state == 0)
+		pthread_cond_wait(&server->start_changed, &server->start_lock);
+	int state = server->start_state;
+	pthread_mutex_unlock(&server->start_lock);
+	return state;
+}
+
+void set_start_state(server_t *server, int state) {
+	pthread_mutex_lock(&server->start_lock);
+	server->start_state = state;
+	pthread_cond_broadcast(&server->start_changed);
+	pthread_mutex_unlock(&server->start_lock);
+}
+
+void free_ports(server_t *server, unsigned num_ports) {
+	unsigned i;
+	for(i = 0; i < num_ports; ++i) {
+		free(server->ports[i].folder);
+		pthread_mutex_destroy(&server->ports[i].transfer.messages_lock);
+	}
+	free(server->ports);
+	server->ports = NULL;
+	server->num_ports = 0;
+	pthread_mutex_destroy(&server->start_lock);
+	pthread_cond_destroy(&server->start_changed);
+}
+
+void add_link_stats(port_stats_t *stats, const datalink_t *datalink) {
+	atomic_fetch_add(&stats->num_received_data_frames, datalink->num_received_data_frames);
+	atomic_fetch_add(&stats->num_sent_REJs, datalink->num_sent_REJs);
+	atomic_fetch_add(&stats->num_timeouts, datalink->num_timeouts);
+}
+
+int server_start(server_t *server, const transfer_t *settings, char *const ports[], unsigned num_ports, const char *spool_folder) {
+	if((server->ports = calloc(num_ports, sizeof(server_port_t))) == NULL) {
+		printf("ERROR (server_start): unable to allocate %u ports\n", num_ports);
+		return 1;
+	}
+	server->num_ports = num_ports;
+	pthread_mutex_init(&server->start_lock, NULL);
+	pthread_cond_init(&server->start_changed, NULL);
+	server->start_state = 0;
+
+	const char *separator = (*spool_folder != '\0' && spool_folder[strlen(spool_folder) - 1] != '/') ? "/" : "";
+	unsigned i;
+	for(i = 0; i < num_ports; ++i) {
+		server_port_t *port = &server->ports[i];
+		const char *name = strrchr(ports[i], '/');
+		name = (name != NULL) ? name + 1 : ports[i];
+		if((port->folder = malloc(strlen(spool_folder) + strlen(separator) + strlen(name) + 2)) == NULL) {
+			printf("ERROR (server_start): unable to allocate the folder of %s\n", ports[i]);
+			free_ports(server, i);
+			return 1;
+		}
+		sprintf(port->folder, "%s%s%s/", spool_folder, separator, name);
+		if(make_parent_directories(port->folder)) {
+			free(port->folder);
+			free_ports(server, i);
+			return 1;
+		}
+
+		port->server = server;
+		port->transfer = *settings;
+		port->transfer.port = ports[i];
+		port->transfer.mode = RECEIVER;
+		port->transfer.keep_port = 1;
+		port->transfer.connected = 0;
+		// every port has its own messages
+		pthread_mutex_init(&port->transfer.messages_lock, NULL);
+		port->transfer.messages = NULL;
+		port->transfer.assembly = NULL;
+		datalink_init(&port->transfer.datalink, RECEIVER);
+		atomic_init(&port->stats.num_links, 0);
+		atomic_init(&port->stats.num_failures, 0);
+		atomic_init(&port->stats.num_received_data_frames, 0);
+		atomic_init(&port->stats.num_sent_REJs, 0);
+		atomic_init(&port->stats.num_timeouts, 0);
+	}
+
+	for(i = 0; i < num_ports; ++i) {
+		if(pthread_create(&server->ports[i].thread, NULL, server_port_thread, &server->ports[i]) != 0) {
+			printf("ERROR (server_start): unable to start the thread of %s\n", ports[i]);
+			// the threads started so far have not touched their ports yet
+			set_start_state(server, -1);
+			while(i-- > 0)
+				pthread_join(server->ports[i].thread, NULL);
+			free_ports(server, num_ports);
+			return 1;
+		}
+	}
+	set_start_state(server, 1);
+	return 0;
+}
+
+void server_totals(const server_t *server, port_stats_t *totals) {
+	memset(totals, 0, sizeof(*totals));
+	unsigned i;
+	for(i = 0; i < server->num_ports; ++i) {
+		const port_stats_t *stats = &server->ports[i].stats;
+		atomic_fetch_add(&totals->num_links, atomic_load(&stats->num_links));
+		atomic_fetch_add(&totals->num_failures, atomic_load(&stats->num_failures));
+		atomic_fetch_add(&totals->num_received_data_frames, atomic_load(&stats->num_received_data_frames));
+		atomic_fetch_add(&totals->num_sent_REJs, atomic_load(&stats->num_sent_REJs));
+		atomic_fetch_add(&totals->num_timeouts, atomic_load(&stats->num_timeouts));
+	}
+}
+
+void show_port_stats(const char *name, const port_stats_t *stats) {
+	printf("%-20s %8lu %8lu %12lu %8lu %8lu\n", name,
+			atomic_load(&stats->num_links),
+			atomic_load(&stats->num_failures),
+			atomic_load(&stats->num_received_data_frames),
+			atomic_load(&stats->num_sent_REJs),
+			atomic_load(&stats->num_timeouts));
+}
+
+void server_show_stats(const server_t *server) {
+	printf("%-20s %8s %8s %12s %8s %8s\n", "port", "links", "failed", "data frames", "REJs", "timeouts");
+	unsigned i;
+	for(i = 0; i < server->num_ports; ++i)
+		show_port_stats(server->ports[i].transfer.port, &server->ports[i].stats);
+	port_stats_t totals;
+	server_totals(server, &totals);
+	show_port_stats("total", &totals);
+}
@@ -0,0 +1,63 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include "application.h"
+
+/*
+ * Totals of a port since the server started, updated as each of its links ends
+ */
+typedef struct {
+	atomic_ulong num_links;		/* closed by the sender */
+	atomic_ulong num_failures;	/* transfers that failed, dropping their link */
+	atomic_ulong num_received_data_frames;
+	atomic_ulong num_sent_REJs;
+	atomic_ulong num_timeouts;
+} port_stats_t;
+
+/*
+ * One port of the server, served by its own thread and link
+ */
+typedef struct server server_t;
+typedef struct {
+	transfer_t transfer;
+	char *folder;			/* spool folder of the port, with its trailing '/' */
+	pthread_t thread;
+	port_stats_t stats;
+	server_t *server;
+} server_port_t;
+
+/*
+ * Receiver for many ports at once. Every port keeps its own configured link,
+ * answers each SET as soon as it arrives and spools what it receives into
+ * <spool folder>/<port name>/. A port waiting for a sender is blocked in poll,
+ * and the link and writer of a receiving port sleep while they wait on the
+ * line or on each other, so a port only uses CPU for the frames it handles.
+ */
+struct server {
+	server_port_t *ports;
+	unsigned num_ports;
+	pthread_mutex_t start_lock;
+	pthread_cond_t start_changed;
+	int start_state;		/* port threads wait for it to leave 0: 1 to serve, -1 to return */
+};
+
+/*
+ * Starts a thread per port, each with a copy of settings. The threads only
+ * open their ports once all of them are running
+ * Returns 0 if OK, 1 otherwise (nothing is left running then)
+ */
+int server_start(server_t *server, const transfer_t *settings, char *const ports[], unsigned num_ports, const char *spool_folder);
+
+/*
+ * Sum of the totals of every port
+ */
+void server_totals(const server_t *server, port_stats_t *totals);
+
+/*
+ * Prints each port's totals and the sum of them
+ */
+void server_show_stats(const server_t *server);
+
+#endif
@@ -0,0 +1,336 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include "sim.h"
+
+#define SIM_NUM_ENDS 2
+#define SIM_LINE_INITIAL_CAPACITY 4096
+
+typedef enum {
+	SIM_RUNNING,
+	SIM_WAITING,
+	SIM_DONE
+} sim_state_t;
+
+/*
+ * A byte on its way, readable from its arrival on
+ */
+typedef struct {
+	double arrival;
+	unsigned char byte;
+} sim_byte_t;
+
+/*
+ * One way of the channel, in arrival order
+ */
+typedef struct {
+	sim_byte_t *bytes;
+	unsigned head;
+	unsigned length;
+	unsigned capacity;
+	double busy_until;		/* the last byte written is on the wire until then */
+} sim_line_t;
+
+struct sim;
+
+typedef struct {
+	struct sim *sim;
+	unsigned index;
+	pthread_t thread;
+	pthread_cond_t turn;		/* signalled when the end gets to run */
+	sim_state_t state;
+	double deadline;		/* of its wait, INFINITY for none */
+	int deadlock;			/* woken with nothing left to wait for */
+	sim_line_t *rx;
+	sim_line_t *tx;
+	transport_t transport;
+	sim_end_t run;
+	void *context;
+	int result;
+} sim_endpoint_t;
+
+typedef struct sim {
+	pthread_mutex_t lock;
+	pthread_cond_t finished;
+	double now;
+	int running;			/* end that holds the turn, -1 once both are done */
+	sim_endpoint_t ends[SIM_NUM_ENDS];
+	sim_line_t lines[SIM_NUM_ENDS];
+	const sim_channel_t *channel;
+	double byte_error_rate;
+	uint64_t random;
+	sim_results_t *results;
+} sim_t;
+
+uint64_t sim_random(sim_t *sim);
+double sim_uniform(sim_t *sim);
+double sim_next_event(const sim_endpoint_t *end);
+void sim_schedule(sim_t *sim);
+void *sim_thread(void *arg);
+int sim_arrived(const sim_endpoint_t *end);
+int sim_transport_read(transport_t *transport, unsigned char *buffer, unsigned max);
+int sim_transport_write(transport_t *transport, const struct iovec *iov, int iovcnt);
+int sim_transport_poll(transport_t *transport, int timeout_ms);
+void sim_transport_discard(transport_t *transport);
+int sim_transport_close(transport_t *transport);
+double sim_transport_now(const transport_t *transport);
+
+const transport_ops_t sim_transport_ops = {
+	sim_transport_read, sim_transport_write, sim_transport_poll, sim_transport_discard, sim_transport_close, sim_transport_now
+};
+
+uint64_t sim_random(sim_t *sim) {
+	// splitmix64: the channel's own generator, rand() is left to the ends
+	uint64_t z = (sim->random += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+double sim_uniform(sim_t *sim) {
+	return (sim_random(sim) >> 11) * (1.0 / (1ULL << 53));
+}
+
+int sim_run(const sim_channel_t *channel, sim_end_t first, void *first_context, sim_end_t second, void *second_context, sim_results_t *results) {
+	if(channel->baudrate == 0) {
+		printf("ERROR (sim_run): the channel needs a baud rate\n");
+		return 1;
+	}
+	sim_t sim;
+	memset(&sim, 0, sizeof(sim));
+	memset(results, 0, sizeof(*results));
+	pthread_mutex_init(&sim.lock, NULL);
+	pthread_cond_init(&sim.finished, NULL);
+	sim.channel = channel;
+	// a byte is hit with the chance any of its bits is, and then a single bit of it flips
+	sim.byte_error_rate = 1 - pow(1 - channel->bit_error_rate, 8);
+	sim.random = channel->seed;
+	sim.results = results;
+	srand(channel->seed);
+
+	sim_end_t runs[SIM_NUM_ENDS] = {first, second};
+	void *contexts[SIM_NUM_ENDS] = {first_context, second_context};
+	unsigned i;
+	for(i = 0; i < SIM_NUM_ENDS; ++i) {
+		sim_endpoint_t *end = &sim.ends[i];
+		end->sim = &sim;
+		end->index = i;
+		pthread_cond_init(&end->turn, NULL);
+		// both start right away, the first one first
+		end->state = SIM_WAITING;
+		end->deadline = 0;
+		end->rx = &sim.lines[i];
+		end->tx = &sim.lines[(i + 1) % SIM_NUM_ENDS];
+		transport_init(&end->transport);
+		end->transport.ops = &sim_transport_ops;
+		end->transport.context = end;
+		end->run = runs[i];
+		end->context = contexts[i];
+	}
+
+	pthread_mutex_lock(&sim.lock);
+	sim.running = -2;	// nobody until both threads exist
+	unsigned num_started;
+	for(num_started = 0; num_started < SIM_NUM_ENDS; ++num_started) {
+		if(pthread_create(&sim.ends[num_started].thread, NULL, sim_thread, &sim.ends[num_started]) != 0) {
+			printf("ERROR (sim_run): unable to start an end\n");
+			break;
+		}
+	}
+	// an end left without its peer only waits until the deadlock is noticed
+	for(i = num_started; i < SIM_NUM_ENDS; ++i)
+		sim.ends[i].state = SIM_DONE;
+	sim_schedule(&sim);
+	while(sim.running != -1)
+		pthread_cond_wait(&sim.finished, &sim.lock);
+	pthread_mutex_unlock(&sim.lock);
+
+	int ret = (num_started < SIM_NUM_ENDS);
+	for(i = 0; i < num_started; ++i) {
+		pthread_join(sim.ends[i].thread, NULL);
+		ret |= (sim.ends[i].result != 0);
+	}
+	for(i = 0; i < SIM_NUM_ENDS; ++i) {
+		pthread_cond_destroy(&sim.ends[i].turn);
+		free(sim.lines[i].bytes);
+	}
+	pthread_cond_destroy(&sim.finished);
+	pthread_mutex_destroy(&sim.lock);
+	results->duration = sim.now;
+	return ret;
+}
+
+void *sim_thread(void *arg) {
+	sim_endpoint_t *end = arg;
+	sim_t *sim = end->sim;
+	pthread_mutex_lock(&sim->lock);
+	while(sim->running != (int)end->index)
+		pthread_cond_wait(&end->turn, &sim->lock);
+	pthread_mutex_unlock(&sim->lock);
+
+	end->result = end->run(end->context, &end->transport);
+
+	pthread_mutex_lock(&sim->lock);
+	end->state = SIM_DONE;
+	sim_schedule(sim);
+	pthread_mutex_unlock(&sim->lock);
+	return NULL;
+}
+
+double sim_next_event(const sim_endpoint_t *end) {
+	double next = end->deadline;
+	if(end->rx->length > 0 && end->rx->bytes[end->rx->head].arrival < next)
+		next = end->rx->bytes[end->rx->head].arrival;
+	return next;
+}
+
+/*
+ * Hands the turn to the waiting end with the earliest event, moving the clock
+ * up to it. Called with the lock held by the end giving up the turn.
+ */
+void sim_schedule(sim_t *sim) {
+	int next = -1;
+	double next_time = INFINITY;
+	unsigned i;
+	for(i = 0; i < SIM_NUM_ENDS; ++i) {
+		const sim_endpoint_t *end = &sim->ends[i];
+		if(end->state != SIM_WAITING)
+			continue;
+		// ties go to the lower end, so that runs are repeatable
+		double time = sim_next_event(end);
+		if(next < 0 || time < next_time) {
+			next = i;
+			next_time = time;
+		}
+	}
+
+	if(next < 0) {
+		sim->running = -1;
+		pthread_cond_signal(&sim->finished);
+		return;
+	}
+	sim_endpoint_t *end = &sim->ends[next];
+	if(isinf(next_time)) {
+		// everyone left waits for ever: it gets an error instead
+		end->deadlock = 1;
+		sim->results->deadlock = 1;
+	} else if(next_time > sim->now) {
+		sim->now = next_time;
+	}
+	end->state = SIM_RUNNING;
+	sim->running = next;
+	pthread_cond_signal(&end->turn);
+}
+
+int sim_arrived(const sim_endpoint_t *end) {
+	return end->rx->length > 0 && end->rx->bytes[end->rx->head].arrival <= end->sim->now;
+}
+
+int sim_transport_read(transport_t *transport, unsigned char *buffer, unsigned max) {
+	sim_endpoint_t *end = transport->context;
+	sim_line_t *line = end->rx;
+	pthread_mutex_lock(&end->sim->lock);
+	unsigned length = 0;
+	while(length < max && sim_arrived(end)) {
+		buffer[length++] = line->bytes[line->head].byte;
+		line->head = (line->head + 1) % line->capacity;
+		--line->length;
+	}
+	pthread_mutex_unlock(&end->sim->lock);
+	if(length == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+	return length;
+}
+
+int sim_transport_write(transport_t *transport, const struct iovec *iov, int iovcnt) {
+	sim_endpoint_t *end = transport->context;
+	sim_t *sim = end->sim;
+	sim_line_t *line = end->tx;
+	double byte_time = (double)SIM_LINE_BITS_PER_BYTE / sim->channel->baudrate;
+	int written = 0;
+	int i;
+	pthread_mutex_lock(&sim->lock);
+	for(i = 0; i < iovcnt; ++i) {
+		const unsigned char *data = iov[i].iov_base;
+		size_t j;
+		for(j = 0; j < iov[i].iov_len; ++j) {
+			if(line->length == line->capacity) {
+				unsigned capacity = line->capacity ? 2 * line->capacity : SIM_LINE_INITIAL_CAPACITY;
+				sim_byte_t *bytes;
+				if((bytes = malloc(capacity * sizeof(sim_byte_t))) == NULL) {
+					printf("ERROR (sim_transport_write): unable to allocate %u bytes of line\n", capacity);
+					pthread_mutex_unlock(&sim->lock);
+					return -1;
+				}
+				unsigned k;
+				for(k = 0; k < line->length; ++k)
+					bytes[k] = line->bytes[(line->head + k) % line->capacity];
+				free(line->bytes);
+				line->bytes = bytes;
+				line->head = 0;
+				line->capacity = capacity;
+			}
+			// the UART sends one byte after the other, write() itself takes no time
+			double start = line->busy_until > sim->now ? line->busy_until : sim->now;
+			line->busy_until = start + byte_time;
+			sim_byte_t *byte = &line->bytes[(line->head + line->length) % line->capacity];
+			byte->arrival = line->busy_until + sim->channel->delay;
+			byte->byte = data[j];
+			if(sim->byte_error_rate > 0 && sim_uniform(sim) < sim->byte_error_rate) {
+				byte->byte ^= 1 << (sim_random(sim) % 8);
+				++sim->results->num_corrupted_bytes;
+			}
+			++line->length;
+			++written;
+		}
+	}
+	sim->results->num_bytes += written;
+	pthread_mutex_unlock(&sim->lock);
+	return written;
+}
+
+int sim_transport_poll(transport_t *transport, int timeout_ms) {
+	sim_endpoint_t *end = transport->context;
+	sim_t *sim = end->sim;
+	pthread_mutex_lock(&sim->lock);
+	if(sim_arrived(end) || timeout_ms == 0) {
+		int ready = sim_arrived(end);
+		pthread_mutex_unlock(&sim->lock);
+		return ready;
+	}
+	// give the turn away until a byte arrives or the timeout is up
+	end->deadline = timeout_ms < 0 ? INFINITY : sim->now + timeout_ms / 1000.0;
+	end->state = SIM_WAITING;
+	sim_schedule(sim);
+	while(sim->running != (int)end->index)
+		pthread_cond_wait(&end->turn, &sim->lock);
+	int ready = sim_arrived(end);
+	int deadlock = end->deadlock;
+	end->deadlock = 0;
+	pthread_mutex_unlock(&sim->lock);
+	if(!ready && deadlock) {
+		errno = EDEADLK;
+		return -1;
+	}
+	return ready;
+}
+
+void sim_transport_discard(transport_t *transport) {
+	unsigned char buffer[256];
+	while(sim_transport_read(transport, buffer, sizeof(buffer)) > 0);
+}
+
+int sim_transport_close(transport_t *transport) {
+	// the line belongs to the simulation, which frees it once both ends are done
+	return 0;
+}
+
+double sim_transport_now(const transport_t *transport) {
+	const sim_endpoint_t *end = transport->context;
+	return end->sim->now;
+}
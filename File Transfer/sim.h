@@ -0,0 +1,47 @@
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+#include "transport.h"
+
+#define SIM_LINE_BITS_PER_BYTE 10	/* start, 8 data and stop bits */
+
+/*
+ * Line between the two ends of a simulation, alike both ways
+ */
+typedef struct {
+	unsigned baudrate;		/* bits per second */
+	double delay;			/* propagation, seconds */
+	double bit_error_rate;		/* of every data bit, independently */
+	uint64_t seed;			/* the same seed always plays out the same way */
+} sim_channel_t;
+
+/*
+ * Runs one end of the simulated link, from llopen to llclose, over transport,
+ * which is already open. It must not block on anything but the transport.
+ * Returns 0 if OK, 1 otherwise
+ */
+typedef int (*sim_end_t)(void *context, transport_t *transport);
+
+/*
+ * Totals of a simulation
+ */
+typedef struct {
+	double duration;		/* virtual seconds until both ends returned */
+	unsigned long num_bytes;	/* written on the line, both ways */
+	unsigned long num_corrupted_bytes;
+	int deadlock;			/* both ends waited for ever with nothing on the line */
+} sim_results_t;
+
+/*
+ * Runs first and second against each other over a simulated channel on a
+ * virtual clock: each end is a thread, but only one of them runs at a time,
+ * and whenever both wait the clock jumps straight to the next byte arrival or
+ * timeout. Timeouts of seconds take no time at all and, as nothing depends on
+ * the system's clock or scheduler, a seed always gives the same run.
+ * rand() is seeded with the channel's seed as well.
+ * Returns 0 if both ends returned 0, 1 otherwise
+ */
+int sim_run(const sim_channel_t *channel, sim_end_t first, void *first_context, sim_end_t second, void *second_context, sim_results_t *results);
+
+#endif
@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include "spsc_queue.h"
+
+void spsc_queue_wake(spsc_queue_t *queue);
+
+int spsc_queue_init(spsc_queue_t *queue, size_t capacity, size_t slot_size) {
+	size_t rounded = 1;
+	while(rounded < capacity)
+		rounded <<= 1;
+	// keep every slot suitably aligned for the struct stored in it
+	slot_size = (slot_size + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1);
+
+	if((queue->slots = malloc(rounded * slot_size)) == NULL) {
+		printf("ERROR (spsc_queue_init): unable to allocate %lu bytes of memory\n", (unsigned long)(rounded * slot_size));
+		return 1;
+	}
+	queue->slot_size = slot_size;
+	queue->capacity = rounded;
+	atomic_init(&queue->head, 0);
+	atomic_init(&queue->tail, 0);
+	atomic_init(&queue->closed, 0);
+	atomic_init(&queue->num_waiting, 0);
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_cond_init(&queue->changed, NULL);
+	return 0;
+}
+
+void spsc_queue_destroy(spsc_queue_t *queue) {
+	free(queue->slots);
+	queue->slots = NULL;
+	pthread_cond_destroy(&queue->changed);
+	pthread_mutex_destroy(&queue->lock);
+}
+
+void spsc_queue_wake(spsc_queue_t *queue) {
+	// pairs with the fence in the _wait calls: either the sleeper sees the change
+	// before it sleeps, or it is counted here and gets the broadcast
+	atomic_thread_fence(memory_order_seq_cst);
+	if(atomic_load_explicit(&queue->num_waiting, memory_order_relaxed) == 0)
+		return;
+	pthread_mutex_lock(&queue->lock);
+	pthread_cond_broadcast(&queue->changed);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+void *spsc_queue_reserve(spsc_queue_t *queue) {
+	size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+	if(tail - head == queue->capacity)
+		return NULL;
+	return &queue->slots[(tail & (queue->capacity - 1)) * queue->slot_size];
+}
+
+void spsc_queue_commit(spsc_queue_t *queue) {
+	size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+	atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+	spsc_queue_wake(queue);
+}
+
+void *spsc_queue_front(spsc_queue_t *queue) {
+	size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+	if(head == tail)
+		return NULL;
+	return &queue->slots[(head & (queue->capacity - 1)) * queue->slot_size];
+}
+
+void spsc_queue_release(spsc_queue_t *queue) {
+	size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+	spsc_queue_wake(queue);
+}
+
+void *spsc_queue_reserve_wait(spsc_queue_t *queue) {
+	void *slot;
+	if((slot = spsc_queue_reserve(queue)) != NULL)
+		return slot;
+	pthread_mutex_lock(&queue->lock);
+	atomic_fetch_add(&queue->num_waiting, 1);
+	for(;;) {
+		atomic_thread_fence(memory_order_seq_cst);
+		if((slot = spsc_queue_reserve(queue)) != NULL || atomic_load_explicit(&queue->closed, memory_order_acquire))
+			break;
+		pthread_cond_wait(&queue->changed, &queue->lock);
+	}
+	atomic_fetch_sub(&queue->num_waiting, 1);
+	pthread_mutex_unlock(&queue->lock);
+	return slot;
+}
+
+void *spsc_queue_front_wait(spsc_queue_t *queue) {
+	void *slot;
+	if((slot = spsc_queue_front(queue)) != NULL)
+		return slot;
+	pthread_mutex_lock(&queue->lock);
+	atomic_fetch_add(&queue->num_waiting, 1);
+	for(;;) {
+		atomic_thread_fence(memory_order_seq_cst);
+		if((slot = spsc_queue_front(queue)) != NULL)
+			break;
+		if(atomic_load_explicit(&queue->closed, memory_order_acquire)) {
+			// a commit may have raced with the close
+			slot = spsc_queue_front(queue);
+			break;
+		}
+		pthread_cond_wait(&queue->changed, &queue->lock);
+	}
+	atomic_fetch_sub(&queue->num_waiting, 1);
+	pthread_mutex_unlock(&queue->lock);
+	return slot;
+}
+
+void spsc_queue_close(spsc_queue_t *queue) {
+	atomic_store_explicit(&queue->closed, 1, memory_order_release);
+	spsc_queue_wake(queue);
+}
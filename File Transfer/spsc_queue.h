@@ -0,0 +1,61 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+/*
+ * Lock-free ring of fixed-size slots shared by exactly one producer thread
+ * and one consumer thread. Slots are filled and drained in place, so no
+ * extra copy is made between the two stages. A side that has to wait sleeps
+ * on the queue's condition variable, which the other side only locks while
+ * someone is asleep on it.
+ */
+typedef struct {
+	unsigned char *slots;
+	size_t slot_size;
+	size_t capacity;		/* always a power of two */
+	_Alignas(64) atomic_size_t head;	/* next slot to be consumed */
+	_Alignas(64) atomic_size_t tail;	/* next slot to be produced */
+	atomic_int closed;
+	atomic_int num_waiting;		/* threads asleep in a _wait call */
+	pthread_mutex_t lock;
+	pthread_cond_t changed;		/* a slot was committed or released, or the queue closed */
+} spsc_queue_t;
+
+/*
+ * Allocates a queue holding at least capacity slots of slot_size bytes
+ * Returns 0 if OK, 1 otherwise
+ */
+int spsc_queue_init(spsc_queue_t *queue, size_t capacity, size_t slot_size);
+void spsc_queue_destroy(spsc_queue_t *queue);
+
+/*
+ * Producer side: returns the next free slot (NULL if the queue is full),
+ * which only becomes visible to the consumer after spsc_queue_commit
+ */
+void *spsc_queue_reserve(spsc_queue_t *queue);
+void spsc_queue_commit(spsc_queue_t *queue);
+
+/*
+ * Consumer side: returns the oldest committed slot (NULL if the queue is empty),
+ * which is handed back to the producer by spsc_queue_release
+ */
+void *spsc_queue_front(spsc_queue_t *queue);
+void spsc_queue_release(spsc_queue_t *queue);
+
+/*
+ * Blocking variants, which sleep until the other side commits, releases or
+ * closes. Both return NULL once the queue has been closed
+ * (the consumer still drains every slot committed before closing)
+ */
+void *spsc_queue_reserve_wait(spsc_queue_t *queue);
+void *spsc_queue_front_wait(spsc_queue_t *queue);
+
+/*
+ * Marks the end of the stream. May be called by either side.
+ */
+void spsc_queue_close(spsc_queue_t *queue);
+
+#endif
@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "../bus.h"
+
+/*
+ * Distributes a file to several nodes of a bus in memory. A hub stands for
+ * the shared line: whatever the master writes reaches every node, each with
+ * its own rate of corrupted bytes, and whatever a node writes reaches the
+ * master. Nodes that lose part of the broadcast must get it repaired over
+ * their own link, and every copy must check out.
+ */
+
+#define NUM_NODES 3
+#define FILE_SIZE (256 * 1024)
+#define HUB_BUFFER_SIZE 4096
+
+/* chance of each byte to a node to be corrupted on the way */
+const double byte_error_rates[NUM_NODES] = {0, 5e-5, 2e-4};
+
+typedef struct {
+	transport_t master;			/* the hub's end of the master's link */
+	transport_t nodes[NUM_NODES];		/* the hub's end of each node's link */
+	unsigned seeds[NUM_NODES];
+	unsigned long num_corrupted[NUM_NODES];
+} hub_t;
+
+typedef struct {
+	hub_t *hub;
+	unsigned index;
+} hub_port_t;
+
+typedef struct {
+	transfer_t transfer;
+	unsigned node;
+	char folder[128];
+	int result;
+} node_t;
+
+void *hub_down_thread(void *arg);
+void *hub_up_thread(void *arg);
+void *node_thread(void *arg);
+int write_file(const char *path, unsigned size);
+int same_files(const char *a, const char *b);
+
+void *hub_down_thread(void *arg) {
+	hub_t *hub = arg;
+	unsigned char buffer[HUB_BUFFER_SIZE], copy[HUB_BUFFER_SIZE];
+	int length;
+	// the memory transport blocks until there is something to read, 0 once the master is gone
+	while((length = transport_read(&hub->master, buffer, sizeof(buffer))) > 0) {
+		unsigned i;
+		int j;
+		for(i = 0; i < NUM_NODES; ++i) {
+			memcpy(copy, buffer, length);
+			for(j = 0; j < length; ++j) {
+				if(rand_r(&hub->seeds[i]) < byte_error_rates[i] * RAND_MAX) {
+					copy[j] ^= 0x10;
+					++hub->num_corrupted[i];
+				}
+			}
+			struct iovec iov = { copy, length };
+			transport_write(&hub->nodes[i], &iov, 1);
+		}
+	}
+	return NULL;
+}
+
+void *hub_up_thread(void *arg) {
+	hub_port_t *port = arg;
+	unsigned char buffer[HUB_BUFFER_SIZE];
+	int length;
+	// only the node the master polls speaks, so nodes never write over each other
+	while((length = transport_read(&port->hub->nodes[port->index], buffer, sizeof(buffer))) > 0) {
+		struct iovec iov = { buffer, length };
+		transport_write(&port->hub->master, &iov, 1);
+	}
+	return NULL;
+}
+
+void *node_thread(void *arg) {
+	node_t *node = arg;
+	node->result = bus_receive(&node->transfer, node->node, node->folder);
+	return NULL;
+}
+
+int write_file(const char *path, unsigned size) {
+	FILE *file;
+	if((file = fopen(path, "wb")) == NULL)
+		return 1;
+	unsigned i;
+	for(i = 0; i < size; ++i)
+		fputc(rand(), file);
+	return fclose(file) != 0;
+}
+
+int same_files(const char *a, const char *b) {
+	FILE *fa = fopen(a, "rb"), *fb = fopen(b, "rb");
+	int same = (fa != NULL && fb != NULL);
+	while(same) {
+		int ca = fgetc(fa), cb = fgetc(fb);
+		same = (ca == cb);
+		if(ca == EOF)
+			break;
+	}
+	if(fa != NULL)
+		fclose(fa);
+	if(fb != NULL)
+		fclose(fb);
+	return same;
+}
+
+int main(int argc, char *argv[]) // ./bus_repair
+{
+	char dir[] = "/tmp/bus_repairXXXXXX";
+	if(mkdtemp(dir) == NULL) {
+		perror("bus_repair");
+		return 1;
+	}
+	char source[128];
+	snprintf(source, sizeof(source), "%s/source.bin", dir);
+	if(write_file(source, FILE_SIZE)) {
+		perror("bus_repair");
+		return 1;
+	}
+
+	hub_t hub;
+	transfer_t master;
+	node_t nodes[NUM_NODES];
+	unsigned numbers[NUM_NODES];
+	transfer_init(&master, "bus", SENDER);
+	master.timeout = 1;
+	if(transport_open_memory_pair(&master.datalink.transport, &hub.master))
+		return 1;
+	unsigned i;
+	for(i = 0; i < NUM_NODES; ++i) {
+		node_t *node = &nodes[i];
+		node->node = numbers[i] = i + 1;
+		snprintf(node->folder, sizeof(node->folder), "%s/node%u/", dir, node->node);
+		if(mkdir(node->folder, 0755) != 0) {
+			perror("bus_repair");
+			return 1;
+		}
+		transfer_init(&node->transfer, "bus", RECEIVER);
+		node->transfer.keep_port = 1;
+		if(transport_open_memory_pair(&node->transfer.datalink.transport, &hub.nodes[i]))
+			return 1;
+		hub.seeds[i] = i + 1;
+		hub.num_corrupted[i] = 0;
+	}
+
+	pthread_t down, up[NUM_NODES], node_threads[NUM_NODES];
+	hub_port_t ports[NUM_NODES];
+	pthread_create(&down, NULL, hub_down_thread, &hub);
+	for(i = 0; i < NUM_NODES; ++i) {
+		ports[i].hub = &hub;
+		ports[i].index = i;
+		pthread_create(&up[i], NULL, hub_up_thread, &ports[i]);
+		pthread_create(&node_threads[i], NULL, node_thread, &nodes[i]);
+	}
+	int ret = bus_distribute(&master, source, numbers, NUM_NODES);
+	for(i = 0; i < NUM_NODES; ++i) {
+		pthread_join(node_threads[i], NULL);
+		ret |= nodes[i].result;
+	}
+
+	// closing the lines ends the hub
+	transport_close(&master.datalink.transport);
+	pthread_join(down, NULL);
+	unsigned long num_corrupted = 0;
+	int same = (ret == 0);
+	for(i = 0; i < NUM_NODES; ++i) {
+		transport_close(&nodes[i].transfer.datalink.transport);
+		pthread_join(up[i], NULL);
+		transport_close(&hub.nodes[i]);
+		num_corrupted += hub.num_corrupted[i];
+
+		char copy[256];
+		snprintf(copy, sizeof(copy), "%ssource.bin", nodes[i].folder);
+		same &= same_files(source, copy);
+		printf("bus_repair: node %u, %lu bytes corrupted on the way\n", nodes[i].node, hub.num_corrupted[i]);
+		unlink(copy);
+		rmdir(nodes[i].folder);
+	}
+	transport_close(&hub.master);
+	unlink(source);
+	rmdir(dir);
+
+	if(!same)
+		printf("bus_repair: FAILED, a copy did not arrive intact\n");
+	else if(num_corrupted == 0)
+		printf("bus_repair: FAILED, nothing was lost, so nothing was repaired\n");
+	else
+		printf("bus_repair: OK\n");
+	return !(same && num_corrupted > 0);
+}
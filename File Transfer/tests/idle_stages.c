@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <pthread.h>
+#include "../application.h"
+#include "slow_line.h"
+
+/*
+ * Sends a file over a slow line in memory and checks that the stages waiting
+ * on it sleep: the sender's read-ahead and framing stages wait on full queues
+ * and the receiver's writer on an empty one, so the whole process should use
+ * a small share of one core however long the transfer takes.
+ */
+
+#define LINE_BAUDRATE 921600
+#define FILE_SIZE (128 * 1024)
+#define MAX_CPU_SHARE 0.25	/* of one core, over the whole transfer */
+
+typedef struct {
+	transfer_t transfer;
+	char folder[128];
+	int result;
+} receiver_t;
+
+void *receiver_thread(void *arg);
+int write_file(const char *path, unsigned size);
+int same_files(const char *a, const char *b);
+double seconds(clockid_t clock);
+
+void *receiver_thread(void *arg) {
+	receiver_t *receiver = arg;
+	do
+		receiver->result = transfer_receive(&receiver->transfer, receiver->folder);
+	while(receiver->result == 0 && receiver->transfer.connected);
+	return NULL;
+}
+
+int write_file(const char *path, unsigned size) {
+	FILE *file;
+	if((file = fopen(path, "wb")) == NULL)
+		return 1;
+	unsigned i;
+	for(i = 0; i < size; ++i)
+		fputc(rand(), file);
+	return fclose(file) != 0;
+}
+
+int same_files(const char *a, const char *b) {
+	FILE *fa = fopen(a, "rb"), *fb = fopen(b, "rb");
+	int same = (fa != NULL && fb != NULL);
+	while(same) {
+		int ca = fgetc(fa), cb = fgetc(fb);
+		same = (ca == cb);
+		if(ca == EOF)
+			break;
+	}
+	if(fa != NULL)
+		fclose(fa);
+	if(fb != NULL)
+		fclose(fb);
+	return same;
+}
+
+double seconds(clockid_t clock) {
+	struct timespec now;
+	clock_gettime(clock, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) // ./idle_stages
+{
+	char dir[] = "/tmp/idle_stagesXXXXXX";
+	if(mkdtemp(dir) == NULL) {
+		perror("idle_stages");
+		return 1;
+	}
+	char source[128], copy[256];
+	snprintf(source, sizeof(source), "%s/source.bin", dir);
+	receiver_t receiver;
+	snprintf(receiver.folder, sizeof(receiver.folder), "%s/received/", dir);
+	snprintf(copy, sizeof(copy), "%ssource.bin", receiver.folder);
+	if(mkdir(receiver.folder, 0755) != 0 || write_file(source, FILE_SIZE)) {
+		perror("idle_stages");
+		return 1;
+	}
+
+	transfer_t sender;
+	slow_line_t line;
+	transfer_init(&sender, "memory", SENDER);
+	transfer_init(&receiver.transfer, "memory", RECEIVER);
+	sender.progress_mode = receiver.transfer.progress_mode = PROGRESS_OFF;
+	sender.keep_port = receiver.transfer.keep_port = 1;
+	if(transport_open_memory_pair(&sender.datalink.transport, &receiver.transfer.datalink.transport))
+		return 1;
+	slow_line_wrap(&line, &sender.datalink.transport, LINE_BAUDRATE);
+
+	double start = seconds(CLOCK_MONOTONIC);
+	double start_cpu = seconds(CLOCK_PROCESS_CPUTIME_ID);
+	pthread_t thread;
+	pthread_create(&thread, NULL, receiver_thread, &receiver);
+	int ret = transfer_send_file(&sender, source);
+	ret |= transfer_close(&sender);
+	pthread_join(thread, NULL);
+	ret |= receiver.result;
+	transfer_close(&receiver.transfer);
+	double elapsed = seconds(CLOCK_MONOTONIC) - start;
+	double cpu = seconds(CLOCK_PROCESS_CPUTIME_ID) - start_cpu;
+
+	int same = (ret == 0 && same_files(source, copy));
+	int idle = (cpu < MAX_CPU_SHARE * elapsed);
+	printf("idle_stages: %d bytes in %.2f s at %d baud, %.2f s of CPU (%.0f%% of a core)\n",
+			FILE_SIZE, elapsed, LINE_BAUDRATE, cpu, 100 * cpu / elapsed);
+	if(!same)
+		printf("idle_stages: FAILED, the file did not arrive intact\n");
+	else if(!idle)
+		printf("idle_stages: FAILED, waiting stages use more than %.0f%% of a core\n", 100 * MAX_CPU_SHARE);
+	else
+		printf("idle_stages: OK\n");
+
+	unlink(copy);
+	unlink(source);
+	rmdir(receiver.folder);
+	rmdir(dir);
+	return !(same && idle);
+}
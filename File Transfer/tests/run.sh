@@ -0,0 +1,8 @@
+# builds every test with the library's sources, without the injected frame errors, and runs them
+cd "$(dirname "$0")"
+SOURCES="../serial.c ../transport.c ../datalink.c ../application.c ../frame_validator.c ../frame_parser.c ../spsc_queue.c ../perf_counters.c ../file_source.c ../file_sink.c ../checkpoint.c ../checksum.c ../manifest.c ../delta.c ../dedup.c ../block_cache.c ../compression.c ../chunk_pool.c ../progress.c ../server.c ../bus.c ../sim.c"
+failed=0
+for test in idle_stages server_ports bus_repair tcp_listen; do
+	gcc -Wall -D_FILE_OFFSET_BITS=64 -DBCC1_ERR_PROB=0 -DBCC2_ERR_PROB=0 $test.c slow_line.c $SOURCES -lm -lz -pthread -o $test && ./$test || failed=1
+done
+exit $failed
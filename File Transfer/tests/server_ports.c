@@ -0,0 +1,202 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "../application.h"
+#include "../server.h"
+#include "slow_line.h"
+
+/*
+ * Runs a server on several TCP ports in a process of its own and checks its
+ * CPU use: none while every port waits for a sender, and a small share of a
+ * core while all of them receive at once from senders on slow lines.
+ */
+
+#define NUM_PORTS 4
+#define LINE_BAUDRATE 921600
+#define FILE_SIZE (64 * 1024)
+#define IDLE_SECONDS 1
+#define MAX_IDLE_CPU 0.02	/* seconds, for the whole server */
+#define MAX_CPU_SHARE 0.25	/* of one core, for all ports receiving together */
+#define CONNECT_ATTEMPTS 50	/* 100 ms apart, while the server starts */
+
+typedef struct {
+	char address[64];
+	const char *path;
+	int result;
+} sender_t;
+
+void *sender_thread(void *arg);
+int write_file(const char *path, unsigned size);
+int same_files(const char *a, const char *b);
+double seconds(void);
+double process_cpu(pid_t pid);
+
+void *sender_thread(void *arg) {
+	sender_t *sender = arg;
+	transfer_t transfer;
+	slow_line_t line;
+	transfer_init(&transfer, sender->address, SENDER);
+	transfer.progress_mode = PROGRESS_OFF;
+	transfer.keep_port = 1;
+	unsigned attempt;
+	sender->result = 1;
+	for(attempt = 0; attempt < CONNECT_ATTEMPTS; ++attempt) {
+		if(transport_open(&transfer.datalink.transport, sender->address, 0) == 0)
+			break;
+		usleep(100000);
+	}
+	if(attempt == CONNECT_ATTEMPTS)
+		return NULL;
+	slow_line_wrap(&line, &transfer.datalink.transport, LINE_BAUDRATE);
+	sender->result = transfer_send_file(&transfer, sender->path);
+	sender->result |= transfer_close(&transfer);
+	return NULL;
+}
+
+int write_file(const char *path, unsigned size) {
+	FILE *file;
+	if((file = fopen(path, "wb")) == NULL)
+		return 1;
+	unsigned i;
+	for(i = 0; i < size; ++i)
+		fputc(rand(), file);
+	return fclose(file) != 0;
+}
+
+int same_files(const char *a, const char *b) {
+	FILE *fa = fopen(a, "rb"), *fb = fopen(b, "rb");
+	int same = (fa != NULL && fb != NULL);
+	while(same) {
+		int ca = fgetc(fa), cb = fgetc(fb);
+		same = (ca == cb);
+		if(ca == EOF)
+			break;
+	}
+	if(fa != NULL)
+		fclose(fa);
+	if(fb != NULL)
+		fclose(fb);
+	return same;
+}
+
+double seconds(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+double process_cpu(pid_t pid) {
+	// user and system time of every thread, fields 14 and 15 of stat
+	char path[64], stat[1024];
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	FILE *file;
+	if((file = fopen(path, "r")) == NULL)
+		return -1;
+	size_t length = fread(stat, 1, sizeof(stat) - 1, file);
+	fclose(file);
+	stat[length] = '\0';
+	char *fields = strrchr(stat, ')');
+	unsigned long utime, stime;
+	if(fields == NULL || sscanf(fields, ") %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+		return -1;
+	return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+int main(int argc, char *argv[]) // ./server_ports
+{
+	char dir[] = "/tmp/server_portsXXXXXX";
+	if(mkdtemp(dir) == NULL) {
+		perror("server_ports");
+		return 1;
+	}
+	char source[128], spool[128];
+	snprintf(source, sizeof(source), "%s/source.bin", dir);
+	snprintf(spool, sizeof(spool), "%s/spool/", dir);
+	if(write_file(source, FILE_SIZE)) {
+		perror("server_ports");
+		return 1;
+	}
+
+	unsigned first_port = 20000 + getpid() % 20000;
+	char names[NUM_PORTS][32];
+	char *ports[NUM_PORTS];
+	sender_t senders[NUM_PORTS];
+	unsigned i;
+	for(i = 0; i < NUM_PORTS; ++i) {
+		snprintf(names[i], sizeof(names[i]), TCP_PREFIX ":%u", first_port + i);
+		ports[i] = names[i];
+		snprintf(senders[i].address, sizeof(senders[i].address), TCP_PREFIX "127.0.0.1:%u", first_port + i);
+		senders[i].path = source;
+	}
+
+	pid_t server_pid = fork();
+	if(server_pid < 0) {
+		perror("server_ports");
+		return 1;
+	}
+	if(server_pid == 0) {
+		transfer_t settings;
+		server_t server;
+		transfer_init(&settings, "", RECEIVER);
+		settings.progress_mode = PROGRESS_OFF;
+		if(server_start(&server, &settings, ports, NUM_PORTS, spool))
+			_exit(1);
+		while(1)
+			pause();
+	}
+
+	// every port waits for its sender, blocked in poll
+	sleep(IDLE_SECONDS);
+	double idle_start = process_cpu(server_pid);
+	sleep(IDLE_SECONDS);
+	double idle_cpu = process_cpu(server_pid) - idle_start;
+
+	double start = seconds();
+	double start_cpu = process_cpu(server_pid);
+	pthread_t threads[NUM_PORTS];
+	for(i = 0; i < NUM_PORTS; ++i)
+		pthread_create(&threads[i], NULL, sender_thread, &senders[i]);
+	int ret = 0;
+	for(i = 0; i < NUM_PORTS; ++i) {
+		pthread_join(threads[i], NULL);
+		ret |= senders[i].result;
+	}
+	double elapsed = seconds() - start;
+	double cpu = process_cpu(server_pid) - start_cpu;
+	kill(server_pid, SIGKILL);
+	waitpid(server_pid, NULL, 0);
+
+	int same = (ret == 0 && idle_start >= 0);
+	for(i = 0; i < NUM_PORTS; ++i) {
+		char copy[256];
+		snprintf(copy, sizeof(copy), "%s%s/source.bin", spool, names[i]);
+		same &= same_files(source, copy);
+		unlink(copy);
+		snprintf(copy, sizeof(copy), "%s%s", spool, names[i]);
+		rmdir(copy);
+	}
+	rmdir(spool);
+	unlink(source);
+	rmdir(dir);
+
+	int idle = (idle_cpu <= MAX_IDLE_CPU);
+	int busy = (cpu < MAX_CPU_SHARE * elapsed);
+	printf("server_ports: %d idle ports used %.2f s of CPU in %d s\n", NUM_PORTS, idle_cpu, IDLE_SECONDS);
+	printf("server_ports: %d ports received %d bytes each in %.2f s at %d baud, %.2f s of CPU (%.0f%% of a core)\n",
+			NUM_PORTS, FILE_SIZE, elapsed, LINE_BAUDRATE, cpu, 100 * cpu / elapsed);
+	if(!same)
+		printf("server_ports: FAILED, the files did not arrive intact\n");
+	else if(!idle)
+		printf("server_ports: FAILED, idle ports use CPU\n");
+	else if(!busy)
+		printf("server_ports: FAILED, receiving ports use more than %.0f%% of a core\n", 100 * MAX_CPU_SHARE);
+	else
+		printf("server_ports: OK\n");
+	return !(same && idle && busy);
+}
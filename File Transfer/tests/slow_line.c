@@ -0,0 +1,28 @@
+#include <time.h>
+#include "slow_line.h"
+
+#define SLOW_LINE_BITS_PER_BYTE 10	/* start, 8 data and stop bits */
+
+int slow_line_write(transport_t *transport, const struct iovec *iov, int iovcnt);
+
+void slow_line_wrap(slow_line_t *line, transport_t *transport, unsigned baudrate) {
+	line->base = transport->ops;
+	line->ops = *transport->ops;
+	line->ops.write = slow_line_write;
+	line->baudrate = baudrate;
+	transport->ops = &line->ops;
+	transport->context = line;
+}
+
+int slow_line_write(transport_t *transport, const struct iovec *iov, int iovcnt) {
+	slow_line_t *line = transport->context;
+	size_t length = 0;
+	int i;
+	for(i = 0; i < iovcnt; ++i)
+		length += iov[i].iov_len;
+	// the UART is busy with the bytes for that long, the writer sleeps meanwhile
+	double seconds = (double)length * SLOW_LINE_BITS_PER_BYTE / line->baudrate;
+	struct timespec busy = { (time_t)seconds, (long)((seconds - (time_t)seconds) * 1e9) };
+	nanosleep(&busy, NULL);
+	return line->base->write(transport, iov, iovcnt);
+}
@@ -0,0 +1,21 @@
+#ifndef SLOW_LINE_H
+#define SLOW_LINE_H
+
+#include "../transport.h"
+
+/*
+ * An open transport whose writes take as long as on a serial line
+ */
+typedef struct {
+	transport_ops_t ops;
+	const transport_ops_t *base;
+	unsigned baudrate;
+} slow_line_t;
+
+/*
+ * Slows transport down to baudrate, so that the line is the slowest stage of
+ * whatever runs over it. line must outlive the transport.
+ */
+void slow_line_wrap(slow_line_t *line, transport_t *transport, unsigned baudrate);
+
+#endif
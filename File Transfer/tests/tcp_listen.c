@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include "../application.h"
+
+/*
+ * Receives a file on a TCP port from a sender that connects first and only
+ * sends SET a while later, as a sender still opening its file would. The
+ * receiver takes the connection as it comes and must keep waiting for SET
+ * until its own timeout, not give up as soon as the peer is accepted.
+ */
+
+#define FILE_SIZE (64 * 1024)
+#define RECEIVER_TIMEOUT 3	/* seconds */
+#define SET_DELAY 1		/* seconds between connecting and sending SET */
+#define CONNECT_ATTEMPTS 50	/* 100 ms apart, while the receiver starts */
+
+typedef struct {
+	transfer_t transfer;
+	char folder[128];
+	int result;
+} receiver_t;
+
+void *receiver_thread(void *arg);
+int write_file(const char *path, unsigned size);
+int same_files(const char *a, const char *b);
+
+void *receiver_thread(void *arg) {
+	receiver_t *receiver = arg;
+	do
+		receiver->result = transfer_receive(&receiver->transfer, receiver->folder);
+	while(receiver->result == 0 && receiver->transfer.connected);
+	return NULL;
+}
+
+int write_file(const char *path, unsigned size) {
+	FILE *file;
+	if((file = fopen(path, "wb")) == NULL)
+		return 1;
+	unsigned i;
+	for(i = 0; i < size; ++i)
+		fputc(rand(), file);
+	return fclose(file) != 0;
+}
+
+int same_files(const char *a, const char *b) {
+	FILE *fa = fopen(a, "rb"), *fb = fopen(b, "rb");
+	int same = (fa != NULL && fb != NULL);
+	while(same) {
+		int ca = fgetc(fa), cb = fgetc(fb);
+		same = (ca == cb);
+		if(ca == EOF)
+			break;
+	}
+	if(fa != NULL)
+		fclose(fa);
+	if(fb != NULL)
+		fclose(fb);
+	return same;
+}
+
+int main(int argc, char *argv[]) // ./tcp_listen
+{
+	char dir[] = "/tmp/tcp_listenXXXXXX";
+	if(mkdtemp(dir) == NULL) {
+		perror("tcp_listen");
+		return 1;
+	}
+	char source[128], copy[256];
+	snprintf(source, sizeof(source), "%s/source.bin", dir);
+	receiver_t receiver;
+	snprintf(receiver.folder, sizeof(receiver.folder), "%s/received/", dir);
+	snprintf(copy, sizeof(copy), "%ssource.bin", receiver.folder);
+	if(mkdir(receiver.folder, 0755) != 0 || write_file(source, FILE_SIZE)) {
+		perror("tcp_listen");
+		return 1;
+	}
+
+	unsigned port = 20000 + getpid() % 20000;
+	char listen_address[32], connect_address[64];
+	snprintf(listen_address, sizeof(listen_address), TCP_PREFIX ":%u", port);
+	snprintf(connect_address, sizeof(connect_address), TCP_PREFIX "127.0.0.1:%u", port);
+
+	transfer_t sender;
+	transfer_init(&sender, connect_address, SENDER);
+	transfer_init(&receiver.transfer, listen_address, RECEIVER);
+	receiver.transfer.timeout = RECEIVER_TIMEOUT;
+	sender.keep_port = 1;
+	pthread_t thread;
+	pthread_create(&thread, NULL, receiver_thread, &receiver);
+
+	unsigned attempt;
+	for(attempt = 0; attempt < CONNECT_ATTEMPTS; ++attempt) {
+		if(transport_open(&sender.datalink.transport, connect_address, 0) == 0)
+			break;
+		usleep(100000);
+	}
+	int ret = 1;
+	if(attempt < CONNECT_ATTEMPTS) {
+		// connected, but SET only goes out with the transfer
+		sleep(SET_DELAY);
+		ret = transfer_send_file(&sender, source);
+		ret |= transfer_close(&sender);
+	}
+	pthread_join(thread, NULL);
+	ret |= receiver.result;
+	transfer_close(&receiver.transfer);
+
+	int same = (ret == 0 && same_files(source, copy));
+	if(attempt == CONNECT_ATTEMPTS)
+		printf("tcp_listen: FAILED, unable to connect to %s\n", listen_address);
+	else if(!same)
+		printf("tcp_listen: FAILED, the receiver dropped a sender that connected %d s before SET\n", SET_DELAY);
+	else
+		printf("tcp_listen: OK\n");
+
+	unlink(copy);
+	unlink(source);
+	rmdir(receiver.folder);
+	rmdir(dir);
+	return !same;
+}
@@ -0,0 +1,428 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "transport.h"
+#include "serial.h"
+
+#define MIN(A, B) (((A) < (B)) ? (A) : (B))
+
+/*
+ * Bytes going one way between two memory transports
+ */
+struct memory_channel {
+	pthread_mutex_t lock;
+	pthread_cond_t changed;		/* bytes written, read, or an end closed */
+	unsigned char buffer[MEMORY_TRANSPORT_CAPACITY];
+	unsigned head;			/* next byte read */
+	unsigned length;
+	int closed;			/* one of the ends is gone */
+	int num_ends;			/* freed when the last one closes */
+};
+
+int serial_transport_close(transport_t *transport);
+void serial_transport_discard(transport_t *transport);
+int fd_transport_read(transport_t *transport, unsigned char *buffer, unsigned max);
+int fd_transport_write(transport_t *transport, const struct iovec *iov, int iovcnt);
+int fd_transport_poll(transport_t *transport, int timeout_ms);
+void fd_transport_discard(transport_t *transport);
+int fd_transport_close(transport_t *transport);
+int open_tcp(transport_t *transport, const char *address);
+void tcp_hang_up(transport_t *transport);
+int tcp_transport_read(transport_t *transport, unsigned char *buffer, unsigned max);
+int tcp_transport_write(transport_t *transport, const struct iovec *iov, int iovcnt);
+int tcp_transport_poll(transport_t *transport, int timeout_ms);
+int tcp_transport_close(transport_t *transport);
+struct memory_channel *memory_channel_new();
+void memory_channel_release(struct memory_channel *channel);
+int memory_transport_read(transport_t *transport, unsigned char *buffer, unsigned max);
+int memory_transport_write(transport_t *transport, const struct iovec *iov, int iovcnt);
+int memory_transport_poll(transport_t *transport, int timeout_ms);
+void memory_transport_discard(transport_t *transport);
+int memory_transport_close(transport_t *transport);
+
+// a serial port is read and written like any descriptor, only opening and closing it differ
+const transport_ops_t serial_transport_ops = {
+	fd_transport_read, fd_transport_write, fd_transport_poll, serial_transport_discard, serial_transport_close, NULL
+};
+const transport_ops_t fd_transport_ops = {
+	fd_transport_read, fd_transport_write, fd_transport_poll, fd_transport_discard, fd_transport_close, NULL
+};
+const transport_ops_t tcp_transport_ops = {
+	tcp_transport_read, tcp_transport_write, tcp_transport_poll, fd_transport_discard, tcp_transport_close, NULL
+};
+const transport_ops_t memory_transport_ops = {
+	memory_transport_read, memory_transport_write, memory_transport_poll, memory_transport_discard, memory_transport_close, NULL
+};
+
+void transport_init(transport_t *transport) {
+	transport->ops = NULL;
+	transport->fd = -1;
+	transport->out_fd = -1;
+	transport->owns_fd = 0;
+	transport->listen_fd = -1;
+	transport->rx = NULL;
+	transport->tx = NULL;
+	transport->context = NULL;
+}
+
+int transport_open(transport_t *transport, const char *name, int baudrate) {
+	transport_init(transport);
+	if(strncmp(name, TCP_PREFIX, strlen(TCP_PREFIX)) == 0)
+		return open_tcp(transport, name + strlen(TCP_PREFIX));
+
+	int fd = serial_initialize(name, 1, 0, baudrate, &transport->oldtio);
+	if(fd < 0)
+		return 1;
+	transport->fd = fd;
+	transport->out_fd = fd;
+	transport->owns_fd = 1;
+	transport->ops = &serial_transport_ops;
+	return 0;
+}
+
+void transport_open_fd(transport_t *transport, int in_fd, int out_fd) {
+	transport_init(transport);
+	transport->fd = in_fd;
+	transport->out_fd = out_fd;
+	transport->ops = &fd_transport_ops;
+}
+
+int transport_open_memory_pair(transport_t *a, transport_t *b) {
+	transport_init(a);
+	transport_init(b);
+	struct memory_channel *forward = memory_channel_new();
+	struct memory_channel *backward = memory_channel_new();
+	if(forward == NULL || backward == NULL) {
+		printf("ERROR (transport_open_memory_pair): unable to allocate the channels\n");
+		free(forward);
+		free(backward);
+		return 1;
+	}
+	a->tx = b->rx = forward;
+	a->rx = b->tx = backward;
+	a->ops = b->ops = &memory_transport_ops;
+	return 0;
+}
+
+int transport_read(transport_t *transport, unsigned char *buffer, unsigned max) {
+	return transport->ops->read(transport, buffer, max);
+}
+
+int transport_write(transport_t *transport, const struct iovec *iov, int iovcnt) {
+	return transport->ops->write(transport, iov, iovcnt);
+}
+
+int transport_poll(transport_t *transport, int timeout_ms) {
+	return transport->ops->poll(transport, timeout_ms);
+}
+
+void transport_discard(transport_t *transport) {
+	transport->ops->discard(transport);
+}
+
+double transport_now(const transport_t *transport) {
+	if(transport->ops != NULL && transport->ops->now != NULL)
+		return transport->ops->now(transport);
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int transport_close(transport_t *transport) {
+	if(transport->ops == NULL)
+		return 0;
+	int ret = transport->ops->close(transport);
+	transport_init(transport);
+	return ret;
+}
+
+int serial_transport_close(transport_t *transport) {
+	return serial_terminate(transport->fd, &transport->oldtio);
+}
+
+void serial_transport_discard(transport_t *transport) {
+	tcflush(transport->fd, TCIOFLUSH);
+}
+
+int fd_transport_read(transport_t *transport, unsigned char *buffer, unsigned max) {
+	return read(transport->fd, buffer, max);
+}
+
+int fd_transport_write(transport_t *transport, const struct iovec *iov, int iovcnt) {
+	return writev(transport->out_fd, iov, iovcnt);
+}
+
+int fd_transport_poll(transport_t *transport, int timeout_ms) {
+	struct pollfd pfd = { transport->fd, POLLIN, 0 };
+	return poll(&pfd, 1, timeout_ms);
+}
+
+void fd_transport_discard(transport_t *transport) {
+	// only what already arrived can be dropped, a socket has no output queue to flush
+	unsigned char buffer[4096];
+	while(transport->fd >= 0 && fd_transport_poll(transport, 0) > 0 && read(transport->fd, buffer, sizeof(buffer)) > 0);
+}
+
+int fd_transport_close(transport_t *transport) {
+	if(!transport->owns_fd)
+		return 0;
+	int ret = close(transport->fd) < 0;
+	if(transport->out_fd != transport->fd)
+		ret |= close(transport->out_fd) < 0;
+	return ret;
+}
+
+int open_tcp(transport_t *transport, const char *address) {
+	const char *colon = strrchr(address, ':');
+	if(colon == NULL) {
+		printf("ERROR (open_tcp): %s is not <host>:<port>\n", address);
+		return 1;
+	}
+	char host[colon - address + 1];
+	memcpy(host, address, colon - address);
+	host[colon - address] = '\0';
+	int listening = (*host == '\0');
+
+	struct addrinfo hints, *results, *result;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = listening ? AI_PASSIVE : 0;
+	int error = getaddrinfo(listening ? NULL : host, colon + 1, &hints, &results);
+	if(error) {
+		printf("ERROR (open_tcp): %s: %s\n", address, gai_strerror(error));
+		return 1;
+	}
+	int fd = -1;
+	for(result = results; result != NULL && fd < 0; result = result->ai_next) {
+		if((fd = socket(result->ai_family, result->ai_socktype, result->ai_protocol)) < 0)
+			continue;
+		int on = 1;
+		if(listening) {
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+			if(bind(fd, result->ai_addr, result->ai_addrlen) == 0 && listen(fd, 1) == 0)
+				break;
+		} else if(connect(fd, result->ai_addr, result->ai_addrlen) == 0) {
+			// a frame is written in one go, waiting to coalesce it only delays the answer
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+			break;
+		}
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(results);
+	if(fd < 0) {
+		perror(address);
+		return 1;
+	}
+
+	transport->owns_fd = 1;
+	transport->ops = &tcp_transport_ops;
+	if(listening) {
+		// the peer is accepted by the first poll, like a serial line a sender may start at any time
+		transport->listen_fd = fd;
+		printf("Waiting for a peer on port %s\n", colon + 1);
+	} else {
+		transport->fd = fd;
+		transport->out_fd = fd;
+		printf("Connected to %s\n", address);
+	}
+	return 0;
+}
+
+void tcp_hang_up(transport_t *transport) {
+	if(transport->fd >= 0)
+		close(transport->fd);
+	transport->fd = -1;
+	transport->out_fd = -1;
+}
+
+int tcp_transport_read(transport_t *transport, unsigned char *buffer, unsigned max) {
+	int ret = read(transport->fd, buffer, max);
+	if(ret != 0 || transport->listen_fd < 0)
+		return ret;
+	// the peer hung up: the line is idle until the next one connects
+	tcp_hang_up(transport);
+	errno = EAGAIN;
+	return -1;
+}
+
+int tcp_transport_write(transport_t *transport, const struct iovec *iov, int iovcnt) {
+	int length = 0;
+	int i;
+	for(i = 0; i < iovcnt; ++i)
+		length += iov[i].iov_len;
+	// nobody on the line: the bytes are lost, as they would be on a serial port
+	if(transport->fd < 0)
+		return length;
+	struct msghdr message;
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = (struct iovec *)iov;
+	message.msg_iovlen = iovcnt;
+	int ret = sendmsg(transport->fd, &message, MSG_NOSIGNAL);
+	if(ret < 0 && (errno == EPIPE || errno == ECONNRESET) && transport->listen_fd >= 0) {
+		tcp_hang_up(transport);
+		return length;
+	}
+	return ret;
+}
+
+int tcp_transport_poll(transport_t *transport, int timeout_ms) {
+	if(transport->fd >= 0)
+		return fd_transport_poll(transport, timeout_ms);
+	if(transport->listen_fd < 0) {
+		// a client whose server went away only times out
+		poll(NULL, 0, timeout_ms);
+		return 0;
+	}
+	struct pollfd pfd = { transport->listen_fd, POLLIN, 0 };
+	double start = transport_now(transport);
+	int ready = poll(&pfd, 1, timeout_ms);
+	if(ready <= 0)
+		return ready;
+	int fd = accept(transport->listen_fd, NULL, NULL);
+	if(fd < 0)
+		return (errno == EINTR || errno == ECONNABORTED) ? 0 : -1;
+	int on = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	transport->fd = fd;
+	transport->out_fd = fd;
+	// the peer may connect well before it speaks: it gets the rest of the wait
+	int left = timeout_ms;
+	if(timeout_ms > 0) {
+		left = timeout_ms - (int)((transport_now(transport) - start) * 1000);
+		if(left < 0)
+			left = 0;
+	}
+	return fd_transport_poll(transport, left);
+}
+
+int tcp_transport_close(transport_t *transport) {
+	tcp_hang_up(transport);
+	if(transport->listen_fd >= 0)
+		close(transport->listen_fd);
+	return 0;
+}
+
+struct memory_channel *memory_channel_new() {
+	struct memory_channel *channel;
+	if((channel = malloc(sizeof(struct memory_channel))) == NULL)
+		return NULL;
+	pthread_mutex_init(&channel->lock, NULL);
+	pthread_cond_init(&channel->changed, NULL);
+	channel->head = 0;
+	channel->length = 0;
+	channel->closed = 0;
+	channel->num_ends = 2;
+	return channel;
+}
+
+void memory_channel_release(struct memory_channel *channel) {
+	pthread_mutex_lock(&channel->lock);
+	channel->closed = 1;
+	int last = (--channel->num_ends == 0);
+	pthread_cond_broadcast(&channel->changed);
+	pthread_mutex_unlock(&channel->lock);
+	if(!last)
+		return;
+	pthread_mutex_destroy(&channel->lock);
+	pthread_cond_destroy(&channel->changed);
+	free(channel);
+}
+
+int memory_transport_read(transport_t *transport, unsigned char *buffer, unsigned max) {
+	struct memory_channel *channel = transport->rx;
+	pthread_mutex_lock(&channel->lock);
+	while(channel->length == 0 && !channel->closed)
+		pthread_cond_wait(&channel->changed, &channel->lock);
+	unsigned length = MIN(max, channel->length);
+	unsigned first = MIN(length, MEMORY_TRANSPORT_CAPACITY - channel->head);
+	memcpy(buffer, &channel->buffer[channel->head], first);
+	memcpy(&buffer[first], channel->buffer, length - first);
+	channel->head = (channel->head + length) % MEMORY_TRANSPORT_CAPACITY;
+	channel->length -= length;
+	if(length > 0)
+		pthread_cond_broadcast(&channel->changed);
+	pthread_mutex_unlock(&channel->lock);
+	return length;
+}
+
+int memory_transport_write(transport_t *transport, const struct iovec *iov, int iovcnt) {
+	struct memory_channel *channel = transport->tx;
+	int written = 0;
+	int i;
+	pthread_mutex_lock(&channel->lock);
+	for(i = 0; i < iovcnt; ++i) {
+		const unsigned char *data = iov[i].iov_base;
+		unsigned left = iov[i].iov_len;
+		while(left > 0) {
+			// a full channel blocks the writer until the reader catches up, like a full pty
+			while(channel->length == MEMORY_TRANSPORT_CAPACITY && !channel->closed)
+				pthread_cond_wait(&channel->changed, &channel->lock);
+			if(channel->closed) {
+				// nobody reads any more, the bytes are lost on the line
+				written += left;
+				break;
+			}
+			unsigned tail = (channel->head + channel->length) % MEMORY_TRANSPORT_CAPACITY;
+			unsigned length = MIN(left, MIN(MEMORY_TRANSPORT_CAPACITY - channel->length, MEMORY_TRANSPORT_CAPACITY - tail));
+			memcpy(&channel->buffer[tail], data, length);
+			channel->length += length;
+			data += length;
+			left -= length;
+			written += length;
+			pthread_cond_broadcast(&channel->changed);
+		}
+	}
+	pthread_mutex_unlock(&channel->lock);
+	return written;
+}
+
+int memory_transport_poll(transport_t *transport, int timeout_ms) {
+	struct memory_channel *channel = transport->rx;
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	if(timeout_ms > 0) {
+		deadline.tv_sec += timeout_ms / 1000;
+		deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+		if(deadline.tv_nsec >= 1000000000L) {
+			++deadline.tv_sec;
+			deadline.tv_nsec -= 1000000000L;
+		}
+	}
+	pthread_mutex_lock(&channel->lock);
+	int timed_out = 0;
+	while(channel->length == 0 && !channel->closed && !timed_out) {
+		if(timeout_ms < 0)
+			pthread_cond_wait(&channel->changed, &channel->lock);
+		else
+			timed_out = (pthread_cond_timedwait(&channel->changed, &channel->lock, &deadline) == ETIMEDOUT);
+	}
+	// a closed channel is readable, the read tells the line is gone
+	int ready = (channel->length > 0 || channel->closed);
+	pthread_mutex_unlock(&channel->lock);
+	return ready;
+}
+
+void memory_transport_discard(transport_t *transport) {
+	struct memory_channel *channel = transport->rx;
+	pthread_mutex_lock(&channel->lock);
+	channel->length = 0;
+	pthread_cond_broadcast(&channel->changed);
+	pthread_mutex_unlock(&channel->lock);
+}
+
+int memory_transport_close(transport_t *transport) {
+	memory_channel_release(transport->rx);
+	memory_channel_release(transport->tx);
+	return 0;
+}
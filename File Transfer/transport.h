@@ -0,0 +1,104 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <termios.h>
+#include <sys/uio.h>
+
+#define TCP_PREFIX "tcp:"		/* tcp:<host>:<port> connects, tcp::<port> waits for the peer */
+#define MEMORY_TRANSPORT_CAPACITY 65536	/* bytes in flight each way, about what a pty buffers */
+
+typedef struct transport transport_t;
+
+/*
+ * What a data link needs of the line it runs over. Every call behaves like
+ * the system call of the same name on the transport's descriptor.
+ */
+typedef struct {
+	/*
+	 * Returns the number of bytes read, 0 once the line is gone, -1 with errno set otherwise
+	 */
+	int (*read)(transport_t *transport, unsigned char *buffer, unsigned max);
+
+	/*
+	 * Writes the whole of iov
+	 * Returns the number of bytes written, -1 on error
+	 */
+	int (*write)(transport_t *transport, const struct iovec *iov, int iovcnt);
+
+	/*
+	 * Waits up to timeout_ms (-1 for ever) for something to read
+	 * Returns > 0 if there is, 0 on timeout, -1 with errno set on error
+	 */
+	int (*poll)(transport_t *transport, int timeout_ms);
+
+	/*
+	 * Drops whatever is in flight to this end
+	 */
+	void (*discard)(transport_t *transport);
+
+	/*
+	 * Returns 0 if OK, 1 otherwise
+	 */
+	int (*close)(transport_t *transport);
+
+	/*
+	 * Seconds on the clock the line runs by, NULL for the system's monotonic clock
+	 */
+	double (*now)(const transport_t *transport);
+} transport_ops_t;
+
+struct memory_channel;
+
+/*
+ * One end of a line: a serial port, a pipe or socket, a TCP connection or
+ * a buffer shared with another thread of the process
+ */
+struct transport {
+	const transport_ops_t *ops;	/* NULL while closed */
+	int fd;				/* read side, -1 for memory transports */
+	int out_fd;			/* write side, the same as fd but for a pair of pipes */
+	int owns_fd;			/* the descriptors are closed with the transport */
+	int listen_fd;			/* tcp::<port>: accepts the next peer once one hangs up, -1 otherwise */
+	struct termios oldtio;		/* serial: port settings restored when it is closed */
+	struct memory_channel *rx;
+	struct memory_channel *tx;
+	void *context;			/* free for the caller's own ops */
+};
+
+/*
+ * A closed transport
+ */
+void transport_init(transport_t *transport);
+
+/*
+ * Opens name: a TCP_PREFIX address, or else a serial port configured at baudrate (0 for the default)
+ * Returns 0 if OK, 1 otherwise
+ */
+int transport_open(transport_t *transport, const char *name, int baudrate);
+
+/*
+ * Runs over descriptors of the caller, read from in_fd and written to out_fd:
+ * both ends of a socketpair, a pair of pipes, stdin and stdout...
+ * They stay open after transport_close.
+ */
+void transport_open_fd(transport_t *transport, int in_fd, int out_fd);
+
+/*
+ * Connects a and b back to back through memory, for two threads of the process
+ * Returns 0 if OK, 1 otherwise
+ */
+int transport_open_memory_pair(transport_t *a, transport_t *b);
+
+int transport_read(transport_t *transport, unsigned char *buffer, unsigned max);
+int transport_write(transport_t *transport, const struct iovec *iov, int iovcnt);
+int transport_poll(transport_t *transport, int timeout_ms);
+void transport_discard(transport_t *transport);
+double transport_now(const transport_t *transport);
+
+/*
+ * Closes an open transport, which can be opened again
+ * Returns 0 if OK, 1 otherwise
+ */
+int transport_close(transport_t *transport);
+
+#endif